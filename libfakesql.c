@@ -22,6 +22,10 @@
  *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #ifdef WIN32
 # include <windows.h>
 # include <config-win.h>
@@ -31,19 +35,103 @@
 #include <sql.h>
 #include <sqlext.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <memory.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
 #include <mysql.h>
 
-#ifndef SQLLEN
+#if !defined (WIN32) && defined (HAVE_PTHREAD_H)
+# include <pthread.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#if defined (HAVE_MMAP) && defined (HAVE_SYS_MMAN_H)
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <fcntl.h>
+#else
+# undef HAVE_MMAP
+#endif
+
+#if defined (HAVE_PIPE) && defined (HAVE_FCNTL_H) && defined (HAVE_UNISTD_H)
+# include <fcntl.h>
+#else
+# undef HAVE_PIPE
+#endif
+
+#if defined (HAVE_PIPE) && defined (HAVE_EVENTFD) \
+    && defined (HAVE_SYS_EVENTFD_H)
+# include <sys/eventfd.h>
+#else
+# undef HAVE_EVENTFD
+#endif
+
+#if defined (HAVE_EPOLL_CREATE1) && defined (HAVE_SYS_EPOLL_H)
+# include <sys/epoll.h>
+#else
+# undef HAVE_EPOLL_CREATE1
+#endif
+
+#if defined (HAVE_POLL) && defined (HAVE_POLL_H)
+# include <poll.h>
+#else
+# undef HAVE_POLL
+#endif
+
+#if defined (HAVE_WRITEV) && defined (HAVE_SYS_UIO_H)
+# include <sys/uio.h>
+#else
+# undef HAVE_WRITEV
+struct iovec
+  {
+    void *	iov_base;
+    size_t	iov_len;
+  };
+#endif
+
+#if defined (__SSE2__) || defined (_M_X64) \
+    || (defined (_M_IX86_FP) && _M_IX86_FP >= 2)
+# define HAVE_SSE2 1
+# include <emmintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+static __inline int
+CTZ (unsigned int x)
+{
+  unsigned long i;
+
+  _BitScanForward (&i, x);
+  return (int) i;
+}
+# else
+#  define CTZ(X)		__builtin_ctz (X)
+# endif
+#endif
+
+#if !defined (SQLLEN) && !defined (HAVE_SQLLEN)
 # define SQLLEN SQLINTEGER
 #endif
 
 #ifdef WIN32
 # define snprintf _snprintf
+# define strncasecmp _strnicmp
+# define strcasecmp _stricmp
+# define strtoull _strtoui64
+# define ssize_t SSIZE_T
+# define write _write
+# include <io.h>
 #endif
 
 #define DBOF(X)			((TSQLPrivate *)((X)->net.vio))
+#define RESOF(X)		((TSQLResult *)(X))
+#define COLUMNAR(X)		(RESOF(X)->pCols && RESOF(X)->pCols->bView)
 
 #define UNIMPLEMENTED_VOID
 #define UNIMPLEMENTED_OK	return (0);
@@ -55,26 +143,837 @@
 
 #define TRACE(T)
 
+#define QC_BUCKETS		1024	/* query cache hash size */
+#define STMT_POOL_SIZE		4	/* idle statements kept per connection */
+#define STMT_POOL_MAX		64
+#define PING_WINDOW_MS		1000	/* a round trip proves liveness this long */
+#define FETCH_BATCH_SIZE	64	/* rows per SQLFetch in store_result */
+#define FETCH_BATCH_BYTES	(1024*1024)
+#define CATALOG_CACHE_TTL	60	/* seconds mysql_list_* results are kept */
+#define LOAD_BATCH_ROWS		1000	/* rows per SQLExecute of LOAD DATA */
+#define LOAD_BATCH_BYTES	(4*1024*1024) /* the arena and the arrays of a batch */
+#define LOAD_PART_MIN		(1024*1024) /* smallest file part per thread */
+#define EX_IOV			256	/* pieces per writev in result export */
+#define EX_BUF			(256*1024)
+#define SQL_MAX_TABLES		8	/* tables remembered per statement */
+#define DIALECT_CACHE_SIZE	256	/* translated statements kept */
+#define LONG_QUERY_TIME		1000	/* ms, slow log threshold */
+#define XL_BUCKETS		64	/* dialect cache hash size */
+#define XL_KEY_MAX		4096	/* longer statements are not kept */
+#define XL_DEPTH		32	/* parenthesis levels the rewriter follows */
+#define COL_ROWS		256	/* first row room of a columnar result */
+#define COL_BYTES		4096	/* first value buffer of a column */
+#define RF_MAGIC		"m2oRES1"	/* result files, 8 bytes */
+#define RF_ORDER		0x01020304UL
+#define RF_ALIGN(N)		(((N) + 7) & ~7UL)
+#define SHC_MAGIC		"m2oSHC2"	/* shared cache segment, 8 bytes */
+#define SHC_SIZE		(64UL*1024*1024) /* default segment size */
+#define SHC_MIN_SIZE		(1024UL*1024)
+#define SHC_CHUNK		4096	/* allocation unit of the segment */
+#define SHC_SLOT_BYTES		16384	/* segment bytes per entry slot */
+#define SHC_PROBE		8	/* slots a key may live in */
+#define SHC_TABLES		256	/* table generations, hashed */
+#define ASYNC_THREADS		64	/* workers of the non-blocking API */
+#define GROUP_COMMIT_MAX	256	/* statements per group commit */
+#define GROUP_SAVEPOINT		"mysql2odbc_group" /* before each grouped write */
+#define LOAD_SAVEPOINT		"mysql2odbc_load" /* before each LOAD DATA batch */
+#define ROUTE_RETRY_MS		5000	/* a lost replica is left alone this long */
+#define ROUTE_DECAY_MS		500	/* unused latency figures halve this often */
+#define HEDGE_THREADS		16	/* workers that send hedged reads */
+#define HEDGE_CLASSES		64	/* statement classes timed, hashed */
+#define HEDGE_BUCKETS		128	/* latency histogram, 4 per power of 2 */
+#define HEDGE_SAMPLES		32	/* executes timed before a class hedges */
+#define HEDGE_WINDOW		1024	/* samples before a histogram halves */
+#define HEDGE_MIN_US		1000	/* never hedge sooner than this */
+#define HEDGE_SPAN		65536	/* reads the extra load is measured over */
+#define SHARD_ITEMS		64	/* select list items merged by kind */
+#define SHARD_ORDER		16	/* ORDER BY terms merged on */
+#define SCROLL_WINDOWS		4	/* blocks a scrollable result keeps */
+#define STATE_SLOTS		64	/* SQLSTATE hash, see _state_errno */
+
+/* States of a hedge, see _hedge_arm */
+#define HEDGE_IDLE		0
+#define HEDGE_ARMED		1	/* waits for its deadline */
+#define HEDGE_SENT		2	/* a worker runs it */
+#define HEDGE_DONE		3	/* finished, statement not collected */
+
+/* How a column of a scattered SELECT is merged, see _shard_select */
+#define SHARD_PLAIN		0
+#define SHARD_SUM		1	/* COUNT and SUM */
+#define SHARD_MIN		2
+#define SHARD_MAX		3
+
+/* Statement classes, see _sql_analyze */
+#define SQL_KIND_OTHER		0
+#define SQL_KIND_READ		1	/* SELECT, SHOW, DESCRIBE, ... */
+#define SQL_KIND_WRITE		2	/* INSERT, UPDATE, DELETE, ... */
+#define SQL_KIND_DDL		3	/* CREATE, ALTER, DROP, ... */
+#define SQL_KIND_BEGIN		4	/* BEGIN, START TRANSACTION */
+#define SQL_KIND_END		5	/* COMMIT, ROLLBACK */
+
+/* Non-blocking calls, see _async_start */
+#define ASYNC_CONNECT		1
+#define ASYNC_QUERY		2
+#define ASYNC_STORE		3
+#define ASYNC_FETCH		4
+#define ASYNC_CLOSE		5
+
+/* Lexer token types, see _sql_token */
+#define TK_END			0
+#define TK_WORD			1
+#define TK_QUOTED		2	/* `identifier` */
+#define TK_STRING		3	/* 'literal' or "literal" */
+#define TK_NUMBER		4
+#define TK_PUNCT		5
+
+/* Encodings, see _cs_init */
+#define CS_LATIN1		1
+#define CS_UTF8			2	/* utf8, utf8mb3, utf8mb4 */
+#define CS_CONVERT(P)		((P)->csClient != (P)->csOdbc)
+
 /* from errmsg.h */
 #define CR_UNKNOWN_ERROR	2000
 #define CR_OUT_OF_MEMORY	2008
 #define CR_SERVER_LOST		2013
+#define CR_CANT_READ_CHARSET	2019
+#define CR_COMMANDS_OUT_OF_SYNC	2014
+#define CR_NET_PACKET_TOO_LARGE	2020
 
 #define CR_ODBC_ERROR		9999
 
+/* from mysqld_error.h */
+#define ER_FILE_NOT_FOUND	1017
+#define ER_ERROR_ON_WRITE	1026
+#define ER_ACCESS_DENIED_ERROR	1045
+#define ER_NO_DB_ERROR		1046
+#define ER_TABLE_EXISTS_ERROR	1050
+#define ER_BAD_FIELD_ERROR	1054
+#define ER_DUP_FIELDNAME	1060
+#define ER_DUP_KEYNAME		1061
+#define ER_PARSE_ERROR		1064
+#define ER_CANT_DROP_FIELD_OR_KEY 1091
+#define ER_WRONG_VALUE_COUNT_ON_ROW 1136
+#define ER_NO_SUCH_TABLE	1146
+#define ER_NOT_ALLOWED_COMMAND	1148
+#define ER_ERROR_DURING_COMMIT	1180
+#define ER_ERROR_DURING_ROLLBACK 1181
+#define ER_LOCK_DEADLOCK	1213
+#define ER_WRONG_VALUE_FOR_VAR	1231
+#define ER_NOT_SUPPORTED_YET	1235
+#define ER_WARN_DATA_OUT_OF_RANGE 1264
+#define ER_QUERY_INTERRUPTED	1317
+#define ER_DIVISION_BY_ZERO	1365
+#define ER_DATA_TOO_LONG	1406
+#define ER_NO_PARTITION_FOR_GIVEN_VALUE 1526
+
+/*
+ *  Threading primitives
+ *
+ *  Only process wide state (the shared ODBC environment and the per
+ *  thread error slot) is protected by these. A MYSQL handle is owned by
+ *  one thread at a time; that is enforced with a compare-and-swap on the
+ *  handle itself, so independent handles never contend on a lock.
+ *  Threads of our own are only started by LOAD DATA LOCAL INFILE, for
+ *  the slow log writer, for the workers of the non-blocking API, for
+ *  the group commit flusher, to send hedged reads and to run a statement
+ *  on several shards at once.
+ */
+#if defined (WIN32)
+# define HAVE_THREADS		1
+typedef CRITICAL_SECTION	TMUTEX;
+typedef INIT_ONCE		TONCE;
+typedef DWORD			TKEY;
+# define ONCE_INIT		INIT_ONCE_STATIC_INIT
+# define RUN_ONCE(O,F)		InitOnceExecuteOnce (O, _once_adapter, (PVOID) (F), NULL)
+# define MUTEX_INIT(M)		InitializeCriticalSection (M)
+# define MUTEX_LOCK(M)		EnterCriticalSection (M)
+# define MUTEX_UNLOCK(M)	LeaveCriticalSection (M)
+# define KEY_CREATE(K,D)	((*(K) = TlsAlloc ()) == TLS_OUT_OF_INDEXES)
+# define KEY_GET(K)		TlsGetValue (K)
+# define KEY_SET(K,V)		TlsSetValue (K, V)
+# define ATOMIC_CAS(P,O,N)	(InterlockedCompareExchange (P, N, O) == (O))
+# define ATOMIC_SET(P,V)	InterlockedExchange (P, V)
+typedef HANDLE			TTHREAD;
+# define THREAD_FN		DWORD WINAPI
+# define THREAD_RET		0
+# define THREAD_CREATE(T,F,A)	((*(T) = CreateThread (NULL, 0, F, A, 0, NULL)) == NULL)
+# define THREAD_JOIN(T)		(WaitForSingleObject (T, INFINITE), CloseHandle (T))
+# define THREAD_DETACH(T)	CloseHandle (T)
+typedef CONDITION_VARIABLE	TCOND;
+# define COND_INIT(C)		InitializeConditionVariable (C)
+# define COND_WAIT(C,M)		SleepConditionVariableCS (C, M, INFINITE)
+# define COND_TIMEDWAIT(C,M,MS)	SleepConditionVariableCS (C, M, MS)
+# define COND_SIGNAL(C)		WakeConditionVariable (C)
+# define COND_BROADCAST(C)	WakeAllConditionVariable (C)
+#elif defined (HAVE_PTHREAD_H)
+# define HAVE_THREADS		1
+typedef pthread_mutex_t		TMUTEX;
+typedef pthread_once_t		TONCE;
+typedef pthread_key_t		TKEY;
+# define ONCE_INIT		PTHREAD_ONCE_INIT
+# define RUN_ONCE(O,F)		pthread_once (O, F)
+# define MUTEX_INIT(M)		pthread_mutex_init (M, NULL)
+# define MUTEX_LOCK(M)		pthread_mutex_lock (M)
+# define MUTEX_UNLOCK(M)	pthread_mutex_unlock (M)
+# define KEY_CREATE(K,D)	pthread_key_create (K, D)
+# define KEY_GET(K)		pthread_getspecific (K)
+# define KEY_SET(K,V)		pthread_setspecific (K, V)
+# define ATOMIC_CAS(P,O,N)	__sync_bool_compare_and_swap (P, O, N)
+# define ATOMIC_SET(P,V)	(__sync_synchronize (), *(P) = (V))
+typedef pthread_t		TTHREAD;
+# define THREAD_FN		void *
+# define THREAD_RET		NULL
+# define THREAD_CREATE(T,F,A)	pthread_create (T, NULL, F, A)
+# define THREAD_JOIN(T)		pthread_join (T, NULL)
+# define THREAD_DETACH(T)	pthread_detach (T)
+typedef pthread_cond_t		TCOND;
+# define COND_INIT(C)		pthread_cond_init (C, NULL)
+# define COND_WAIT(C,M)		pthread_cond_wait (C, M)
+# define COND_TIMEDWAIT(C,M,MS)	_cond_timedwait (C, M, MS)
+# define COND_SIGNAL(C)		pthread_cond_signal (C)
+# define COND_BROADCAST(C)	pthread_cond_broadcast (C)
+#else
+# define HAVE_THREADS		0
+typedef int			TMUTEX;
+typedef int			TONCE;
+typedef void *			TKEY;
+# define ONCE_INIT		0
+# define RUN_ONCE(O,F)		{ if (!*(O)) { *(O) = 1; F (); } }
+# define MUTEX_INIT(M)
+# define MUTEX_LOCK(M)
+# define MUTEX_UNLOCK(M)
+# define KEY_CREATE(K,D)	(*(K) = NULL, 0)
+# define KEY_GET(K)		(K)
+# define KEY_SET(K,V)		((K) = (V))
+# define ATOMIC_CAS(P,O,N)	(*(P) == (O) ? (*(P) = (N), 1) : 0)
+# define ATOMIC_SET(P,V)	(*(P) = (V))
+typedef int			TTHREAD;
+# define THREAD_FN		void *
+# define THREAD_RET		NULL
+# define THREAD_CREATE(T,F,A)	(*(T) = 0, 1)	/* caller runs F itself */
+# define THREAD_JOIN(T)
+# define THREAD_DETACH(T)
+typedef int			TCOND;
+# define COND_INIT(C)
+# define COND_WAIT(C,M)
+# define COND_TIMEDWAIT(C,M,MS)
+# define COND_SIGNAL(C)
+# define COND_BROADCAST(C)
+#endif
+
 typedef struct SSQLPrivate TSQLPrivate;
+typedef struct SSQLResult TSQLResult;
+typedef struct SThreadPrivate TThreadPrivate;
+typedef struct SSQLToken TSQLToken;
+typedef struct SSQLInfo TSQLInfo;
+typedef struct SQCacheEntry TQCacheEntry;
+typedef struct SCatEntry TCatEntry;
+typedef struct SIdentity TIdentity;
+typedef struct SLoadSpec TLoadSpec;
+typedef struct SLoadField TLoadField;
+typedef struct SLoadPart TLoadPart;
+typedef struct SExport TExport;
+typedef struct SDialect TDialect;
+typedef struct SXlateEntry TXlateEntry;
+typedef struct SXlateBuf TXlateBuf;
+typedef struct SSlowQuery TSlowQuery;
+typedef struct SColumn TColumn;
+typedef struct SColumns TColumns;
+typedef struct SResHead TResHead;
+typedef struct SResField TResField;
+typedef struct SShcStamp TShcStamp;
+typedef struct SShcSlot TShcSlot;
+typedef struct SShcHead TShcHead;
+typedef struct SAsync TAsync;
+typedef struct SRouteTarget TRouteTarget;
+typedef struct SRouteLink TRouteLink;
+typedef struct SHedge THedge;
+typedef struct SShard TShard;
+typedef struct SShardRange TShardRange;
+typedef struct SShardPlan TShardPlan;
+typedef struct SScrollWin TScrollWin;
+typedef struct SScroll TScroll;
+
+struct SSQLToken
+  {
+    int		type;
+    const char *start;
+    size_t	len;
+  };
+
+struct SSQLInfo
+  {
+    int		kind;
+    int		bCacheable;	/* deterministic read */
+    int		bAllTables;	/* could not tell which tables are touched */
+    int		bInsert;	/* INSERT or REPLACE */
+    int		bReturning;	/* the INSERT returns the key itself */
+    unsigned int nTables;
+    char	tables[SQL_MAX_TABLES][NAME_LEN + 1];
+  };
+
+struct SQCacheEntry
+  {
+    TQCacheEntry *pHashNext;
+    TQCacheEntry *pLruPrev;
+    TQCacheEntry *pLruNext;
+    unsigned long hash;
+    char *	key;
+    size_t	keyLen;
+    time_t	expires;
+    unsigned long bytes;
+    int		refCount;	/* cache itself plus open results */
+    int		bLinked;
+    TSQLInfo	info;
+    unsigned int field_count;
+    MYSQL_FIELD *fields;
+    MYSQL_DATA *data;
+    my_ulonglong affected_rows;
+  };
+
+/* How a DBMS reports generated keys, see _identity_init */
+struct SIdentity
+  {
+    const char *dbms;		/* SQL_DBMS_NAME prefix */
+    const char *batch;		/* query to append to the INSERT, or NULL */
+    const char *query;		/* query to run on its own afterwards */
+    int		bKnown;		/* only for tables known to have an identity */
+  };
+
+/* Catalog cache entry, see _cat_get */
+#define CAT_DBS			0
+#define CAT_TABLES		1
+#define CAT_FIELDS		2
+#define CAT_IDENTITY		3	/* nItems set if the table has one */
+
+struct SCatEntry
+  {
+    TCatEntry *	pNext;
+    int		kind;
+    char *	pTable;		/* CAT_FIELDS and CAT_IDENTITY */
+    char *	pDb;		/* current database, not for CAT_DBS */
+    time_t	expires;	/* not for CAT_IDENTITY, kept until DDL */
+    unsigned int nItems;
+    char **	ppNames;	/* CAT_DBS and CAT_TABLES */
+    MYSQL_FIELD *fields;	/* CAT_FIELDS */
+  };
+
+/* Target of the statement rewriter, see _xl_init */
+#define XL_LIMIT_KEEP		0	/* LIMIT is understood */
+#define XL_LIMIT_OFFSET		1	/* LIMIT n OFFSET m */
+#define XL_LIMIT_FETCH		2	/* OFFSET m ROWS FETCH NEXT n ROWS ONLY */
+#define XL_LIMIT_MSSQL		3	/* the same, OFFSET and ORDER BY required */
+#define XL_VALUE(T)		((T)->type == TK_NUMBER \
+				 || ((T)->type == TK_PUNCT && *(T)->start == '?'))
+#define XL_SELECT		1	/* nesting level flags in _xl_rewrite */
+#define XL_ORDER		2
+
+struct SDialect
+  {
+    const char *name;		/* sql-dialect option */
+    const char *dbms;		/* SQL_DBMS_NAME prefix, NULL if none */
+    char	quoteOpen;	/* identifier quotes */
+    char	quoteClose;
+    int		limit;		/* XL_LIMIT_* */
+    const char *now;		/* NOW() */
+    const char *curdate;	/* CURDATE() */
+    const char *curtime;	/* CURTIME() */
+  };
+
+/* Translated statement, see _xl_translate */
+struct SXlateEntry
+  {
+    TXlateEntry *pHashNext;
+    TXlateEntry *pLruPrev;
+    TXlateEntry *pLruNext;
+    unsigned long hash;
+    char *	key;
+    size_t	keyLen;
+    char *	out;		/* NULL if the statement is fine as it is */
+    size_t	outLen;
+  };
+
+struct SXlateBuf
+  {
+    char *	p;
+    size_t	n;
+    size_t	cap;
+    int		bFailed;
+  };
+
+/* Slow log record of one statement, see _slow_begin */
+#define SLOW_EXECUTE		0	/* SQLExecDirect */
+#define SLOW_DESCRIBE		1	/* result columns in _impl_query */
+#define SLOW_BIND		2
+#define SLOW_FETCH		3
+#define SLOW_HOLD		4	/* client has the result */
+#define SLOW_PHASES		5
+
+struct SSlowQuery
+  {
+    TSlowQuery *pNext;		/* writer queue */
+    char *	pPath;
+    char *	pQuery;
+    size_t	nQuery;
+    size_t	nAlloc;
+    time_t	when;
+    my_ulonglong ulLimit;	/* us */
+    my_ulonglong aPhase[SLOW_PHASES]; /* us */
+    my_ulonglong ulHeld;	/* _now_us at hand out, less the fetch time */
+    my_ulonglong rows;
+    my_ulonglong bytes;
+    int		bActive;	/* still being timed */
+  };
+
+/* One column of a columnar result, laid out as MYSQL_COLUMN */
+struct SColumn
+  {
+    char *	data;
+    size_t	nAlloc;
+    unsigned long *offsets;	/* rows + 1 */
+    unsigned char *nulls;
+  };
+
+struct SColumns
+  {
+    TColumn *	aCol;
+    unsigned int nCols;
+    my_ulonglong nRows;
+    my_ulonglong nAlloc;	/* rows offsets and nulls have room for */
+    my_ulonglong nCursor;	/* next row of mysql_fetch_row */
+    MYSQL_ROW	pRow;		/* handed out by mysql_fetch_row */
+    int		bView;		/* mysql_fetch_row reads the columns */
+    int		bBorrowed;	/* buffers belong to a file or the shared cache */
+    char *	pMap;		/* file the columns live in, see _rf_load */
+    size_t	nMap;
+    int		bMapped;
+    volatile long *pPin;	/* shared cache entry held, see _shc_lookup */
+  };
+
+/* Result file, see _rf_write. Positions are from the start of the file. */
+struct SResHead
+  {
+    char	magic[8];	/* RF_MAGIC */
+    unsigned long order;	/* RF_ORDER as written */
+    unsigned long ulSize;	/* sizeof (unsigned long) */
+    unsigned long fields;
+    unsigned long rows;
+    unsigned long size;		/* of the whole file */
+  };
+
+/* One per field after the header */
+struct SResField
+  {
+    unsigned long name;		/* 0 for NULL */
+    unsigned long table;
+    unsigned long def;
+    unsigned long type;
+    unsigned long length;
+    unsigned long max_length;
+    unsigned long flags;
+    unsigned long decimals;
+    unsigned long offsets;	/* the column, as in MYSQL_COLUMN */
+    unsigned long nulls;
+    unsigned long data;
+  };
+
+/* Shared cache segment, see _shc_attach. Positions are from its start. */
+#define SHC_FREE		0
+#define SHC_BUSY		1
+#define SHC_READY		2	/* plus the results reading it */
+
+/* Generations a cached read depends on, see _shc_stamp */
+struct SShcStamp
+  {
+    long	generation;
+    long	writes;
+    int		bAll;		/* read tables we could not tell */
+    unsigned int nTables;
+    unsigned short aTable[SQL_MAX_TABLES];	/* see _shc_table */
+    long	aGen[SQL_MAX_TABLES];
+  };
+
+struct SShcSlot
+  {
+    volatile long state;	/* SHC_* */
+    unsigned long hash;
+    unsigned long chunk;	/* key, then the result image */
+    unsigned long nChunks;
+    unsigned long keyLen;
+    unsigned long size;		/* of the image */
+    unsigned long lastUsed;	/* tick */
+    long	expires;	/* time (), see query-cache-ttl */
+    TShcStamp	stamp;
+  };
+
+struct SShcHead
+  {
+    char	magic[8];	/* SHC_MAGIC */
+    unsigned long order;	/* RF_ORDER as written */
+    unsigned long ulSize;	/* sizeof (unsigned long) */
+    unsigned long size;		/* of the segment */
+    unsigned long nSlots;
+    unsigned long nChunks;
+    unsigned long slots;
+    unsigned long owners;	/* slot + 1 per chunk, 0 for free */
+    unsigned long chunks;
+    volatile unsigned long tick;
+    volatile long generation;	/* writes to tables we could not tell */
+    volatile long writes;
+    volatile long aTableGen[SHC_TABLES];
+  };
+
+struct SAsync
+  {
+    TAsync *	pNext;		/* worker queue */
+    MYSQL *	mysql;
+    int		op;		/* ASYNC_*, 0 when idle */
+    int		bQueued;	/* on a worker, done is posted to fdPost */
+    volatile long lDone;
+    int		fd;		/* readable once done, also NET.fd */
+    int		fdPost;		/* the same eventfd, or a pipe */
+    unsigned long epollId;	/* registered there, see _async_wait_any */
+    unsigned long waitStamp;	/* of the last wait, with _async.lock */
+    unsigned int iWait;
+
+    /* arguments, the caller keeps them until the call is complete */
+    const char *pHost;
+    const char *pUser;
+    const char *pPasswd;
+    const char *pDb;
+    unsigned int port;
+    const char *pSocket;
+    unsigned long clientFlag;
+    const char *pQuery;
+    unsigned long nQuery;
+    MYSQL_RES *	pRes;
+
+    /* results */
+    int		rc;
+    MYSQL *	pConn;
+    MYSQL_RES *	pResult;
+    MYSQL_ROW	row;
+  };
+
+/* Load and latency of one replica DSN, process wide */
+struct SRouteTarget
+  {
+    TRouteTarget *pNext;
+    char *	pDsn;
+    unsigned long nOutstanding;	/* executes in flight */
+    unsigned long ulLatency;	/* us, moving average of executes */
+    unsigned long ulSampled;	/* _now_ms of the last execute */
+  };
+
+/* Connection of a handle to a replica, see _route_pick */
+struct SRouteLink
+  {
+    TRouteTarget *pTarget;
+    char *	pConnStr;
+    SQLHDBC	hDbc;
+    SQLHSTMT	hStmt;		/* idle statement */
+    int		bConnected;
+    unsigned int nLent;		/* statements the primary side holds */
+    int		bDown;
+    unsigned long ulDown;	/* _now_ms it was lost */
+    double	dWeight;	/* scratch of _route_pick */
+  };
+
+/* Second send of a replica read, see _hedge_arm */
+struct SHedge
+  {
+    THedge *	pNext;		/* armed, earliest deadline first */
+    TSQLPrivate *pDB;
+    int		state;		/* HEDGE_* */
+    int		winner;		/* 1 = the first send, 2 = the hedge */
+    my_ulonglong ullDue;	/* _now_us it is sent again */
+    unsigned int iRead;		/* class of the owner's read, _hedge_class */
+    unsigned int iClass;	/* of the armed one, under _hedge.lock */
+    TRouteLink *pFirst;		/* replica and statement of the first send */
+    SQLHSTMT	hFirst;
+    const char *pExec;		/* text of the first send, while armed */
+    long	execLen;
+    char *	pText;		/* copy the hedge runs */
+    size_t	nTextMax;
+    TRouteLink *pLink;		/* replica of the hedge */
+    SQLHSTMT	hStmt;		/* its statement, set under _hedge.lock */
+    SQLRETURN	ret;
+    int		bLost;		/* the replica of the hedge is gone */
+  };
+
+/* One DSN of the shard map, see _shard_init */
+struct SShard
+  {
+    char *	pDsn;
+    char *	pConnStr;
+    MYSQL *	mysql;		/* connected on first use */
+    int		bUsed;		/* the statement runs here */
+    const char *pText;		/* what it runs */
+    size_t	nText;
+    char *	pOwnText;	/* rows of a split INSERT */
+    size_t	nOwnMax;
+    int		rc;
+    MYSQL_RES *	pRes;
+    my_ulonglong affected;
+    my_ulonglong insertId;
+    TTHREAD	thread;
+    int		bThread;
+  };
+
+/* Keys lo to hi live on one shard */
+struct SShardRange
+  {
+    double	lo;
+    double	hi;
+    int		bLo;		/* bounded below */
+    int		bHi;
+    unsigned int iShard;
+  };
+
+/* How the results of a scattered SELECT come together */
+struct SShardPlan
+  {
+    int		bStar;		/* select list has a * */
+    int		bAgg;		/* some item is an aggregate */
+    int		bGroup;		/* GROUP BY or DISTINCT */
+    int		bGroupBy;	/* rows fold on the aKey items only */
+    unsigned int nItems;
+    unsigned char aItem[SHARD_ITEMS]; /* SHARD_* */
+    unsigned char aKey[SHARD_ITEMS]; /* named by GROUP BY */
+    unsigned int nOrder;
+    int		aOrderCol[SHARD_ORDER]; /* 0 based, -1 = by name */
+    int		aOrderDesc[SHARD_ORDER];
+    char	aOrderName[SHARD_ORDER][NAME_LEN + 1];
+    int		bLimit;
+    unsigned long nOffset;
+    unsigned long nLimit;
+    size_t	limStart;	/* the LIMIT clause in the text */
+    size_t	limEnd;
+  };
+
+/* Rows start to start + nRows of a scrollable cursor, by column */
+struct SScrollWin
+  {
+    my_ulonglong start;
+    SQLULEN	nRows;		/* 0 = not loaded */
+    unsigned long stamp;	/* last use, the oldest is loaded again */
+    char **	ppBuf;		/* nWindow values of each column */
+    SQLLEN *	pInd;
+  };
+
+/* A use_result result that can seek, see _scroll_row */
+struct SScroll
+  {
+    SQLULEN	nWindow;	/* rows per block */
+    my_ulonglong pos;		/* row the next mysql_fetch_row returns */
+    my_ulonglong nTotal;	/* rows in the result, once bEnd */
+    int		bEnd;
+    unsigned long clock;
+    SQLULEN	nFetched;	/* ROWS_FETCHED_PTR */
+    TScrollWin *pBound;		/* window the columns are bound to */
+    TScrollWin	aWin[SCROLL_WINDOWS];
+  };
 
 struct SSQLPrivate
   {
-    SQLHENV	hEnv;
+    SQLHENV	hEnv;		/* shared, see _global_init */
     SQLHDBC	hDbc;
     SQLHSTMT	hStmt;
     int		bConnected;
     int		bHaveData;
     int		bPrepared;
+    volatile long lBusy;	/* owner guard, see _enter */
+    int		bInTrans;	/* explicit BEGIN seen */
+    TQCacheEntry *pQcHit;	/* result of last query came from cache */
+    char *	pQcKey;		/* key of a cacheable query in flight */
+    size_t	qcKeyLen;
+    unsigned long qcHash;
+    unsigned long qcGeneration;
+    TSQLInfo	qcInfo;
+    SQLHSTMT	hDiagStmt;	/* statement of the failing call, if not hStmt */
+    SQLRETURN	diagRc;		/* SQL_SUCCESS_WITH_INFO not read yet */
+    SQLHSTMT	hDiagInfo;	/* its statement, see _diag_drain */
+    unsigned int nWarnings;	/* mysql_warning_count */
+    SQLHSTMT	aStmtPool[STMT_POOL_MAX];
+    unsigned int nStmtPool;
+    unsigned int nStmtPoolMax;
+    unsigned int nMaxActive;	/* SQL_MAX_CONCURRENT_ACTIVITIES, 0 = no limit */
+    TSQLResult *pStreaming;	/* use_result results with an open cursor */
+    char *	pConnStr;	/* kept for reconnects */
+    char	szSqlState[6];	/* of the last error */
+    unsigned long ulAlive;	/* _now_ms of the last successful round trip */
+    unsigned long nPingWindow;	/* ms mysql_ping trusts ulAlive */
+    TCatEntry *	pCatalog;
+    unsigned int nCatalogTtl;	/* seconds, 0 = no caching */
+    const TIdentity *pIdentity;	/* NULL if the DBMS is unknown */
+    int		bIdentityBatch;
+    int		bIdentityPending; /* insert_id still to be asked for */
+    int		bIdentityWanted; /* the INSERT running generates a key */
+    int		csClient;	/* CS_*, encoding the application uses */
+    int		csOdbc;		/* CS_*, encoding of SQL_C_CHAR data */
+    const char *pszCharset;	/* mysql_character_set_name */
+    const TDialect *pDialect;	/* NULL to send statements unchanged */
+    TXlateEntry *aXlate[XL_BUCKETS];
+    TXlateEntry *pXlateHead;	/* most recently used */
+    TXlateEntry *pXlateTail;
+    unsigned int nXlate;
+    unsigned int nXlateMax;
+    char *	pXlateTmp;	/* translation too long to keep */
+    MYSQL_RES *	pLocalRes;	/* SHOW or shared cache hit, answered here */
+    TSlowQuery *pSlow;		/* timing of the last statement */
+    int		bSlowQueued;	/* mysql_close waits for the writer */
+    TSQLResult *pLazyRes;	/* stored result still naming through hStmt */
+    int		bRowCountPending; /* affected_rows not asked for yet */
+    int		bShared;	/* uses the shared cache, see _shc_attach */
+    char *	pShcKey;	/* key of a cacheable query in flight */
+    size_t	shcKeyLen;
+    unsigned long shcHash;
+    TShcStamp	shcStamp;	/* generations when it started */
+    SQLUINTEGER	ulBatch;	/* SQL_BATCH_SUPPORT */
+    char *	pMulti;		/* text of a multi-statement query */
+    size_t	nMulti;
+    size_t	iMulti;		/* statements after the current result */
+    int		bMultiBatch;	/* sent as one batch, see _multi_more */
+    SQLHSTMT	hMulti;		/* the batch while results are to come */
+    MYSQL *	mysql;		/* owner, for the group commit flusher */
+    int		bAutocommit;	/* as the client last set it */
+    unsigned int nGroupMs;	/* group commit latency bound, 0 = off */
+    int		bGroup;		/* writes wait for a group commit */
+    unsigned int nGroup;	/* statements in it */
+    unsigned long ulGroupStart;	/* _now_ms of its first write */
+    int		bGroupListed;	/* on the flusher list */
+    TSQLPrivate *pGroupNext;
+    int		bGroupRefused;	/* no savepoints, writes are not grouped */
+    unsigned int groupErrno;	/* a commit failed after the call returned */
+    char	szGroupError[MYSQL_ERRMSG_SIZE];
+    int		bGroupRows;	/* row count taken before the flusher's commit */
+    my_ulonglong groupRows;
+    TRouteLink *aLinks;		/* replicas, see _route_init */
+    unsigned int nLinks;
+    unsigned long ulRoute;	/* random state of _route_pick */
+    int		bSession;	/* session state the replicas lack */
+    TRouteLink *pRouted;	/* owner of hStmt when a replica ran it */
+    unsigned int nHedgePct;	/* extra executes allowed, 0 = no hedging */
+    THedge	hedge;
+    char *	pShardTable;	/* sharded table, see _shard_init */
+    char *	pShardKey;	/* and its key column */
+    TShard *	aShards;
+    unsigned int nShards;
+    TShardRange *aRanges;
+    unsigned int nRanges;
+    unsigned int nScrollWindow;	/* rows per block, 0 = forward only */
+    int		bScrollAsked;	/* scrollType is known */
+    SQLULEN	scrollType;	/* cursor of scrollable reads, see _scroll_cursor */
+    char *	pScrollSql;	/* read on hStmt a seek may run again */
+  };
+
+/* A MYSQL_RES is always allocated as one of these */
+struct SSQLResult
+  {
+    MYSQL_RES	res;
+    TQCacheEntry *pCached;	/* rows and fields are shared with the cache */
+    SQLHSTMT	hStmt;		/* cursor of a use_result result */
+    MYSQL_ROW	pUseRow;	/* row array handed out by use_result */
+    TSQLResult *pNext;		/* next in TSQLPrivate.pStreaming */
+    char *	pConv;		/* transcoded use_result row */
+    TSlowQuery *pSlow;		/* until mysql_free_result */
+    SQLHSTMT	hMeta;		/* column names not read yet, see _meta_resolve */
+    TColumns *	pCols;		/* values by column, see _col_alloc */
+    TRouteLink *pLink;		/* replica the cursor belongs to */
+    TScroll *	pScroll;	/* a scrollable cursor, see _scroll_row */
+    char *	pScrollSql;	/* read to run on one, see _scroll_open */
+  };
+
+/* LOAD DATA LOCAL INFILE, see _ld_parse */
+struct SLoadSpec
+  {
+    char *	pFile;
+    char *	pTable;		/* as written, may be db.table */
+    TSQLToken	tBare;		/* the table part of it */
+    char *	pColumns;	/* "(a, b)", NULL for all columns */
+    int *	aMap;		/* field -> parameter, -1 for @var */
+    unsigned int nMap;
+    unsigned int nParams;
+    int		bReplace;
+    int		bIgnore;	/* duplicates are skipped, unless REPLACE */
+    int		cs;		/* CS_* of the file */
+    char *	pFieldTerm;
+    size_t	nFieldTerm;
+    char *	pLineTerm;
+    size_t	nLineTerm;
+    char *	pLineStart;
+    size_t	nLineStart;
+    int		enclose;	/* -1 for none */
+    int		escape;		/* -1 for none */
+    unsigned long nIgnore;
+    char	aStop[4];	/* bytes _ld_scan stops at */
+  };
+
+struct SLoadField
+  {
+    size_t	off;		/* in TLoadPart.pArena */
+    SQLLEN	len;		/* or SQL_NULL_DATA */
+  };
+
+/* A range of the file and the connection it goes over */
+struct SLoadPart
+  {
+    const TLoadSpec *pSpec;
+    MYSQL *	mysql;
+    const char *pConnStr;	/* workers connect on their own */
+    TTHREAD	thread;
+    int		bThread;
+    volatile long *plStop;	/* set when a part failed */
+    int		bTrans;		/* commit comes from _ld_query */
+    const char *pCur;
+    const char *pEnd;
+    unsigned long nIgnore;
+    char *	pArena;		/* decoded fields of the batch */
+    size_t	nArena;
+    size_t	nUsed;
+    TLoadField *pRows;		/* LOAD_BATCH_ROWS x nParams */
+    char **	ppCol;		/* parameter arrays */
+    SQLLEN *	pInd;
+    SQLLEN *	pWidth;		/* bytes per value of each array */
+    int		bArray;		/* driver takes parameter arrays */
+    int		bNoSavepoint;	/* the data source refused LOAD_SAVEPOINT */
+    SQLUSMALLINT aStatus[LOAD_BATCH_ROWS];
+    my_ulonglong records;
+    my_ulonglong skipped;
+    my_ulonglong warnings;
+  };
+
+/* State of mysql_export_result */
+struct SExport
+  {
+    int		fd;
+    int		format;
+    struct iovec aIov[EX_IOV];	/* queued for writev */
+    int		nIov;
+    char *	pBuf;		/* copied and escaped values */
+    size_t	nBuf;
+    size_t	nUsed;
+    my_ulonglong bytes;
+  };
+
+/* Error state for calls that have no usable MYSQL handle */
+struct SThreadPrivate
+  {
+    unsigned int last_errno;
+    char	last_error[MYSQL_ERRMSG_SIZE];
+    int		epfd;		/* of mysql_wait_any, valid with epollId */
+    unsigned long epollId;
   };
 
 /* Prototypes */
+static void
+	_global_init (void);
+static TThreadPrivate *
+	_thread_private (void);
+static int
+	_enter (MYSQL *mysql);
+static void
+	_leave (MYSQL *mysql);
 static int
 	_alloc_db (MYSQL *mysql);
 static void
@@ -84,7 +983,11 @@ static int
 static void
 	_set_error (MYSQL *mysql, unsigned int err);
 static void
-	_fetch_db_errors (MYSQL *mysql, const char *where, int save);
+	_fetch_db_errors (MYSQL *mysql, const char *where);
+static void
+	_diag_forget (TSQLPrivate *pDB, SQLHSTMT hStmt);
+static void
+	_state_init (void);
 static TSQLPrivate *
 	_db (MYSQL *mysql);
 static int
@@ -94,13 +997,162 @@ static MYSQL_FIELD *
 static void
 	_free_fields (MYSQL *mysql);
 static MYSQL_RES *
-	_alloc_res (MYSQL *mysql);
+	_alloc_res (MYSQL *mysql, int bBind);
 static void
 	_free_res (MYSQL_RES *res);
+static SQLHSTMT
+	_stmt_acquire (MYSQL *mysql);
+static void
+	_stmt_release (TSQLPrivate *pDB, SQLHSTMT hStmt);
+static int
+	_bind_res (MYSQL *mysql, MYSQL_RES *res, SQLHSTMT hStmt);
+static SQLULEN
+	_bind_block (MYSQL *mysql, MYSQL_RES *res, SQLHSTMT hStmt,
+	    char **ppBuf, SQLLEN **ppInd, SQLULEN *pFetched);
+static int
+	_fetch_all (MYSQL *mysql, MYSQL_RES *res, SQLHSTMT hStmt);
+static void
+	_col_free (TColumns *pCols);
+static void
+	_unmap_file (char *data, size_t size, int bMapped);
+static void
+	_shc_unpin (volatile long *pState);
+static void
+	_shc_invalidate (TSQLInfo *info);
+static int
+	_shc_attach (const char *path, unsigned long size);
+static TAsync *
+	_async_context (MYSQL *mysql);
+static void
+	_async_free (MYSQL *mysql);
+static void
+	_detach_res (MYSQL_RES *res);
+static void
+	_multi_reset (TSQLPrivate *pDB);
+static void
+	_impl_affected_rows (MYSQL *mysql);
+static void
+	_group_wait (TSQLPrivate *pDB);
+static void
+	_group_unlist (TSQLPrivate *pDB);
+static int
+	_group_end (TSQLPrivate *pDB, SQLSMALLINT completion);
+static int
+	_group_exec (MYSQL *mysql, const char *sql);
+static void
+	_trans_status (TSQLPrivate *pDB);
+static int
+	_route_init (MYSQL *mysql, const char *user, const char *passwd);
+static void
+	_route_give (TRouteLink *link, SQLHSTMT hStmt);
+static void
+	_route_return (TSQLPrivate *pDB);
+static void
+	_route_down (TRouteLink *link);
+static void
+	_route_free (TSQLPrivate *pDB);
+static int
+	_hedge_arm (MYSQL *mysql, TRouteLink *link, SQLHSTMT hStmt,
+	    const char *exec, long execLen);
+static SQLRETURN
+	_hedge_settle (TSQLPrivate *pDB, int hedge, SQLRETURN ret,
+	    my_ulonglong us, TRouteLink **pLink, SQLHSTMT *phStmt);
+static void
+	_hedge_collect (TSQLPrivate *pDB, int bWait);
+static THREAD_FN
+	_hedge_worker (void *arg);
+static int
+	_shard_init (MYSQL *mysql, const char *user, const char *passwd);
+static int
+	_shard_query (MYSQL *mysql, const char *query, size_t len);
+static void
+	_shard_free (TSQLPrivate *pDB);
+static int
+	_query_run (MYSQL *mysql, const char *query, long len, int bBatch);
+static int
+	_scroll_cursor (MYSQL *mysql, SQLHSTMT hStmt);
+static int
+	_scroll_init (MYSQL *mysql, MYSQL_RES *res, SQLHSTMT hStmt);
+static int
+	_scroll_row (MYSQL_RES *res);
+static void
+	_scroll_free (TSQLResult *pRes);
+static void
+	_meta_resolve (MYSQL_RES *res);
+static SQLLEN
+	_display_size (SQLSMALLINT sqlType, SQLULEN colSize);
+static enum enum_field_types
+	_field_type (SQLSMALLINT sqlType);
+static int
+	_make_room (MYSQL *mysql);
+static void
+	_drop_stmts (TSQLPrivate *pDB, int bOrphan);
+static int
+	_reconnect (MYSQL *mysql);
+static unsigned long
+	_now_ms (void);
+static my_ulonglong
+	_now_us (void);
+static void
+	_apply_options (MYSQL *mysql);
+static void
+	_cat_flush (TSQLPrivate *pDB);
+static TCatEntry *
+	_cat_get (MYSQL *mysql, int kind, const char *table, int *pbOwned);
+static void
+	_cat_free_entry (TCatEntry *entry);
+static void
+	_identity_init (MYSQL *mysql);
+static void
+	_qc_init (MYSQL *mysql);
+static void
+	_xl_init (MYSQL *mysql);
+static int
+	_xl_rewrite (const TDialect *d, const char *query, size_t len,
+	    char **ppOut, size_t *pOutLen);
+static void
+	_xl_flush (TSQLPrivate *pDB);
+static void
+	_xl_trim (TSQLPrivate *pDB);
+static void
+	_slow_finish (TSQLPrivate *pDB);
+static void
+	_slow_release (MYSQL_RES *res);
+static void
+	_slow_free (TSlowQuery *sq);
+static void
+	_slow_drain (void);
+static int
+	_cs_init (MYSQL *mysql);
+static char *
+	_cs_dup (TSQLPrivate *pDB, int bToClient, const char *src,
+	    size_t *pLen);
+static size_t
+	_cs_convert (int from, const char *src, size_t len, char *dst);
+static void
+	_free_options (struct st_mysql_options *opt);
+static int
+	_read_options (MYSQL *mysql);
 static int
 	_append_row (MYSQL_DATA *data, MYSQL_ROWS **pp);
 static void
 	_free_data (MYSQL_DATA *data);
+static const char *
+	_sql_token (const char *cp, const char *end, TSQLToken *tok);
+static void
+	_sql_analyze (const char *query, size_t len, TSQLInfo *info);
+static void
+	_qc_unref (TQCacheEntry *entry);
+static int
+	_qc_lookup (MYSQL *mysql, const char *query, size_t len);
+static void
+	_qc_insert (MYSQL *mysql, MYSQL_RES *res);
+static void
+	_qc_invalidate (TSQLInfo *info);
+static void
+	_qc_reset (TSQLPrivate *pDB);
+static MYSQL_RES *
+	_qc_result (MYSQL *mysql);
 static MYSQL *
 	_impl_init (MYSQL *mysql);
 static void
@@ -120,69 +1172,354 @@ static MYSQL_RES *
 	_impl_store_result (MYSQL *mysql);
 static MYSQL_ROW
 	_impl_fetch_row (MYSQL_RES *res);
-
-
 static int
-_alloc_db (MYSQL *mysql)
-{
-  TSQLPrivate *pDB;
-
-  pDB = (TSQLPrivate *) calloc (1, sizeof (TSQLPrivate));
-  if (pDB == NULL)
-    {
-      _set_error (mysql, CR_OUT_OF_MEMORY);
-      return -1;
-    }
+	_impl_ping (MYSQL *mysql);
+static int
+	_impl_options (MYSQL *mysql, enum mysql_option option, const char *arg);
+
+
+static TONCE _global_once = ONCE_INIT;
+static SQLHENV _global_henv = SQL_NULL_HENV;
+static SQLRETURN _global_rc = SQL_ERROR;
+static TKEY _thread_key;
+static int _thread_key_ok = 0;
+static TMUTEX _defaults_lock;
+static unsigned char _state_index[STATE_SLOTS];
+static struct SCnfBlock *_defaults_mem = NULL;	/* see load_defaults */
+#if !HAVE_THREADS
+static TThreadPrivate _thread_static;
+#endif
 
-  pDB->hEnv = SQL_NULL_HENV;
-  pDB->hDbc = SQL_NULL_HDBC;
-  pDB->hStmt = SQL_NULL_HSTMT;
+/* Query cache, see _qc_lookup */
+static struct
+  {
+    TMUTEX	lock;
+    volatile unsigned long maxBytes;
+    unsigned int ttl;
+    unsigned long bytes;
+    unsigned long generation;
+    TQCacheEntry *buckets[QC_BUCKETS];
+    TQCacheEntry *pLruHead;
+    TQCacheEntry *pLruTail;
+    MYSQL_QUERY_CACHE_STATS stats;
+    int		bConfigured;	/* see _qc_init */
+  } _qc;
+
+/* Shared result cache of this process, see _shc_attach */
+static struct
+  {
+    TMUTEX	lock;
+    char *	pPath;
+    int		fd;
+    size_t	nSize;
+    TShcHead *	pHead;
+    TShcSlot *	aSlot;
+    unsigned long *aOwner;
+    char *	pChunks;
+  } _shc;
+
+/* Workers of the non-blocking API, see _async_start */
+static struct
+  {
+    TMUTEX	lock;
+    TCOND	work;
+    TAsync *	pHead;
+    TAsync *	pTail;
+    int		nQueued;
+    int		nThreads;
+    int		nIdle;
+    unsigned long epollSerial;
+    unsigned long waitSerial;	/* stamps of _async_wait_any */
+  } _async;
+
+/* Connections with a group commit pending, see _group_worker */
+static struct
+  {
+    TMUTEX	lock;
+    TCOND	work;
+    TCOND	done;		/* a flush gave its handle back */
+    TSQLPrivate *pHead;
+    int		bRunning;
+  } _group;
+
+/* Replica DSNs of this process, see _route_pick */
+static struct
+  {
+    TMUTEX	lock;
+    TRouteTarget *pHead;
+  } _route;
 
-  _set_error (mysql, 0);
+/* Hedged reads of this process, see _hedge_worker */
+static struct
+  {
+    TMUTEX	lock;
+    TCOND	work;
+    TCOND	done;		/* a hedge finished */
+    THedge *	pHead;		/* armed */
+    int		nThreads;
+    int		nIdle;
+    unsigned long nReads;	/* reads that could be hedged */
+    unsigned long nSent;	/* of those, sent twice */
+    unsigned int aHist[HEDGE_CLASSES][HEDGE_BUCKETS];
+    unsigned int aSamples[HEDGE_CLASSES];
+  } _hedge;
+
+/* Slow log writer queue, see _slow_submit */
+static struct
+  {
+    TMUTEX	lock;
+    TCOND	work;
+    TCOND	idle;
+    TSlowQuery *pHead;
+    TSlowQuery *pTail;
+    int		bRunning;
+    int		bBusy;
+  } _slow;
 
-#if 0
-  DBOF(mysql) = pDB;
-#else
-  mysql->net.vio = pDB;
-#endif
 
-  return 0;
+#ifdef WIN32
+static BOOL CALLBACK
+_once_adapter (PINIT_ONCE once, PVOID fn, PVOID *ctx)
+{
+  ((void (*) (void)) fn) ();
+  return TRUE;
 }
+#endif
 
 
 static void
-_free_db (MYSQL *mysql)
+_thread_destroy (void *arg)
 {
-  TSQLPrivate *pDB;
-
-  pDB = DBOF(mysql);
-  if (pDB)
-    {
-      if (pDB->hStmt != SQL_NULL_HSTMT)
-	SQLFreeStmt (pDB->hStmt, SQL_DROP);
-      if (pDB->bConnected)
-	SQLDisconnect (pDB->hDbc);
-      if (pDB->hDbc != SQL_NULL_HDBC)
-	SQLFreeConnect (pDB->hDbc);
-      if (pDB->hEnv != SQL_NULL_HENV)
-	SQLFreeEnv (pDB->hEnv);
+  TThreadPrivate *pThr = (TThreadPrivate *) arg;
 
-      pDB->hEnv = SQL_NULL_HENV;
-      pDB->hDbc = SQL_NULL_HDBC;
-      pDB->hStmt = SQL_NULL_HSTMT;
-      pDB->bConnected = 0;
-      free (pDB);
-#if 0
-      DBOF(mysql) = NULL;
-#else
-      mysql->net.vio = NULL;
+  if (pThr == NULL)
+    return;
+#ifdef HAVE_EPOLL_CREATE1
+  if (pThr->epollId)
+    close (pThr->epfd);
 #endif
-    }
+  free (pThr);
 }
 
 
-static TSQLPrivate *
-_db (MYSQL *mysql)
+/*
+ *  Runs exactly once per process, no matter how many threads race into
+ *  mysql_init, my_init, my_thread_init or the first connect
+ */
+static void
+_global_init (void)
+{
+  _thread_key_ok = (KEY_CREATE (&_thread_key, _thread_destroy) == 0);
+  MUTEX_INIT (&_qc.lock);
+  MUTEX_INIT (&_defaults_lock);
+  MUTEX_INIT (&_shc.lock);
+  MUTEX_INIT (&_slow.lock);
+  COND_INIT (&_slow.work);
+  COND_INIT (&_slow.idle);
+  MUTEX_INIT (&_async.lock);
+  COND_INIT (&_async.work);
+  MUTEX_INIT (&_group.lock);
+  COND_INIT (&_group.work);
+  COND_INIT (&_group.done);
+  MUTEX_INIT (&_route.lock);
+  MUTEX_INIT (&_hedge.lock);
+  COND_INIT (&_hedge.work);
+  COND_INIT (&_hedge.done);
+  _state_init ();
+
+  _global_rc = SQLAllocEnv (&_global_henv);
+  if (_global_rc != SQL_SUCCESS && _global_rc != SQL_SUCCESS_WITH_INFO)
+    _global_henv = SQL_NULL_HENV;
+}
+
+
+static TThreadPrivate *
+_thread_private (void)
+{
+#if HAVE_THREADS
+  TThreadPrivate *pThr;
+
+  RUN_ONCE (&_global_once, _global_init);
+  if (!_thread_key_ok)
+    return NULL;
+
+  if ((pThr = (TThreadPrivate *) KEY_GET (_thread_key)) == NULL)
+    {
+      if ((pThr = (TThreadPrivate *) calloc (1, sizeof (TThreadPrivate))))
+	KEY_SET (_thread_key, pThr);
+    }
+
+  return pThr;
+#else
+  return &_thread_static;
+#endif
+}
+
+
+/*
+ *  Claim the handle for the calling thread. A second thread that enters
+ *  the same handle gets CR_COMMANDS_OUT_OF_SYNC instead of corrupting the
+ *  statement state; separate handles never touch shared memory here.
+ *  The group commit flusher holds a handle as 2 for a moment, that one
+ *  is waited for.
+ */
+static int
+_enter (MYSQL *mysql)
+{
+  TSQLPrivate *pDB;
+
+  if (mysql == NULL)
+    return -1;
+
+  if ((pDB = DBOF(mysql)) == NULL)
+    return 0;
+
+  while (!ATOMIC_CAS (&pDB->lBusy, 0, 1))
+    {
+      if (pDB->lBusy != 2)
+	{
+	  _set_error (mysql, CR_COMMANDS_OUT_OF_SYNC);
+	  return -1;
+	}
+      _group_wait (pDB);
+    }
+
+  return 0;
+}
+
+
+static void
+_leave (MYSQL *mysql)
+{
+  TSQLPrivate *pDB;
+
+  if (mysql && (pDB = DBOF(mysql)) != NULL)
+    ATOMIC_SET (&pDB->lBusy, 0);
+}
+
+
+static int
+_alloc_db (MYSQL *mysql)
+{
+  TSQLPrivate *pDB;
+
+  pDB = (TSQLPrivate *) calloc (1, sizeof (TSQLPrivate));
+  if (pDB == NULL)
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return -1;
+    }
+
+  pDB->hEnv = SQL_NULL_HENV;
+  pDB->hDbc = SQL_NULL_HDBC;
+  pDB->hStmt = SQL_NULL_HSTMT;
+  pDB->nStmtPoolMax = STMT_POOL_SIZE;
+  pDB->nPingWindow = PING_WINDOW_MS;
+  pDB->mysql = mysql;
+  pDB->bAutocommit = 1;
+
+  _set_error (mysql, 0);
+
+#if 0
+  DBOF(mysql) = pDB;
+#else
+  mysql->net.vio = pDB;
+#endif
+
+  return 0;
+}
+
+
+static void
+_free_db (MYSQL *mysql)
+{
+  TSQLPrivate *pDB;
+
+  pDB = DBOF(mysql);
+  if (pDB)
+    {
+      /* Writes of an open group were reported done, commit them */
+      _group_unlist (pDB);
+      if (pDB->bGroup && pDB->bConnected)
+	_group_end (pDB, SQL_COMMIT);
+      _qc_reset (pDB);
+      _multi_reset (pDB);
+      _drop_stmts (pDB, 1);
+      _cat_flush (pDB);
+      _xl_flush (pDB);
+      if (pDB->pLocalRes)
+	_free_res (pDB->pLocalRes);
+      _route_free (pDB);
+      _shard_free (pDB);
+      safe_free (pDB->pScrollSql);
+      _slow_finish (pDB);
+      if (pDB->pSlow)
+	_slow_free (pDB->pSlow);
+      if (pDB->bSlowQueued)
+	_slow_drain ();
+      safe_free (pDB->pConnStr);
+      if (pDB->bConnected)
+	SQLDisconnect (pDB->hDbc);
+      if (pDB->hDbc != SQL_NULL_HDBC)
+	SQLFreeConnect (pDB->hDbc);
+
+      /* hEnv is the process wide environment and stays allocated */
+
+      pDB->hEnv = SQL_NULL_HENV;
+      pDB->hDbc = SQL_NULL_HDBC;
+      pDB->hStmt = SQL_NULL_HSTMT;
+      pDB->bConnected = 0;
+      free (pDB);
+#if 0
+      DBOF(mysql) = NULL;
+#else
+      mysql->net.vio = NULL;
+#endif
+    }
+}
+
+
+/*
+ *  Drop all statements of a connection. Results that were being streamed
+ *  simply end, orphaned ones also lose their connection.
+ */
+static void
+_drop_stmts (TSQLPrivate *pDB, int bOrphan)
+{
+  TSQLResult *pRes;
+
+  if (pDB->pLazyRes)
+    _meta_resolve (&pDB->pLazyRes->res);
+  pDB->bRowCountPending = 0;
+  _route_return (pDB);
+  while ((pRes = pDB->pStreaming) != NULL)
+    {
+      _meta_resolve (&pRes->res);
+      pDB->pStreaming = pRes->pNext;
+      if (pRes->pLink)
+	_route_give (pRes->pLink, pRes->hStmt);
+      else
+	SQLFreeStmt (pRes->hStmt, SQL_DROP);
+      pRes->hStmt = SQL_NULL_HSTMT;
+      pRes->pLink = NULL;
+      pRes->pNext = NULL;
+      if (bOrphan)
+	pRes->res.handle = NULL;
+    }
+  _diag_forget (pDB, SQL_NULL_HSTMT);
+  while (pDB->nStmtPool > 0)
+    SQLFreeStmt (pDB->aStmtPool[--pDB->nStmtPool], SQL_DROP);
+  if (pDB->hStmt != SQL_NULL_HSTMT)
+    SQLFreeStmt (pDB->hStmt, SQL_DROP);
+  pDB->hStmt = SQL_NULL_HSTMT;
+  pDB->hMulti = SQL_NULL_HSTMT;
+  pDB->bPrepared = 0;
+  pDB->bHaveData = FALSE;
+}
+
+
+static TSQLPrivate *
+_db (MYSQL *mysql)
 {
   TSQLPrivate *pDB;
 
@@ -195,7 +1532,7 @@ _db (MYSQL *mysql)
       return NULL;
     }
 
-  if (!pDB->bConnected || pDB->hStmt == SQL_NULL_HSTMT)
+  if (!pDB->bConnected)
     {
       _set_error (mysql, CR_SERVER_LOST);
       return NULL;
@@ -212,14 +1549,30 @@ _connect_db (MYSQL *mysql, const char *connStr)
 {
   TSQLPrivate *pDB;
   SQLSMALLINT buflen;
+  SQLUSMALLINT maxActive;
   SQLCHAR buf[257];
   SQLRETURN ret;
 
   pDB = DBOF(mysql);
 
-  ret = SQLAllocEnv (&pDB->hEnv);
-  if (_trap_sqlerror (mysql, ret, "SQLAllocEnv"))
+  if (_cs_init (mysql))
+    return -1;
+
+  RUN_ONCE (&_global_once, _global_init);
+  pDB->hEnv = _global_henv;
+  if (_trap_sqlerror (mysql, _global_rc, "SQLAllocEnv"))
     return -1;
+  _qc_init (mysql);
+
+  if (pDB->pConnStr != connStr)
+    {
+      safe_free (pDB->pConnStr);
+      if ((pDB->pConnStr = strdup (connStr)) == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return -1;
+	}
+    }
 
   ret = SQLAllocConnect (pDB->hEnv, &pDB->hDbc);
   if (_trap_sqlerror (mysql, ret, "SQLAllocConnect"))
@@ -238,6 +1591,10 @@ _connect_db (MYSQL *mysql, const char *connStr)
    *  ask for one. If an empty string or a ? is given, show a nice
    *  list of options
    */
+  if (mysql->options.connect_timeout)
+    SQLSetConnectAttr (pDB->hDbc, SQL_ATTR_LOGIN_TIMEOUT,
+	(SQLPOINTER) (SQLULEN) mysql->options.connect_timeout, 0);
+
   ret = SQLDriverConnect (pDB->hDbc, 0, (SQLCHAR *) connStr, SQL_NTS, buf,
 	  sizeof (buf), &buflen, SQL_DRIVER_NOPROMPT);
   if (_trap_sqlerror (mysql, ret, "SQLAllocConnect"))
@@ -245,150 +1602,448 @@ _connect_db (MYSQL *mysql, const char *connStr)
 
   pDB->bConnected = 1;
 
+  /* Some drivers can only have one cursor open per connection */
+  pDB->nMaxActive = 0;
+  ret = SQLGetInfo (pDB->hDbc, SQL_MAX_CONCURRENT_ACTIVITIES,
+      &maxActive, sizeof (maxActive), NULL);
+  if (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO)
+    pDB->nMaxActive = maxActive;
+
+  _identity_init (mysql);
+  _xl_init (mysql);
+
+  /* One shared cache segment per process */
+  pDB->bShared = mysql->options.shared_cache
+      && _shc_attach (mysql->options.shared_cache,
+	  mysql->options.shared_cache_size) == 0;
+
   ret = SQLAllocStmt (pDB->hDbc, &pDB->hStmt);
   if (_trap_sqlerror (mysql, ret, "SQLAllocConnect"))
     return -1;
 
+  /* Also runs again after a reconnect, as with the MySQL client */
+  if (mysql->options.init_command)
+    {
+      ret = SQLExecDirect (pDB->hStmt,
+	  (SQLCHAR *) mysql->options.init_command, SQL_NTS);
+      if (_trap_sqlerror (mysql, ret, "SQLExecDirect"))
+	return -1;
+      SQLFreeStmt (pDB->hStmt, SQL_CLOSE);
+    }
+
+  /* A reconnect keeps what mysql_autocommit asked for */
+  if (!pDB->bAutocommit)
+    {
+      ret = SQLSetConnectAttr (pDB->hDbc, SQL_ATTR_AUTOCOMMIT,
+	  (SQLPOINTER) SQL_AUTOCOMMIT_OFF, 0);
+      if (_trap_sqlerror (mysql, ret, "SQLSetConnectAttr"))
+	return -1;
+    }
+  _trans_status (pDB);
+
+  pDB->ulAlive = _now_ms ();
+
   return 0;
 }
 
 
+/*
+ *  Replace a dead ODBC connection with a fresh one to the same DSN.
+ *  Open cursors and a running transaction are lost.
+ */
+static int
+_reconnect (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+
+  _qc_reset (pDB);
+  _drop_stmts (pDB, 0);
+  if (pDB->bConnected)
+    SQLDisconnect (pDB->hDbc);
+  if (pDB->hDbc != SQL_NULL_HDBC)
+    SQLFreeConnect (pDB->hDbc);
+  pDB->hDbc = SQL_NULL_HDBC;
+  pDB->bConnected = 0;
+  pDB->bInTrans = 0;
+  pDB->bSession = 0;
+  _group_unlist (pDB);
+  pDB->bGroup = 0;
+
+  return _connect_db (mysql, pDB->pConnStr);
+}
+
+
+static unsigned long
+_now_ms (void)
+{
+#if defined (WIN32)
+  return (unsigned long) GetTickCount ();
+#elif defined (CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+  return (unsigned long) time (NULL) * 1000;
+#endif
+}
+
+
+static my_ulonglong
+_now_us (void)
+{
+#if defined (WIN32)
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency (&freq);
+  QueryPerformanceCounter (&count);
+  return (my_ulonglong) (count.QuadPart / freq.QuadPart * 1000000
+      + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#elif defined (CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (my_ulonglong) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  return (my_ulonglong) time (NULL) * 1000000;
+#endif
+}
+
+
 static void
 _set_error (MYSQL *mysql, unsigned int err)
 {
-  mysql->net.last_errno = err;
+  TThreadPrivate *pThr;
+  unsigned int *perrno;
+  char *perror;
+  const char *msg;
+
+  if (mysql != NULL)
+    {
+      perrno = &mysql->net.last_errno;
+      perror = mysql->net.last_error;
+    }
+  else if ((pThr = _thread_private ()) != NULL)
+    {
+      perrno = &pThr->last_errno;
+      perror = pThr->last_error;
+    }
+  else
+    return;
 
   switch (err)
     {
     case CR_OUT_OF_MEMORY:
-      strcpy (mysql->net.last_error, "MySQL client run out of memory");
+      msg = "MySQL client run out of memory";
       break;
 
     case CR_UNKNOWN_ERROR:
-      strcpy (mysql->net.last_error, "Unknown MySQL error");
+      msg = "Unknown MySQL error";
       break;
 
     case CR_SERVER_LOST:
-      strcpy (mysql->net.last_error, "MySQL server has gone away");
+      msg = "MySQL server has gone away";
+      break;
+
+    case CR_COMMANDS_OUT_OF_SYNC:
+      msg = "Commands out of sync;  You can't run this command now";
+      break;
+
+    case CR_CANT_READ_CHARSET:
+      msg = "Can't initialize character set";
+      break;
+
+    case CR_NET_PACKET_TOO_LARGE:
+      msg = "Result set is bigger than the configured buffer limit";
+      break;
+
+    case ER_FILE_NOT_FOUND:
+      msg = "Can't find file";
+      break;
+
+    case ER_ERROR_ON_WRITE:
+      msg = "Error writing file";
+      break;
+
+    case ER_PARSE_ERROR:
+      msg = "You have an error in your SQL syntax";
+      break;
+
+    case ER_NO_SUCH_TABLE:
+      msg = "Table doesn't exist";
+      break;
+
+    case ER_NOT_ALLOWED_COMMAND:
+      msg = "The used command is not allowed with this MySQL version";
+      break;
+
+    case ER_ERROR_DURING_ROLLBACK:
+      msg = "Got error during ROLLBACK";
+      break;
+
+    case ER_WRONG_VALUE_FOR_VAR:
+      msg = "Variable can't be set to that value";
+      break;
+
+    case ER_NOT_SUPPORTED_YET:
+      msg = "This version of MySQL doesn't yet support this";
+      break;
+
+    case ER_NO_PARTITION_FOR_GIVEN_VALUE:
+      msg = "Table has no partition for value";
       break;
 
     default:
-      mysql->net.last_error[0] = 0;
+      msg = "";
     }
+
+  *perrno = err;
+  strncpy (perror, msg, MYSQL_ERRMSG_SIZE - 1);
+  perror[MYSQL_ERRMSG_SIZE - 1] = 0;
 }
 
 
 /*
- *  Show all the error information that is available
+ *  SQLSTATEs with a MySQL error number of their own. The rest are
+ *  CR_ODBC_ERROR, the message still says what happened: 23000 is any
+ *  integrity constraint, 42000 a syntax error or a missing privilege,
+ *  HYT00 any timeout, no one MySQL error fits.
  */
-static void
-_fetch_db_errors (MYSQL *mysql, const char *where, int save)
+static const struct
+  {
+    const char *state;
+    unsigned int err;
+  }
+_state_map[] =
+  {
+    { "21S01", ER_WRONG_VALUE_COUNT_ON_ROW },
+    { "22001", ER_DATA_TOO_LONG },
+    { "22003", ER_WARN_DATA_OUT_OF_RANGE },
+    { "22012", ER_DIVISION_BY_ZERO },
+    { "28000", ER_ACCESS_DENIED_ERROR },
+    { "3D000", ER_NO_DB_ERROR },
+    { "40001", ER_LOCK_DEADLOCK },
+    { "42S01", ER_TABLE_EXISTS_ERROR },
+    { "42S02", ER_NO_SUCH_TABLE },
+    { "42S11", ER_DUP_KEYNAME },
+    { "42S12", ER_CANT_DROP_FIELD_OR_KEY },
+    { "42S21", ER_DUP_FIELDNAME },
+    { "42S22", ER_BAD_FIELD_ERROR },
+    { "HY008", ER_QUERY_INTERRUPTED },
+  };
+
+
+static unsigned int
+_state_hash (const char *state)
 {
-  TSQLPrivate *pDB;
-  SQLCHAR buf[512];
-  SQLCHAR sqlstate[15];
-  SQLRETURN ret;
-  char *copy = NULL;
+  unsigned int h = 0, i;
 
-  pDB = DBOF(mysql);
+  for (i = 0; i < 5 && state[i]; i++)
+    h = h * 33 + (unsigned char) state[i];
 
-  /* Get statement errors */
-  if (pDB->hStmt)
-    {
-      for (;;)
-	{
-	  ret = SQLError (pDB->hEnv, pDB->hDbc, pDB->hStmt,
-	      sqlstate, NULL, buf, sizeof(buf), NULL);
-	  if (ret != SQL_SUCCESS)
-	    break;
-	  if (save && copy == NULL)
-	    copy = strdup ((const char *)buf);
-#ifdef DEBUG
-	  fprintf (stderr, "%s, SQLSTATE=%s\n", buf, sqlstate);
-#endif
-	}
-    }
+  return h % STATE_SLOTS;
+}
 
-  /* Get connection errors */
-  if (pDB->hDbc)
-    {
-      for (;;)
-	{
-	  ret = SQLError (pDB->hEnv, pDB->hDbc, SQL_NULL_HSTMT,
-	      sqlstate, NULL, buf, sizeof(buf), NULL);
-	  if (ret != SQL_SUCCESS)
-	    break;
-	  if (save && copy == NULL)
-	    copy = strdup ((const char *)buf);
-#ifdef DEBUG
-	  fprintf (stderr, "%s, SQLSTATE=%s\n", buf, sqlstate);
-#endif
-	}
-    }
 
-  /* Get environment errors */
-  if (pDB->hEnv)
-    {
-      for (;;)
-	{
-	  ret = SQLError (pDB->hEnv, SQL_NULL_HDBC, SQL_NULL_HSTMT,
-	      sqlstate, NULL, buf, sizeof(buf), NULL);
-	  if (ret != SQL_SUCCESS)
-	    break;
-	  if (save && copy == NULL)
-	    copy = strdup ((const char *)buf);
-#ifdef DEBUG
-	  fprintf (stderr, "%s, SQLSTATE=%s\n", buf, sqlstate);
-#endif
-	}
-    }
+/*
+ *  Slots of _state_index hold 1 + the entry of _state_map, 0 if free.
+ *  The table is mostly empty, a lookup probes a slot or two.
+ */
+static void
+_state_init (void)
+{
+  unsigned int i, h;
 
-  if (copy)
+  for (i = 0; i < sizeof (_state_map) / sizeof (_state_map[0]); i++)
     {
-      char *cp, *dp;
-      int i;
+      for (h = _state_hash (_state_map[i].state); _state_index[h];
+	  h = (h + 1) % STATE_SLOTS)
+	;
+      _state_index[h] = (unsigned char) (i + 1);
+    }
+}
 
-      /* Remove [vendor info][driver info] */
-      cp = copy;
-      for (i = 0; i < 2; i++)
-	{
-	  if (*cp != '[' || (dp = strchr (cp, ']')) == NULL)
-	    break;
-	  cp = dp + 1;
-	}
-      if (cp > copy)
-	{
-	  if (*cp == ' ')
-	    cp++;
-	  if (cp[0] && cp[1])
-	    strcpy (copy, cp);
-	}
 
-      /* Remove trailing \n */
-      if ((cp = strchr (copy, '\n')) != NULL)
-	*cp = 0;
+static unsigned int
+_state_errno (const char *state)
+{
+  unsigned int h, i;
 
-      strncpy (mysql->net.last_error, copy, MYSQL_ERRMSG_SIZE);
-      mysql->net.last_error[MYSQL_ERRMSG_SIZE - 1] = 0;
-      free (copy);
+  for (h = _state_hash (state); (i = _state_index[h]) != 0;
+      h = (h + 1) % STATE_SLOTS)
+    {
+      if (!memcmp (_state_map[i - 1].state, state, 5))
+	return _state_map[i - 1].err;
     }
+
+  return CR_ODBC_ERROR;
 }
 
 
+/*
+ *  The first diagnostic record of a failed call: of the statement, else
+ *  the connection, else the environment. Later records and levels are
+ *  left alone, the next call on the handle clears them. The message of
+ *  MYSQL_ERRMSG_SIZE goes without its [vendor][driver] prefix; returns -1
+ *  if there is no record.
+ */
 static int
-_trap_sqlerror (MYSQL *mysql, SQLRETURN rc, const char *where)
+_diag_read (TSQLPrivate *pDB, SQLHSTMT hStmt, char *state, char *msg)
 {
-#ifdef DEBUG
-  fprintf (stderr, "%s: ret=%d\n", where, rc);
-#endif
-  switch (rc)
-    {
-    case SQL_SUCCESS:
-    case SQL_NO_DATA_FOUND:
-      break;
+  SQLCHAR buf[512];
+  SQLCHAR sqlstate[15];
+  SQLRETURN ret = SQL_NO_DATA_FOUND;
+  char *cp, *dp;
+  int i;
+
+  if (hStmt)
+    ret = SQLGetDiagRec (SQL_HANDLE_STMT, hStmt, 1, sqlstate, NULL,
+	buf, sizeof (buf), NULL);
+  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO && pDB->hDbc)
+    ret = SQLGetDiagRec (SQL_HANDLE_DBC, pDB->hDbc, 1, sqlstate, NULL,
+	buf, sizeof (buf), NULL);
+  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO && pDB->hEnv)
+    ret = SQLGetDiagRec (SQL_HANDLE_ENV, pDB->hEnv, 1, sqlstate, NULL,
+	buf, sizeof (buf), NULL);
+  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+    return -1;
+  buf[sizeof (buf) - 1] = 0;
+
+  memcpy (state, sqlstate, 5);
+  state[5] = 0;
+
+  /* Remove [vendor info][driver info] */
+  cp = (char *) buf;
+  for (i = 0; i < 2; i++)
+    {
+      if (*cp != '[' || (dp = strchr (cp, ']')) == NULL)
+	break;
+      cp = dp + 1;
+    }
+  if (cp > (char *) buf)
+    {
+      if (*cp == ' ')
+	cp++;
+      if (!cp[0] || !cp[1])
+	cp = (char *) buf;
+    }
+
+  /* Remove trailing \n */
+  if ((dp = strchr (cp, '\n')) != NULL)
+    *dp = 0;
+
+  strncpy (msg, cp, MYSQL_ERRMSG_SIZE);
+  msg[MYSQL_ERRMSG_SIZE - 1] = 0;
+
+  return 0;
+}
+
+
+/*
+ *  Report the first diagnostic record of a failed call
+ */
+static void
+_fetch_db_errors (MYSQL *mysql, const char *where)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+
+  (void) where;			/* DEBUG only */
+  pDB->szSqlState[0] = 0;
+  if (_diag_read (pDB, pDB->hDiagStmt ? pDB->hDiagStmt : pDB->hStmt,
+	  pDB->szSqlState, mysql->net.last_error))
+    return;
+#ifdef DEBUG
+  fprintf (stderr, "%s: %s, SQLSTATE=%s\n", where, mysql->net.last_error,
+      pDB->szSqlState);
+#endif
+
+  mysql->net.last_errno = _state_errno (pDB->szSqlState);
+}
+
+
+/*
+ *  A call that succeeded with information adds its records to the
+ *  warnings of the statement. The next call on the handle replaces
+ *  them, so they are counted now, but from the SQL_DIAG_NUMBER header
+ *  only: drivers that warn on every fetch do not slow the fetch loop
+ *  down reading records no one asks for.
+ */
+static void
+_diag_defer (TSQLPrivate *pDB)
+{
+  SQLHSTMT hStmt = pDB->hDiagStmt ? pDB->hDiagStmt : pDB->hStmt;
+  SQLINTEGER n = 0;
+
+  if (hStmt != SQL_NULL_HSTMT
+      && SQLGetDiagField (SQL_HANDLE_STMT, hStmt, 0, SQL_DIAG_NUMBER, &n, 0,
+	  NULL) == SQL_SUCCESS && n > 0)
+    pDB->nWarnings += (unsigned int) n;
+  pDB->diagRc = SQL_SUCCESS_WITH_INFO;
+  pDB->hDiagInfo = hStmt;
+}
+
+
+/*
+ *  The statement goes away or runs again, its records with it
+ */
+static void
+_diag_forget (TSQLPrivate *pDB, SQLHSTMT hStmt)
+{
+  if (hStmt == SQL_NULL_HSTMT || pDB->hDiagInfo == hStmt)
+    {
+      pDB->diagRc = SQL_SUCCESS;
+      pDB->hDiagInfo = SQL_NULL_HSTMT;
+    }
+}
+
+
+static void
+_diag_drain (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+#ifdef DEBUG
+  SQLCHAR buf[512];
+  SQLCHAR sqlstate[15];
+  SQLSMALLINT rec;
+  SQLRETURN ret;
+#endif
+
+  if (pDB == NULL || pDB->diagRc != SQL_SUCCESS_WITH_INFO)
+    return;
+
+  /* The records of the statement are counted already, see _diag_defer.
+   * Those of the connection belong to no statement and are left out.
+   */
+#ifdef DEBUG
+  for (rec = 1; pDB->hDiagInfo; rec++)
+    {
+      ret = SQLGetDiagRec (SQL_HANDLE_STMT, pDB->hDiagInfo, rec, sqlstate, NULL,
+	  buf, sizeof (buf), NULL);
+      if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+	break;
+      fprintf (stderr, "%s, SQLSTATE=%s\n", buf, sqlstate);
+    }
+#endif
+  _diag_forget (pDB, SQL_NULL_HSTMT);
+}
+
+
+static int
+_trap_sqlerror (MYSQL *mysql, SQLRETURN rc, const char *where)
+{
+  TSQLPrivate *pDB;
+
+#ifdef DEBUG
+  fprintf (stderr, "%s: ret=%d\n", where, rc);
+#endif
+  switch (rc)
+    {
+    case SQL_SUCCESS:
+    case SQL_NO_DATA_FOUND:
+      break;
 
     case SQL_SUCCESS_WITH_INFO:
-      _fetch_db_errors (mysql, where, 0);
+      _diag_defer (DBOF(mysql));
       break;
 
     case SQL_INVALID_HANDLE:
@@ -398,7 +2053,18 @@ _trap_sqlerror (MYSQL *mysql, SQLRETURN rc, const char *where)
 
     case SQL_ERROR:
       _set_error (mysql, CR_ODBC_ERROR);
-      _fetch_db_errors (mysql, where, 1);
+      _fetch_db_errors (mysql, where);
+
+      /* SQLSTATE class 08 is a connection exception */
+      pDB = DBOF(mysql);
+      _diag_forget (pDB, SQL_NULL_HSTMT);
+      if (pDB->pRouted && !strncmp (pDB->szSqlState, "08", 2))
+	_route_down (pDB->pRouted);	/* a replica, the primary is fine */
+      else if (pDB->bConnected && !strncmp (pDB->szSqlState, "08", 2))
+	{
+	  mysql->net.last_errno = CR_SERVER_LOST;
+	  pDB->bConnected = 0;
+	}
       return -1;
 
     default:
@@ -415,7 +2081,8 @@ _alloc_fields (MYSQL *mysql, unsigned int field_count)
 {
   MYSQL_FIELD *f;
 
-/*_free_fields (mysql);*/
+  /* Fields of the previous query that no result has claimed */
+  _free_fields (mysql);
   if (field_count)
     {
       f = (MYSQL_FIELD *) calloc (field_count, sizeof (MYSQL_FIELD));
@@ -436,28 +2103,42 @@ _alloc_fields (MYSQL *mysql, unsigned int field_count)
 
 
 static void
-_free_fields (MYSQL *mysql)
+_free_field_array (MYSQL_FIELD *fields, unsigned int field_count)
 {
   unsigned int i;
   MYSQL_FIELD *f;
 
-  if ((f = mysql->fields) != NULL)
+  if ((f = fields) != NULL)
     {
-      for (i = 0; i < mysql->field_count; i++, f++)
+      for (i = 0; i < field_count; i++, f++)
 	{
 	  safe_free (f->name);
 	  safe_free (f->table);
 	  safe_free (f->def);
 	}
-      free (mysql->fields);
+      free (fields);
+    }
+}
+
+
+static void
+_free_fields (MYSQL *mysql)
+{
+  if (mysql->fields != NULL)
+    {
+      _free_field_array (mysql->fields, mysql->field_count);
       mysql->fields = NULL;
       mysql->field_count = 0;
     }
 }
 
 
+/*
+ *  bBind is set for results fetched from the statement; results built
+ *  from stored rows (res->data) never read the bind buffers.
+ */
 static MYSQL_RES *
-_alloc_res (MYSQL *mysql)
+_alloc_res (MYSQL *mysql, int bBind)
 {
   MYSQL_RES *res;
   MYSQL_FIELD *f;
@@ -466,25 +2147,31 @@ _alloc_res (MYSQL *mysql)
   if (mysql->fields == NULL)
     return NULL;
 
-  if ((res = (MYSQL_RES *) calloc (1, sizeof (MYSQL_RES))) == NULL)
+  if ((res = (MYSQL_RES *) calloc (1, sizeof (TSQLResult))) == NULL)
     goto failed;
 
+  /* The result owns the field descriptions from here on */
   res->row_count = 0;
   res->current_field = 0;
   res->field_count = mysql->field_count;
   res->fields = mysql->fields;
   res->handle = mysql;
   res->eof = 0;
+  mysql->fields = NULL;
 
   /* Put indicators here */
   res->lengths = (unsigned long *) calloc (res->field_count, sizeof (SQLLEN));
 
   /* These hold allocated fields */
   res->row = (MYSQL_ROW) calloc (res->field_count, sizeof (char *));
+  if (res->lengths == NULL || res->row == NULL)
+    goto failed;
 
-  for (f = res->fields, j = 0; j < res->field_count; j++, f++)
+  for (f = res->fields, j = 0; bBind && j < res->field_count; j++, f++)
     {
-      /* Allocation amount */
+      /* Allocation amount, a LONGTEXT length would wrap around */
+      if (f->length > (unsigned int) -1 - 32)
+	goto failed;
       f->max_length = f->length + 32;
       if ((res->row[j] = malloc (res->fields[j].max_length)) == NULL)
 	goto failed;
@@ -518,10 +2205,34 @@ _free_res (MYSQL_RES *res)
 	    }
 	  free (res->row);
 	}
-      if (res->data)
-	_free_data (res->data);
-      else if (res->current_row)
-	free (res->current_row);
+      if (RESOF(res)->hMeta && res->handle
+	  && DBOF(res->handle)->pLazyRes == RESOF(res))
+	DBOF(res->handle)->pLazyRes = NULL;
+      RESOF(res)->hMeta = SQL_NULL_HSTMT;
+      if (RESOF(res)->hStmt)
+	_detach_res (res);
+      _scroll_free (RESOF(res));
+      safe_free (RESOF(res)->pScrollSql);
+      safe_free (RESOF(res)->pUseRow);
+      safe_free (RESOF(res)->pConv);
+      if (RESOF(res)->pSlow)
+	_slow_release (res);
+      if (RESOF(res)->pCached)
+	{
+	  /* rows and fields belong to the query cache */
+	  _qc_unref (RESOF(res)->pCached);
+	}
+      else
+	{
+	  if (res->data)
+	    _free_data (res->data);
+	  /* The names of a loaded result are in its file */
+	  if (RESOF(res)->pCols && RESOF(res)->pCols->bBorrowed)
+	    free (res->fields);
+	  else
+	    _free_field_array (res->fields, res->field_count);
+	}
+      _col_free (RESOF(res)->pCols);
       free (res);
     }
 }
@@ -553,240 +2264,11863 @@ _append_row (MYSQL_DATA *data, MYSQL_ROWS **pp)
 }
 
 
+/*
+ *  Statement handles
+ *
+ *  The connection keeps the statement of its last query in hStmt. A
+ *  use_result result takes that statement over together with its open
+ *  cursor, so the next query runs on another handle taken from a small
+ *  per connection free list. Handles go back to the list when the cursor
+ *  is exhausted or the result is freed.
+ */
+static SQLHSTMT
+_stmt_acquire (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLHSTMT hStmt;
+  SQLRETURN ret;
+
+  if (pDB->nStmtPool > 0)
+    return pDB->aStmtPool[--pDB->nStmtPool];
+
+  ret = SQLAllocStmt (pDB->hDbc, &hStmt);
+  if (_trap_sqlerror (mysql, ret, "SQLAllocStmt"))
+    return SQL_NULL_HSTMT;
+
+  return hStmt;
+}
+
+
 static void
-_free_data (MYSQL_DATA *data)
+_stmt_release (TSQLPrivate *pDB, SQLHSTMT hStmt)
 {
-  unsigned int j;
-  MYSQL_ROWS *r, *r2;
+  _diag_forget (pDB, hStmt);
+  SQLFreeStmt (hStmt, SQL_CLOSE);
+  SQLFreeStmt (hStmt, SQL_UNBIND);
 
-  if (data)
+  if (pDB->nStmtPool < pDB->nStmtPoolMax)
+    pDB->aStmtPool[pDB->nStmtPool++] = hStmt;
+  else
+    SQLFreeStmt (hStmt, SQL_DROP);
+}
+
+
+/*
+ *  Give a streaming result its statement back to the connection
+ */
+static void
+_detach_res (MYSQL_RES *res)
+{
+  TSQLResult *pRes = RESOF(res);
+  TSQLResult **pp;
+  TSQLPrivate *pDB;
+
+  if (pRes->hStmt == SQL_NULL_HSTMT)
+    return;
+
+  _meta_resolve (res);
+  pDB = DBOF(res->handle);
+  for (pp = &pDB->pStreaming; *pp; pp = &(*pp)->pNext)
     {
-      if (data->data)
+      if (*pp == pRes)
 	{
-	  for (r = data->data; r; r = r2)
-	    {
-	      if (r->data)
-		{
-		  for (j = 0; j < data->fields; j++)
-		    {
-		      if (r->data[j])
-			free (r->data[j]); /* char * */
-		    }
-		}
-	      r2 = r->next;
-	      free (r); /* MYSQL_ROWS */
-	    }
+	  *pp = pRes->pNext;
+	  break;
 	}
-      free (data); /* MYSQL_DATA */
     }
-}
 
+  _scroll_free (pRes);
+  safe_free (pRes->pScrollSql);
+  pRes->pScrollSql = NULL;
 
-/******************************************************************************/
+  /* The statement of a batch still has results for mysql_next_result */
+  if (pRes->pLink)
+    {
+      _route_give (pRes->pLink, pRes->hStmt);
+      pRes->pLink = NULL;
+    }
+  else if (pRes->hStmt == pDB->hMulti && pDB->hStmt == SQL_NULL_HSTMT)
+    {
+      SQLFreeStmt (pRes->hStmt, SQL_UNBIND);
+      pDB->hStmt = pRes->hStmt;
+    }
+  else
+    _stmt_release (pDB, pRes->hStmt);
+  pRes->hStmt = SQL_NULL_HSTMT;
+  pRes->pNext = NULL;
+}
 
 
-/* Very, very dummy */
-unsigned long max_allowed_packet = 0;
-unsigned long net_buffer_length = 0;
+/*
+ *  Column names and tables are read from the driver only when the
+ *  client looks at the fields, or just before the statement that can
+ *  still tell goes away
+ */
+static void
+_meta_resolve (MYSQL_RES *res)
+{
+  TSQLResult *pRes = RESOF(res);
+  SQLHSTMT hStmt = pRes->hMeta;
+  TSQLPrivate *pDB;
+  SQLSMALLINT retLen;
+  SQLCHAR value[128];
+  MYSQL_FIELD *f;
+  unsigned int j;
 
+  if (hStmt == SQL_NULL_HSTMT)
+    return;
+  pRes->hMeta = SQL_NULL_HSTMT;
+  pDB = DBOF(res->handle);
+  if (pDB->pLazyRes == pRes)
+    pDB->pLazyRes = NULL;
 
-static MYSQL *
-_impl_init (MYSQL *mysql)
-{
-  if (mysql == NULL)
+  for (j = 0, f = res->fields; j < res->field_count; j++, f++)
     {
-      if ((mysql = malloc (sizeof (MYSQL))) == NULL)
-	return NULL;
-      mysql->free_me = 1;
-    }
-  memset (mysql, 0, sizeof (MYSQL));
+      /* field.table */
+      value[0] = 0;
+      SQLColAttribute (hStmt, (SQLUSMALLINT) (j + 1), SQL_DESC_TABLE_NAME,
+	  value, (SQLSMALLINT) sizeof (value), &retLen, NULL);
+      f->table = _cs_dup (pDB, 1, (const char *) value, NULL);
 
-  return mysql;
+      /* field.name */
+      value[0] = 0;
+      SQLColAttribute (hStmt, (SQLUSMALLINT) (j + 1), SQL_DESC_LABEL,
+	  value, (SQLSMALLINT) sizeof (value), &retLen, NULL);
+      f->name = _cs_dup (pDB, 1, (const char *) value, NULL);
+
+      /* Callers print these, never leave them NULL */
+      if (f->table == NULL)
+	f->table = strdup ("");
+      if (f->name == NULL)
+	f->name = strdup ("");
+    }
 }
 
 
-static void 
-_impl_close (MYSQL *mysql)
+/*
+ *  What SQL_DESC_DISPLAY_SIZE would say, from the SQLDescribeCol data
+ */
+static SQLLEN
+_display_size (SQLSMALLINT sqlType, SQLULEN colSize)
 {
-  if (mysql)
+  switch (sqlType)
     {
-      safe_free (mysql->host);
-      safe_free (mysql->user);
-      safe_free (mysql->passwd);
-      safe_free (mysql->unix_socket);
-      safe_free (mysql->server_version);
-      safe_free (mysql->host_info);
-      safe_free (mysql->info);
-      safe_free (mysql->db);
-      _free_db (mysql);
-      _free_fields (mysql);
-      if (mysql->free_me)
-	free (mysql);
+    case SQL_BIT:
+      return 1;
+    case SQL_TINYINT:
+      return 4;
+    case SQL_SMALLINT:
+      return 6;
+    case SQL_INTEGER:
+      return 11;
+    case SQL_BIGINT:
+      return 20;
+    case SQL_REAL:
+      return 14;
+    case SQL_FLOAT:
+    case SQL_DOUBLE:
+      return 24;
+    case SQL_DECIMAL:
+    case SQL_NUMERIC:
+      return (SQLLEN) colSize + 2;	/* sign and decimal point */
+    case SQL_BINARY:
+    case SQL_VARBINARY:
+    case SQL_LONGVARBINARY:
+      return (SQLLEN) colSize * 2;	/* hex digits */
+    default:
+      return (SQLLEN) colSize;
     }
 }
 
 
-static MYSQL *
-_impl_real_connect (
-    MYSQL *mysql,
-    const char *host,
-    const char *user,
-    const char *passwd,
-    const char *db,
-    unsigned int port,
-    const char *unix_socket,
-    unsigned int clientflag)
+static int
+_bind_res (MYSQL *mysql, MYSQL_RES *res, SQLHSTMT hStmt)
 {
-  int save_free;
-  char dsn[512];
+  unsigned int j;
+  SQLRETURN ret;
 
-  /* this is all to fool the client */
-  mysql->host = safe_dup (host);
-  mysql->user = safe_dup (user);
-  mysql->passwd = safe_dup (passwd);
-  mysql->db = safe_dup (db);
-  mysql->unix_socket = safe_dup (unix_socket);
-  mysql->port = port;
-  mysql->client_flag = clientflag;
-  mysql->server_version = strdup (MYSQL_SERVER_VERSION "-" MYSQL_SERVER_SUFFIX);
-  mysql->host_info = strdup ("localhost via TCP/IP");
-  mysql->protocol_version = PROTOCOL_VERSION;
-  mysql->thread_id = 100;
-  mysql->server_capabilities = 0;
-  mysql->affected_rows = (my_ulonglong) -1;
-  mysql->status = MYSQL_STATUS_READY;
+  SQLFreeStmt (hStmt, SQL_UNBIND);
+  for (j = 0; j < res->field_count; j++)
+    {
+      ret = SQLBindCol (
+	  hStmt,
+	  (SQLUSMALLINT) (j + 1),
+	  SQL_C_CHAR,
+	  res->row[j],
+	  (SQLINTEGER) res->fields[j].max_length,
+	  (SQLLEN *) &res->lengths[j]);
 
-  snprintf (dsn, sizeof (dsn), "DSN=%s;UID=%s;PWD=%s",
-      db && db[0] ? db : "mysql",
-      user ? user : "",
-      passwd ? passwd : "");
+      if (_trap_sqlerror (mysql, ret, "SQLBindCol"))
+	return -1;
+    }
 
-  if (_alloc_db (mysql))
-    goto failed;
+  return 0;
+}
 
-  if (_connect_db (mysql, dsn))
-    goto failed;
 
-  return mysql;
+/*
+ *  Columnar results
+ *
+ *  With the columnar option mysql_store_result keeps every column in
+ *  one buffer: the values back to back, each 0 terminated, an offset per
+ *  row and a NULL bitmap. mysql_fetch_column hands these out as they
+ *  are, so a scan over one column touches nothing else. mysql_fetch_row
+ *  keeps working; its row points into the column buffers. Results that
+ *  are kept as rows, from the query cache or answered locally, are
+ *  transposed the first time mysql_fetch_column asks for them.
+ */
+static void
+_col_free (TColumns *pCols)
+{
+  unsigned int j;
 
-failed:
-  save_free = mysql->free_me;
-  mysql->free_me = 0;
-  _impl_close (mysql);
-  mysql->free_me = save_free;
+  if (pCols == NULL)
+    return;
+  if (pCols->pPin)
+    _shc_unpin (pCols->pPin);
+  else if (pCols->pMap)
+    _unmap_file (pCols->pMap, pCols->nMap, pCols->bMapped);
+  else if (pCols->aCol && !pCols->bBorrowed)
+    {
+      for (j = 0; j < pCols->nCols; j++)
+	{
+	  safe_free (pCols->aCol[j].data);
+	  safe_free (pCols->aCol[j].offsets);
+	  safe_free (pCols->aCol[j].nulls);
+	}
+    }
+  safe_free (pCols->aCol);
+  safe_free (pCols->pRow);
+  free (pCols);
+}
+
+
+/*
+ *  Room for n rows
+ */
+static int
+_col_grow (TColumns *pCols, my_ulonglong n)
+{
+  size_t oldBits = (size_t) (pCols->nAlloc + 7) / 8;
+  size_t bits = (size_t) (n + 7) / 8;
+  unsigned long *offsets;
+  unsigned char *nulls;
+  TColumn *col;
+  unsigned int j;
+
+  for (j = 0; j < pCols->nCols; j++)
+    {
+      col = &pCols->aCol[j];
+      offsets = (unsigned long *) realloc (col->offsets,
+	  (size_t) (n + 1) * sizeof (unsigned long));
+      if (offsets == NULL)
+	return -1;
+      if (col->offsets == NULL)
+	offsets[0] = 0;
+      col->offsets = offsets;
+
+      if ((nulls = (unsigned char *) realloc (col->nulls, bits)) == NULL)
+	return -1;
+      memset (nulls + oldBits, 0, bits - oldBits);
+      col->nulls = nulls;
+    }
+  pCols->nAlloc = n;
+
+  return 0;
+}
+
+
+/*
+ *  Columns with room for nRoom rows, 0 for columns that live elsewhere
+ */
+static TColumns *
+_col_alloc (unsigned int nCols, my_ulonglong nRoom)
+{
+  TColumns *pCols;
+
+  if ((pCols = (TColumns *) calloc (1, sizeof (TColumns))) == NULL)
+    return NULL;
+  pCols->nCols = nCols;
+  pCols->aCol = (TColumn *) calloc (nCols + 1, sizeof (TColumn));
+  pCols->pRow = (MYSQL_ROW) calloc (nCols + 1, sizeof (char *));
+  if (pCols->aCol == NULL || pCols->pRow == NULL
+      || (nRoom && _col_grow (pCols, nRoom)))
+    {
+      _col_free (pCols);
+      return NULL;
+    }
+
+  return pCols;
+}
+
+
+/*
+ *  Append a value to column j of the row being built. src is NULL for
+ *  NULL; from is the CS_* to transcode from, 0 for a plain copy.
+ */
+static int
+_col_put (TColumns *pCols, unsigned int j, const char *src, int from)
+{
+  TColumn *col = &pCols->aCol[j];
+  my_ulonglong r = pCols->nRows;
+  size_t at = col->offsets[r];
+  size_t len, need, n;
+  char *data;
+
+  if (src == NULL)
+    {
+      col->nulls[r >> 3] |= (unsigned char) (1 << (r & 7));
+      src = "";
+    }
+  len = strlen (src);
+
+  need = at + (from == CS_LATIN1 ? 2 * len : len) + 1;
+  if ((size_t) (unsigned long) need != need)
+    return -1;
+  if (need > col->nAlloc)
+    {
+      for (n = col->nAlloc ? 2 * col->nAlloc : COL_BYTES; n < need; n *= 2)
+	;
+      if ((data = (char *) realloc (col->data, n)) == NULL)
+	return -1;
+      col->data = data;
+      col->nAlloc = n;
+    }
+
+  if (from)
+    len = _cs_convert (from, src, len, col->data + at);
+  else
+    memcpy (col->data + at, src, len + 1);
+  col->offsets[r + 1] = (unsigned long) (at + len + 1);
+
+  return 0;
+}
+
+
+/*
+ *  Append row i of a block fetched by _fetch_all
+ */
+static int
+_col_append (MYSQL *mysql, MYSQL_RES *res, char **ppBuf, SQLLEN *pInd,
+    SQLULEN nRows, SQLULEN i, unsigned long *pBytes)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TColumns *pCols = RESOF(res)->pCols;
+  int from = CS_CONVERT (pDB) ? pDB->csOdbc : 0;
+  my_ulonglong r = pCols->nRows;
+  const char *src;
+  unsigned int j;
+
+  if (r == pCols->nAlloc && _col_grow (pCols, 2 * r))
+    return -1;
+  for (j = 0; j < res->field_count; j++)
+    {
+      if (pInd[j * nRows + i] == SQL_NULL_DATA)
+	src = NULL;
+      else
+	src = ppBuf[j] + i * res->fields[j].max_length;
+      if (_col_put (pCols, j, src, from))
+	return -1;
+      *pBytes += pCols->aCol[j].offsets[r + 1] - pCols->aCol[j].offsets[r];
+    }
+  pCols->nRows++;
+  res->data->rows++;
+
+  return 0;
+}
+
+
+/*
+ *  Columns of a result kept as rows
+ */
+static int
+_col_from_rows (MYSQL_RES *res)
+{
+  TColumns *pCols;
+  MYSQL_ROWS *rp;
+  unsigned int j;
+
+  if ((pCols = _col_alloc (res->field_count, res->data->rows + 1)) == NULL)
+    return -1;
+  for (rp = res->data->data; rp; rp = rp->next)
+    {
+      if (pCols->nRows == pCols->nAlloc
+	  && _col_grow (pCols, 2 * pCols->nAlloc))
+	goto failed;
+      for (j = 0; j < res->field_count; j++)
+	{
+	  if (_col_put (pCols, j, rp->data[j], 0))
+	    goto failed;
+	}
+      pCols->nRows++;
+    }
+  RESOF(res)->pCols = pCols;
+
+  return 0;
+
+failed:
+  _col_free (pCols);
+  return -1;
+}
+
+
+/*
+ *  mysql_fetch_row of a columnar result
+ */
+static MYSQL_ROW
+_col_fetch_row (MYSQL_RES *res)
+{
+  TColumns *pCols = RESOF(res)->pCols;
+  my_ulonglong r = pCols->nCursor;
+  unsigned long *off;
+  TColumn *col;
+  unsigned int j;
+
+  if (r >= pCols->nRows)
+    return res->current_row = NULL;
+
+  for (j = 0; j < res->field_count; j++)
+    {
+      col = &pCols->aCol[j];
+      off = col->offsets + r;
+      res->lengths[j] = off[1] - off[0] - 1;
+      if (col->nulls[r >> 3] & (1 << (r & 7)))
+	pCols->pRow[j] = NULL;
+      else
+	pCols->pRow[j] = col->data + off[0];
+    }
+  pCols->nCursor++;
+  res->row_count++;
+
+  return res->current_row = pCols->pRow;
+}
+
+
+/*
+ *  Bind column-wise arrays so that one SQLFetch returns a block of rows.
+ *  Returns the block size, 1 if the driver or memory does not allow it.
+ */
+static SQLULEN
+_bind_block (MYSQL *mysql, MYSQL_RES *res, SQLHSTMT hStmt,
+    char **ppBuf, SQLLEN **ppInd, SQLULEN *pFetched)
+{
+  SQLULEN nRows, rowBytes;
+  unsigned int j;
+  SQLRETURN ret;
+
+  nRows = mysql->options.fetch_batch_size;
+  for (rowBytes = 0, j = 0; j < res->field_count; j++)
+    rowBytes += res->fields[j].max_length;
+  if (rowBytes && nRows > FETCH_BATCH_BYTES / rowBytes)
+    nRows = FETCH_BATCH_BYTES / rowBytes;
+  if (nRows <= 1)
+    return 1;
+
+  *ppInd = (SQLLEN *) calloc (res->field_count * nRows, sizeof (SQLLEN));
+  if (*ppInd == NULL)
+    return 1;
+  for (j = 0; j < res->field_count; j++)
+    {
+      if ((ppBuf[j] = malloc (nRows * res->fields[j].max_length)) == NULL)
+	return 1;
+    }
+
+  ret = SQLSetStmtAttr (hStmt, SQL_ATTR_ROW_ARRAY_SIZE,
+      (SQLPOINTER) nRows, 0);
+  if (ret != SQL_SUCCESS)
+    {
+      SQLSetStmtAttr (hStmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER) 1, 0);
+      return 1;
+    }
+  SQLSetStmtAttr (hStmt, SQL_ATTR_ROW_BIND_TYPE,
+      (SQLPOINTER) SQL_BIND_BY_COLUMN, 0);
+  SQLSetStmtAttr (hStmt, SQL_ATTR_ROWS_FETCHED_PTR, pFetched, 0);
+
+  SQLFreeStmt (hStmt, SQL_UNBIND);
+  for (j = 0; j < res->field_count; j++)
+    {
+      ret = SQLBindCol (hStmt, (SQLUSMALLINT) (j + 1), SQL_C_CHAR,
+	  ppBuf[j], (SQLLEN) res->fields[j].max_length,
+	  *ppInd + j * nRows);
+      if (_trap_sqlerror (mysql, ret, "SQLBindCol"))
+	{
+	  SQLSetStmtAttr (hStmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER) 1, 0);
+	  SQLSetStmtAttr (hStmt, SQL_ATTR_ROWS_FETCHED_PTR, NULL, 0);
+	  return 0;
+	}
+    }
+
+  return nRows;
+}
+
+
+/*
+ *  Scrollable results
+ *
+ *  With scroll-window set, mysql_data_seek and mysql_row_seek work on a
+ *  mysql_use_result result as well. Reads run on the usual forward only
+ *  cursor, wherever _route_read sends them; the first seek on a
+ *  streaming result runs its read again on a static cursor of the same
+ *  statement, or a keyset driven one when that is all the driver
+ *  offers, and the result keeps it open until mysql_free_result.
+ *  mysql_fetch_row then reads the block of rows around its position
+ *  with SQLFetchScroll (SQL_FETCH_ABSOLUTE). The last SCROLL_WINDOWS
+ *  blocks are kept, paging back and forth over the same rows costs no
+ *  round trip and memory stays bounded whatever the size of the result.
+ *
+ *  mysql_row_tell of such a result is a position only mysql_row_seek
+ *  understands. _make_room never buffers a scrollable result.
+ */
+
+/*
+ *  The scrollable cursor the driver offers, SQL_CURSOR_FORWARD_ONLY if
+ *  none
+ */
+static SQLULEN
+_scroll_type (TSQLPrivate *pDB)
+{
+  SQLUINTEGER options = 0;
+  SQLRETURN ret;
+
+  if (!pDB->bScrollAsked)
+    {
+      pDB->bScrollAsked = 1;
+      ret = SQLGetInfo (pDB->hDbc, SQL_SCROLL_OPTIONS, &options,
+	  sizeof (options), NULL);
+      if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+	options = 0;
+      if (options & SQL_SO_STATIC)
+	pDB->scrollType = SQL_CURSOR_STATIC;
+      else if (options & SQL_SO_KEYSET_DRIVEN)
+	pDB->scrollType = SQL_CURSOR_KEYSET_DRIVEN;
+      else
+	pDB->scrollType = SQL_CURSOR_FORWARD_ONLY;
+    }
+
+  return pDB->scrollType;
+}
+
+
+/*
+ *  Put a scrollable cursor on the statement of a read. Returns -1 if
+ *  the driver has none.
+ */
+static int
+_scroll_cursor (MYSQL *mysql, SQLHSTMT hStmt)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLULEN type = SQL_CURSOR_FORWARD_ONLY;
+  SQLRETURN ret;
+
+  if (_scroll_type (pDB) == SQL_CURSOR_FORWARD_ONLY)
+    return -1;
+
+  ret = SQLSetStmtAttr (hStmt, SQL_ATTR_CURSOR_TYPE,
+      (SQLPOINTER) pDB->scrollType, 0);
+  if (ret == SQL_SUCCESS)
+    type = pDB->scrollType;
+  else if (ret == SQL_SUCCESS_WITH_INFO)
+    {
+      /* The driver picked another one */
+      if (SQLGetStmtAttr (hStmt, SQL_ATTR_CURSOR_TYPE, &type, 0, NULL)
+	  != SQL_SUCCESS)
+	type = SQL_CURSOR_FORWARD_ONLY;
+    }
+
+  return type == SQL_CURSOR_FORWARD_ONLY ? -1 : 0;
+}
+
+
+/*
+ *  A use_result result of a scrollable cursor reads blocks of rows,
+ *  as many as fit in FETCH_BATCH_BYTES
+ */
+static int
+_scroll_init (MYSQL *mysql, MYSQL_RES *res, SQLHSTMT hStmt)
+{
+  TScroll *pScroll;
+  SQLULEN nRows, rowBytes;
+  unsigned int j;
+  SQLRETURN ret;
+
+  nRows = DBOF(mysql)->nScrollWindow;
+  for (rowBytes = 0, j = 0; j < res->field_count; j++)
+    rowBytes += res->fields[j].max_length;
+  if (rowBytes && nRows > FETCH_BATCH_BYTES / rowBytes)
+    nRows = FETCH_BATCH_BYTES / rowBytes;
+  if (nRows == 0)
+    nRows = 1;
+
+  if ((pScroll = (TScroll *) calloc (1, sizeof (TScroll))) == NULL)
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return -1;
+    }
+  RESOF(res)->pScroll = pScroll;
+
+  ret = SQLSetStmtAttr (hStmt, SQL_ATTR_ROW_ARRAY_SIZE,
+      (SQLPOINTER) nRows, 0);
+  if (ret != SQL_SUCCESS)
+    {
+      SQLSetStmtAttr (hStmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER) 1, 0);
+      nRows = 1;
+    }
+  pScroll->nWindow = nRows;
+  SQLSetStmtAttr (hStmt, SQL_ATTR_ROW_BIND_TYPE,
+      (SQLPOINTER) SQL_BIND_BY_COLUMN, 0);
+  SQLSetStmtAttr (hStmt, SQL_ATTR_ROWS_FETCHED_PTR, &pScroll->nFetched, 0);
+
+  return 0;
+}
+
+
+/*
+ *  The first seek on a streaming read runs it again on a scrollable
+ *  cursor of its statement. Without one the seek does nothing, as for
+ *  any mysql_use_result result.
+ */
+static int
+_scroll_open (MYSQL_RES *res)
+{
+  TSQLResult *pRes = RESOF(res);
+  MYSQL *mysql = res->handle;
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLRETURN ret;
+  int rc = 0;
+
+  if (_scroll_type (pDB) != SQL_CURSOR_FORWARD_ONLY)
+    {
+      SQLFreeStmt (pRes->hStmt, SQL_CLOSE);
+      SQLFreeStmt (pRes->hStmt, SQL_UNBIND);
+      if (_scroll_cursor (mysql, pRes->hStmt))
+	{
+	  _set_error (mysql, ER_NOT_SUPPORTED_YET);
+	  rc = -1;
+	}
+      else
+	{
+	  pDB->hDiagStmt = pRes->hStmt;
+	  ret = SQLExecDirect (pRes->hStmt, (SQLCHAR *) pRes->pScrollSql,
+	      SQL_NTS);
+	  rc = _trap_sqlerror (mysql, ret, "SQLExecDirect");
+	  pDB->hDiagStmt = SQL_NULL_HSTMT;
+	  if (rc == 0)
+	    rc = _scroll_init (mysql, res, pRes->hStmt);
+
+	  /* The read goes on where the stream was */
+	  if (rc == 0)
+	    pRes->pScroll->pos = res->row_count;
+	}
+      res->eof = rc != 0;
+    }
+  safe_free (pRes->pScrollSql);
+  pRes->pScrollSql = NULL;
+
+  return rc;
+}
+
+
+static void
+_scroll_win_free (TScrollWin *win, unsigned int nCols)
+{
+  unsigned int j;
+
+  if (win->ppBuf)
+    {
+      for (j = 0; j < nCols; j++)
+	safe_free (win->ppBuf[j]);
+      free (win->ppBuf);
+    }
+  safe_free (win->pInd);
+  win->ppBuf = NULL;
+  win->pInd = NULL;
+  win->nRows = 0;
+}
+
+
+/*
+ *  Read the block starting at row start into win
+ */
+static int
+_scroll_load (MYSQL_RES *res, TScrollWin *win, my_ulonglong start)
+{
+  TSQLResult *pRes = RESOF(res);
+  TScroll *pScroll = pRes->pScroll;
+  SQLULEN nWindow = pScroll->nWindow;
+  TSQLPrivate *pDB = DBOF(res->handle);
+  unsigned int j;
+  SQLRETURN ret;
+  int rc;
+
+  if (win->ppBuf == NULL)
+    {
+      win->ppBuf = (char **) calloc (res->field_count, sizeof (char *));
+      win->pInd = (SQLLEN *) calloc (res->field_count * nWindow,
+	  sizeof (SQLLEN));
+      for (j = 0; win->ppBuf && win->pInd && j < res->field_count; j++)
+	{
+	  win->ppBuf[j] = malloc (nWindow * res->fields[j].max_length);
+	  if (win->ppBuf[j] == NULL)
+	    break;
+	}
+      if (win->ppBuf == NULL || win->pInd == NULL || j < res->field_count)
+	{
+	  _scroll_win_free (win, res->field_count);
+	  _set_error (res->handle, CR_OUT_OF_MEMORY);
+	  return -1;
+	}
+    }
+  win->nRows = 0;
+
+  if (pScroll->pBound != win)
+    {
+      pScroll->pBound = NULL;
+      SQLFreeStmt (pRes->hStmt, SQL_UNBIND);
+      for (j = 0; j < res->field_count; j++)
+	{
+	  ret = SQLBindCol (pRes->hStmt, (SQLUSMALLINT) (j + 1), SQL_C_CHAR,
+	      win->ppBuf[j], (SQLLEN) res->fields[j].max_length,
+	      win->pInd + j * nWindow);
+	  if (_trap_sqlerror (res->handle, ret, "SQLBindCol"))
+	    return -1;
+	}
+      pScroll->pBound = win;
+    }
+
+  pScroll->nFetched = 0;
+  pDB->hDiagStmt = pRes->hStmt;
+  ret = SQLFetchScroll (pRes->hStmt, SQL_FETCH_ABSOLUTE,
+      (SQLLEN) (start + 1));
+  rc = _trap_sqlerror (res->handle, ret, "SQLFetchScroll");
+  pDB->hDiagStmt = SQL_NULL_HSTMT;
+  if (rc)
+    return -1;
+
+  if (ret != SQL_NO_DATA_FOUND)
+    {
+      win->start = start;
+      win->nRows = pScroll->nFetched;
+    }
+  /* A short block is the end, the rows in the result are known now */
+  if (win->nRows < nWindow && (win->nRows || start == 0))
+    {
+      pScroll->bEnd = 1;
+      pScroll->nTotal = start + win->nRows;
+    }
+
+  return 0;
+}
+
+
+/*
+ *  The row at the position of a scrollable result goes into res->row.
+ *  Returns 1 for a row, 0 past the end, -1 on errors.
+ */
+static int
+_scroll_row (MYSQL_RES *res)
+{
+  TScroll *pScroll = RESOF(res)->pScroll;
+  TScrollWin *win, *old;
+  my_ulonglong pos = pScroll->pos;
+  SQLULEN i;
+  unsigned int j, k;
+  char *src;
+  SQLLEN ind;
+  size_t n;
+
+  if (pScroll->bEnd && pos >= pScroll->nTotal)
+    return 0;
+
+  for (win = NULL, old = pScroll->aWin, k = 0; k < SCROLL_WINDOWS; k++)
+    {
+      if (pScroll->aWin[k].nRows && pos >= pScroll->aWin[k].start
+	  && pos < pScroll->aWin[k].start + pScroll->aWin[k].nRows)
+	{
+	  win = &pScroll->aWin[k];
+	  break;
+	}
+      if (pScroll->aWin[k].stamp < old->stamp)
+	old = &pScroll->aWin[k];
+    }
+
+  if (win == NULL)
+    {
+      /* Blocks start at multiples of the window, reading backwards
+       * gets whole blocks too.
+       */
+      win = old;
+      if (_scroll_load (res, win, pos - pos % pScroll->nWindow) < 0)
+	return -1;
+      if (pos >= win->start + win->nRows)
+	return 0;
+    }
+  win->stamp = ++pScroll->clock;
+
+  i = (SQLULEN) (pos - win->start);
+  for (j = 0; j < res->field_count; j++)
+    {
+      ind = win->pInd[j * pScroll->nWindow + i];
+      if (ind == SQL_NULL_DATA)
+	{
+	  ((SQLLEN *) res->lengths)[j] = ind;
+	  continue;
+	}
+      /* Not ind, which may be SQL_NO_TOTAL */
+      src = win->ppBuf[j] + i * res->fields[j].max_length;
+      n = strlen (src);
+      memcpy (res->row[j], src, n + 1);
+      ((SQLLEN *) res->lengths)[j] = (SQLLEN) n;
+    }
+  pScroll->pos++;
+
+  return 1;
+}
+
+
+/*
+ *  Before the statement goes back: the blocks, and the forward only
+ *  cursor the other queries expect
+ */
+static void
+_scroll_free (TSQLResult *pRes)
+{
+  TScroll *pScroll = pRes->pScroll;
+  unsigned int k;
+
+  if (pScroll == NULL)
+    return;
+
+  if (pRes->hStmt != SQL_NULL_HSTMT)
+    {
+      SQLFreeStmt (pRes->hStmt, SQL_CLOSE);
+      SQLFreeStmt (pRes->hStmt, SQL_UNBIND);
+      SQLSetStmtAttr (pRes->hStmt, SQL_ATTR_ROW_ARRAY_SIZE,
+	  (SQLPOINTER) 1, 0);
+      SQLSetStmtAttr (pRes->hStmt, SQL_ATTR_ROWS_FETCHED_PTR, NULL, 0);
+      SQLSetStmtAttr (pRes->hStmt, SQL_ATTR_CURSOR_TYPE,
+	  (SQLPOINTER) SQL_CURSOR_FORWARD_ONLY, 0);
+    }
+  for (k = 0; k < SCROLL_WINDOWS; k++)
+    _scroll_win_free (&pScroll->aWin[k], pRes->res.field_count);
+  free (pScroll);
+  pRes->pScroll = NULL;
+}
+
+
+/*
+ *  Fetch the remaining rows of a bound statement into res->data. Returns
+ *  -1 if memory or max-result-buffer runs out, the rows read so far are
+ *  no result.
+ */
+static int
+_fetch_all (MYSQL *mysql, MYSQL_RES *res, SQLHSTMT hStmt)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  MYSQL_ROWS *rp = NULL;
+  unsigned long nBytes = 0;
+  SQLULEN nRows, nFetched, i;
+  unsigned int j;
+  SQLRETURN ret;
+  SQLLEN *pInd = NULL;
+  SQLLEN ind;
+  char **ppBuf;
+  int rc = 0;
+
+  if (res->data == NULL)
+    {
+      res->data = (MYSQL_DATA *) calloc (1, sizeof (MYSQL_DATA));
+      if (res->data == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return -1;
+	}
+      res->data->fields = res->field_count;
+    }
+
+  /* Rows come in blocks when possible, else through the bound res->row */
+  ppBuf = (char **) calloc (res->field_count + 1, sizeof (char *));
+  if (ppBuf == NULL)
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return -1;
+    }
+  nFetched = 1;
+  nRows = _bind_block (mysql, res, hStmt, ppBuf, &pInd, &nFetched);
+  if (nRows == 0)
+    rc = -1;
+  else if (nRows == 1)
+    {
+      for (j = 0; j < res->field_count; j++)
+	safe_free (ppBuf[j]);
+      safe_free (pInd);
+      memcpy (ppBuf, res->row, res->field_count * sizeof (char *));
+      pInd = (SQLLEN *) res->lengths;
+    }
+
+  pDB->hDiagStmt = hStmt;
+  while (rc == 0)
+    {
+      ret = SQLFetch (hStmt);
+      if (_trap_sqlerror (mysql, ret, "SQLFetch"))
+	{
+	  rc = -1;
+	  break;
+	}
+      if (ret == SQL_NO_DATA_FOUND)
+	break;
+
+      for (i = 0; i < nFetched && rc == 0; i++)
+	{
+	  if (RESOF(res)->pCols)
+	    {
+	      if (_col_append (mysql, res, ppBuf, pInd, nRows, i, &nBytes))
+		{
+		  _set_error (mysql, CR_OUT_OF_MEMORY);
+		  rc = -1;
+		  break;
+		}
+	    }
+	  else if (_append_row (res->data, &rp) == -1)
+	    {
+	      _set_error (mysql, CR_OUT_OF_MEMORY);
+	      rc = -1;
+	      break;
+	    }
+	  else
+	    {
+	      for (j = 0; j < res->field_count; j++)
+		{
+		  ind = pInd[j * nRows + i];
+		  if (ind == SQL_NULL_DATA)
+		    continue;
+		  rp->data[j] = _cs_dup (pDB, 1,
+		      ppBuf[j] + i * res->fields[j].max_length, NULL);
+		  if (rp->data[j] == NULL)
+		    {
+		      _set_error (mysql, CR_OUT_OF_MEMORY);
+		      rc = -1;
+		      break;
+		    }
+		  nBytes += strlen (rp->data[j]) + 1;
+		}
+	    }
+
+	  if (mysql->options.max_result_buffer
+	      && nBytes > mysql->options.max_result_buffer)
+	    {
+	      _set_error (mysql, CR_NET_PACKET_TOO_LARGE);
+	      rc = -1;
+	    }
+	}
+    }
+  pDB->hDiagStmt = SQL_NULL_HSTMT;
+
+  if (nRows > 1)
+    {
+      SQLFreeStmt (hStmt, SQL_UNBIND);
+      SQLSetStmtAttr (hStmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER) 1, 0);
+      SQLSetStmtAttr (hStmt, SQL_ATTR_ROWS_FETCHED_PTR, NULL, 0);
+    }
+  if (nRows != 1)
+    {
+      for (j = 0; j < res->field_count; j++)
+	safe_free (ppBuf[j]);
+      safe_free (pInd);
+    }
+  free (ppBuf);
+
+  res->data_cursor = res->data->data;
+
+  return rc;
+}
+
+
+/*
+ *  Drivers that allow only a limited number of open cursors get the
+ *  older streaming results buffered before another statement runs. The
+ *  client keeps reading them through mysql_fetch_row as if nothing
+ *  happened.
+ */
+static int
+_make_room (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TSQLResult *pRes;
+  unsigned int nOpen;
+
+  if (pDB->nMaxActive == 0)
+    return 0;
+
+  for (nOpen = 0, pRes = pDB->pStreaming; pRes; pRes = pRes->pNext)
+    nOpen++;
+
+  while (nOpen + 1 > pDB->nMaxActive)
+    {
+      /* A scrollable result keeps its cursor */
+      for (pRes = pDB->pStreaming; pRes && pRes->pScroll; pRes = pRes->pNext)
+	;
+      if (pRes == NULL)
+	break;
+      if (_fetch_all (mysql, &pRes->res, pRes->hStmt) < 0)
+	{
+	  /* Part of it is no result either, the client sees it end */
+	  _free_data (pRes->res.data);
+	  pRes->res.data = NULL;
+	  pRes->res.data_cursor = NULL;
+	  pRes->res.eof = 1;
+	  _detach_res (&pRes->res);
+	  return -1;
+	}
+      _detach_res (&pRes->res);
+      nOpen--;
+    }
+
+  return 0;
+}
+
+
+static void
+_free_data (MYSQL_DATA *data)
+{
+  unsigned int j;
+  MYSQL_ROWS *r, *r2;
+
+  if (data)
+    {
+      if (data->data)
+	{
+	  for (r = data->data; r; r = r2)
+	    {
+	      if (r->data)
+		{
+		  for (j = 0; j < data->fields; j++)
+		    {
+		      if (r->data[j])
+			free (r->data[j]); /* char * */
+		    }
+		}
+	      r2 = r->next;
+	      free (r); /* MYSQL_ROWS */
+	    }
+	}
+      free (data); /* MYSQL_DATA */
+    }
+}
+
+
+/******************************************************************************/
+
+/*
+ *  Minimal SQL lexer
+ *
+ *  Just enough to classify statements and to find the tables they touch.
+ *  Comments and whitespace are skipped, quotes are honoured so keywords
+ *  inside literals are never seen.
+ */
+static const char *
+_sql_token (const char *cp, const char *end, TSQLToken *tok)
+{
+  char quote;
+
+  for (;;)
+    {
+      while (cp < end && isspace ((unsigned char) *cp))
+	cp++;
+      if (cp >= end)
+	break;
+      if (*cp == '#' || (*cp == '-' && cp + 1 < end && cp[1] == '-'))
+	{
+	  while (cp < end && *cp != '\n')
+	    cp++;
+	}
+      else if (*cp == '/' && cp + 1 < end && cp[1] == '*')
+	{
+	  for (cp += 2; cp < end && !(*cp == '*' && cp + 1 < end && cp[1] == '/'); cp++)
+	    ;
+	  cp = (cp < end) ? cp + 2 : end;
+	}
+      else
+	break;
+    }
+
+  tok->start = cp;
+  if (cp >= end)
+    {
+      tok->type = TK_END;
+      tok->len = 0;
+      return cp;
+    }
+
+  if (isalpha ((unsigned char) *cp) || *cp == '_' || *cp == '$'
+      || (*cp & 0x80))
+    {
+      while (cp < end && (isalnum ((unsigned char) *cp) || *cp == '_'
+	      || *cp == '$' || (*cp & 0x80)))
+	cp++;
+      tok->type = TK_WORD;
+    }
+  else if (isdigit ((unsigned char) *cp))
+    {
+      while (cp < end && (isalnum ((unsigned char) *cp) || *cp == '.'))
+	cp++;
+      tok->type = TK_NUMBER;
+    }
+  else if (*cp == '\'' || *cp == '"' || *cp == '`')
+    {
+      quote = *cp++;
+      while (cp < end)
+	{
+	  if (*cp == '\\' && quote != '`' && cp + 1 < end)
+	    cp += 2;
+	  else if (*cp == quote)
+	    {
+	      /* doubled quote stands for the quote itself */
+	      if (cp + 1 < end && cp[1] == quote)
+		cp += 2;
+	      else
+		break;
+	    }
+	  else
+	    cp++;
+	}
+      if (cp < end)
+	cp++;
+      tok->type = (quote == '`') ? TK_QUOTED : TK_STRING;
+    }
+  else
+    {
+      cp++;
+      tok->type = TK_PUNCT;
+    }
+
+  tok->len = cp - tok->start;
+
+  return cp;
+}
+
+
+static int
+_tok_is (TSQLToken *tok, const char *word)
+{
+  size_t len = strlen (word);
+
+  return tok->type == TK_WORD && tok->len == len
+      && !strncasecmp (tok->start, word, len);
+}
+
+
+static int
+_tok_in (TSQLToken *tok, const char * const *words)
+{
+  for (; *words; words++)
+    {
+      if (_tok_is (tok, *words))
+	return 1;
+    }
+  return 0;
+}
+
+
+static void
+_sql_add_table (TSQLInfo *info, TSQLToken *tok)
+{
+  const char *cp = tok->start;
+  size_t len = tok->len;
+  char *dp;
+
+  if (tok->type == TK_QUOTED && len >= 2)
+    {
+      cp++;
+      len -= 2;
+    }
+
+  if (info->nTables >= SQL_MAX_TABLES || len > NAME_LEN)
+    {
+      info->bAllTables = 1;
+      return;
+    }
+
+  /* Invalidation is by name only, so compare case insensitive */
+  dp = info->tables[info->nTables];
+  while (len--)
+    *dp++ = tolower ((unsigned char) *cp++);
+  *dp = 0;
+
+  for (len = 0; len < info->nTables; len++)
+    {
+      if (!strcmp (info->tables[len], info->tables[info->nTables]))
+	return;
+    }
+  info->nTables++;
+}
+
+
+static const char * const _sql_reads[] =
+  {
+    "SELECT", "SHOW", "DESCRIBE", "DESC", "EXPLAIN", NULL
+  };
+
+static const char * const _sql_writes[] =
+  {
+    "INSERT", "UPDATE", "DELETE", "REPLACE", "LOAD", "CALL", "DO",
+    "HANDLER", "LOCK", NULL
+  };
+
+static const char * const _sql_ddl[] =
+  {
+    "CREATE", "ALTER", "DROP", "RENAME", "TRUNCATE", "OPTIMIZE", "REPAIR",
+    NULL
+  };
+
+/* Words between the verb and the first table name */
+static const char * const _sql_modifiers[] =
+  {
+    "LOW_PRIORITY", "DELAYED", "HIGH_PRIORITY", "IGNORE", "INTO", "QUICK",
+    "TABLE", "TABLES", "TEMPORARY", "IF", "NOT", "EXISTS", "FROM", "ONLY",
+    NULL
+  };
+
+/* Words that end a FROM clause */
+static const char * const _sql_clause_end[] =
+  {
+    "WHERE", "GROUP", "ORDER", "LIMIT", "HAVING", "ON", "USING", "UNION",
+    "SET", "VALUES", "VALUE", "FOR", "PROCEDURE", "INTO", "WINDOW", "LOCK",
+    NULL
+  };
+
+/* Anything that makes two runs of a SELECT disagree */
+static const char * const _sql_volatile[] =
+  {
+    "NOW", "SYSDATE", "CURDATE", "CURTIME", "CURRENT_DATE", "CURRENT_TIME",
+    "CURRENT_TIMESTAMP", "LOCALTIME", "LOCALTIMESTAMP", "UNIX_TIMESTAMP",
+    "UTC_DATE", "UTC_TIME", "UTC_TIMESTAMP", "RAND", "UUID", "UUID_SHORT",
+    "CONNECTION_ID", "LAST_INSERT_ID", "FOUND_ROWS", "ROW_COUNT", "USER",
+    "CURRENT_USER", "SESSION_USER", "SYSTEM_USER", "DATABASE", "SCHEMA",
+    "GET_LOCK", "RELEASE_LOCK", "IS_FREE_LOCK", "SLEEP", "BENCHMARK",
+    "SQL_NO_CACHE", "INTO", "UPDATE", "SHARE", "NEXTVAL", NULL
+  };
+
+
+/*
+ *  Classify a statement and collect the tables it references. Anything
+ *  that is not clearly understood sets bAllTables, so callers err on the
+ *  side of invalidating too much.
+ */
+static void
+_sql_analyze (const char *query, size_t len, TSQLInfo *info)
+{
+  const char *cp = query;
+  const char *end = query + len;
+  TSQLToken tok, next;
+  int bInFrom = 0;
+  int bWant = 0;
+  int bVerb = 1;
+
+  memset (info, 0, sizeof (TSQLInfo));
+
+  cp = _sql_token (cp, end, &tok);
+  if (tok.type != TK_WORD)
+    {
+      info->kind = SQL_KIND_OTHER;
+      return;
+    }
+
+  if (_tok_in (&tok, _sql_reads))
+    {
+      info->kind = SQL_KIND_READ;
+      info->bCacheable = _tok_is (&tok, "SELECT");
+    }
+  else if (_tok_in (&tok, _sql_writes))
+    {
+      info->kind = SQL_KIND_WRITE;
+      info->bInsert = _tok_is (&tok, "INSERT") || _tok_is (&tok, "REPLACE");
+    }
+  else if (_tok_in (&tok, _sql_ddl))
+    info->kind = SQL_KIND_DDL;
+  else if (_tok_is (&tok, "BEGIN") || _tok_is (&tok, "START"))
+    {
+      info->kind = SQL_KIND_BEGIN;
+      return;
+    }
+  else if (_tok_is (&tok, "COMMIT") || _tok_is (&tok, "ROLLBACK"))
+    {
+      info->kind = SQL_KIND_END;
+      return;
+    }
+  else
+    {
+      info->kind = SQL_KIND_OTHER;
+      return;
+    }
+
+  /* Stored procedures and DDL on non-table objects can touch anything */
+  if (_tok_is (&tok, "CALL") || _tok_is (&tok, "DO")
+      || _tok_is (&tok, "HANDLER"))
+    info->bAllTables = 1;
+  if (info->kind == SQL_KIND_DDL)
+    {
+      _sql_token (cp, end, &next);
+      if (!_tok_is (&tok, "TRUNCATE") && !_tok_is (&next, "TABLE")
+	  && !_tok_is (&next, "TEMPORARY") && !_tok_is (&next, "IGNORE"))
+	info->bAllTables = 1;
+    }
+
+  /* The verb of a write or DDL statement is followed by its target */
+  bWant = bInFrom = (info->kind != SQL_KIND_READ);
+
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END)
+	break;
+
+      if (info->bCacheable && tok.type == TK_WORD
+	  && _tok_in (&tok, _sql_volatile))
+	info->bCacheable = 0;
+      if (info->bInsert && tok.type == TK_WORD
+	  && (_tok_is (&tok, "RETURNING") || _tok_is (&tok, "OUTPUT")))
+	info->bReturning = 1;
+      if (tok.type == TK_PUNCT && *tok.start == '@')
+	info->bCacheable = 0;	/* session variables */
+
+      if (bWant && bVerb && tok.type == TK_WORD
+	  && _tok_in (&tok, _sql_modifiers))
+	continue;
+      bVerb = 0;
+
+      if (tok.type == TK_WORD
+	  && (_tok_is (&tok, "FROM") || _tok_is (&tok, "JOIN")
+	      || _tok_is (&tok, "STRAIGHT_JOIN") || _tok_is (&tok, "UPDATE")
+	      || _tok_is (&tok, "TABLE") || _tok_is (&tok, "TO")))
+	{
+	  bInFrom = 1;
+	  bWant = 1;
+	  continue;
+	}
+
+      if (bWant && (tok.type == TK_WORD || tok.type == TK_QUOTED))
+	{
+	  /* db.table: keep the table part */
+	  const char *np = _sql_token (cp, end, &next);
+	  while (next.type == TK_PUNCT && *next.start == '.')
+	    {
+	      np = _sql_token (np, end, &next);
+	      if (next.type != TK_WORD && next.type != TK_QUOTED)
+		break;
+	      tok = next;
+	      cp = np;
+	      np = _sql_token (cp, end, &next);
+	    }
+	  _sql_add_table (info, &tok);
+	  bWant = 0;
+	  continue;
+	}
+      bWant = 0;
+
+      if (tok.type == TK_PUNCT)
+	{
+	  if (bInFrom && *tok.start == ',')
+	    bWant = 1;
+	  else if (*tok.start == ')' || *tok.start == ';')
+	    bInFrom = 0;
+	}
+      else if (tok.type == TK_WORD && _tok_in (&tok, _sql_clause_end))
+	bInFrom = 0;
+    }
+
+  if (info->kind != SQL_KIND_READ && info->nTables == 0)
+    info->bAllTables = 1;
+  if (info->bAllTables)
+    info->bCacheable = 0;
+}
+
+
+/*
+ *  Query result cache
+ *
+ *  Process wide and off by default (see mysql_query_cache_configure).
+ *  Stored results of deterministic SELECTs are kept under a key made of
+ *  database, user and the statement with whitespace and comments
+ *  normalized. Entries expire after a TTL and are dropped when the process
+ *  writes to any table they reference. An entry is shared by reference
+ *  with the results handed out, so a hit costs no copying at all.
+ */
+
+/*
+ *  query-cache-size and query-cache-ttl of the first connection that
+ *  sets them size the cache, unless mysql_query_cache_configure came
+ *  first. Options of later connections do not change it.
+ */
+static void
+_qc_init (MYSQL *mysql)
+{
+  if (mysql->options.query_cache_size == 0 || _qc.bConfigured)
+    return;
+
+  MUTEX_LOCK (&_qc.lock);
+  if (!_qc.bConfigured)
+    {
+      _qc.maxBytes = mysql->options.query_cache_size;
+      _qc.ttl = mysql->options.query_cache_ttl;
+      _qc.bConfigured = 1;
+    }
+  MUTEX_UNLOCK (&_qc.lock);
+}
+
+
+static char *
+_qc_make_key (MYSQL *mysql, const char *query, size_t len, size_t *keyLen,
+    unsigned long *hash)
+{
+  const char *cp = query;
+  const char *end = query + len;
+  TSQLToken tok;
+  unsigned long h;
+  size_t i, n;
+  char *key, *dp;
+
+  /* Worst case every character is a token and gets a blank. Rows are
+   * kept in the client encoding, so that is part of the key too.
+   */
+  n = (mysql->db ? strlen (mysql->db) : 0)
+      + (mysql->user ? strlen (mysql->user) : 0) + 2 * len + 5;
+  if ((key = (char *) malloc (n)) == NULL)
+    return NULL;
+
+  dp = key;
+  dp += sprintf (dp, "%s%c%s%c%c%c", mysql->db ? mysql->db : "", 1,
+      mysql->user ? mysql->user : "", 1, '0' + DBOF(mysql)->csClient, 1);
+
+  /* One blank between tokens, comments and trailing ';' dropped */
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END)
+	break;
+      if (tok.type == TK_PUNCT && *tok.start == ';')
+	continue;
+      if (dp > key && dp[-1] != 1)
+	*dp++ = ' ';
+      memcpy (dp, tok.start, tok.len);
+      dp += tok.len;
+    }
+  *dp = 0;
+  *keyLen = dp - key;
+
+  /* FNV-1a */
+  for (h = 2166136261UL, i = 0; i < *keyLen; i++)
+    h = (h ^ (unsigned char) key[i]) * 16777619UL;
+  *hash = h;
+
+  return key;
+}
+
+
+static void
+_qc_free_entry (TQCacheEntry *entry)
+{
+  safe_free (entry->key);
+  _free_data (entry->data);
+  _free_field_array (entry->fields, entry->field_count);
+  free (entry);
+}
+
+
+static void
+_qc_unref (TQCacheEntry *entry)
+{
+  int bFree;
+
+  MUTEX_LOCK (&_qc.lock);
+  bFree = (--entry->refCount == 0);
+  MUTEX_UNLOCK (&_qc.lock);
+
+  if (bFree)
+    _qc_free_entry (entry);
+}
+
+
+/* Call with the lock held */
+static void
+_qc_unlink (TQCacheEntry *entry)
+{
+  TQCacheEntry **pp;
+
+  for (pp = &_qc.buckets[entry->hash % QC_BUCKETS]; *pp; pp = &(*pp)->pHashNext)
+    {
+      if (*pp == entry)
+	{
+	  *pp = entry->pHashNext;
+	  break;
+	}
+    }
+
+  if (entry->pLruPrev)
+    entry->pLruPrev->pLruNext = entry->pLruNext;
+  else
+    _qc.pLruHead = entry->pLruNext;
+  if (entry->pLruNext)
+    entry->pLruNext->pLruPrev = entry->pLruPrev;
+  else
+    _qc.pLruTail = entry->pLruPrev;
+
+  _qc.bytes -= entry->bytes;
+  _qc.stats.entries--;
+  entry->bLinked = 0;
+
+  if (--entry->refCount == 0)
+    _qc_free_entry (entry);
+}
+
+
+/*
+ *  Look up the query. On a hit the entry is parked in the connection for
+ *  the following store/use_result; on a cacheable miss the key is kept so
+ *  the stored result can be added.
+ */
+static int
+_qc_lookup (MYSQL *mysql, const char *query, size_t len)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TQCacheEntry *entry;
+  time_t now;
+
+  /* Inside a transaction we could see, and cache, uncommitted rows */
+  if (pDB->qcInfo.kind != SQL_KIND_READ || !pDB->qcInfo.bCacheable
+      || pDB->bInTrans)
+    return 0;
+
+  pDB->pQcKey = _qc_make_key (mysql, query, len, &pDB->qcKeyLen,
+      &pDB->qcHash);
+  if (pDB->pQcKey == NULL)
+    return 0;
+
+  now = time (NULL);
+
+  MUTEX_LOCK (&_qc.lock);
+  pDB->qcGeneration = _qc.generation;
+  for (entry = _qc.buckets[pDB->qcHash % QC_BUCKETS]; entry;
+      entry = entry->pHashNext)
+    {
+      if (entry->hash == pDB->qcHash && entry->keyLen == pDB->qcKeyLen
+	  && !memcmp (entry->key, pDB->pQcKey, pDB->qcKeyLen))
+	break;
+    }
+
+  if (entry && entry->expires <= now)
+    {
+      _qc.stats.evictions++;
+      _qc_unlink (entry);
+      entry = NULL;
+    }
+
+  if (entry == NULL)
+    {
+      _qc.stats.misses++;
+      MUTEX_UNLOCK (&_qc.lock);
+      return 0;
+    }
+
+  /* Move to the front of the LRU list */
+  if (entry != _qc.pLruHead)
+    {
+      entry->pLruPrev->pLruNext = entry->pLruNext;
+      if (entry->pLruNext)
+	entry->pLruNext->pLruPrev = entry->pLruPrev;
+      else
+	_qc.pLruTail = entry->pLruPrev;
+      entry->pLruPrev = NULL;
+      entry->pLruNext = _qc.pLruHead;
+      _qc.pLruHead->pLruPrev = entry;
+      _qc.pLruHead = entry;
+    }
+
+  entry->refCount++;
+  _qc.stats.hits++;
+  MUTEX_UNLOCK (&_qc.lock);
+
+  free (pDB->pQcKey);
+  pDB->pQcKey = NULL;
+  pDB->pQcHit = entry;
+
+  return 1;
+}
+
+
+/*
+ *  Hand the rows of a freshly stored result over to the cache. The result
+ *  keeps using them through a reference, so nothing is copied.
+ */
+static void
+_qc_insert (MYSQL *mysql, MYSQL_RES *res)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TQCacheEntry *entry;
+  MYSQL_ROWS *rp;
+  unsigned long bytes;
+  unsigned int j;
+
+  if (pDB->pQcKey == NULL || res->data == NULL)
+    return;
+
+  /* The cache shares rows, columns would have to be copied */
+  if (RESOF(res)->pCols)
+    {
+      _qc_reset (pDB);
+      return;
+    }
+  _meta_resolve (res);
+
+  bytes = sizeof (TQCacheEntry) + pDB->qcKeyLen
+      + res->field_count * (sizeof (MYSQL_FIELD) + 2 * NAME_LEN);
+  for (rp = res->data->data; rp; rp = rp->next)
+    {
+      bytes += sizeof (MYSQL_ROWS) + res->field_count * sizeof (char *);
+      for (j = 0; j < res->field_count; j++)
+	{
+	  if (rp->data[j])
+	    bytes += strlen (rp->data[j]) + 1;
+	}
+    }
+
+  if (bytes > _qc.maxBytes / 4
+      || (entry = (TQCacheEntry *) calloc (1, sizeof (TQCacheEntry))) == NULL)
+    {
+      _qc_reset (pDB);
+      return;
+    }
+
+  entry->hash = pDB->qcHash;
+  entry->key = pDB->pQcKey;
+  entry->keyLen = pDB->qcKeyLen;
+  entry->bytes = bytes;
+  entry->info = pDB->qcInfo;
+  entry->field_count = res->field_count;
+  entry->fields = res->fields;
+  entry->data = res->data;
+  entry->affected_rows = mysql->affected_rows;
+  entry->refCount = 2;
+  pDB->pQcKey = NULL;
+
+  MUTEX_LOCK (&_qc.lock);
+
+  /* A write went through while we were reading; the rows may be stale */
+  if (pDB->qcGeneration != _qc.generation || _qc.maxBytes == 0)
+    {
+      MUTEX_UNLOCK (&_qc.lock);
+      entry->data = NULL;
+      entry->fields = NULL;
+      _qc_free_entry (entry);
+      return;
+    }
+
+  entry->expires = time (NULL) + _qc.ttl;
+  entry->bLinked = 1;
+  entry->pHashNext = _qc.buckets[entry->hash % QC_BUCKETS];
+  _qc.buckets[entry->hash % QC_BUCKETS] = entry;
+  entry->pLruNext = _qc.pLruHead;
+  if (_qc.pLruHead)
+    _qc.pLruHead->pLruPrev = entry;
+  else
+    _qc.pLruTail = entry;
+  _qc.pLruHead = entry;
+  _qc.bytes += bytes;
+  _qc.stats.entries++;
+
+  while (_qc.bytes > _qc.maxBytes && _qc.pLruTail != entry)
+    {
+      _qc.stats.evictions++;
+      _qc_unlink (_qc.pLruTail);
+    }
+  _qc.stats.bytes = _qc.bytes;
+
+  MUTEX_UNLOCK (&_qc.lock);
+
+  RESOF(res)->pCached = entry;
+}
+
+
+/*
+ *  Drop every entry that references a table written by this statement
+ */
+static void
+_qc_invalidate (TSQLInfo *info)
+{
+  TQCacheEntry *entry, *next;
+  unsigned int i, j;
+  int bHit;
+
+  MUTEX_LOCK (&_qc.lock);
+  _qc.generation++;
+  for (entry = _qc.pLruHead; entry; entry = next)
+    {
+      next = entry->pLruNext;
+      bHit = info->bAllTables;
+      for (i = 0; !bHit && i < info->nTables; i++)
+	{
+	  for (j = 0; !bHit && j < entry->info.nTables; j++)
+	    bHit = !strcmp (info->tables[i], entry->info.tables[j]);
+	}
+      if (bHit)
+	{
+	  _qc.stats.invalidations++;
+	  _qc_unlink (entry);
+	}
+    }
+  _qc.stats.bytes = _qc.bytes;
+  MUTEX_UNLOCK (&_qc.lock);
+
+  /* and for the other processes */
+  _shc_invalidate (info);
+}
+
+
+static void
+_qc_reset (TSQLPrivate *pDB)
+{
+  if (pDB->pQcHit)
+    {
+      _qc_unref (pDB->pQcHit);
+      pDB->pQcHit = NULL;
+    }
+  if (pDB->pQcKey)
+    {
+      free (pDB->pQcKey);
+      pDB->pQcKey = NULL;
+    }
+  safe_free (pDB->pShcKey);
+  pDB->pShcKey = NULL;
+}
+
+
+/*
+ *  Build a result that reads straight from the cached rows
+ */
+static MYSQL_RES *
+_qc_result (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TQCacheEntry *entry = pDB->pQcHit;
+  MYSQL_RES *res;
+
+  if ((res = (MYSQL_RES *) calloc (1, sizeof (TSQLResult))) == NULL
+      || (res->lengths = (unsigned long *) calloc (entry->field_count + 1,
+		  sizeof (unsigned long))) == NULL)
+    {
+      safe_free (res);
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return NULL;
+    }
+
+  /* The reference taken by _qc_lookup moves to the result */
+  pDB->pQcHit = NULL;
+  RESOF(res)->pCached = entry;
+  res->field_count = entry->field_count;
+  res->fields = entry->fields;
+  res->data = entry->data;
+  res->data_cursor = entry->data->data;
+  res->handle = mysql;
+
+  return res;
+}
+
+
+/******************************************************************************/
+
+
+/*
+ *  Character sets
+ *
+ *  The driver hands out SQL_C_CHAR data in the encoding of the data
+ *  source, odbc-character-set. When it is set and the client asked for
+ *  another one with MYSQL_SET_CHARSET_NAME, statements go out and
+ *  results come back through these transcoders. Without it, or when
+ *  both agree, the data is not touched at all. utf8, utf8mb3 and utf8mb4 are
+ *  the same encoding here.
+ */
+static const struct
+  {
+    const char *	name;
+    int			cs;
+  } _charsets[] =
+  {
+    { "latin1",		CS_LATIN1 },
+    { "utf8",		CS_UTF8 },
+    { "utf8mb3",	CS_UTF8 },
+    { "utf8mb4",	CS_UTF8 },
+    { NULL }
+  };
+
+
+static int
+_cs_lookup (const char *name)
+{
+  int i;
+
+  for (i = 0; _charsets[i].name; i++)
+    {
+      if (!strcasecmp (name, _charsets[i].name))
+	return i;
+    }
+
+  return -1;
+}
+
+
+/*
+ *  Pick the client and the data source encodings of a connection
+ */
+static int
+_cs_init (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  const char *name;
+  int odbc, client;
+
+  name = mysql->options.charset_name;
+  client = _cs_lookup (name ? name : MYSQL_CHARSET);
+  if (client < 0)
+    {
+      _set_error (mysql, CR_CANT_READ_CHARSET);
+      return -1;
+    }
+
+  /* Without odbc-character-set the data passes through as it is */
+  name = mysql->options.odbc_charset;
+  odbc = name ? _cs_lookup (name) : client;
+  if (odbc < 0)
+    {
+      _set_error (mysql, CR_CANT_READ_CHARSET);
+      return -1;
+    }
+
+  /* Names and lists in the caches were read in the old encoding */
+  if (pDB->csClient && pDB->csClient != _charsets[client].cs)
+    _cat_flush (pDB);
+
+  pDB->csOdbc = _charsets[odbc].cs;
+  pDB->csClient = _charsets[client].cs;
+  pDB->pszCharset = _charsets[client].name;
+
+  return 0;
+}
+
+
+/*
+ *  Length of the leading run of 7 bit characters
+ */
+static size_t
+_cs_ascii_span (const unsigned char *s, size_t len)
+{
+  size_t i = 0;
+#ifdef HAVE_SSE2
+  int mask;
+
+  /* 16 at a time, the sign bits point at the first 8 bit character */
+  for (; i + 16 <= len; i += 16)
+    {
+      mask = _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *) (s + i)));
+      if (mask)
+	return i + CTZ (mask);
+    }
+#endif
+
+  for (; i < len && s[i] < 0x80; i++)
+    ;
+
+  return i;
+}
+
+
+/*
+ *  Length of the UTF-8 sequence at s, 0 if it is not a valid one.
+ *  Overlong forms, surrogates and code points past U+10FFFF are invalid.
+ */
+static size_t
+_utf8_check (const unsigned char *s, size_t len, unsigned long *pCode)
+{
+  unsigned long c = s[0];
+  size_t n, i;
+
+  if (c < 0x80)
+    n = 1;
+  else if (c >= 0xC2 && c <= 0xDF)
+    n = 2, c &= 0x1F;
+  else if (c >= 0xE0 && c <= 0xEF)
+    n = 3, c &= 0x0F;
+  else if (c >= 0xF0 && c <= 0xF4)
+    n = 4, c &= 0x07;
+  else
+    return 0;
+  if (n > len)
+    return 0;
+
+  for (i = 1; i < n; i++)
+    {
+      if ((s[i] & 0xC0) != 0x80)
+	return 0;
+      c = (c << 6) | (s[i] & 0x3F);
+    }
+  if ((n == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF)))
+      || (n == 4 && (c < 0x10000 || c > 0x10FFFF)))
+    return 0;
+
+  *pCode = c;
+  return n;
+}
+
+
+/*
+ *  Transcode len bytes from the encoding 'from' into the other one.
+ *  latin1 doubles at most, UTF-8 only shrinks; characters latin1 cannot
+ *  hold and invalid UTF-8 become '?'. Returns the length written to dst,
+ *  which is 0 terminated.
+ */
+static size_t
+_cs_convert (int from, const char *src, size_t len, char *dst)
+{
+  const unsigned char *s = (const unsigned char *) src;
+  unsigned char *d = (unsigned char *) dst;
+  unsigned long c;
+  size_t i, n;
+
+  for (i = 0; i < len; )
+    {
+      /* Most text is plain ASCII, which both share */
+      n = _cs_ascii_span (s + i, len - i);
+      memcpy (d, s + i, n);
+      d += n;
+      if ((i += n) >= len)
+	break;
+
+      if (from == CS_LATIN1)
+	{
+	  *d++ = (unsigned char) (0xC0 | (s[i] >> 6));
+	  *d++ = (unsigned char) (0x80 | (s[i] & 0x3F));
+	  i++;
+	}
+      else if ((n = _utf8_check (s + i, len - i, &c)) == 0)
+	{
+	  *d++ = '?';
+	  i++;
+	}
+      else
+	{
+	  *d++ = (unsigned char) (c < 0x100 ? c : '?');
+	  i += n;
+	}
+    }
+  *d = 0;
+
+  return (size_t) (d - (unsigned char *) dst);
+}
+
+
+/*
+ *  strdup in the other encoding. bToClient tells the direction, without
+ *  a conversion on the connection it is a plain copy.
+ */
+static char *
+_cs_dup (TSQLPrivate *pDB, int bToClient, const char *src, size_t *pLen)
+{
+  size_t len = strlen (src);
+  int from = bToClient ? pDB->csOdbc : pDB->csClient;
+  char *dst;
+
+  if (!CS_CONVERT (pDB))
+    {
+      if ((dst = (char *) malloc (len + 1)) != NULL)
+	memcpy (dst, src, len + 1);
+    }
+  else if ((dst = (char *) malloc (from == CS_LATIN1 ? 2 * len + 1 : len + 1)))
+    len = _cs_convert (from, src, len, dst);
+  if (pLen)
+    *pLen = len;
+
+  return dst;
+}
+
+
+/*
+ *  Generated keys
+ *
+ *  ODBC has no portable way to return the key an INSERT generated, so
+ *  each DBMS gets its own identity query. Where the driver takes batches
+ *  it is appended to the INSERT and comes back as a second result in the
+ *  same round trip. Otherwise it only runs when mysql_insert_id asks.
+ */
+static const TIdentity _identity[] =
+  {
+    { "MySQL",		"SELECT LAST_INSERT_ID()",
+			"SELECT LAST_INSERT_ID()",	0 },
+    { "MariaDB",	"SELECT LAST_INSERT_ID()",
+			"SELECT LAST_INSERT_ID()",	0 },
+    { "Microsoft SQL Server", "SELECT SCOPE_IDENTITY()",
+			"SELECT @@IDENTITY",		0 },
+    { "Adaptive Server", NULL,
+			"SELECT @@IDENTITY",		0 },
+    { "PostgreSQL",	"SELECT lastval()",
+			"SELECT lastval()",		1 },
+    { "SQLite",		NULL,
+			"SELECT last_insert_rowid()",	0 },
+    { "DB2",		NULL,
+			"SELECT IDENTITY_VAL_LOCAL() FROM SYSIBM.SYSDUMMY1", 0 },
+    { "OpenLink Virtuoso", NULL,
+			"SELECT identity_value()",	0 },
+    { NULL }
+  };
+
+
+/*
+ *  Pick the strategy once per connection
+ */
+static void
+_identity_init (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLUINTEGER batch = 0;
+  SQLCHAR name[128];
+  SQLRETURN ret;
+  int i;
+
+  pDB->pIdentity = NULL;
+  pDB->bIdentityBatch = 0;
+  pDB->bIdentityPending = 0;
+  pDB->bIdentityWanted = 0;
+
+  /* Multiple statements go out in one batch on the same condition */
+  ret = SQLGetInfo (pDB->hDbc, SQL_BATCH_SUPPORT, &batch, sizeof (batch),
+      NULL);
+  pDB->ulBatch = (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO)
+      ? batch : 0;
+
+  ret = SQLGetInfo (pDB->hDbc, SQL_DBMS_NAME, name, sizeof (name), NULL);
+  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+    return;
+  for (i = 0; _identity[i].dbms; i++)
+    {
+      if (!strncasecmp ((char *) name, _identity[i].dbms,
+	  strlen (_identity[i].dbms)))
+	{
+	  pDB->pIdentity = &_identity[i];
+	  break;
+	}
+    }
+  if (pDB->pIdentity == NULL || pDB->pIdentity->batch == NULL)
+    return;
+
+  if ((pDB->ulBatch & SQL_BS_ROW_COUNT_EXPLICIT)
+      && (pDB->ulBatch & SQL_BS_SELECT_EXPLICIT))
+    pDB->bIdentityBatch = 1;
+}
+
+
+/*
+ *  Whether the INSERT about to run is followed by the identity query.
+ *  Not when it returns the key itself. lastval () and the like fail
+ *  when the INSERT generated nothing, and on PostgreSQL that failure
+ *  aborts the transaction with the INSERT in it: there the table must
+ *  be known to have an identity or serial column. The catalog is read
+ *  quietly, the INSERT reports its own errors.
+ */
+static int
+_identity_wanted (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TCatEntry *entry;
+  const char *table, *db;
+  unsigned int i, err;
+  char msg[MYSQL_ERRMSG_SIZE];
+  char state[6];
+  int bOwned, bKnown, bWanted = 0;
+
+  if (pDB->pIdentity == NULL || !pDB->qcInfo.bInsert
+      || pDB->qcInfo.bReturning)
+    return 0;
+  if (!pDB->pIdentity->bKnown)
+    return 1;
+  if (pDB->qcInfo.nTables == 0)
+    return 0;
+
+  /* Only DDL changes the answer, whatever the catalog TTL */
+  table = pDB->qcInfo.tables[0];
+  db = mysql->db ? mysql->db : "";
+  for (entry = pDB->pCatalog; entry; entry = entry->pNext)
+    {
+      if (entry->kind == CAT_IDENTITY && !strcmp (entry->pTable, table)
+	  && !strcmp (entry->pDb, db))
+	return entry->nItems;
+    }
+
+  err = mysql->net.last_errno;
+  memcpy (msg, mysql->net.last_error, sizeof (msg));
+  memcpy (state, pDB->szSqlState, sizeof (state));
+  entry = _cat_get (mysql, CAT_FIELDS, table, &bOwned);
+  bKnown = entry != NULL;
+  for (i = 0; entry && i < entry->nItems; i++)
+    {
+      if (entry->fields[i].flags & AUTO_INCREMENT_FLAG)
+	bWanted = 1;
+    }
+  if (entry && bOwned)
+    _cat_free_entry (entry);
+  mysql->net.last_errno = err;
+  memcpy (mysql->net.last_error, msg, sizeof (msg));
+  memcpy (pDB->szSqlState, state, sizeof (state));
+
+  /* A failed lookup is asked again, the table may not exist yet */
+  if (bKnown && (entry = (TCatEntry *) calloc (1, sizeof (TCatEntry))) != NULL)
+    {
+      entry->kind = CAT_IDENTITY;
+      entry->nItems = bWanted;
+      if ((entry->pTable = strdup (table)) == NULL
+	  || (entry->pDb = strdup (db)) == NULL)
+	_cat_free_entry (entry);
+      else
+	{
+	  entry->pNext = pDB->pCatalog;
+	  pDB->pCatalog = entry;
+	}
+    }
+
+  return bWanted;
+}
+
+
+/*
+ *  INSERT followed by the identity query, NULL if that is not safe
+ */
+static char *
+_identity_batch (TSQLPrivate *pDB, const char *query, long *pLen)
+{
+  const char *batch = pDB->pIdentity->batch;
+  long len = *pLen;
+  char *buf;
+
+  /* A trailing ; would leave an empty statement in between */
+  while (len > 0 && (isspace ((unsigned char) query[len - 1])
+      || query[len - 1] == ';'))
+    len--;
+
+  /* Already a batch, or a ; inside a literal: keep out of it */
+  if (len == 0 || memchr (query, ';', len))
+    return NULL;
+
+  if ((buf = malloc (len + strlen (batch) + 3)) == NULL)
+    return NULL;
+  memcpy (buf, query, len);
+  memcpy (buf + len, "\n;", 2);		/* \n ends a trailing -- comment */
+  strcpy (buf + len + 2, batch);
+  *pLen = len + 2 + (long) strlen (batch);
+
+  return buf;
+}
+
+
+/*
+ *  Read the key from the current result of hStmt
+ */
+static int
+_identity_fetch (MYSQL *mysql, SQLHSTMT hStmt)
+{
+  SQLCHAR value[32];
+  SQLRETURN ret;
+  SQLLEN ind;
+
+  mysql->insert_id = 0;
+
+  ret = SQLFetch (hStmt);
+  if (_trap_sqlerror (mysql, ret, "SQLFetch"))
+    return -1;
+  if (ret == SQL_NO_DATA_FOUND)
+    return 0;
+
+  ret = SQLGetData (hStmt, 1, SQL_C_CHAR, value, sizeof (value), &ind);
+  if (_trap_sqlerror (mysql, ret, "SQLGetData"))
+    return -1;
+  if (ind != SQL_NULL_DATA)
+    mysql->insert_id = (my_ulonglong) strtoull ((char *) value, NULL, 10);
+
+  return 0;
+}
+
+
+/*
+ *  Lazy path, for drivers that cannot batch the identity query. Its
+ *  errors are not the client's, the connection keeps the state of the
+ *  statement before.
+ */
+static void
+_impl_insert_id (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLHSTMT hStmt;
+  SQLRETURN ret;
+  unsigned int err;
+  char msg[MYSQL_ERRMSG_SIZE];
+  char state[6];
+
+  pDB->bIdentityPending = 0;
+  err = mysql->net.last_errno;
+  memcpy (msg, mysql->net.last_error, sizeof (msg));
+  memcpy (state, pDB->szSqlState, sizeof (state));
+
+  if (_make_room (mysql) == 0
+      && (hStmt = _stmt_acquire (mysql)) != SQL_NULL_HSTMT)
+    {
+      pDB->hDiagStmt = hStmt;
+      ret = SQLExecDirect (hStmt, (SQLCHAR *) pDB->pIdentity->query,
+	  SQL_NTS);
+      if (_trap_sqlerror (mysql, ret, "SQLExecDirect") == 0)
+	_identity_fetch (mysql, hStmt);
+      pDB->hDiagStmt = SQL_NULL_HSTMT;
+      _stmt_release (pDB, hStmt);
+    }
+
+  mysql->net.last_errno = err;
+  memcpy (mysql->net.last_error, msg, sizeof (msg));
+  memcpy (pDB->szSqlState, state, sizeof (state));
+}
+
+
+/*
+ *  Catalog
+ *
+ *  mysql_list_dbs, mysql_list_tables and mysql_list_fields read the ODBC
+ *  catalog. Complete lists are kept per connection for nCatalogTtl
+ *  seconds, the wild pattern is applied when building the result. DDL
+ *  sent through the connection drops everything.
+ */
+static enum enum_field_types
+_field_type (SQLSMALLINT sqlType)
+{
+  switch (sqlType)
+    {
+    case SQL_BIT:
+    case SQL_TINYINT:
+      return FIELD_TYPE_TINY;
+    case SQL_SMALLINT:
+      return FIELD_TYPE_SHORT;
+    case SQL_INTEGER:
+      return FIELD_TYPE_LONG;
+    case SQL_BIGINT:
+      return FIELD_TYPE_LONGLONG;
+    case SQL_REAL:
+      return FIELD_TYPE_FLOAT;
+    case SQL_FLOAT:
+    case SQL_DOUBLE:
+      return FIELD_TYPE_DOUBLE;
+    case SQL_DECIMAL:
+    case SQL_NUMERIC:
+      return FIELD_TYPE_DECIMAL;
+    case SQL_DATE:
+    case SQL_TYPE_DATE:
+      return FIELD_TYPE_DATE;
+    case SQL_TIME:
+    case SQL_TYPE_TIME:
+      return FIELD_TYPE_TIME;
+    case SQL_TIMESTAMP:
+    case SQL_TYPE_TIMESTAMP:
+      return FIELD_TYPE_DATETIME;
+    case SQL_LONGVARCHAR:
+    case SQL_LONGVARBINARY:
+#ifdef SQL_WLONGVARCHAR
+    case SQL_WLONGVARCHAR:
+#endif
+      return FIELD_TYPE_BLOB;
+    case SQL_VARCHAR:
+    case SQL_VARBINARY:
+#ifdef SQL_WVARCHAR
+    case SQL_WVARCHAR:
+#endif
+      return FIELD_TYPE_VAR_STRING;
+    default:
+      return FIELD_TYPE_STRING;
+    }
+}
+
+
+/*
+ *  MySQL LIKE style match, % and _ with \ as escape, ignoring case
+ */
+static int
+_wild_match (const char *str, const char *wild)
+{
+  for (; *wild; wild++, str++)
+    {
+      if (*wild == '%')
+	{
+	  while (*wild == '%')
+	    wild++;
+	  if (*wild == 0)
+	    return 1;
+	  for (; *str; str++)
+	    {
+	      if (_wild_match (str, wild))
+		return 1;
+	    }
+	  return 0;
+	}
+      if (*str == 0)
+	return 0;
+      if (*wild == '_')
+	continue;
+      if (*wild == '\\' && wild[1])
+	wild++;
+      if (tolower ((unsigned char) *wild) != tolower ((unsigned char) *str))
+	return 0;
+    }
+
+  return *str == 0;
+}
+
+
+static void
+_cat_free_entry (TCatEntry *entry)
+{
+  unsigned int i;
+
+  if (entry->ppNames)
+    {
+      for (i = 0; i < entry->nItems; i++)
+	free (entry->ppNames[i]);
+      free (entry->ppNames);
+    }
+  if (entry->fields)
+    _free_field_array (entry->fields, entry->nItems);
+  safe_free (entry->pTable);
+  safe_free (entry->pDb);
+  free (entry);
+}
+
+
+static void
+_cat_flush (TSQLPrivate *pDB)
+{
+  TCatEntry *entry;
+
+  while ((entry = pDB->pCatalog) != NULL)
+    {
+      pDB->pCatalog = entry->pNext;
+      _cat_free_entry (entry);
+    }
+}
+
+
+static int
+_cat_add_name (TCatEntry *entry, const char *name)
+{
+  char **ppNames;
+
+  /* Grows in powers of two */
+  if ((entry->nItems & (entry->nItems - 1)) == 0)
+    {
+      ppNames = (char **) realloc (entry->ppNames,
+	  (entry->nItems ? 2 * entry->nItems : 16) * sizeof (char *));
+      if (ppNames == NULL)
+	return -1;
+      entry->ppNames = ppNames;
+    }
+  if ((entry->ppNames[entry->nItems] = strdup (name)) == NULL)
+    return -1;
+  entry->nItems++;
+
+  return 0;
+}
+
+
+static int
+_cat_fetch_names (MYSQL *mysql, SQLHSTMT hStmt, TCatEntry *entry,
+    SQLUSMALLINT col)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLCHAR name[257];
+  char conv[2 * sizeof (name) + 1];
+  SQLLEN ind;
+  SQLRETURN ret;
+
+  ret = SQLBindCol (hStmt, col, SQL_C_CHAR, name, sizeof (name), &ind);
+  if (_trap_sqlerror (mysql, ret, "SQLBindCol"))
+    return -1;
+
+  for (;;)
+    {
+      ret = SQLFetch (hStmt);
+      if (_trap_sqlerror (mysql, ret, "SQLFetch"))
+	return -1;
+      if (ret == SQL_NO_DATA_FOUND)
+	break;
+      if (ind == SQL_NULL_DATA || name[0] == 0)
+	continue;
+      if (CS_CONVERT (pDB))
+	{
+	  _cs_convert (pDB->csOdbc, (char *) name,
+	      strlen ((char *) name), conv);
+	  if (_cat_add_name (entry, conv))
+	    {
+	      _set_error (mysql, CR_OUT_OF_MEMORY);
+	      return -1;
+	    }
+	}
+      else if (_cat_add_name (entry, (char *) name))
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return -1;
+	}
+    }
+
+  /* Drivers without catalogs still have the database we are in */
+  if (entry->kind == CAT_DBS && entry->nItems == 0 && mysql->db)
+    {
+      if (_cat_add_name (entry, mysql->db))
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+
+/* Columns of the SQLColumns result we use */
+#define COLS_TABLE_NAME		0
+#define COLS_COLUMN_NAME	1
+#define COLS_DATA_TYPE		2
+#define COLS_COLUMN_SIZE	3
+#define COLS_DECIMAL_DIGITS	4
+#define COLS_NULLABLE		5
+#define COLS_COLUMN_DEF		6
+#define COLS_TYPE_NAME		7
+#define COLS_COUNT		8
+
+/*
+ *  TYPE_NAME of an identity column, "int identity" or "serial" and such
+ */
+static int
+_cat_identity_type (const char *type)
+{
+  const char *cp;
+
+  for (cp = type; *cp; cp++)
+    {
+      if (!strncasecmp (cp, "identity", 8) || !strncasecmp (cp, "serial", 6)
+	  || !strncasecmp (cp, "auto_increment", 14))
+	return 1;
+    }
+
+  return 0;
+}
+
+
+static int
+_cat_fetch_fields (MYSQL *mysql, SQLHSTMT hStmt, TCatEntry *entry)
+{
+  static SQLUSMALLINT cols[COLS_COUNT] = { 3, 4, 5, 7, 9, 11, 13, 6 };
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLCHAR value[COLS_COUNT][257];
+  SQLLEN ind[COLS_COUNT];
+  unsigned int nAlloc = 0;
+  MYSQL_FIELD *f;
+  SQLRETURN ret;
+  int i;
+
+  for (i = 0; i < COLS_COUNT; i++)
+    {
+      ret = SQLBindCol (hStmt, cols[i], SQL_C_CHAR, value[i],
+	  sizeof (value[i]), &ind[i]);
+      if (_trap_sqlerror (mysql, ret, "SQLBindCol"))
+	return -1;
+    }
+
+  for (;;)
+    {
+      ret = SQLFetch (hStmt);
+      if (_trap_sqlerror (mysql, ret, "SQLFetch"))
+	return -1;
+      if (ret == SQL_NO_DATA_FOUND)
+	break;
+      for (i = 0; i < COLS_COUNT; i++)
+	{
+	  if (ind[i] == SQL_NULL_DATA)
+	    value[i][0] = 0;
+	}
+
+      if (entry->nItems == nAlloc)
+	{
+	  nAlloc = nAlloc ? 2 * nAlloc : 16;
+	  f = (MYSQL_FIELD *) realloc (entry->fields,
+	      nAlloc * sizeof (MYSQL_FIELD));
+	  if (f == NULL)
+	    goto nomem;
+	  entry->fields = f;
+	}
+      f = &entry->fields[entry->nItems++];
+      memset (f, 0, sizeof (MYSQL_FIELD));
+
+      f->name = _cs_dup (pDB, 1, (char *) value[COLS_COLUMN_NAME], NULL);
+      f->table = _cs_dup (pDB, 1, (char *) value[COLS_TABLE_NAME], NULL);
+      if (ind[COLS_COLUMN_DEF] != SQL_NULL_DATA)
+	f->def = _cs_dup (pDB, 1, (char *) value[COLS_COLUMN_DEF], NULL);
+      if (f->name == NULL || f->table == NULL
+	  || (ind[COLS_COLUMN_DEF] != SQL_NULL_DATA && f->def == NULL))
+	goto nomem;
+
+      f->type = _field_type ((SQLSMALLINT) atoi ((char *) value[COLS_DATA_TYPE]));
+      f->length = (unsigned int) atol ((char *) value[COLS_COLUMN_SIZE]);
+      f->decimals = (unsigned int) atoi ((char *) value[COLS_DECIMAL_DIGITS]);
+      if (ind[COLS_NULLABLE] != SQL_NULL_DATA
+	  && atoi ((char *) value[COLS_NULLABLE]) == SQL_NO_NULLS)
+	f->flags |= NOT_NULL_FLAG;
+      if (IS_NUM (f->type))
+	f->flags |= NUM_FLAG;
+      if (f->type == FIELD_TYPE_BLOB)
+	f->flags |= BLOB_FLAG;
+
+      /* A serial column takes its default from a sequence */
+      if ((f->def && !strncasecmp (f->def, "nextval(", 8))
+	  || _cat_identity_type ((char *) value[COLS_TYPE_NAME]))
+	f->flags |= AUTO_INCREMENT_FLAG;
+    }
+
+  return 0;
+
+nomem:
+  _set_error (mysql, CR_OUT_OF_MEMORY);
+  return -1;
+}
+
+
+/*
+ *  Find a cached list, or read it from the driver. Lists that are not
+ *  to be cached come back with *pbOwned set.
+ */
+static TCatEntry *
+_cat_get (MYSQL *mysql, int kind, const char *table, int *pbOwned)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TCatEntry *entry, **pp;
+  SQLHSTMT hStmt;
+  SQLRETURN ret;
+  const char *db;
+  char *name;
+  time_t now;
+  int rc;
+
+  /* Tables and columns are those of the current database */
+  db = (kind != CAT_DBS && mysql->db) ? mysql->db : "";
+  now = time (NULL);
+  for (pp = &pDB->pCatalog; (entry = *pp) != NULL; )
+    {
+      if (entry->kind != CAT_IDENTITY && entry->expires <= now)
+	{
+	  *pp = entry->pNext;
+	  _cat_free_entry (entry);
+	  continue;
+	}
+      if (entry->kind == kind && !strcmp (entry->pDb, db)
+	  && (kind != CAT_FIELDS || !strcmp (entry->pTable, table)))
+	{
+	  *pbOwned = 0;
+	  return entry;
+	}
+      pp = &entry->pNext;
+    }
+
+  if (_make_room (mysql) || (hStmt = _stmt_acquire (mysql)) == SQL_NULL_HSTMT)
+    return NULL;
+
+  entry = (TCatEntry *) calloc (1, sizeof (TCatEntry));
+  if (entry == NULL || (entry->pDb = strdup (db)) == NULL
+      || (table && (entry->pTable = strdup (table)) == NULL))
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      rc = -1;
+      goto done;
+    }
+  entry->kind = kind;
+
+  pDB->hDiagStmt = hStmt;
+  switch (kind)
+    {
+    case CAT_DBS:
+      ret = SQLTables (hStmt, (SQLCHAR *) SQL_ALL_CATALOGS, SQL_NTS,
+	  (SQLCHAR *) "", 0, (SQLCHAR *) "", 0, NULL, 0);
+      break;
+
+    case CAT_TABLES:
+      ret = SQLTables (hStmt, NULL, 0, NULL, 0, (SQLCHAR *) "%", SQL_NTS,
+	  (SQLCHAR *) "TABLE,VIEW", SQL_NTS);
+      break;
+
+    default:
+      if ((name = _cs_dup (pDB, 0, table, NULL)) == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  rc = -1;
+	  goto done;
+	}
+      ret = SQLColumns (hStmt, NULL, 0, NULL, 0, (SQLCHAR *) name, SQL_NTS,
+	  (SQLCHAR *) "%", SQL_NTS);
+      free (name);
+      break;
+    }
+  rc = _trap_sqlerror (mysql, ret, kind == CAT_FIELDS ? "SQLColumns" : "SQLTables");
+  if (rc == 0)
+    {
+      if (kind == CAT_FIELDS)
+	rc = _cat_fetch_fields (mysql, hStmt, entry);
+      else
+	rc = _cat_fetch_names (mysql, hStmt, entry, kind == CAT_DBS ? 1 : 3);
+    }
+  pDB->hDiagStmt = SQL_NULL_HSTMT;
+
+done:
+  _stmt_release (pDB, hStmt);
+  if (rc)
+    {
+      if (entry)
+	_cat_free_entry (entry);
+      return NULL;
+    }
+
+  if (pDB->nCatalogTtl)
+    {
+      entry->expires = now + pDB->nCatalogTtl;
+      entry->pNext = pDB->pCatalog;
+      pDB->pCatalog = entry;
+      *pbOwned = 0;
+    }
+  else
+    *pbOwned = 1;
+
+  return entry;
+}
+
+
+static MYSQL_RES *
+_impl_list (MYSQL *mysql, int kind, const char *table, const char *wild)
+{
+  TCatEntry *entry;
+  MYSQL_RES *res = NULL;
+  MYSQL_ROWS *rp = NULL;
+  MYSQL_FIELD *f;
+  unsigned int i, n;
+  char title[NAME_LEN + 11];
+  int bOwned;
+
+  if (_db (mysql) == NULL)
+    return NULL;
+  if (kind == CAT_FIELDS && (table == NULL || *table == 0))
+    return NULL;
+  if (wild && *wild == 0)
+    wild = NULL;
+
+  if ((entry = _cat_get (mysql, kind, table, &bOwned)) == NULL)
+    return NULL;
+
+  if (kind == CAT_FIELDS)
+    {
+      /* The columns are described, there are no rows */
+      for (n = 0, i = 0; i < entry->nItems; i++)
+	{
+	  if (!wild || _wild_match (entry->fields[i].name, wild))
+	    n++;
+	}
+      if ((f = _alloc_fields (mysql, n)) == NULL)
+	goto done;
+      for (i = 0; i < entry->nItems; i++)
+	{
+	  if (wild && !_wild_match (entry->fields[i].name, wild))
+	    continue;
+	  *f = entry->fields[i];
+	  f->name = safe_dup (entry->fields[i].name);
+	  f->table = safe_dup (entry->fields[i].table);
+	  f->def = safe_dup (entry->fields[i].def);
+	  if (!f->name || !f->table || (entry->fields[i].def && !f->def))
+	    {
+	      _set_error (mysql, CR_OUT_OF_MEMORY);
+	      goto done;
+	    }
+	  f++;
+	}
+    }
+  else
+    {
+      if ((f = _alloc_fields (mysql, 1)) == NULL)
+	goto done;
+      if (kind == CAT_DBS)
+	strcpy (title, "Database");
+      else
+	snprintf (title, sizeof (title), "Tables_in_%s",
+	    mysql->db ? mysql->db : "");
+      f->type = FIELD_TYPE_VAR_STRING;
+      f->length = NAME_LEN;
+      if ((f->name = strdup (title)) == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  goto done;
+	}
+    }
+
+  if ((res = _alloc_res (mysql, 0)) == NULL)
+    goto done;
+  res->data = (MYSQL_DATA *) calloc (1, sizeof (MYSQL_DATA));
+  if (res->data == NULL)
+    goto nomem;
+  res->data->fields = res->field_count;
+
+  for (i = 0; kind != CAT_FIELDS && i < entry->nItems; i++)
+    {
+      if (wild && !_wild_match (entry->ppNames[i], wild))
+	continue;
+      if (_append_row (res->data, &rp) == -1
+	  || (rp->data[0] = strdup (entry->ppNames[i])) == NULL)
+	goto nomem;
+    }
+  res->data_cursor = res->data->data;
+
+done:
+  if (bOwned)
+    _cat_free_entry (entry);
+
+  return res;
+
+nomem:
+  _set_error (mysql, CR_OUT_OF_MEMORY);
+  _free_res (res);
+  res = NULL;
+  goto done;
+}
+
+
+/*
+ *  LOAD DATA LOCAL INFILE
+ *
+ *  The statement never reaches the driver. The file is mapped, cut into
+ *  rows according to the FIELDS and LINES clauses and sent as an INSERT
+ *  with array bound parameters, LOAD_BATCH_ROWS rows per SQLExecute.
+ *  With load-threads above one the file is split at line ends and the
+ *  parts are loaded over connections of their own. Like the MySQL
+ *  server does for LOCAL, rows the database refuses are skipped rather
+ *  than ending the load.
+ */
+static char *
+_ld_unquote (TSQLToken *tok, size_t *pLen)
+{
+  const char *cp = tok->start + 1;
+  const char *end = tok->start + tok->len - 1;
+  char *buf, *dp;
+
+  if ((buf = dp = (char *) malloc (tok->len)) == NULL)
+    return NULL;
+
+  while (cp < end)
+    {
+      if (*cp == '\\' && cp + 1 < end)
+	{
+	  switch (*++cp)
+	    {
+	    case '0': *dp++ = 0; break;
+	    case 'b': *dp++ = '\b'; break;
+	    case 'n': *dp++ = '\n'; break;
+	    case 'r': *dp++ = '\r'; break;
+	    case 't': *dp++ = '\t'; break;
+	    case 'Z': *dp++ = 26; break;
+	    default: *dp++ = *cp; break;
+	    }
+	  cp++;
+	}
+      else if (*cp == *tok->start && cp + 1 < end && cp[1] == *cp)
+	{
+	  *dp++ = *cp;
+	  cp += 2;
+	}
+      else
+	*dp++ = *cp++;
+    }
+  *dp = 0;
+  *pLen = dp - buf;
+
+  return buf;
+}
+
+
+static void
+_ld_free_spec (TLoadSpec *spec)
+{
+  safe_free (spec->pFile);
+  safe_free (spec->pTable);
+  safe_free (spec->pColumns);
+  safe_free (spec->pFieldTerm);
+  safe_free (spec->pLineTerm);
+  safe_free (spec->pLineStart);
+  safe_free (spec->aMap);
+}
+
+
+/*
+ *  A quoted option of the FIELDS and LINES clauses
+ */
+static const char *
+_ld_string (const char *cp, const char *end, char **pp, size_t *pLen,
+    int *pErr)
+{
+  TSQLToken tok;
+
+  cp = _sql_token (cp, end, &tok);
+  if (!_tok_is (&tok, "BY"))
+    {
+      *pErr = ER_PARSE_ERROR;
+      return cp;
+    }
+  cp = _sql_token (cp, end, &tok);
+  if (tok.type != TK_STRING)
+    {
+      *pErr = ER_PARSE_ERROR;
+      return cp;
+    }
+  safe_free (*pp);
+  if ((*pp = _ld_unquote (&tok, pLen)) == NULL)
+    *pErr = CR_OUT_OF_MEMORY;
+
+  return cp;
+}
+
+
+/*
+ *  Parse a LOAD DATA statement. Returns 0 if it is LOAD DATA LOCAL, 1 if
+ *  it is something else, or an error code.
+ */
+static int
+_ld_parse (MYSQL *mysql, const char *query, size_t len, TLoadSpec *spec)
+{
+  const char *cp = query;
+  const char *end = query + len;
+  const char *tstart;
+  TSQLToken tok, next;
+  char *value = NULL;
+  size_t vlen, nCols = 0;
+  int err = 0;
+  int cs;
+
+  memset (spec, 0, sizeof (TLoadSpec));
+  spec->enclose = spec->escape = -1;
+  spec->cs = DBOF(mysql)->csClient;
+
+  cp = _sql_token (cp, end, &tok);
+  if (!_tok_is (&tok, "LOAD"))
+    return 1;
+  cp = _sql_token (cp, end, &tok);
+  if (!_tok_is (&tok, "DATA"))
+    return 1;
+  cp = _sql_token (cp, end, &tok);
+  if (_tok_is (&tok, "LOW_PRIORITY") || _tok_is (&tok, "CONCURRENT"))
+    cp = _sql_token (cp, end, &tok);
+  if (!_tok_is (&tok, "LOCAL"))
+    return 1;
+
+  cp = _sql_token (cp, end, &tok);
+  if (!_tok_is (&tok, "INFILE"))
+    return ER_PARSE_ERROR;
+  cp = _sql_token (cp, end, &tok);
+  if (tok.type != TK_STRING)
+    return ER_PARSE_ERROR;
+  if ((spec->pFile = _ld_unquote (&tok, &vlen)) == NULL)
+    return CR_OUT_OF_MEMORY;
+
+  /* The server cannot stop a LOCAL file half way, so without REPLACE
+   * duplicates are skipped as with IGNORE
+   */
+  cp = _sql_token (cp, end, &tok);
+  if (_tok_is (&tok, "REPLACE") || _tok_is (&tok, "IGNORE"))
+    {
+      spec->bReplace = _tok_is (&tok, "REPLACE");
+      cp = _sql_token (cp, end, &tok);
+    }
+  spec->bIgnore = !spec->bReplace;
+  if (!_tok_is (&tok, "INTO"))
+    return ER_PARSE_ERROR;
+  cp = _sql_token (cp, end, &tok);
+  if (!_tok_is (&tok, "TABLE"))
+    return ER_PARSE_ERROR;
+
+  /* db.table, kept as written; tBare is the table for the catalog */
+  cp = _sql_token (cp, end, &tok);
+  if (tok.type != TK_WORD && tok.type != TK_QUOTED)
+    return ER_PARSE_ERROR;
+  tstart = tok.start;
+  for (;;)
+    {
+      spec->tBare = tok;
+      _sql_token (cp, end, &next);
+      if (next.type != TK_PUNCT || *next.start != '.')
+	break;
+      cp = _sql_token (_sql_token (cp, end, &next), end, &tok);
+      if (tok.type != TK_WORD && tok.type != TK_QUOTED)
+	return ER_PARSE_ERROR;
+    }
+  vlen = tok.start + tok.len - tstart;
+  if ((spec->pTable = (char *) malloc (vlen + 1)) == NULL)
+    return CR_OUT_OF_MEMORY;
+  memcpy (spec->pTable, tstart, vlen);
+  spec->pTable[vlen] = 0;
+
+  cp = _sql_token (cp, end, &tok);
+  if (_tok_is (&tok, "CHARACTER") || _tok_is (&tok, "CHARSET"))
+    {
+      if (_tok_is (&tok, "CHARACTER"))
+	cp = _sql_token (cp, end, &tok);
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type != TK_WORD && tok.type != TK_STRING)
+	return ER_PARSE_ERROR;
+      if ((value = (char *) malloc (tok.len + 1)) == NULL)
+	return CR_OUT_OF_MEMORY;
+      memcpy (value, tok.start, tok.len);
+      value[tok.len] = 0;
+      if (tok.type == TK_STRING)
+	{
+	  memmove (value, value + 1, tok.len - 2);
+	  value[tok.len - 2] = 0;
+	}
+      cs = _cs_lookup (value);
+      free (value);
+      value = NULL;
+      if (cs < 0)
+	return CR_CANT_READ_CHARSET;
+      spec->cs = _charsets[cs].cs;
+      cp = _sql_token (cp, end, &tok);
+    }
+
+  if ((spec->pFieldTerm = strdup ("\t")) == NULL
+      || (spec->pLineTerm = strdup ("\n")) == NULL)
+    return CR_OUT_OF_MEMORY;
+  spec->nFieldTerm = spec->nLineTerm = 1;
+  spec->escape = '\\';
+
+  if (_tok_is (&tok, "FIELDS") || _tok_is (&tok, "COLUMNS"))
+    {
+      for (cp = _sql_token (cp, end, &tok); err == 0; )
+	{
+	  if (_tok_is (&tok, "TERMINATED"))
+	    cp = _ld_string (cp, end, &spec->pFieldTerm, &spec->nFieldTerm,
+		&err);
+	  else if (_tok_is (&tok, "OPTIONALLY") || _tok_is (&tok, "ENCLOSED")
+	      || _tok_is (&tok, "ESCAPED"))
+	    {
+	      int *pc = _tok_is (&tok, "ESCAPED") ? &spec->escape
+		  : &spec->enclose;
+
+	      if (_tok_is (&tok, "OPTIONALLY"))
+		cp = _sql_token (cp, end, &tok);
+	      cp = _ld_string (cp, end, &value, &vlen, &err);
+	      if (err == 0 && vlen > 1)
+		err = ER_PARSE_ERROR;
+	      else if (err == 0)
+		*pc = vlen ? (unsigned char) *value : -1;
+	    }
+	  else
+	    break;
+	  cp = _sql_token (cp, end, &tok);
+	}
+    }
+  if (err == 0 && _tok_is (&tok, "LINES"))
+    {
+      for (cp = _sql_token (cp, end, &tok); err == 0; )
+	{
+	  if (_tok_is (&tok, "TERMINATED"))
+	    cp = _ld_string (cp, end, &spec->pLineTerm, &spec->nLineTerm,
+		&err);
+	  else if (_tok_is (&tok, "STARTING"))
+	    cp = _ld_string (cp, end, &spec->pLineStart, &spec->nLineStart,
+		&err);
+	  else
+	    break;
+	  cp = _sql_token (cp, end, &tok);
+	}
+    }
+  safe_free (value);
+  if (err)
+    return err;
+
+  /* Fixed width rows are not emulated */
+  if (spec->nFieldTerm == 0 || spec->nLineTerm == 0)
+    return ER_NOT_SUPPORTED_YET;
+
+  if (_tok_is (&tok, "IGNORE"))
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type != TK_NUMBER)
+	return ER_PARSE_ERROR;
+      spec->nIgnore = strtoul (tok.start, NULL, 10);
+      cp = _sql_token (cp, end, &tok);
+      if (!_tok_is (&tok, "LINES") && !_tok_is (&tok, "ROWS"))
+	return ER_PARSE_ERROR;
+      cp = _sql_token (cp, end, &tok);
+    }
+
+  /* (col, @var, ...): fields read into a variable are dropped */
+  if (tok.type == TK_PUNCT && *tok.start == '(')
+    {
+      if ((spec->pColumns = (char *) malloc (2 * (end - cp) + 3)) == NULL)
+	return CR_OUT_OF_MEMORY;
+      strcpy (spec->pColumns, "(");
+      for (;;)
+	{
+	  int bVar = 0;
+
+	  cp = _sql_token (cp, end, &tok);
+	  if (tok.type == TK_PUNCT && *tok.start == '@')
+	    {
+	      bVar = 1;
+	      cp = _sql_token (cp, end, &tok);
+	    }
+	  if (tok.type != TK_WORD && tok.type != TK_QUOTED)
+	    return ER_PARSE_ERROR;
+	  if ((spec->nMap & 15) == 0)
+	    {
+	      int *aMap = (int *) realloc (spec->aMap,
+		  (spec->nMap + 16) * sizeof (int));
+	      if (aMap == NULL)
+		return CR_OUT_OF_MEMORY;
+	      spec->aMap = aMap;
+	    }
+	  spec->aMap[spec->nMap++] = bVar ? -1 : (int) nCols;
+	  if (!bVar)
+	    {
+	      if (nCols++)
+		strcat (spec->pColumns, ", ");
+	      strncat (spec->pColumns, tok.start, tok.len);
+	    }
+
+	  cp = _sql_token (cp, end, &tok);
+	  if (tok.type == TK_PUNCT && *tok.start == ')')
+	    break;
+	  if (tok.type != TK_PUNCT || *tok.start != ',')
+	    return ER_PARSE_ERROR;
+	}
+      strcat (spec->pColumns, ")");
+      if (nCols == 0)
+	return ER_PARSE_ERROR;
+      spec->nParams = (unsigned int) nCols;
+      cp = _sql_token (cp, end, &tok);
+    }
+
+  /* SET col = expr needs the server */
+  if (_tok_is (&tok, "SET"))
+    return ER_NOT_SUPPORTED_YET;
+  if (tok.type == TK_PUNCT && *tok.start == ';')
+    cp = _sql_token (cp, end, &tok);
+  if (tok.type != TK_END)
+    return ER_PARSE_ERROR;
+
+  /* Bytes the scanner stops at */
+  spec->aStop[0] = spec->pFieldTerm[0];
+  spec->aStop[1] = spec->pLineTerm[0];
+  spec->aStop[2] = spec->escape >= 0 ? (char) spec->escape : spec->aStop[0];
+  spec->aStop[3] = spec->enclose >= 0 ? (char) spec->enclose : spec->aStop[0];
+
+  return 0;
+}
+
+
+/*
+ *  Next byte that may end or change the meaning of a field
+ */
+static const char *
+_ld_scan (const TLoadSpec *spec, const char *cp, const char *end)
+{
+  const char *stop = spec->aStop;
+#ifdef HAVE_SSE2
+  __m128i c0 = _mm_set1_epi8 (stop[0]);
+  __m128i c1 = _mm_set1_epi8 (stop[1]);
+  __m128i c2 = _mm_set1_epi8 (stop[2]);
+  __m128i c3 = _mm_set1_epi8 (stop[3]);
+  __m128i v;
+  int mask;
+
+  for (; cp + 16 <= end; cp += 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) cp);
+      mask = _mm_movemask_epi8 (_mm_or_si128 (
+	  _mm_or_si128 (_mm_cmpeq_epi8 (v, c0), _mm_cmpeq_epi8 (v, c1)),
+	  _mm_or_si128 (_mm_cmpeq_epi8 (v, c2), _mm_cmpeq_epi8 (v, c3))));
+      if (mask)
+	return cp + CTZ (mask);
+    }
+#endif
+
+  for (; cp < end; cp++)
+    {
+      if (*cp == stop[0] || *cp == stop[1] || *cp == stop[2]
+	  || *cp == stop[3])
+	break;
+    }
+
+  return cp;
+}
+
+
+static int
+_ld_room (TLoadPart *part, size_t len)
+{
+  char *p;
+  size_t n;
+
+  if (part->nUsed + len <= part->nArena)
+    return 0;
+  for (n = part->nArena ? part->nArena : 65536; n < part->nUsed + len; )
+    n *= 2;
+  if ((p = (char *) realloc (part->pArena, n)) == NULL)
+    return -1;
+  part->pArena = p;
+  part->nArena = n;
+
+  return 0;
+}
+
+
+/*
+ *  Decode the next row into the arena. Returns 1 for a row, 0 at the
+ *  end of the part, -1 when out of memory.
+ */
+static int
+_ld_row (TLoadPart *part, TLoadField *row)
+{
+  const TLoadSpec *spec = part->pSpec;
+  const char *cp = part->pCur;
+  const char *end = part->pEnd;
+  const char *p;
+  unsigned int k, j, nFields = spec->nMap ? spec->nMap : spec->nParams;
+  size_t start;
+  int bQuoted, bNull, bEol = 0;
+  char c;
+
+  /* Rows must begin with LINES STARTING BY, text before it is skipped */
+  if (spec->nLineStart)
+    {
+      for (p = cp; p + spec->nLineStart <= end; p++)
+	{
+	  if (!memcmp (p, spec->pLineStart, spec->nLineStart))
+	    break;
+	}
+      if (p + spec->nLineStart > end)
+	{
+	  part->pCur = end;
+	  return 0;
+	}
+      cp = p + spec->nLineStart;
+    }
+  else if (cp >= end)
+    return 0;
+
+  for (j = 0; j < spec->nParams; j++)
+    row[j].len = SQL_NULL_DATA;
+
+  for (k = 0; !bEol; k++)
+    {
+      start = part->nUsed;
+      bQuoted = bNull = 0;
+      if (spec->enclose >= 0 && cp < end
+	  && (unsigned char) *cp == spec->enclose)
+	{
+	  bQuoted = 1;
+	  cp++;
+	}
+
+      for (;;)
+	{
+	  p = _ld_scan (spec, cp, end);
+	  if (_ld_room (part, (p - cp) + 1))
+	    return -1;
+	  memcpy (part->pArena + part->nUsed, cp, p - cp);
+	  part->nUsed += p - cp;
+	  if ((cp = p) >= end)
+	    {
+	      bEol = 1;
+	      break;
+	    }
+
+	  c = *cp;
+	  if ((unsigned char) c == spec->escape && cp + 1 < end)
+	    {
+	      /* \N alone is NULL */
+	      if (cp[1] == 'N' && part->nUsed == start && !bQuoted)
+		bNull = 1;
+	      switch (cp[1])
+		{
+		case '0': c = 0; break;
+		case 'b': c = '\b'; break;
+		case 'n': c = '\n'; break;
+		case 'r': c = '\r'; break;
+		case 't': c = '\t'; break;
+		case 'Z': c = 26; break;
+		default: c = cp[1]; break;
+		}
+	      part->pArena[part->nUsed++] = c;
+	      cp += 2;
+	      continue;
+	    }
+	  if (bQuoted && (unsigned char) c == spec->enclose)
+	    {
+	      cp++;
+	      if (cp < end && (unsigned char) *cp == spec->enclose)
+		part->pArena[part->nUsed++] = *cp++;
+	      else
+		bQuoted = 0;
+	      continue;
+	    }
+	  if (!bQuoted && (size_t) (end - cp) >= spec->nLineTerm
+	      && !memcmp (cp, spec->pLineTerm, spec->nLineTerm))
+	    {
+	      cp += spec->nLineTerm;
+	      bEol = 1;
+	      break;
+	    }
+	  if (!bQuoted && (size_t) (end - cp) >= spec->nFieldTerm
+	      && !memcmp (cp, spec->pFieldTerm, spec->nFieldTerm))
+	    {
+	      cp += spec->nFieldTerm;
+	      break;
+	    }
+	  part->pArena[part->nUsed++] = *cp++;
+	}
+
+      /* With ENCLOSED BY, an unquoted NULL is NULL as well */
+      if (bNull && part->nUsed != start + 1)
+	bNull = 0;
+      if (spec->enclose >= 0 && part->nUsed == start + 4
+	  && !memcmp (part->pArena + start, "NULL", 4))
+	bNull = 1;
+
+      j = (k >= nFields) ? (unsigned int) -1
+	  : spec->nMap ? (unsigned int) spec->aMap[k] : k;
+      if (k >= nFields)
+	part->warnings++;
+      if (j == (unsigned int) -1 || bNull)
+	part->nUsed = start;
+      else
+	{
+	  row[j].off = start;
+	  row[j].len = (SQLLEN) (part->nUsed - start);
+	}
+    }
+
+  if (k < nFields)
+    part->warnings++;
+  part->pCur = cp;
+
+  return 1;
+}
+
+
+/*
+ *  Whether the failure of a batch only means skipped rows: LOCAL goes
+ *  on after duplicates, as IGNORE or REPLACE, never after other errors
+ */
+static int
+_ld_skippable (SQLHSTMT hStmt)
+{
+  SQLCHAR state[6];
+  SQLINTEGER native;
+  SQLSMALLINT len, i;
+  SQLRETURN ret;
+
+  for (i = 1; ; i++)
+    {
+      ret = SQLGetDiagRec (SQL_HANDLE_STMT, hStmt, i, state, &native,
+	  NULL, 0, &len);
+      if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+	break;
+      /* Constraint violations for the row, warnings for the others */
+      if (strncmp ((char *) state, "23", 2) && strncmp ((char *) state, "01", 2))
+	return 0;
+    }
+
+  return i > 1;
+}
+
+
+/*
+ *  Bytes a value takes in its parameter array, with the terminator
+ */
+static SQLLEN
+_ld_width (const TLoadPart *part, SQLLEN len)
+{
+  SQLLEN width = (len == SQL_NULL_DATA) ? 1 : len + 1;
+
+  /* Latin-1 becomes up to two bytes each */
+  if (part->pSpec->cs == CS_LATIN1
+      && part->pSpec->cs != DBOF(part->mysql)->csOdbc)
+    width *= 2;
+
+  return width;
+}
+
+
+/*
+ *  Bind the parameter arrays from row i of the batch on
+ */
+static int
+_ld_bind (TLoadPart *part, SQLHSTMT hStmt, SQLULEN i)
+{
+  SQLLEN width;
+  unsigned int j;
+  SQLRETURN ret;
+
+  for (j = 0; j < part->pSpec->nParams; j++)
+    {
+      width = part->pWidth[j];
+      ret = SQLBindParameter (hStmt, (SQLUSMALLINT) (j + 1), SQL_PARAM_INPUT,
+	  SQL_C_CHAR, SQL_VARCHAR, width > 1 ? width - 1 : 1, 0,
+	  part->ppCol[j] + i * width, width,
+	  part->pInd + j * LOAD_BATCH_ROWS + i);
+      if (_trap_sqlerror (part->mysql, ret, "SQLBindParameter"))
+	return -1;
+    }
+
+  return 0;
+}
+
+
+/*
+ *  A failed batch again, one row and one savepoint at a time
+ */
+static int
+_ld_rows (TLoadPart *part, SQLHSTMT hStmt, SQLULEN nRows)
+{
+  MYSQL *mysql = part->mysql;
+  SQLRETURN ret;
+  SQLULEN i;
+
+  if (part->bArray)
+    SQLSetStmtAttr (hStmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER) 1, 0);
+  for (i = 0; i < nRows; i++)
+    {
+      if (_ld_bind (part, hStmt, i))
+	return -1;
+      if (_group_exec (mysql, "SAVEPOINT " LOAD_SAVEPOINT))
+	{
+	  _set_error (mysql, ER_ERROR_DURING_ROLLBACK);
+	  return -1;
+	}
+      ret = SQLExecute (hStmt);
+      if (ret == SQL_ERROR && !_ld_skippable (hStmt))
+	{
+	  _trap_sqlerror (mysql, SQL_ERROR, "SQLExecute");
+	  SQLFreeStmt (hStmt, SQL_CLOSE);
+	  return -1;
+	}
+      SQLFreeStmt (hStmt, SQL_CLOSE);
+      if (ret == SQL_SUCCESS_WITH_INFO)
+	part->warnings++;
+      if (_group_exec (mysql, ret == SQL_ERROR
+	      ? "ROLLBACK TO SAVEPOINT " LOAD_SAVEPOINT
+	      : "RELEASE SAVEPOINT " LOAD_SAVEPOINT))
+	{
+	  _set_error (mysql, ER_ERROR_DURING_ROLLBACK);
+	  return -1;
+	}
+      if (ret == SQL_ERROR)
+	part->skipped++;
+    }
+  part->records += nRows;
+
+  return 0;
+}
+
+
+/*
+ *  Send the rows collected so far. Some data sources (PostgreSQL) give
+ *  up on the whole transaction after a failed row, so each batch goes
+ *  after a savepoint; a batch with skipped rows is rolled back to it and
+ *  sent again by _ld_rows. Where savepoints fail the rows of a failed
+ *  batch are counted as the driver reports them.
+ */
+static int
+_ld_flush (TLoadPart *part, SQLHSTMT hStmt, SQLULEN nRows)
+{
+  const TLoadSpec *spec = part->pSpec;
+  MYSQL *mysql = part->mysql;
+  TSQLPrivate *pDB = DBOF(mysql);
+  TLoadField *f;
+  SQLULEN i, nDone = 0;
+  SQLLEN width, *ind;
+  unsigned int j;
+  SQLRETURN ret;
+  char *buf;
+  int bConv = (spec->cs != pDB->csOdbc);
+  int bFailed, bSaved;
+
+  /* pWidth is the widest value of the batch, see _ld_load */
+  for (j = 0; j < spec->nParams; j++)
+    {
+      width = part->pWidth[j];
+      buf = (char *) realloc (part->ppCol[j], nRows * width);
+      if (buf == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return -1;
+	}
+      part->ppCol[j] = buf;
+      ind = part->pInd + j * LOAD_BATCH_ROWS;
+      for (i = 0; i < nRows; i++, buf += width)
+	{
+	  f = &part->pRows[i * spec->nParams + j];
+	  if ((ind[i] = f->len) == SQL_NULL_DATA)
+	    continue;
+	  if (bConv)
+	    ind[i] = (SQLLEN) _cs_convert (spec->cs, part->pArena + f->off,
+		(size_t) f->len, buf);
+	  else
+	    memcpy (buf, part->pArena + f->off, f->len);
+	}
+    }
+  if (_ld_bind (part, hStmt, 0))
+    return -1;
+
+  for (i = 0; i < nRows; i++)
+    part->aStatus[i] = SQL_PARAM_UNUSED;
+  if (part->bArray)
+    SQLSetStmtAttr (hStmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER) nRows, 0);
+
+  bSaved = !part->bNoSavepoint
+      && _group_exec (mysql, "SAVEPOINT " LOAD_SAVEPOINT) == 0;
+  part->bNoSavepoint = !bSaved;
+
+  /* Rows of an array that failed come with SQL_SUCCESS_WITH_INFO */
+  ret = SQLExecute (hStmt);
+  for (i = 0, bFailed = (ret == SQL_ERROR); i < nRows && !bFailed
+      && ret == SQL_SUCCESS_WITH_INFO; i++)
+    bFailed = (part->aStatus[i] == SQL_PARAM_ERROR);
+  if (bFailed && !_ld_skippable (hStmt))
+    {
+      _trap_sqlerror (mysql, SQL_ERROR, "SQLExecute");
+      SQLFreeStmt (hStmt, SQL_CLOSE);
+      return -1;
+    }
+  else if (ret == SQL_SUCCESS_WITH_INFO)
+    part->warnings++;
+  SQLFreeStmt (hStmt, SQL_CLOSE);
+
+  if (bSaved)
+    {
+      if (_group_exec (mysql, bFailed ? "ROLLBACK TO SAVEPOINT " LOAD_SAVEPOINT
+	      : "RELEASE SAVEPOINT " LOAD_SAVEPOINT))
+	{
+	  _set_error (mysql, ER_ERROR_DURING_ROLLBACK);
+	  return -1;
+	}
+      if (bFailed)
+	return _ld_rows (part, hStmt, nRows);
+    }
+
+  /* Without a status array from the driver the outcome is all or none */
+  for (i = 0; i < nRows; i++)
+    {
+      switch (part->aStatus[i])
+	{
+	case SQL_PARAM_SUCCESS:
+	case SQL_PARAM_SUCCESS_WITH_INFO:
+	  nDone++;
+	  break;
+	case SQL_PARAM_UNUSED:
+	  if (ret != SQL_ERROR)
+	    nDone++;
+	  break;
+	}
+    }
+  part->records += nRows;
+  part->skipped += nRows - nDone;
+
+  return 0;
+}
+
+
+/*
+ *  Load one part of the file over the connection of part->mysql
+ */
+static int
+_ld_load (TLoadPart *part)
+{
+  const TLoadSpec *spec = part->pSpec;
+  MYSQL *mysql = part->mysql;
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLHSTMT hStmt;
+  SQLRETURN ret;
+  SQLULEN nRows = 0;
+  my_ulonglong warnings;
+  TLoadField *row;
+  const char *cp;
+  SQLLEN width;
+  unsigned int j;
+  char *sql, *xl;
+  size_t n, bytes;
+  int rc = 0;
+
+  n = strlen (spec->pTable) + (spec->pColumns ? strlen (spec->pColumns) : 0)
+      + 3 * spec->nParams + 32;
+  part->pRows = (TLoadField *) calloc (LOAD_BATCH_ROWS * spec->nParams,
+      sizeof (TLoadField));
+  part->pInd = (SQLLEN *) calloc (LOAD_BATCH_ROWS * spec->nParams,
+      sizeof (SQLLEN));
+  part->ppCol = (char **) calloc (spec->nParams, sizeof (char *));
+  part->pWidth = (SQLLEN *) calloc (spec->nParams, sizeof (SQLLEN));
+  if ((sql = (char *) malloc (n)) == NULL || part->pRows == NULL
+      || part->pInd == NULL || part->ppCol == NULL || part->pWidth == NULL)
+    {
+      safe_free (sql);
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return -1;
+    }
+
+  n = sprintf (sql, "%s INTO %s %s VALUES (", spec->bReplace
+      ? "REPLACE" : "INSERT", spec->pTable,
+      spec->pColumns ? spec->pColumns : "");
+  for (j = 0; j < spec->nParams; j++)
+    n += sprintf (sql + n, j ? ", ?" : "?");
+  strcpy (sql + n, ")");
+
+  /* Quoted names as the data source wants them */
+  xl = NULL;
+  if (pDB->pDialect && _xl_rewrite (pDB->pDialect, sql, n + 1, &xl, &n))
+    {
+      free (sql);
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return -1;
+    }
+  if (xl)
+    {
+      free (sql);
+      sql = xl;
+    }
+
+  if ((hStmt = _stmt_acquire (mysql)) == SQL_NULL_HSTMT)
+    {
+      free (sql);
+      return -1;
+    }
+  pDB->hDiagStmt = hStmt;
+  ret = SQLPrepare (hStmt, (SQLCHAR *) sql, SQL_NTS);
+  free (sql);
+  if (_trap_sqlerror (mysql, ret, "SQLPrepare"))
+    rc = -1;
+
+  /* Drivers without parameter arrays get one row per SQLExecute */
+  part->bArray = (rc == 0 && SQLSetStmtAttr (hStmt, SQL_ATTR_PARAMSET_SIZE,
+	  (SQLPOINTER) LOAD_BATCH_ROWS, 0) == SQL_SUCCESS);
+  if (part->bArray)
+    {
+      SQLSetStmtAttr (hStmt, SQL_ATTR_PARAM_BIND_TYPE,
+	  (SQLPOINTER) SQL_PARAM_BIND_BY_COLUMN, 0);
+      SQLSetStmtAttr (hStmt, SQL_ATTR_PARAM_STATUS_PTR, part->aStatus, 0);
+    }
+
+  while (rc == 0)
+    {
+      part->nUsed = 0;
+      for (j = 0; j < spec->nParams; j++)
+	part->pWidth[j] = 1;
+      for (nRows = 0; nRows < (part->bArray ? LOAD_BATCH_ROWS : 1)
+	  && part->nUsed < LOAD_BATCH_BYTES; )
+	{
+	  cp = part->pCur;
+	  warnings = part->warnings;
+	  row = &part->pRows[nRows * spec->nParams];
+	  rc = _ld_row (part, row);
+	  if (rc <= 0)
+	    break;
+	  rc = 0;
+	  if (part->nIgnore)
+	    {
+	      /* IGNORE n LINES, usually a header */
+	      part->nIgnore--;
+	      part->warnings = warnings;
+	      part->nUsed = 0;
+	      continue;
+	    }
+
+	  /* The arrays are as wide as the widest value, a row that would
+	   * take them past LOAD_BATCH_BYTES is read again for the next
+	   */
+	  for (bytes = 0, j = 0; j < spec->nParams; j++)
+	    {
+	      width = _ld_width (part, row[j].len);
+	      bytes += (size_t) (width > part->pWidth[j]
+		  ? width : part->pWidth[j]);
+	    }
+	  if (nRows && (nRows + 1) * bytes > LOAD_BATCH_BYTES)
+	    {
+	      part->pCur = cp;
+	      part->warnings = warnings;
+	      break;
+	    }
+	  for (j = 0; j < spec->nParams; j++)
+	    {
+	      width = _ld_width (part, row[j].len);
+	      if (width > part->pWidth[j])
+		part->pWidth[j] = width;
+	    }
+	  nRows++;
+	}
+      if (rc < 0)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  break;
+	}
+      if (nRows && (rc = _ld_flush (part, hStmt, nRows)) != 0)
+	break;
+      if (part->pCur >= part->pEnd)
+	break;
+      if (*part->plStop)
+	{
+	  /* Another part failed, its error is the one reported */
+	  rc = -1;
+	  break;
+	}
+    }
+
+  pDB->hDiagStmt = SQL_NULL_HSTMT;
+  if (part->bArray)
+    {
+      SQLSetStmtAttr (hStmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER) 1, 0);
+      SQLSetStmtAttr (hStmt, SQL_ATTR_PARAM_STATUS_PTR, NULL, 0);
+    }
+  SQLFreeStmt (hStmt, SQL_RESET_PARAMS);
+  _stmt_release (pDB, hStmt);
+
+  if (rc)
+    ATOMIC_SET (part->plStop, 1);
+  return rc;
+}
+
+
+/*
+ *  Autocommit of the connection of a part, off while the load runs
+ */
+static int
+_ld_autocommit (MYSQL *mysql, int bOn)
+{
+  SQLRETURN ret;
+
+  ret = SQLSetConnectAttr (DBOF(mysql)->hDbc, SQL_ATTR_AUTOCOMMIT,
+      (SQLPOINTER) (SQLULEN) (bOn ? SQL_AUTOCOMMIT_ON : SQL_AUTOCOMMIT_OFF),
+      0);
+  return _trap_sqlerror (mysql, ret, "SQLSetConnectAttr");
+}
+
+
+static void
+_ld_free_part (TLoadPart *part)
+{
+  unsigned int j;
+
+  if (part->ppCol)
+    {
+      for (j = 0; j < part->pSpec->nParams; j++)
+	safe_free (part->ppCol[j]);
+      free (part->ppCol);
+    }
+  safe_free (part->pRows);
+  safe_free (part->pInd);
+  safe_free (part->pWidth);
+  safe_free (part->pArena);
+}
+
+
+static THREAD_FN
+_ld_worker (void *arg)
+{
+  TLoadPart *part = (TLoadPart *) arg;
+
+  if (_connect_db (part->mysql, part->pConnStr) == 0
+      && (!part->bTrans || _ld_autocommit (part->mysql, 0) == 0))
+    _ld_load (part);
+  else
+    ATOMIC_SET (part->plStop, 1);
+
+  return THREAD_RET;
+}
+
+
+/*
+ *  Where the part that should begin near cp really begins: after the
+ *  next line terminator that is not escaped
+ */
+static const char *
+_ld_split (const TLoadSpec *spec, const char *cp, const char *start,
+    const char *end)
+{
+  const char *p;
+  size_t nEsc;
+
+  for (; cp + spec->nLineTerm <= end; cp++)
+    {
+      if (memcmp (cp, spec->pLineTerm, spec->nLineTerm))
+	continue;
+      for (nEsc = 0, p = cp; p > start && spec->escape >= 0
+	  && (unsigned char) p[-1] == spec->escape; p--)
+	nEsc++;
+      if ((nEsc & 1) == 0)
+	return cp + spec->nLineTerm;
+    }
+
+  return end;
+}
+
+
+static char *
+_map_file (const char *path, size_t *pSize, int *pbMapped)
+{
+  char *data = NULL;
+#ifdef HAVE_MMAP
+  struct stat sb;
+  int fd;
+
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat (fd, &sb) == 0 && sb.st_size > 0)
+    {
+      data = (char *) mmap (NULL, (size_t) sb.st_size, PROT_READ,
+	  MAP_PRIVATE, fd, 0);
+      if (data == (char *) MAP_FAILED)
+	data = NULL;
+      else
+	{
+	  *pbMapped = 1;
+	  *pSize = (size_t) sb.st_size;
+#ifdef MADV_SEQUENTIAL
+	  madvise (data, *pSize, MADV_SEQUENTIAL);
+#endif
+	}
+    }
+  else if (fstat (fd, &sb) == 0)
+    {
+      /* Nothing to map in an empty file */
+      *pSize = 0;
+      data = (char *) malloc (1);
+    }
+  close (fd);
+#else
+  FILE *fd;
+  long size;
+
+  if ((fd = fopen (path, "rb")) == NULL)
+    return NULL;
+  if (fseek (fd, 0, SEEK_END) == 0 && (size = ftell (fd)) >= 0
+      && fseek (fd, 0, SEEK_SET) == 0
+      && (data = (char *) malloc (size + 1)) != NULL)
+    {
+      if (fread (data, 1, size, fd) != (size_t) size)
+	{
+	  free (data);
+	  data = NULL;
+	}
+      *pSize = size;
+    }
+  fclose (fd);
+#endif
+
+  return data;
+}
+
+
+static void
+_unmap_file (char *data, size_t size, int bMapped)
+{
+#ifdef HAVE_MMAP
+  if (bMapped)
+    {
+      munmap (data, size);
+      return;
+    }
+#endif
+  free (data);
+}
+
+
+/*
+ *  Report the error of a worker connection on the caller's
+ */
+static void
+_ld_error (MYSQL *mysql, MYSQL *w)
+{
+  mysql->net.last_errno = w->net.last_errno;
+  strcpy (mysql->net.last_error, w->net.last_error);
+  strcpy (DBOF(mysql)->szSqlState, DBOF(w)->szSqlState);
+}
+
+
+/*
+ *  Run LOAD DATA LOCAL INFILE. Returns 1 if the query is not one.
+ */
+static int
+_ld_query (MYSQL *mysql, const char *query, size_t len)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TLoadSpec spec;
+  TLoadPart *parts = NULL;
+  TCatEntry *entry;
+  volatile long lStop = 0;
+  unsigned int i, nParts = 1;
+  int bTrans = 0;
+  unsigned long records = 0, skipped = 0, warnings = 0;
+  size_t size = 0;
+  char *data = NULL;
+  char info[128];
+  int bMapped = 0;
+  int bOwned;
+  int rc;
+
+  if ((rc = _ld_parse (mysql, query, len, &spec)) != 0)
+    {
+      _ld_free_spec (&spec);
+      if (rc == 1)
+	return 1;
+      _set_error (mysql, (unsigned int) rc);
+      return -1;
+    }
+  rc = -1;
+
+  if (!(mysql->client_flag & CLIENT_LOCAL_FILES))
+    {
+      _set_error (mysql, ER_NOT_ALLOWED_COMMAND);
+      goto done;
+    }
+
+  /* Without a column list, every column of the table in order */
+  if (spec.nParams == 0)
+    {
+      char *table = (char *) malloc (spec.tBare.len + 1);
+
+      if (table == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  goto done;
+	}
+      memcpy (table, spec.tBare.start, spec.tBare.len);
+      table[spec.tBare.len] = 0;
+      if (spec.tBare.type == TK_QUOTED)
+	{
+	  memmove (table, table + 1, spec.tBare.len - 2);
+	  table[spec.tBare.len - 2] = 0;
+	}
+      entry = _cat_get (mysql, CAT_FIELDS, table, &bOwned);
+      free (table);
+      if (entry == NULL)
+	goto done;
+      spec.nParams = entry->nItems;
+      if (bOwned)
+	_cat_free_entry (entry);
+      if (spec.nParams == 0)
+	{
+	  _set_error (mysql, ER_NO_SUCH_TABLE);
+	  goto done;
+	}
+    }
+
+  if ((data = _map_file (spec.pFile, &size, &bMapped)) == NULL)
+    {
+      _set_error (mysql, ER_FILE_NOT_FOUND);
+      goto done;
+    }
+
+  /* Like the one statement it stands for, the load is all or nothing.
+   * Inside a transaction or a commit group that is up to the caller.
+   */
+  if (pDB->bAutocommit && !pDB->bInTrans && !pDB->bGroup)
+    {
+      if (_ld_autocommit (mysql, 0))
+	goto done;
+      bTrans = 1;
+    }
+
+  /* A part boundary cannot be told apart from a quoted line end, and
+   * other connections would be outside the running transaction
+   */
+#if HAVE_THREADS
+  if (mysql->options.load_threads > 1 && spec.enclose < 0 && bTrans
+      && size >= 2 * LOAD_PART_MIN)
+    {
+      nParts = mysql->options.load_threads;
+      if (nParts > size / LOAD_PART_MIN)
+	nParts = (unsigned int) (size / LOAD_PART_MIN);
+    }
+#endif
+  if ((parts = (TLoadPart *) calloc (nParts, sizeof (TLoadPart))) == NULL)
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      goto done;
+    }
+
+  for (i = 0; i < nParts; i++)
+    {
+      parts[i].pSpec = &spec;
+      parts[i].plStop = &lStop;
+      parts[i].bTrans = bTrans;
+      parts[i].pCur = i ? parts[i - 1].pEnd : data;
+      parts[i].pEnd = (i == nParts - 1) ? data + size
+	  : _ld_split (&spec, data + (size / nParts) * (i + 1), data,
+	      data + size);
+      if (parts[i].pEnd < parts[i].pCur)
+	parts[i].pEnd = parts[i].pCur;
+    }
+  parts[0].mysql = mysql;
+  parts[0].nIgnore = spec.nIgnore;
+
+  /* Handles for the other parts are set up here, connected by the
+   * workers. Without them everything is loaded over this connection.
+   */
+  for (i = 1; i < nParts; i++)
+    {
+      MYSQL *w = _impl_init (NULL);
+
+      if (w == NULL || _alloc_db (w))
+	{
+	  if (w)
+	    _impl_close (w);
+	  break;
+	}
+      w->client_flag = mysql->client_flag;
+      w->options.connect_timeout = mysql->options.connect_timeout;
+      w->options.init_command = safe_dup (mysql->options.init_command);
+      w->options.odbc_charset = safe_dup (mysql->options.odbc_charset);
+      parts[i].mysql = w;
+      parts[i].pConnStr = pDB->pConnStr;
+    }
+  if (i < nParts)
+    {
+      while (--i > 0)
+	_impl_close (parts[i].mysql);
+      parts[0].pEnd = data + size;
+      nParts = 1;
+    }
+
+  for (i = 1; i < nParts; i++)
+    parts[i].bThread = !THREAD_CREATE (&parts[i].thread, _ld_worker,
+	&parts[i]);
+
+  rc = _ld_load (&parts[0]);
+
+  for (i = 1; i < nParts; i++)
+    {
+      if (parts[i].bThread)
+	THREAD_JOIN (parts[i].thread);
+      else
+	_ld_worker (&parts[i]);
+      if (parts[i].mysql->net.last_errno
+	  && (rc == 0 || mysql->net.last_errno == 0))
+	{
+	  _ld_error (mysql, parts[i].mysql);
+	  rc = -1;
+	}
+    }
+
+  /* Commit every part, or none when one of them failed */
+  for (i = 0; bTrans && i < nParts; i++)
+    {
+      MYSQL *w = parts[i].mysql;
+      SQLRETURN ret;
+
+      if (!DBOF(w)->bConnected)
+	continue;
+      ret = SQLEndTran (SQL_HANDLE_DBC, DBOF(w)->hDbc,
+	  (SQLSMALLINT) (rc == 0 ? SQL_COMMIT : SQL_ROLLBACK));
+      if (rc == 0 && _trap_sqlerror (w, ret, "SQLEndTran"))
+	{
+	  if (i)
+	    _ld_error (mysql, w);
+	  rc = -1;
+	}
+    }
+  if (bTrans && _ld_autocommit (mysql, 1))
+    rc = -1;
+
+  for (i = 0; i < nParts; i++)
+    {
+      records += (unsigned long) parts[i].records;
+      skipped += (unsigned long) parts[i].skipped;
+      warnings += (unsigned long) parts[i].warnings;
+      if (i)
+	_impl_close (parts[i].mysql);
+      _ld_free_part (&parts[i]);
+    }
+
+  if (rc == 0)
+    {
+      mysql->affected_rows = (my_ulonglong) (records - skipped);
+      sprintf (info, "Records: %lu  Deleted: 0  Skipped: %lu  Warnings: %lu",
+	  records, skipped, warnings);
+      mysql->info = strdup (info);
+      _alloc_fields (mysql, 0);
+    }
+
+done:
+  safe_free (parts);
+  if (data)
+    _unmap_file (data, size, bMapped);
+  _ld_free_spec (&spec);
+
+  return rc;
+}
+
+
+/*
+ *  Dialect translation
+ *
+ *  Applications written for MySQL send backtick identifiers, LIMIT m,n,
+ *  backslash escapes and functions of its own. When the data source is
+ *  something else, statements are rewritten in one pass over the lexer
+ *  tokens, the text in between is copied as it is. The outcome, also
+ *  when there was nothing to change, is kept per connection in a small
+ *  LRU cache keyed by the statement text, so a hot statement is only
+ *  translated once. SHOW and DESCRIBE have no portable SQL at all and are
+ *  answered from the catalog instead.
+ */
+static const TDialect _dialects[] =
+  {
+    { "mssql",	"Microsoft SQL Server",	'[', ']',	XL_LIMIT_MSSQL,
+      "CURRENT_TIMESTAMP", "CAST(CURRENT_TIMESTAMP AS DATE)",
+      "CAST(CURRENT_TIMESTAMP AS TIME)" },
+    { "sybase",	"Adaptive Server",	'[', ']',	XL_LIMIT_KEEP,
+      "GETDATE()", "CURRENT_DATE()", "CURRENT_TIME()" },
+    { "postgresql", "PostgreSQL",	'"', '"',	XL_LIMIT_OFFSET,
+      "CURRENT_TIMESTAMP", "CURRENT_DATE", "CURRENT_TIME" },
+    { "sqlite",	"SQLite",		'"', '"',	XL_LIMIT_OFFSET,
+      "CURRENT_TIMESTAMP", "CURRENT_DATE", "CURRENT_TIME" },
+    { "db2",	"DB2",			'"', '"',	XL_LIMIT_FETCH,
+      "CURRENT TIMESTAMP", "CURRENT DATE", "CURRENT TIME" },
+    { "oracle",	"Oracle",		'"', '"',	XL_LIMIT_FETCH,
+      "CURRENT_TIMESTAMP", "CURRENT_DATE", "CURRENT_TIMESTAMP" },
+    { "ansi",	NULL,			'"', '"',	XL_LIMIT_FETCH,
+      "CURRENT_TIMESTAMP", "CURRENT_DATE", "CURRENT_TIME" },
+    { NULL }
+  };
+
+
+/*
+ *  The dialect of a sql-dialect name, NULL if there is none
+ */
+static const TDialect *
+_xl_find (const char *name)
+{
+  int i;
+
+  for (i = 0; _dialects[i].name; i++)
+    {
+      if (!strcasecmp (name, _dialects[i].name))
+	return &_dialects[i];
+    }
+
+  return NULL;
+}
+
+
+/*
+ *  Pick the dialect once per connection. The sql-dialect option wins,
+ *  otherwise it follows SQL_DBMS_NAME. MySQL itself and anything unknown
+ *  get their statements unchanged.
+ */
+static void
+_xl_init (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  const char *name = mysql->options.sql_dialect;
+  const TDialect *d = NULL;
+  SQLCHAR dbms[128];
+  SQLRETURN ret;
+  int i;
+
+  if (name && *name)
+    d = _xl_find (name);
+  else
+    {
+      ret = SQLGetInfo (pDB->hDbc, SQL_DBMS_NAME, dbms, sizeof (dbms), NULL);
+      for (i = 0; (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO)
+	  && _dialects[i].name; i++)
+	{
+	  if (_dialects[i].dbms && !strncasecmp ((char *) dbms,
+	      _dialects[i].dbms, strlen (_dialects[i].dbms)))
+	    {
+	      d = &_dialects[i];
+	      break;
+	    }
+	}
+    }
+
+  if (d != pDB->pDialect)
+    _xl_flush (pDB);
+  pDB->pDialect = d;
+}
+
+
+static void
+_xl_put (TXlateBuf *b, const char *s, size_t n)
+{
+  size_t cap;
+  char *p;
+
+  if (b->n + n + 1 > b->cap)
+    {
+      cap = 2 * b->cap + n + 64;
+      if ((p = (char *) realloc (b->p, cap)) == NULL)
+	{
+	  b->bFailed = 1;
+	  return;
+	}
+      b->p = p;
+      b->cap = cap;
+    }
+  memcpy (b->p + b->n, s, n);
+  b->n += n;
+  b->p[b->n] = 0;
+}
+
+
+static void
+_xl_puts (TXlateBuf *b, const char *s)
+{
+  _xl_put (b, s, strlen (s));
+}
+
+
+/*
+ *  A 'literal' or "literal" with MySQL escapes as a standard one.
+ *  Returns 0 if the token is not a complete literal.
+ */
+static int
+_xl_string (TXlateBuf *b, TSQLToken *tok)
+{
+  const char *cp = tok->start + 1;
+  const char *end = tok->start + tok->len;
+  const char *s;
+  char quote = *tok->start;
+  char c;
+
+  _xl_put (b, "'", 1);
+  for (;;)
+    {
+      for (s = cp; cp < end && *cp != '\\' && *cp != '\'' && *cp != quote;
+	  cp++)
+	;
+      _xl_put (b, s, cp - s);
+      if (cp >= end)
+	return 0;
+      if (*cp == '\\' && cp + 1 < end)
+	{
+	  switch (c = cp[1])
+	    {
+	    case 'n': _xl_put (b, "\n", 1); break;
+	    case 'r': _xl_put (b, "\r", 1); break;
+	    case 't': _xl_put (b, "\t", 1); break;
+	    case 'b': _xl_put (b, "\b", 1); break;
+	    case 'Z': _xl_put (b, "\032", 1); break;
+	    case '\'': _xl_put (b, "''", 2); break;
+	    case '0':		/* no way to write NUL in the statement */
+	    case '%':		/* LIKE patterns keep these */
+	    case '_':
+	      _xl_put (b, cp, 2);
+	      break;
+	    default: _xl_put (b, &c, 1); break;
+	    }
+	  cp += 2;
+	}
+      else if (*cp == quote && cp + 1 < end && cp[1] == quote)
+	{
+	  _xl_puts (b, quote == '\'' ? "''" : "\"");
+	  cp += 2;
+	}
+      else if (*cp == quote)
+	break;
+      else
+	{
+	  /* a ' inside "literal", or a trailing backslash */
+	  _xl_puts (b, *cp == '\'' ? "''" : "\\");
+	  cp++;
+	}
+    }
+  _xl_put (b, "'", 1);
+
+  return cp + 1 == end;
+}
+
+
+/*
+ *  LIMIT n, LIMIT m,n or LIMIT n OFFSET m in the form of the target.
+ *  Returns where the clause ends, NULL to leave it alone.
+ */
+static const char *
+_xl_limit (const TDialect *d, TXlateBuf *b, int bOrdered, const char *cp,
+    const char *end)
+{
+  TSQLToken first, sep, second;
+  TSQLToken *count = &first, *offset = NULL;
+  const char *np;
+
+  cp = _sql_token (cp, end, &first);
+  if (!XL_VALUE (&first))
+    return NULL;
+  np = _sql_token (cp, end, &sep);
+  if ((sep.type == TK_PUNCT && *sep.start == ',') || _tok_is (&sep, "OFFSET"))
+    {
+      cp = _sql_token (np, end, &second);
+      if (!XL_VALUE (&second))
+	return NULL;
+      if (*sep.start == ',')
+	{
+	  offset = &first;
+	  count = &second;
+	}
+      else
+	offset = &second;
+    }
+
+  /* Markers bind by position, they must stay in order */
+  if (offset && *offset->start == '?' && *count->start == '?'
+      && (offset == &first) != (d->limit != XL_LIMIT_OFFSET))
+    return NULL;
+
+  if (d->limit == XL_LIMIT_OFFSET)
+    {
+      if (offset == NULL)
+	return NULL;
+      _xl_puts (b, "LIMIT ");
+      _xl_put (b, count->start, count->len);
+      _xl_puts (b, " OFFSET ");
+      _xl_put (b, offset->start, offset->len);
+      return cp;
+    }
+
+  if (d->limit == XL_LIMIT_MSSQL && !bOrdered)
+    _xl_puts (b, "ORDER BY (SELECT NULL) ");
+  if (offset || d->limit == XL_LIMIT_MSSQL)
+    {
+      _xl_puts (b, "OFFSET ");
+      if (offset)
+	_xl_put (b, offset->start, offset->len);
+      else
+	_xl_puts (b, "0");
+      _xl_puts (b, " ROWS ");
+    }
+  _xl_puts (b, "FETCH NEXT ");
+  _xl_put (b, count->start, count->len);
+  _xl_puts (b, " ROWS ONLY");
+
+  return cp;
+}
+
+
+/*
+ *  Rewrite a statement for the dialect. *ppOut stays NULL if it can go
+ *  out unchanged. Returns -1 when out of memory.
+ */
+static int
+_xl_rewrite (const TDialect *d, const char *query, size_t len, char **ppOut,
+    size_t *pOutLen)
+{
+  const char *cp = query;
+  const char *end = query + len;
+  const char *copied = query;	/* input up to here is in the output */
+  const char *np, *s, *e;
+  unsigned char aLevel[XL_DEPTH];
+  unsigned int depth = 0;
+  TSQLToken tok, next;
+  TXlateBuf b;
+  size_t mark;
+  int bChanged = 0;
+
+  *ppOut = NULL;
+  memset (&b, 0, sizeof (b));
+  aLevel[0] = 0;
+
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+
+      /* Whitespace and comments, only # comments are MySQL's own */
+      if (memchr (copied, '#', tok.start - copied))
+	{
+	  _xl_put (&b, " ", 1);
+	  bChanged = 1;
+	}
+      else
+	_xl_put (&b, copied, tok.start - copied);
+      copied = cp;
+      if (tok.type == TK_END)
+	break;
+
+      switch (tok.type)
+	{
+	case TK_QUOTED:
+	  e = tok.start + tok.len - 1;
+	  if (tok.len < 2 || *e != '`')
+	    {
+	      _xl_put (&b, tok.start, tok.len);
+	      break;
+	    }
+	  _xl_put (&b, &d->quoteOpen, 1);
+	  for (np = s = tok.start + 1; np < e; np++)
+	    {
+	      if (*np != '`' && *np != d->quoteClose)
+		continue;
+	      _xl_put (&b, s, np - s + 1);
+	      if (*np == '`')
+		np++;			/* `` is one backtick */
+	      else
+		_xl_put (&b, np, 1);
+	      s = np + 1;
+	    }
+	  _xl_put (&b, s, e - s);
+	  _xl_put (&b, &d->quoteClose, 1);
+	  bChanged = 1;
+	  break;
+
+	case TK_STRING:
+	  if (*tok.start == '\'' && !memchr (tok.start, '\\', tok.len))
+	    {
+	      _xl_put (&b, tok.start, tok.len);
+	      break;
+	    }
+	  mark = b.n;
+	  if (_xl_string (&b, &tok))
+	    bChanged = 1;
+	  else
+	    {
+	      b.n = mark;
+	      _xl_put (&b, tok.start, tok.len);
+	    }
+	  break;
+
+	case TK_PUNCT:
+	  if (*tok.start == '(')
+	    {
+	      /* Too deep to follow, leave the statement to the driver */
+	      if (++depth == XL_DEPTH)
+		goto unchanged;
+	      aLevel[depth] = 0;
+	    }
+	  else if (*tok.start == ')' && depth > 0)
+	    depth--;
+	  _xl_put (&b, tok.start, tok.len);
+	  break;
+
+	case TK_WORD:
+	  if (_tok_is (&tok, "SELECT"))
+	    aLevel[depth] = XL_SELECT;
+	  else if (_tok_is (&tok, "ORDER"))
+	    aLevel[depth] |= XL_ORDER;
+	  else if (_tok_is (&tok, "LIMIT") && d->limit != XL_LIMIT_KEEP
+	      && (aLevel[depth] & XL_SELECT)
+	      && (np = _xl_limit (d, &b, aLevel[depth] & XL_ORDER, cp,
+		  end)) != NULL)
+	    {
+	      cp = copied = np;
+	      bChanged = 1;
+	      break;
+	    }
+	  else if (_tok_is (&tok, "NOW") || _tok_is (&tok, "CURDATE")
+	      || _tok_is (&tok, "CURTIME"))
+	    {
+	      /* Only the calls without arguments */
+	      np = _sql_token (cp, end, &next);
+	      if (next.type == TK_PUNCT && *next.start == '(')
+		{
+		  np = _sql_token (np, end, &next);
+		  if (next.type == TK_PUNCT && *next.start == ')')
+		    {
+		      _xl_puts (&b, _tok_is (&tok, "NOW") ? d->now
+			  : _tok_is (&tok, "CURDATE") ? d->curdate
+			  : d->curtime);
+		      cp = copied = np;
+		      bChanged = 1;
+		      break;
+		    }
+		}
+	    }
+	  else if (_tok_is (&tok, "IFNULL"))
+	    {
+	      _sql_token (cp, end, &next);
+	      if (next.type == TK_PUNCT && *next.start == '(')
+		{
+		  _xl_puts (&b, "COALESCE");
+		  bChanged = 1;
+		  break;
+		}
+	    }
+	  _xl_put (&b, tok.start, tok.len);
+	  break;
+
+	default:
+	  _xl_put (&b, tok.start, tok.len);
+	  break;
+	}
+    }
+
+  if (b.bFailed)
+    {
+      safe_free (b.p);
+      return -1;
+    }
+  if (bChanged)
+    {
+      *ppOut = b.p;
+      *pOutLen = b.n;
+      return 0;
+    }
+
+unchanged:
+  safe_free (b.p);
+  return 0;
+}
+
+
+static void
+_xl_unlink (TSQLPrivate *pDB, TXlateEntry *entry)
+{
+  if (entry->pLruPrev)
+    entry->pLruPrev->pLruNext = entry->pLruNext;
+  else
+    pDB->pXlateHead = entry->pLruNext;
+  if (entry->pLruNext)
+    entry->pLruNext->pLruPrev = entry->pLruPrev;
+  else
+    pDB->pXlateTail = entry->pLruPrev;
+  entry->pLruPrev = entry->pLruNext = NULL;
+}
+
+
+static void
+_xl_free_entry (TXlateEntry *entry)
+{
+  safe_free (entry->key);
+  safe_free (entry->out);
+  free (entry);
+}
+
+
+/*
+ *  Drop least recently used statements down to the limit
+ */
+static void
+_xl_trim (TSQLPrivate *pDB)
+{
+  TXlateEntry *entry, **pp;
+
+  while (pDB->nXlate > pDB->nXlateMax && (entry = pDB->pXlateTail) != NULL)
+    {
+      _xl_unlink (pDB, entry);
+      for (pp = &pDB->aXlate[entry->hash % XL_BUCKETS]; *pp != entry;
+	  pp = &(*pp)->pHashNext)
+	;
+      *pp = entry->pHashNext;
+      _xl_free_entry (entry);
+      pDB->nXlate--;
+    }
+}
+
+
+static void
+_xl_flush (TSQLPrivate *pDB)
+{
+  TXlateEntry *entry;
+
+  while ((entry = pDB->pXlateHead) != NULL)
+    {
+      pDB->pXlateHead = entry->pLruNext;
+      _xl_free_entry (entry);
+    }
+  memset (pDB->aXlate, 0, sizeof (pDB->aXlate));
+  pDB->pXlateTail = NULL;
+  pDB->nXlate = 0;
+  safe_free (pDB->pXlateTmp);
+  pDB->pXlateTmp = NULL;
+}
+
+
+/*
+ *  The statement as the data source wants it, either query itself or
+ *  text owned by the cache. NULL when out of memory.
+ */
+static const char *
+_xl_translate (TSQLPrivate *pDB, const char *query, size_t len,
+    size_t *pLen)
+{
+  TXlateEntry *entry;
+  unsigned long h;
+  size_t i;
+
+  *pLen = len;
+  safe_free (pDB->pXlateTmp);
+  pDB->pXlateTmp = NULL;
+
+  if (pDB->nXlateMax == 0 || len > XL_KEY_MAX)
+    {
+      if (_xl_rewrite (pDB->pDialect, query, len, &pDB->pXlateTmp, pLen))
+	return NULL;
+      return pDB->pXlateTmp ? pDB->pXlateTmp : query;
+    }
+
+  /* FNV-1a */
+  for (h = 2166136261UL, i = 0; i < len; i++)
+    h = (h ^ (unsigned char) query[i]) * 16777619UL;
+
+  for (entry = pDB->aXlate[h % XL_BUCKETS]; entry; entry = entry->pHashNext)
+    {
+      if (entry->hash == h && entry->keyLen == len
+	  && !memcmp (entry->key, query, len))
+	break;
+    }
+
+  if (entry)
+    _xl_unlink (pDB, entry);
+  else
+    {
+      if ((entry = (TXlateEntry *) calloc (1, sizeof (TXlateEntry))) == NULL)
+	return NULL;
+      if ((entry->key = (char *) malloc (len + 1)) == NULL
+	  || _xl_rewrite (pDB->pDialect, query, len, &entry->out,
+	      &entry->outLen))
+	{
+	  _xl_free_entry (entry);
+	  return NULL;
+	}
+      memcpy (entry->key, query, len);
+      entry->key[len] = 0;
+      entry->keyLen = len;
+      entry->hash = h;
+      entry->pHashNext = pDB->aXlate[h % XL_BUCKETS];
+      pDB->aXlate[h % XL_BUCKETS] = entry;
+      pDB->nXlate++;
+    }
+
+  entry->pLruNext = pDB->pXlateHead;
+  if (pDB->pXlateHead)
+    pDB->pXlateHead->pLruPrev = entry;
+  else
+    pDB->pXlateTail = entry;
+  pDB->pXlateHead = entry;
+  _xl_trim (pDB);
+
+  if (entry->out == NULL)
+    return query;
+  *pLen = entry->outLen;
+  return entry->out;
+}
+
+
+/*
+ *  Column type the way SHOW COLUMNS spells it
+ */
+static void
+_xl_type_name (MYSQL_FIELD *f, char *buf, size_t size)
+{
+  switch (f->type)
+    {
+    case FIELD_TYPE_TINY:
+      snprintf (buf, size, "tinyint");
+      break;
+    case FIELD_TYPE_SHORT:
+      snprintf (buf, size, "smallint");
+      break;
+    case FIELD_TYPE_LONG:
+      snprintf (buf, size, "int");
+      break;
+    case FIELD_TYPE_LONGLONG:
+      snprintf (buf, size, "bigint");
+      break;
+    case FIELD_TYPE_FLOAT:
+      snprintf (buf, size, "float");
+      break;
+    case FIELD_TYPE_DOUBLE:
+      snprintf (buf, size, "double");
+      break;
+    case FIELD_TYPE_DECIMAL:
+      snprintf (buf, size, "decimal(%u,%u)", f->length, f->decimals);
+      break;
+    case FIELD_TYPE_DATE:
+      snprintf (buf, size, "date");
+      break;
+    case FIELD_TYPE_TIME:
+      snprintf (buf, size, "time");
+      break;
+    case FIELD_TYPE_DATETIME:
+      snprintf (buf, size, "datetime");
+      break;
+    case FIELD_TYPE_BLOB:
+      snprintf (buf, size, "text");
+      break;
+    case FIELD_TYPE_STRING:
+      snprintf (buf, size, "char(%u)", f->length);
+      break;
+    default:
+      snprintf (buf, size, "varchar(%u)", f->length);
+      break;
+    }
+}
+
+
+/*
+ *  SHOW COLUMNS and DESCRIBE, in the six columns MySQL returns
+ */
+static MYSQL_RES *
+_xl_columns (MYSQL *mysql, const char *table, const char *wild)
+{
+  static const char * const titles[] =
+    {
+      "Field", "Type", "Null", "Key", "Default", "Extra"
+    };
+  TCatEntry *entry;
+  MYSQL_RES *res = NULL;
+  MYSQL_ROWS *rp = NULL;
+  MYSQL_FIELD *f, *col;
+  unsigned int i, j;
+  char type[64];
+  int bOwned;
+
+  if ((entry = _cat_get (mysql, CAT_FIELDS, table, &bOwned)) == NULL)
+    return NULL;
+
+  if ((f = _alloc_fields (mysql, 6)) == NULL)
+    goto done;
+  for (j = 0; j < 6; j++, f++)
+    {
+      f->type = FIELD_TYPE_VAR_STRING;
+      f->length = (j == 4) ? 255 : NAME_LEN;
+      if ((f->name = strdup (titles[j])) == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  goto done;
+	}
+    }
+
+  if ((res = _alloc_res (mysql, 0)) == NULL)
+    goto done;
+  res->data = (MYSQL_DATA *) calloc (1, sizeof (MYSQL_DATA));
+  if (res->data == NULL)
+    goto nomem;
+  res->data->fields = res->field_count;
+
+  for (i = 0; i < entry->nItems; i++)
+    {
+      col = &entry->fields[i];
+      if (wild && !_wild_match (col->name, wild))
+	continue;
+      _xl_type_name (col, type, sizeof (type));
+      if (_append_row (res->data, &rp) == -1
+	  || (rp->data[0] = strdup (col->name)) == NULL
+	  || (rp->data[1] = strdup (type)) == NULL
+	  || (rp->data[2] = strdup ((col->flags & NOT_NULL_FLAG)
+	      ? "NO" : "YES")) == NULL
+	  || (rp->data[3] = strdup ("")) == NULL
+	  || (col->def && (rp->data[4] = strdup (col->def)) == NULL)
+	  || (rp->data[5] = strdup ("")) == NULL)
+	goto nomem;
+    }
+  res->data_cursor = res->data->data;
+
+done:
+  if (bOwned)
+    _cat_free_entry (entry);
+
+  return res;
+
+nomem:
+  _set_error (mysql, CR_OUT_OF_MEMORY);
+  _free_res (res);
+  res = NULL;
+  goto done;
+}
+
+
+/*
+ *  Identifier token into buf, -1 if it is no name or too long
+ */
+static int
+_xl_name (TSQLToken *tok, char *buf)
+{
+  const char *cp = tok->start;
+  size_t len = tok->len;
+
+  if (tok->type == TK_QUOTED && len >= 2)
+    {
+      cp++;
+      len -= 2;
+    }
+  else if (tok->type != TK_WORD)
+    return -1;
+  if (len == 0 || len > NAME_LEN)
+    return -1;
+  memcpy (buf, cp, len);
+  buf[len] = 0;
+
+  return 0;
+}
+
+
+/*
+ *  SHOW DATABASES, SHOW TABLES, SHOW COLUMNS and DESCRIBE of a table.
+ *  The result waits in pLocalRes for mysql_store_result. Returns 1 for
+ *  anything else, which goes to the driver as usual.
+ */
+static int
+_xl_show (MYSQL *mysql, const char *query, size_t len)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  const char *cp = query;
+  const char *end = query + len;
+  char table[NAME_LEN + 1];
+  char name[NAME_LEN + 1];
+  char *pattern = NULL;
+  const char *wild = NULL;
+  TSQLToken tok;
+  MYSQL_RES *res;
+  size_t n;
+  int kind;
+
+  cp = _sql_token (cp, end, &tok);
+  if (_tok_is (&tok, "SHOW"))
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (_tok_is (&tok, "FULL"))
+	cp = _sql_token (cp, end, &tok);
+      if (_tok_is (&tok, "DATABASES") || _tok_is (&tok, "SCHEMAS"))
+	kind = CAT_DBS;
+      else if (_tok_is (&tok, "TABLES"))
+	kind = CAT_TABLES;
+      else if (_tok_is (&tok, "COLUMNS") || _tok_is (&tok, "FIELDS"))
+	kind = CAT_FIELDS;
+      else
+	return 1;
+      cp = _sql_token (cp, end, &tok);
+      if (kind == CAT_FIELDS)
+	{
+	  if (!_tok_is (&tok, "FROM") && !_tok_is (&tok, "IN"))
+	    return 1;
+	  cp = _sql_token (cp, end, &tok);
+	  if (_xl_name (&tok, table))
+	    return 1;
+	  cp = _sql_token (cp, end, &tok);
+	}
+
+      /* Only the current database is in the catalog */
+      if (kind != CAT_DBS && (_tok_is (&tok, "FROM") || _tok_is (&tok, "IN")))
+	{
+	  cp = _sql_token (cp, end, &tok);
+	  if (_xl_name (&tok, name) || mysql->db == NULL
+	      || strcasecmp (name, mysql->db))
+	    return 1;
+	  cp = _sql_token (cp, end, &tok);
+	}
+
+      if (_tok_is (&tok, "LIKE"))
+	{
+	  cp = _sql_token (cp, end, &tok);
+	  if (tok.type != TK_STRING)
+	    return 1;
+	  if ((wild = pattern = _ld_unquote (&tok, &n)) == NULL)
+	    {
+	      _set_error (mysql, CR_OUT_OF_MEMORY);
+	      return -1;
+	    }
+	  cp = _sql_token (cp, end, &tok);
+	}
+    }
+  else if (_tok_is (&tok, "DESCRIBE") || _tok_is (&tok, "DESC"))
+    {
+      kind = CAT_FIELDS;
+      cp = _sql_token (cp, end, &tok);
+      if (_tok_in (&tok, _sql_reads) || _tok_in (&tok, _sql_writes)
+	  || _xl_name (&tok, table))
+	return 1;
+      cp = _sql_token (cp, end, &tok);
+
+      /* DESCRIBE t col, or a pattern for the column */
+      if (_xl_name (&tok, name) == 0)
+	{
+	  wild = name;
+	  cp = _sql_token (cp, end, &tok);
+	}
+      else if (tok.type == TK_STRING)
+	{
+	  if ((wild = pattern = _ld_unquote (&tok, &n)) == NULL)
+	    {
+	      _set_error (mysql, CR_OUT_OF_MEMORY);
+	      return -1;
+	    }
+	  cp = _sql_token (cp, end, &tok);
+	}
+    }
+  else
+    return 1;
+
+  if (tok.type == TK_PUNCT && *tok.start == ';')
+    cp = _sql_token (cp, end, &tok);
+  if (tok.type != TK_END)
+    {
+      safe_free (pattern);
+      return 1;
+    }
+
+  if (kind == CAT_FIELDS)
+    res = _xl_columns (mysql, table, wild);
+  else
+    res = _impl_list (mysql, kind, NULL, wild);
+  safe_free (pattern);
+  if (res == NULL)
+    return -1;
+
+  pDB->pLocalRes = res;
+  mysql->affected_rows = res->data->rows;
+
+  return 0;
+}
+
+
+/*
+ *  Slow query log
+ *
+ *  With slow-log set every statement is timed by phase: execute, describe
+ *  of the result columns, bind, fetch and the time the client holds the
+ *  result until mysql_free_result. Those whose execute, describe, bind
+ *  and fetch time together reach long-query-time go to a queue, and a
+ *  background thread appends them to the log in the format of the MySQL
+ *  server's slow log, with the phases added. The query path only pays
+ *  for the clock readings and a copy of the statement.
+ */
+#define SLOW_SECS(U)	(unsigned long) ((U) / 1000000), \
+			(unsigned long) ((U) % 1000000)
+
+static void
+_slow_free (TSlowQuery *sq)
+{
+  safe_free (sq->pPath);
+  safe_free (sq->pQuery);
+  free (sq);
+}
+
+
+/*
+ *  Start timing a statement, if the slow log is on
+ */
+static void
+_slow_begin (MYSQL *mysql, const char *query, size_t len)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  const char *path = mysql->options.slow_log;
+  TSlowQuery *sq;
+  char *p;
+
+  /* The previous statement, if its result was never asked for */
+  _slow_finish (pDB);
+
+  if (path == NULL || *path == 0)
+    return;
+
+  /* Logging is best effort, no memory means no record */
+  if ((sq = pDB->pSlow) == NULL)
+    {
+      if ((sq = (TSlowQuery *) calloc (1, sizeof (TSlowQuery))) == NULL)
+	return;
+      pDB->pSlow = sq;
+    }
+  if (sq->pPath == NULL || strcmp (sq->pPath, path))
+    {
+      safe_free (sq->pPath);
+      if ((sq->pPath = strdup (path)) == NULL)
+	return;
+    }
+  if (len + 1 > sq->nAlloc)
+    {
+      if ((p = (char *) realloc (sq->pQuery, len + 1)) == NULL)
+	return;
+      sq->pQuery = p;
+      sq->nAlloc = len + 1;
+    }
+  memcpy (sq->pQuery, query, len);
+  sq->pQuery[len] = 0;
+  sq->nQuery = len;
+  sq->when = time (NULL);
+  sq->ulLimit = (my_ulonglong) mysql->options.long_query_time * 1000;
+  memset (sq->aPhase, 0, sizeof (sq->aPhase));
+  sq->rows = 0;
+  sq->bytes = 0;
+  sq->bActive = 1;
+}
+
+
+/*
+ *  Start of a phase, 0 when nothing is timed
+ */
+static my_ulonglong
+_slow_now (TSlowQuery *sq)
+{
+  return (sq && sq->bActive) ? _now_us () : 0;
+}
+
+
+static void
+_slow_add (TSlowQuery *sq, int phase, my_ulonglong start)
+{
+  if (sq && sq->bActive)
+    sq->aPhase[phase] += _now_us () - start;
+}
+
+
+/*
+ *  Size of the values of a stored result
+ */
+static my_ulonglong
+_slow_bytes (MYSQL_RES *res)
+{
+  TColumns *pCols = RESOF(res)->pCols;
+  my_ulonglong bytes = 0;
+  MYSQL_ROWS *rp;
+  unsigned int j;
+
+  /* Each value of a column is followed by its 0 */
+  if (COLUMNAR (res))
+    {
+      for (j = 0; j < res->field_count; j++)
+	bytes += pCols->aCol[j].offsets[pCols->nRows] - pCols->nRows;
+      return bytes;
+    }
+
+  for (rp = res->data->data; rp; rp = rp->next)
+    {
+      for (j = 0; j < res->field_count; j++)
+	{
+	  if (rp->data[j])
+	    bytes += strlen (rp->data[j]);
+	}
+    }
+
+  return bytes;
+}
+
+
+static int
+_slow_over (TSlowQuery *sq)
+{
+  return sq->aPhase[SLOW_EXECUTE] + sq->aPhase[SLOW_DESCRIBE]
+      + sq->aPhase[SLOW_BIND] + sq->aPhase[SLOW_FETCH] >= sq->ulLimit;
+}
+
+
+static void
+_slow_write (TSlowQuery *list)
+{
+  TSlowQuery *sq, *prev = NULL;
+  FILE *fp = NULL;
+  my_ulonglong total;
+  struct tm tm;
+
+  for (sq = list; sq; prev = sq, sq = sq->pNext)
+    {
+      if (prev == NULL || strcmp (prev->pPath, sq->pPath))
+	{
+	  if (fp)
+	    fclose (fp);
+	  fp = fopen (sq->pPath, "a");
+	}
+      if (fp == NULL)
+	continue;
+
+#ifdef WIN32
+      gmtime_s (&tm, &sq->when);
+#else
+      gmtime_r (&sq->when, &tm);
+#endif
+      total = sq->aPhase[SLOW_EXECUTE] + sq->aPhase[SLOW_DESCRIBE]
+	  + sq->aPhase[SLOW_BIND] + sq->aPhase[SLOW_FETCH];
+      fprintf (fp, "# Time: %04d-%02d-%02dT%02d:%02d:%02dZ\n",
+	  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+	  tm.tm_hour, tm.tm_min, tm.tm_sec);
+      fprintf (fp, "# Query_time: %lu.%06lu  Execute: %lu.%06lu"
+	  "  Describe: %lu.%06lu  Bind: %lu.%06lu  Fetch: %lu.%06lu"
+	  "  Hold: %lu.%06lu\n",
+	  SLOW_SECS (total), SLOW_SECS (sq->aPhase[SLOW_EXECUTE]),
+	  SLOW_SECS (sq->aPhase[SLOW_DESCRIBE]),
+	  SLOW_SECS (sq->aPhase[SLOW_BIND]),
+	  SLOW_SECS (sq->aPhase[SLOW_FETCH]),
+	  SLOW_SECS (sq->aPhase[SLOW_HOLD]));
+      fprintf (fp, "# Rows_sent: %lu  Bytes_sent: %lu\n",
+	  (unsigned long) sq->rows, (unsigned long) sq->bytes);
+      fwrite (sq->pQuery, 1, sq->nQuery, fp);
+      fputs ((sq->nQuery && sq->pQuery[sq->nQuery - 1] == ';')
+	  ? "\n" : ";\n", fp);
+    }
+  if (fp)
+    fclose (fp);
+
+  while ((sq = list) != NULL)
+    {
+      list = sq->pNext;
+      _slow_free (sq);
+    }
+}
+
+
+static THREAD_FN
+_slow_writer (void *arg)
+{
+  TSlowQuery *list;
+
+  MUTEX_LOCK (&_slow.lock);
+  for (;;)
+    {
+      /* A caller that wrote itself before the thread ran goes on */
+      while (_slow.pHead == NULL || _slow.bBusy)
+	COND_WAIT (&_slow.work, &_slow.lock);
+      list = _slow.pHead;
+      _slow.pHead = _slow.pTail = NULL;
+      _slow.bBusy = 1;
+      MUTEX_UNLOCK (&_slow.lock);
+
+      _slow_write (list);
+
+      MUTEX_LOCK (&_slow.lock);
+      _slow.bBusy = 0;
+      if (_slow.pHead == NULL)
+	COND_BROADCAST (&_slow.idle);
+    }
+
+  return THREAD_RET;
+}
+
+
+/*
+ *  Hand a record to the writer, which owns it from here on
+ */
+static void
+_slow_submit (TSlowQuery *sq)
+{
+  TTHREAD thread;
+
+  sq->pNext = NULL;
+  sq->bActive = 0;
+
+  MUTEX_LOCK (&_slow.lock);
+  if (_slow.pTail)
+    _slow.pTail->pNext = sq;
+  else
+    _slow.pHead = sq;
+  _slow.pTail = sq;
+
+  if (!_slow.bRunning && THREAD_CREATE (&thread, _slow_writer, NULL) == 0)
+    {
+      THREAD_DETACH (thread);
+      _slow.bRunning = 1;
+    }
+
+  if (_slow.bRunning)
+    COND_SIGNAL (&_slow.work);
+  else
+    {
+      /* No thread to do it, write here, outside the lock. Records
+       * queued meanwhile are written by the same caller, in order.
+       */
+      while (!_slow.bBusy && (sq = _slow.pHead) != NULL)
+	{
+	  _slow.pHead = _slow.pTail = NULL;
+	  _slow.bBusy = 1;
+	  MUTEX_UNLOCK (&_slow.lock);
+
+	  _slow_write (sq);
+
+	  MUTEX_LOCK (&_slow.lock);
+	  _slow.bBusy = 0;
+	  if (_slow.pHead == NULL)
+	    COND_BROADCAST (&_slow.idle);
+	}
+    }
+  MUTEX_UNLOCK (&_slow.lock);
+}
+
+
+/*
+ *  The statement is done without a result for the client
+ */
+static void
+_slow_finish (TSQLPrivate *pDB)
+{
+  TSlowQuery *sq = pDB->pSlow;
+
+  if (sq == NULL || !sq->bActive)
+    return;
+  sq->bActive = 0;
+  if (_slow_over (sq))
+    {
+      pDB->pSlow = NULL;
+      pDB->bSlowQueued = 1;
+      _slow_submit (sq);
+    }
+}
+
+
+/*
+ *  The record moves to the result, fetch and hold time still to come
+ */
+static void
+_slow_attach (TSQLPrivate *pDB, MYSQL_RES *res)
+{
+  TSlowQuery *sq = pDB->pSlow;
+
+  if (sq == NULL || !sq->bActive)
+    return;
+  sq->ulHeld = _now_us () - sq->aPhase[SLOW_FETCH];
+  RESOF(res)->pSlow = sq;
+  pDB->pSlow = NULL;
+  pDB->bSlowQueued = 1;
+}
+
+
+/*
+ *  mysql_free_result of a timed result
+ */
+static void
+_slow_release (MYSQL_RES *res)
+{
+  TSlowQuery *sq = RESOF(res)->pSlow;
+  my_ulonglong now = _now_us ();
+
+  RESOF(res)->pSlow = NULL;
+  if (now > sq->ulHeld + sq->aPhase[SLOW_FETCH])
+    sq->aPhase[SLOW_HOLD] = now - sq->ulHeld - sq->aPhase[SLOW_FETCH];
+  sq->rows = res->data ? res->data->rows : res->row_count;
+  if (_slow_over (sq))
+    _slow_submit (sq);
+  else
+    _slow_free (sq);
+}
+
+
+/*
+ *  Wait until the writer has the queue on disk
+ */
+static void
+_slow_drain (void)
+{
+  MUTEX_LOCK (&_slow.lock);
+  while (_slow.pHead || _slow.bBusy)
+    COND_WAIT (&_slow.idle, &_slow.lock);
+  MUTEX_UNLOCK (&_slow.lock);
+}
+
+
+/*
+ *  Result export
+ *
+ *  mysql_export_result writes the rows of a result straight to a file
+ *  descriptor. Values that need no escaping are handed to writev where
+ *  they lie in the stored rows; everything else goes through a scratch
+ *  buffer. Streamed rows are always copied, the next SQLFetch reuses
+ *  their buffers.
+ */
+static const char * const _ex_stops[] =
+  {
+    "\",\n\r",			/* MYSQL_EXPORT_CSV */
+    "\t\n\r\\",			/* MYSQL_EXPORT_TSV */
+    "\"\\\"\\"			/* MYSQL_EXPORT_JSONL, plus control chars */
+  };
+
+
+/*
+ *  Length of the prefix of s that can be written as it is
+ */
+static size_t
+_ex_span (const char *s, size_t len, const char *stop, int bCtl)
+{
+  size_t i = 0;
+#ifdef HAVE_SSE2
+  __m128i c0 = _mm_set1_epi8 (stop[0]);
+  __m128i c1 = _mm_set1_epi8 (stop[1]);
+  __m128i c2 = _mm_set1_epi8 (stop[2]);
+  __m128i c3 = _mm_set1_epi8 (stop[3]);
+  __m128i ctl = _mm_set1_epi8 (bCtl ? 0x1F : 0);
+  __m128i v, hit;
+  int mask;
+
+  for (; i + 16 <= len; i += 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      hit = _mm_or_si128 (
+	  _mm_or_si128 (_mm_cmpeq_epi8 (v, c0), _mm_cmpeq_epi8 (v, c1)),
+	  _mm_or_si128 (_mm_cmpeq_epi8 (v, c2), _mm_cmpeq_epi8 (v, c3)));
+      if (bCtl)
+	{
+	  /* unsigned v <= 0x1F */
+	  hit = _mm_or_si128 (hit,
+	      _mm_cmpeq_epi8 (_mm_min_epu8 (v, ctl), v));
+	}
+      if ((mask = _mm_movemask_epi8 (hit)) != 0)
+	return i + CTZ (mask);
+    }
+#endif
+
+  for (; i < len; i++)
+    {
+      if (s[i] == stop[0] || s[i] == stop[1] || s[i] == stop[2]
+	  || s[i] == stop[3] || (bCtl && (unsigned char) s[i] < 0x20))
+	break;
+    }
+
+  return i;
+}
+
+
+static int
+_ex_flush (TExport *ex)
+{
+  struct iovec *iov = ex->aIov;
+  int n = ex->nIov;
+  ssize_t done;
+
+  while (n > 0)
+    {
+#ifdef HAVE_WRITEV
+      done = writev (ex->fd, iov, n);
+#else
+      done = write (ex->fd, iov->iov_base, iov->iov_len);
+#endif
+      if (done < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      ex->bytes += done;
+
+      /* Partial writes leave the rest of the vector for the next round */
+      while (n > 0 && (size_t) done >= iov->iov_len)
+	{
+	  done -= iov->iov_len;
+	  iov++;
+	  n--;
+	}
+      if (n > 0)
+	{
+	  iov->iov_base = (char *) iov->iov_base + done;
+	  iov->iov_len -= done;
+	}
+    }
+  ex->nIov = 0;
+  ex->nUsed = 0;
+
+  return 0;
+}
+
+
+/*
+ *  Queue len bytes. Unless bStable, the bytes are copied.
+ */
+static int
+_ex_put (TExport *ex, const char *p, size_t len, int bStable)
+{
+  struct iovec *last;
+
+  if (len == 0)
+    return 0;
+
+  if (!bStable && len > ex->nBuf)
+    {
+      /* Too big to copy, so send it before the caller moves on */
+      if (_ex_flush (ex))
+	return -1;
+      ex->aIov[0].iov_base = (void *) p;
+      ex->aIov[0].iov_len = len;
+      ex->nIov = 1;
+      return _ex_flush (ex);
+    }
+
+  if (ex->nIov == EX_IOV || (!bStable && ex->nUsed + len > ex->nBuf))
+    {
+      if (_ex_flush (ex))
+	return -1;
+    }
+  if (!bStable)
+    {
+      memcpy (ex->pBuf + ex->nUsed, p, len);
+      p = ex->pBuf + ex->nUsed;
+      ex->nUsed += len;
+    }
+
+  /* Consecutive copies end up in one piece */
+  last = ex->nIov ? &ex->aIov[ex->nIov - 1] : NULL;
+  if (last && (char *) last->iov_base + last->iov_len == p)
+    last->iov_len += len;
+  else
+    {
+      ex->aIov[ex->nIov].iov_base = (void *) p;
+      ex->aIov[ex->nIov].iov_len = len;
+      ex->nIov++;
+    }
+
+  return 0;
+}
+
+
+/*
+ *  Escape into the scratch buffer, the worst case must already fit
+ */
+static size_t
+_ex_escape (int format, const char *s, size_t len, char *d)
+{
+  char *d0 = d;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      unsigned char c = (unsigned char) s[i];
+
+      if (format == MYSQL_EXPORT_CSV)
+	{
+	  if (c == '"')
+	    *d++ = '"';
+	  *d++ = c;
+	}
+      else if (format == MYSQL_EXPORT_TSV)
+	{
+	  switch (c)
+	    {
+	    case '\t': *d++ = '\\'; *d++ = 't'; break;
+	    case '\n': *d++ = '\\'; *d++ = 'n'; break;
+	    case '\r': *d++ = '\\'; *d++ = 'r'; break;
+	    case '\\': *d++ = '\\'; *d++ = '\\'; break;
+	    default: *d++ = c; break;
+	    }
+	}
+      else
+	{
+	  switch (c)
+	    {
+	    case '"': *d++ = '\\'; *d++ = '"'; break;
+	    case '\\': *d++ = '\\'; *d++ = '\\'; break;
+	    case '\n': *d++ = '\\'; *d++ = 'n'; break;
+	    case '\r': *d++ = '\\'; *d++ = 'r'; break;
+	    case '\t': *d++ = '\\'; *d++ = 't'; break;
+	    default:
+	      if (c < 0x20)
+		d += sprintf (d, "\\u%04x", c);
+	      else
+		*d++ = c;
+	      break;
+	    }
+	}
+    }
+
+  return d - d0;
+}
+
+
+static int
+_ex_value (TExport *ex, const char *s, size_t len, int bQuote, int bStable)
+{
+  const char *stop = _ex_stops[ex->format];
+  int bCtl = (ex->format == MYSQL_EXPORT_JSONL);
+  size_t n, worst;
+
+  n = _ex_span (s, len, stop, bCtl);
+  if (n == len)
+    {
+      /* The common case: nothing to escape */
+      if (bQuote && _ex_put (ex, "\"", 1, 0))
+	return -1;
+      if (_ex_put (ex, s, len, bStable))
+	return -1;
+      return bQuote ? _ex_put (ex, "\"", 1, 0) : 0;
+    }
+
+  /* CSV quotes a value with a special character in it */
+  if (ex->format == MYSQL_EXPORT_CSV)
+    bQuote = 1;
+  worst = (bCtl ? 6 : 2) * (len - n) + n + 2;
+
+  /* Make sure nothing below flushes: the escaped text is not queued yet */
+  if (ex->nUsed + worst > ex->nBuf || ex->nIov + 3 > EX_IOV)
+    {
+      if (_ex_flush (ex))
+	return -1;
+      if (worst > ex->nBuf)
+	{
+	  char *p = (char *) realloc (ex->pBuf, worst);
+
+	  if (p == NULL)
+	    return -1;
+	  ex->pBuf = p;
+	  ex->nBuf = worst;
+	}
+    }
+
+  if (bQuote)
+    _ex_put (ex, "\"", 1, 0);
+  n = _ex_escape (ex->format, s, len, ex->pBuf + ex->nUsed);
+  ex->nUsed += n;
+  if (_ex_put (ex, ex->pBuf + ex->nUsed - n, n, 1))
+    return -1;
+  return bQuote ? _ex_put (ex, "\"", 1, 0) : 0;
+}
+
+
+static my_ulonglong
+_impl_export (MYSQL_RES *res, int fd, enum mysql_export_format format,
+    unsigned int flags)
+{
+  TExport ex;
+  MYSQL_ROW row;
+  MYSQL_FIELD *f;
+  unsigned long *lengths;
+  my_ulonglong nRows = 0;
+  unsigned int j;
+  MYSQL *mysql = res->data ? NULL : res->handle;
+  int bStable = (res->data != NULL);
+  int rc = 0;
+
+  if ((unsigned int) format > MYSQL_EXPORT_JSONL)
+    return (my_ulonglong) -1;
+  if (format == MYSQL_EXPORT_JSONL || (flags & MYSQL_EXPORT_HEADER))
+    _meta_resolve (res);
+
+  memset (&ex, 0, sizeof (ex));
+  ex.fd = fd;
+  ex.format = format;
+  ex.nBuf = EX_BUF;
+  if ((ex.pBuf = (char *) malloc (ex.nBuf)) == NULL)
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return (my_ulonglong) -1;
+    }
+  if (mysql)
+    _set_error (mysql, 0);
+
+  if ((flags & MYSQL_EXPORT_HEADER) && format != MYSQL_EXPORT_JSONL)
+    {
+      for (j = 0, f = res->fields; j < res->field_count && rc == 0; j++, f++)
+	{
+	  if (j)
+	    rc = _ex_put (&ex, format == MYSQL_EXPORT_CSV ? "," : "\t", 1, 0);
+	  if (rc == 0)
+	    rc = _ex_value (&ex, f->name, strlen (f->name), 0, 0);
+	}
+      if (rc == 0)
+	rc = _ex_put (&ex, format == MYSQL_EXPORT_CSV ? "\r\n" : "\n",
+	    format == MYSQL_EXPORT_CSV ? 2 : 1, 0);
+    }
+
+  while (rc == 0 && (row = _impl_fetch_row (res)) != NULL)
+    {
+      lengths = res->data && !COLUMNAR (res) ? NULL : res->lengths;
+      for (j = 0, f = res->fields; j < res->field_count && rc == 0; j++, f++)
+	{
+	  const char *v = row[j];
+	  size_t len = v ? (lengths ? lengths[j] : strlen (v)) : 0;
+
+	  if (format == MYSQL_EXPORT_JSONL)
+	    {
+	      rc = _ex_put (&ex, j ? "," : "{", 1, 0);
+	      if (rc == 0)
+		rc = _ex_value (&ex, f->name, strlen (f->name), 1, 0);
+	      if (rc == 0)
+		rc = _ex_put (&ex, ":", 1, 0);
+	      if (rc == 0 && v == NULL)
+		rc = _ex_put (&ex, "null", 4, 0);
+	      else if (rc == 0)
+		rc = _ex_value (&ex, v, len, !IS_NUM (f->type) || len == 0,
+		    bStable);
+	      continue;
+	    }
+
+	  if (j)
+	    rc = _ex_put (&ex, format == MYSQL_EXPORT_CSV ? "," : "\t", 1, 0);
+	  if (rc)
+	    break;
+	  if (v == NULL)
+	    rc = (format == MYSQL_EXPORT_TSV) ? _ex_put (&ex, "\\N", 2, 0) : 0;
+	  else if (len == 0 && format == MYSQL_EXPORT_CSV)
+	    rc = _ex_put (&ex, "\"\"", 2, 0);	/* not NULL */
+	  else
+	    rc = _ex_value (&ex, v, len, 0, bStable);
+	}
+      if (rc == 0)
+	{
+	  if (format == MYSQL_EXPORT_JSONL)
+	    rc = _ex_put (&ex, res->field_count ? "}\n" : "{}\n",
+		res->field_count ? 2 : 3, 0);
+	  else
+	    rc = _ex_put (&ex, format == MYSQL_EXPORT_CSV ? "\r\n" : "\n",
+		format == MYSQL_EXPORT_CSV ? 2 : 1, 0);
+	}
+      nRows++;
+    }
+  if (rc == 0)
+    rc = _ex_flush (&ex);
+
+  free (ex.pBuf);
+
+  /* The handle of a stored result may be gone already */
+  if (rc)
+    {
+      _set_error (mysql, ER_ERROR_ON_WRITE);
+      return (my_ulonglong) -1;
+    }
+  if (mysql && mysql->net.last_errno)
+    return (my_ulonglong) -1;
+
+  return nRows;
+}
+
+
+/*
+ *  Result files
+ *
+ *  mysql_save_result writes a stored result in the columnar layout of
+ *  MYSQL_COLUMN, with every position relative to the start of the file.
+ *  mysql_load_result maps the file and points a read-only result at it;
+ *  nothing is parsed or copied. A file is meant for the platform that
+ *  wrote it: the header tells the byte order and the width of unsigned
+ *  long, and a file that differs is refused.
+ */
+static unsigned long
+_rf_place (unsigned long *pAt, unsigned long n)
+{
+  unsigned long at = *pAt;
+
+  *pAt += n;
+  return at;
+}
+
+
+static unsigned long
+_rf_string (unsigned long *pAt, const char *s)
+{
+  return s ? _rf_place (pAt, (unsigned long) strlen (s) + 1) : 0;
+}
+
+
+/*
+ *  Write n bytes at position to, padding with zeros up to it. The image
+ *  goes to fd, or to memory at dst.
+ */
+static int
+_rf_put (FILE *fd, char *dst, unsigned long *pAt, unsigned long to,
+    const void *p, size_t n)
+{
+  static const char zeros[RF_ALIGN (1)];
+  size_t pad;
+
+  if (dst)
+    {
+      memset (dst + *pAt, 0, to - *pAt);
+      if (n)
+	memcpy (dst + to, p, n);
+      *pAt = to + (unsigned long) n;
+      return 0;
+    }
+
+  while (*pAt < to)
+    {
+      pad = to - *pAt < sizeof (zeros) ? to - *pAt : sizeof (zeros);
+      if (fwrite (zeros, 1, pad, fd) != pad)
+	return -1;
+      *pAt += (unsigned long) pad;
+    }
+  if (n && fwrite (p, 1, n, fd) != n)
+    return -1;
+  *pAt += (unsigned long) n;
+
+  return 0;
+}
+
+
+/*
+ *  Where everything of a result goes, see _rf_write. Returns the field
+ *  table, the header is filled in.
+ */
+static TResField *
+_rf_layout (MYSQL_RES *res, TResHead *head)
+{
+  TColumns *pCols = RESOF(res)->pCols;
+  unsigned long rows = (unsigned long) pCols->nRows;
+  TResField *aField, *rf;
+  MYSQL_FIELD *f;
+  unsigned long at;
+  unsigned int j;
+
+  aField = (TResField *) calloc (res->field_count + 1, sizeof (TResField));
+  if (aField == NULL)
+    return NULL;
+
+  at = sizeof (TResHead) + res->field_count * sizeof (TResField);
+  for (j = 0; j < res->field_count; j++)
+    {
+      f = &res->fields[j];
+      rf = &aField[j];
+      rf->name = _rf_string (&at, f->name);
+      rf->table = _rf_string (&at, f->table);
+      rf->def = _rf_string (&at, f->def);
+      rf->type = f->type;
+      rf->length = f->length;
+      rf->max_length = f->max_length;
+      rf->flags = f->flags;
+      rf->decimals = f->decimals;
+    }
+  for (j = 0; j < res->field_count; j++)
+    {
+      rf = &aField[j];
+      at = RF_ALIGN (at);
+      rf->offsets = _rf_place (&at, (rows + 1) * sizeof (unsigned long));
+      rf->nulls = _rf_place (&at, (rows + 7) / 8);
+      rf->data = _rf_place (&at, pCols->aCol[j].offsets[rows]);
+    }
+
+  memset (head, 0, sizeof (TResHead));
+  memcpy (head->magic, RF_MAGIC, sizeof (head->magic));
+  head->order = RF_ORDER;
+  head->ulSize = sizeof (unsigned long);
+  head->fields = res->field_count;
+  head->rows = rows;
+  head->size = RF_ALIGN (at);
+
+  return aField;
+}
+
+
+/*
+ *  Write the image _rf_layout planned to fd or to dst
+ */
+static int
+_rf_write (MYSQL_RES *res, const TResHead *head, const TResField *aField,
+    FILE *fd, char *dst)
+{
+  TColumns *pCols = RESOF(res)->pCols;
+  unsigned long rows = head->rows;
+  const TResField *rf;
+  MYSQL_FIELD *f;
+  TColumn *col;
+  unsigned long at = 0;
+  unsigned int j;
+
+  if (_rf_put (fd, dst, &at, 0, head, sizeof (TResHead))
+      || _rf_put (fd, dst, &at, at, aField,
+	  res->field_count * sizeof (TResField)))
+    return -1;
+  for (j = 0; j < res->field_count; j++)
+    {
+      f = &res->fields[j];
+      rf = &aField[j];
+      if ((f->name && _rf_put (fd, dst, &at, rf->name, f->name,
+	      strlen (f->name) + 1))
+	  || (f->table && _rf_put (fd, dst, &at, rf->table, f->table,
+	      strlen (f->table) + 1))
+	  || (f->def && _rf_put (fd, dst, &at, rf->def, f->def,
+	      strlen (f->def) + 1)))
+	return -1;
+    }
+  for (j = 0; j < res->field_count; j++)
+    {
+      col = &pCols->aCol[j];
+      rf = &aField[j];
+      if (_rf_put (fd, dst, &at, rf->offsets, col->offsets,
+	      (rows + 1) * sizeof (unsigned long))
+	  || _rf_put (fd, dst, &at, rf->nulls, col->nulls, (rows + 7) / 8)
+	  || _rf_put (fd, dst, &at, rf->data, col->data, col->offsets[rows]))
+	return -1;
+    }
+
+  return _rf_put (fd, dst, &at, head->size, NULL, 0);
+}
+
+
+static int
+_rf_check_string (const char *base, unsigned long size, unsigned long at)
+{
+  return at == 0 || (at < size && memchr (base + at, 0, size - at));
+}
+
+
+/*
+ *  Sections of one column, see _rf_write. Past these checks a file is
+ *  trusted to be as mysql_save_result wrote it.
+ */
+static int
+_rf_check_column (const char *base, unsigned long size, unsigned long rows,
+    const TResField *rf)
+{
+  const unsigned long *offsets;
+
+  if (rf->offsets % sizeof (unsigned long)
+      || rows >= size / sizeof (unsigned long)
+      || rf->offsets > size - (rows + 1) * sizeof (unsigned long)
+      || rf->nulls > size || (rows + 7) / 8 > size - rf->nulls
+      || rf->data > size)
+    return 0;
+
+  offsets = (const unsigned long *) (base + rf->offsets);
+  return offsets[0] == 0 && offsets[rows] <= size - rf->data
+      && (rows == 0 || base[rf->data + offsets[rows] - 1] == 0);
+}
+
+
+/*
+ *  Read-only result over the image at base, which must stay in place
+ *  while the result lives
+ */
+static MYSQL_RES *
+_rf_open (char *base, size_t size)
+{
+  const TResHead *head = (const TResHead *) base;
+  const TResField *aField, *rf;
+  TColumns *pCols = NULL;
+  MYSQL_RES *res = NULL;
+  MYSQL_FIELD *f;
+  TColumn *col;
+  unsigned long rows;
+  unsigned int j;
+
+  if (size < sizeof (TResHead)
+      || memcmp (head->magic, RF_MAGIC, sizeof (head->magic))
+      || head->order != RF_ORDER
+      || head->ulSize != sizeof (unsigned long)
+      || head->size != size || head->fields == 0
+      || head->fields > (size - sizeof (TResHead)) / sizeof (TResField))
+    return NULL;
+  rows = head->rows;
+  aField = (const TResField *) (head + 1);
+  for (j = 0; j < head->fields; j++)
+    {
+      rf = &aField[j];
+      if (!_rf_check_string (base, size, rf->name)
+	  || !_rf_check_string (base, size, rf->table)
+	  || !_rf_check_string (base, size, rf->def)
+	  || !_rf_check_column (base, size, rows, rf))
+	return NULL;
+    }
+
+  if ((res = (MYSQL_RES *) calloc (1, sizeof (TSQLResult))) == NULL
+      || (pCols = _col_alloc (head->fields, 0)) == NULL)
+    goto failed;
+  res->field_count = head->fields;
+  res->fields = (MYSQL_FIELD *) calloc (head->fields, sizeof (MYSQL_FIELD));
+  res->lengths = (unsigned long *) calloc (head->fields + 1,
+      sizeof (unsigned long));
+  res->data = (MYSQL_DATA *) calloc (1, sizeof (MYSQL_DATA));
+  if (res->fields == NULL || res->lengths == NULL || res->data == NULL)
+    goto failed;
+  res->data->rows = rows;
+  res->data->fields = head->fields;
+  res->eof = 1;
+
+  /* Everything points into the image */
+  for (j = 0; j < head->fields; j++)
+    {
+      rf = &aField[j];
+      f = &res->fields[j];
+      f->name = rf->name ? base + rf->name : NULL;
+      f->table = rf->table ? base + rf->table : NULL;
+      f->def = rf->def ? base + rf->def : NULL;
+      f->type = (enum enum_field_types) rf->type;
+      f->length = (unsigned int) rf->length;
+      f->max_length = (unsigned int) rf->max_length;
+      f->flags = (unsigned int) rf->flags;
+      f->decimals = (unsigned int) rf->decimals;
+
+      col = &pCols->aCol[j];
+      col->offsets = (unsigned long *) (base + rf->offsets);
+      col->nulls = (unsigned char *) (base + rf->nulls);
+      col->data = base + rf->data;
+    }
+  pCols->nRows = pCols->nAlloc = rows;
+  pCols->bView = 1;
+  pCols->bBorrowed = 1;
+  RESOF(res)->pCols = pCols;
+
+  return res;
+
+failed:
+  if (res)
+    {
+      safe_free (res->fields);
+      safe_free (res->lengths);
+      safe_free (res->data);
+      free (res);
+    }
+  _col_free (pCols);
+  return NULL;
+}
+
+
+static MYSQL_RES *
+_rf_load (const char *path)
+{
+  MYSQL_RES *res;
+  size_t size = 0;
+  int bMapped = 0;
+  char *base;
+
+  if ((base = _map_file (path, &size, &bMapped)) == NULL)
+    return NULL;
+  if ((res = _rf_open (base, size)) == NULL)
+    {
+      _unmap_file (base, size, bMapped);
+      return NULL;
+    }
+  RESOF(res)->pCols->pMap = base;
+  RESOF(res)->pCols->nMap = size;
+  RESOF(res)->pCols->bMapped = bMapped;
+
+  return res;
+}
+
+
+/*
+ *  Shared result cache
+ *
+ *  Processes that name the same shared-cache file share one cache
+ *  segment, mapped from that file. The segment has a header, a table of
+ *  entry slots, an owner table for the chunks and the chunks themselves.
+ *  An entry is a run of chunks with the key followed by the image of the
+ *  result as mysql_save_result writes it, so a hit is handed out by
+ *  _rf_open straight from the shared pages.
+ *
+ *  Lookups take no lock. The state word of a slot is SHC_FREE, SHC_BUSY
+ *  while a writer owns it, or SHC_READY plus the number of results
+ *  reading it; a reader pins the slot with a compare-and-swap and only
+ *  then compares the key. Writers hold the file lock (and _shc.lock for
+ *  the threads of this process) and only evict slots nobody pins. A
+ *  writer that dies leaves its slot busy, the next writer takes it back;
+ *  a reader that dies keeps its entry pinned until the file is removed.
+ *
+ *  Writes bump a generation per table (hashed), every write bumps the
+ *  write count and a write to unknown tables the global generation. An
+ *  entry remembers the ones of the tables it read and is stale once any
+ *  of them moved, or once query-cache-ttl has passed.
+ */
+static unsigned int
+_shc_table (const char *name)
+{
+  unsigned long h;
+
+  for (h = 2166136261UL; *name; name++)
+    h = (h ^ (unsigned char) *name) * 16777619UL;
+  return (unsigned int) (h % SHC_TABLES);
+}
+
+
+static void
+_shc_bump (volatile long *p)
+{
+  long v;
+
+  do
+    v = *p;
+  while (!ATOMIC_CAS (p, v, v + 1));
+}
+
+
+static int
+_shc_pin (TShcSlot *slot)
+{
+  long s;
+
+  for (;;)
+    {
+      if ((s = slot->state) < SHC_READY)
+	return 0;
+      if (ATOMIC_CAS (&slot->state, s, s + 1))
+	return 1;
+    }
+}
+
+
+static void
+_shc_unpin (volatile long *pState)
+{
+  long s;
+
+  do
+    s = *pState;
+  while (!ATOMIC_CAS (pState, s, s - 1));
+}
+
+
+/*
+ *  The generations a read of these tables depends on
+ */
+static void
+_shc_stamp (const TSQLInfo *info, TShcStamp *st)
+{
+  TShcHead *head = _shc.pHead;
+  unsigned int i;
+
+  memset (st, 0, sizeof (TShcStamp));
+  st->generation = head->generation;
+  st->writes = head->writes;
+  st->bAll = info->bAllTables || info->nTables == 0;
+  for (i = 0; !st->bAll && i < info->nTables; i++)
+    {
+      st->aTable[i] = (unsigned short) _shc_table (info->tables[i]);
+      st->aGen[i] = head->aTableGen[st->aTable[i]];
+    }
+  st->nTables = st->bAll ? 0 : info->nTables;
+}
+
+
+static int
+_shc_fresh (const TShcStamp *st)
+{
+  TShcHead *head = _shc.pHead;
+  unsigned int i;
+
+  if (st->generation != head->generation
+      || (st->bAll && st->writes != head->writes))
+    return 0;
+  for (i = 0; i < st->nTables; i++)
+    {
+      if (st->aGen[i] != head->aTableGen[st->aTable[i]])
+	return 0;
+    }
+
+  return 1;
+}
+
+
+static int
+_shc_lock (void)
+{
+#ifdef HAVE_MMAP
+  struct flock fl;
+
+  MUTEX_LOCK (&_shc.lock);
+  memset (&fl, 0, sizeof (fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_len = 1;
+  while (fcntl (_shc.fd, F_SETLKW, &fl) == -1)
+    {
+      if (errno != EINTR)
+	{
+	  MUTEX_UNLOCK (&_shc.lock);
+	  return -1;
+	}
+    }
+#endif
+  return 0;
+}
+
+
+static void
+_shc_unlock (void)
+{
+#ifdef HAVE_MMAP
+  struct flock fl;
+
+  memset (&fl, 0, sizeof (fl));
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_len = 1;
+  fcntl (_shc.fd, F_SETLK, &fl);
+  MUTEX_UNLOCK (&_shc.lock);
+#endif
+}
+
+
+/*
+ *  Lay out an empty segment of size bytes, mapped at head
+ */
+static void
+_shc_format (TShcHead *head, unsigned long size)
+{
+  unsigned long nSlots = size / SHC_SLOT_BYTES;
+  unsigned long at;
+
+  memset (head, 0, sizeof (TShcHead));
+  head->size = size;
+  head->nSlots = nSlots;
+  at = RF_ALIGN (sizeof (TShcHead));
+  head->slots = at;
+  at = RF_ALIGN (at + nSlots * sizeof (TShcSlot));
+  head->owners = at;
+  head->nChunks = (size - at) / (SHC_CHUNK + sizeof (unsigned long));
+  at = RF_ALIGN (at + head->nChunks * sizeof (unsigned long));
+  head->chunks = at;
+  head->nChunks = (size - at) / SHC_CHUNK;
+  memset ((char *) head + head->slots, 0, head->chunks - head->slots);
+  head->order = RF_ORDER;
+  head->ulSize = sizeof (unsigned long);
+  memcpy (head->magic, SHC_MAGIC, sizeof (head->magic));
+}
+
+
+/*
+ *  Map the segment of this process, creating the file if needed. Only
+ *  one segment per process; a second name is refused.
+ */
+static int
+_shc_attach (const char *path, unsigned long size)
+{
+  int rc = -1;
+#ifdef HAVE_MMAP
+  struct stat sb;
+  struct flock fl;
+  TShcHead head;
+  char *base;
+  int bFormat = 0;
+  int fd;
+
+  MUTEX_LOCK (&_shc.lock);
+  if (_shc.pHead)
+    {
+      rc = strcmp (_shc.pPath, path) ? -1 : 0;
+      MUTEX_UNLOCK (&_shc.lock);
+      return rc;
+    }
+  if (size < SHC_MIN_SIZE)
+    size = SHC_MIN_SIZE;
+
+  if ((fd = open (path, O_RDWR | O_CREAT, 0600)) < 0)
+    {
+      MUTEX_UNLOCK (&_shc.lock);
+      return -1;
+    }
+  memset (&fl, 0, sizeof (fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_len = 1;
+  while (fcntl (fd, F_SETLKW, &fl) == -1 && errno == EINTR)
+    ;
+
+  /* The first process formats it, the others take its size. Another
+   * process may still map a file of the wrong format, it is formatted
+   * in place and never shrunk: pages past the end would fault there.
+   */
+  if (fstat (fd, &sb))
+    goto done;
+  if ((size_t) sb.st_size >= sizeof (TShcHead)
+      && pread (fd, &head, sizeof (head), 0) == (ssize_t) sizeof (head)
+      && !memcmp (head.magic, SHC_MAGIC, sizeof (head.magic))
+      && head.order == RF_ORDER && head.ulSize == sizeof (unsigned long)
+      && head.size == (unsigned long) sb.st_size)
+    size = head.size;
+  else if ((unsigned long) sb.st_size > size)
+    {
+      size = (unsigned long) sb.st_size;
+      bFormat = 1;
+    }
+  else if (ftruncate (fd, (off_t) size))
+    goto done;
+  else
+    bFormat = 1;
+
+  base = (char *) mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd, 0);
+  if (base != (char *) MAP_FAILED && (_shc.pPath = strdup (path)) != NULL)
+    {
+      if (bFormat)
+	_shc_format ((TShcHead *) base, size);
+      _shc.fd = fd;
+      _shc.nSize = size;
+      _shc.pHead = (TShcHead *) base;
+      _shc.aSlot = (TShcSlot *) (base + _shc.pHead->slots);
+      _shc.aOwner = (unsigned long *) (base + _shc.pHead->owners);
+      _shc.pChunks = base + _shc.pHead->chunks;
+      rc = 0;
+    }
+  else if (base != (char *) MAP_FAILED)
+    munmap (base, size);
+
+done:
+  fl.l_type = F_UNLCK;
+  fcntl (fd, F_SETLK, &fl);
+  if (rc)
+    close (fd);
+  MUTEX_UNLOCK (&_shc.lock);
+#endif
+  return rc;
+}
+
+
+/*
+ *  Key of the statement: the query cache key behind the DSN
+ */
+static char *
+_shc_make_key (MYSQL *mysql, const char *query, size_t len, size_t *keyLen,
+    unsigned long *hash)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  size_t nHost = mysql->host ? strlen (mysql->host) : 0;
+  size_t nQc, i;
+  unsigned long h;
+  char *qc, *key;
+
+  if (pDB->pQcKey)
+    {
+      qc = pDB->pQcKey;
+      nQc = pDB->qcKeyLen;
+    }
+  else if ((qc = _qc_make_key (mysql, query, len, &nQc, &h)) == NULL)
+    return NULL;
+
+  if ((key = (char *) malloc (nHost + 1 + nQc)) != NULL)
+    {
+      memcpy (key, mysql->host ? mysql->host : "", nHost);
+      key[nHost] = 1;
+      memcpy (key + nHost + 1, qc, nQc);
+      *keyLen = nHost + 1 + nQc;
+      for (h = 2166136261UL, i = 0; i < *keyLen; i++)
+	h = (h ^ (unsigned char) key[i]) * 16777619UL;
+      *hash = h;
+    }
+  if (qc != pDB->pQcKey)
+    free (qc);
+
+  return key;
+}
+
+
+/*
+ *  Look up the query. A hit waits in pLocalRes, pinned until it is freed;
+ *  on a cacheable miss the key and the generations are kept for
+ *  _shc_insert.
+ */
+static int
+_shc_lookup (MYSQL *mysql, const char *query, size_t len)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TShcHead *head = _shc.pHead;
+  TShcSlot *slot;
+  MYSQL_RES *res;
+  unsigned long k;
+  char *entry;
+
+  if (pDB->qcInfo.kind != SQL_KIND_READ || !pDB->qcInfo.bCacheable
+      || pDB->bInTrans)
+    return 0;
+
+  pDB->pShcKey = _shc_make_key (mysql, query, len, &pDB->shcKeyLen,
+      &pDB->shcHash);
+  if (pDB->pShcKey == NULL)
+    return 0;
+  _shc_stamp (&pDB->qcInfo, &pDB->shcStamp);
+
+  for (k = 0; k < SHC_PROBE; k++)
+    {
+      slot = &_shc.aSlot[(pDB->shcHash + k) % head->nSlots];
+      if (slot->hash != pDB->shcHash || !_shc_pin (slot))
+	continue;
+
+      /* Pinned, the slot holds still */
+      entry = _shc.pChunks + slot->chunk * SHC_CHUNK;
+      res = NULL;
+      if (slot->hash == pDB->shcHash && slot->keyLen == pDB->shcKeyLen
+	  && !memcmp (entry, pDB->pShcKey, pDB->shcKeyLen)
+	  && _shc_fresh (&slot->stamp) && slot->expires > (long) time (NULL))
+	res = _rf_open (entry + RF_ALIGN (slot->keyLen), slot->size);
+      if (res == NULL)
+	{
+	  _shc_unpin (&slot->state);
+	  continue;
+	}
+
+      /* Racing readers may store an older tick, that is fine for LRU */
+      slot->lastUsed = ++head->tick;
+      RESOF(res)->pCols->pPin = &slot->state;
+      res->handle = mysql;
+      pDB->pLocalRes = res;
+      safe_free (pDB->pShcKey);
+      pDB->pShcKey = NULL;
+      return 1;
+    }
+
+  return 0;
+}
+
+
+/* Call with the lock held */
+static void
+_shc_release (TShcSlot *slot)
+{
+  unsigned long i;
+
+  for (i = 0; i < slot->nChunks; i++)
+    _shc.aOwner[slot->chunk + i] = 0;
+  slot->hash = 0;
+  ATOMIC_SET (&slot->state, SHC_FREE);
+}
+
+
+/*
+ *  Take a slot nobody reads. Call with the lock held.
+ */
+static int
+_shc_evict (TShcSlot *slot)
+{
+  if (!ATOMIC_CAS (&slot->state, SHC_READY, SHC_BUSY))
+    return 0;
+  _shc_release (slot);
+  return 1;
+}
+
+
+/*
+ *  First run of n free chunks, or -1
+ */
+static long
+_shc_find_run (unsigned long n)
+{
+  unsigned long i, run;
+
+  for (run = 0, i = 0; i < _shc.pHead->nChunks; i++)
+    {
+      run = _shc.aOwner[i] ? 0 : run + 1;
+      if (run == n)
+	return (long) (i + 1 - n);
+    }
+
+  return -1;
+}
+
+
+/*
+ *  Least recently used slot nobody reads, in all or in the probe window
+ */
+static TShcSlot *
+_shc_victim (unsigned long first, unsigned long count)
+{
+  TShcSlot *slot, *victim = NULL;
+  unsigned long k;
+
+  for (k = 0; k < count; k++)
+    {
+      slot = &_shc.aSlot[(first + k) % _shc.pHead->nSlots];
+      if (slot->state == SHC_READY
+	  && (victim == NULL || slot->lastUsed < victim->lastUsed))
+	victim = slot;
+    }
+
+  return victim;
+}
+
+
+/*
+ *  Copy a freshly stored result into the segment
+ */
+static void
+_shc_insert (MYSQL *mysql, MYSQL_RES *res)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TShcHead *head = _shc.pHead;
+  TShcSlot *slot, *free_slot = NULL;
+  TResField *aField = NULL;
+  int bTransposed = 0;
+  TResHead image;
+  unsigned long k, n, bytes;
+  long chunk, now;
+  char *entry;
+
+  _meta_resolve (res);
+  if (RESOF(res)->pCols == NULL)
+    {
+      if (_col_from_rows (res))
+	goto done;
+      bTransposed = 1;
+    }
+  if ((aField = _rf_layout (res, &image)) == NULL)
+    goto done;
+
+  bytes = RF_ALIGN (pDB->shcKeyLen) + image.size;
+  n = (bytes + SHC_CHUNK - 1) / SHC_CHUNK;
+  if (n > head->nChunks / 4 || _shc_lock ())
+    goto done;
+
+  /* A write went through while we were reading; the rows may be stale */
+  if (!_shc_fresh (&pDB->shcStamp))
+    goto unlock;
+
+  /* Slots left busy by a writer that died, stale and expired entries */
+  now = (long) time (NULL);
+  for (k = 0; k < head->nSlots; k++)
+    {
+      slot = &_shc.aSlot[k];
+      if (slot->state == SHC_BUSY)
+	_shc_release (slot);
+      else if (slot->state == SHC_READY
+	  && (!_shc_fresh (&slot->stamp) || slot->expires <= now))
+	_shc_evict (slot);
+    }
+
+  /* Another process may have been quicker */
+  for (k = 0; k < SHC_PROBE; k++)
+    {
+      slot = &_shc.aSlot[(pDB->shcHash + k) % head->nSlots];
+      if (slot->state >= SHC_READY && slot->hash == pDB->shcHash
+	  && slot->expires > now && slot->keyLen == pDB->shcKeyLen
+	  && !memcmp (_shc.pChunks + slot->chunk * SHC_CHUNK, pDB->pShcKey,
+	      pDB->shcKeyLen))
+	goto unlock;
+      if (free_slot == NULL && slot->state == SHC_FREE)
+	free_slot = slot;
+    }
+  if (free_slot == NULL)
+    {
+      slot = _shc_victim (pDB->shcHash, SHC_PROBE);
+      if (slot == NULL || !_shc_evict (slot))
+	goto unlock;
+      free_slot = slot;
+    }
+
+  while ((chunk = _shc_find_run (n)) < 0)
+    {
+      if ((slot = _shc_victim (0, head->nSlots)) == NULL)
+	goto unlock;
+      _shc_evict (slot);
+    }
+
+  /* Readers leave a busy slot alone */
+  slot = free_slot;
+  slot->state = SHC_BUSY;
+  slot->hash = pDB->shcHash;
+  slot->chunk = (unsigned long) chunk;
+  slot->nChunks = n;
+  slot->keyLen = pDB->shcKeyLen;
+  slot->size = image.size;
+  slot->lastUsed = ++head->tick;
+  slot->expires = now + (long) _qc.ttl;
+  slot->stamp = pDB->shcStamp;
+  for (k = 0; k < n; k++)
+    _shc.aOwner[chunk + k] = (unsigned long) (slot - _shc.aSlot) + 1;
+  entry = _shc.pChunks + slot->chunk * SHC_CHUNK;
+  memcpy (entry, pDB->pShcKey, pDB->shcKeyLen);
+  if (_rf_write (res, &image, aField, NULL,
+	  entry + RF_ALIGN (pDB->shcKeyLen)))
+    _shc_release (slot);
+  else
+    ATOMIC_SET (&slot->state, SHC_READY);
+
+unlock:
+  _shc_unlock ();
+done:
+  safe_free (aField);
+  safe_free (pDB->pShcKey);
+  pDB->pShcKey = NULL;
+  if (bTransposed)
+    {
+      _col_free (RESOF(res)->pCols);
+      RESOF(res)->pCols = NULL;
+    }
+}
+
+
+/*
+ *  A statement wrote these tables
+ */
+static void
+_shc_invalidate (TSQLInfo *info)
+{
+  TShcHead *head = _shc.pHead;
+  unsigned int i;
+
+  if (head == NULL)
+    return;
+
+  _shc_bump (&head->writes);
+  if (info->bAllTables)
+    _shc_bump (&head->generation);
+  for (i = 0; i < info->nTables; i++)
+    _shc_bump (&head->aTableGen[_shc_table (info->tables[i])]);
+}
+
+
+/*
+ *  Non-blocking API
+ *
+ *  A _start call hands the blocking call to a worker and returns
+ *  MYSQL_WAIT_READ. The worker writes one byte to the pipe of the handle
+ *  when it is done, which wakes the event loop, and the _cont call picks
+ *  up the result. Without threads or a pipe the call runs in _start.
+ */
+static TAsync *
+_async_context (MYSQL *mysql)
+{
+  TAsync *a;
+
+  if ((a = mysql->async_context) != NULL)
+    return a;
+
+  if ((a = (TAsync *) calloc (1, sizeof (TAsync))) == NULL)
+    return NULL;
+  a->mysql = mysql;
+  a->fd = a->fdPost = -1;
+#if HAVE_THREADS && defined (HAVE_PIPE)
+  {
+    int aPipe[2];
+
+# ifdef HAVE_EVENTFD
+    a->fd = a->fdPost = eventfd (0, EFD_CLOEXEC);
+# endif
+    if (a->fd == -1 && pipe (aPipe) == 0)
+      {
+	fcntl (aPipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl (aPipe[1], F_SETFD, FD_CLOEXEC);
+	a->fd = aPipe[0];
+	a->fdPost = aPipe[1];
+      }
+  }
+#endif
+  mysql->async_context = a;
+  mysql->net.fd = a->fd;
+
+  return a;
+}
+
+
+/*
+ *  An eventfd moves 8 byte counters, a pipe one byte per call
+ */
+#define ASYNC_POST_SIZE(A)	((A)->fd == (A)->fdPost ? 8 : 1)
+
+
+/*
+ *  Wait for the post of a call that was handed to a worker
+ */
+static void
+_async_wait (TAsync *a)
+{
+#if HAVE_THREADS && defined (HAVE_PIPE)
+  unsigned char buf[8];
+
+  if (a->bQueued)
+    {
+      while (read (a->fd, buf, ASYNC_POST_SIZE (a)) < 0 && errno == EINTR)
+	;
+      a->bQueued = 0;
+    }
+#endif
+}
+
+
+static void
+_async_free (MYSQL *mysql)
+{
+  TAsync *a;
+
+  if ((a = mysql->async_context) == NULL)
+    return;
+
+  /* A call still on a worker uses the handle, let it finish */
+  _async_wait (a);
+  if (a->op == ASYNC_STORE && a->pResult)
+    mysql_free_result (a->pResult);
+#if HAVE_THREADS && defined (HAVE_PIPE)
+  if (a->fd != -1)
+    close (a->fd);
+  if (a->fdPost != a->fd)
+    close (a->fdPost);
+#endif
+  free (a);
+  mysql->async_context = NULL;
+  mysql->net.fd = -1;
+}
+
+
+/*
+ *  Claim the context of a handle for a call
+ */
+static TAsync *
+_async_prepare (MYSQL *mysql, int op)
+{
+  TAsync *a;
+
+  if ((a = _async_context (mysql)) == NULL)
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return NULL;
+    }
+  if (a->op)
+    {
+      _set_error (mysql, CR_COMMANDS_OUT_OF_SYNC);
+      return NULL;
+    }
+
+  a->op = op;
+  a->lDone = 0;
+  a->pConn = NULL;
+  a->pResult = NULL;
+  a->row = NULL;
+
+  return a;
+}
+
+
+/*
+ *  The blocking call itself
+ */
+static void
+_async_run (TAsync *a)
+{
+  switch (a->op)
+    {
+    case ASYNC_CONNECT:
+      a->pConn = mysql_real_connect (a->mysql, a->pHost, a->pUser,
+	  a->pPasswd, a->pDb, a->port, a->pSocket,
+	  (unsigned int) a->clientFlag);
+      break;
+
+    case ASYNC_QUERY:
+      a->rc = mysql_real_query (a->mysql, a->pQuery,
+	  (unsigned int) a->nQuery);
+      break;
+
+    case ASYNC_STORE:
+      a->pResult = mysql_store_result (a->mysql);
+      break;
+
+    case ASYNC_FETCH:
+      a->row = mysql_fetch_row (a->pRes);
+      break;
+
+    case ASYNC_CLOSE:
+      /* The disconnect, mysql_close_cont frees the rest */
+      _free_db (a->mysql);
+      break;
+    }
+}
+
+
+#if HAVE_THREADS && defined (HAVE_PIPE)
+static THREAD_FN
+_async_worker (void *arg)
+{
+  static const unsigned char one[8] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+  TAsync *a;
+  int fd, n;
+
+  MUTEX_LOCK (&_async.lock);
+  for (;;)
+    {
+      while (_async.pHead == NULL)
+	{
+	  _async.nIdle++;
+	  COND_WAIT (&_async.work, &_async.lock);
+	  _async.nIdle--;
+	}
+      a = _async.pHead;
+      if ((_async.pHead = a->pNext) == NULL)
+	_async.pTail = NULL;
+      _async.nQueued--;
+      MUTEX_UNLOCK (&_async.lock);
+
+      _async_run (a);
+
+      /* The reader waits for the post before it lets go of the context */
+      fd = a->fdPost;
+      n = ASYNC_POST_SIZE (a);
+      ATOMIC_SET (&a->lDone, 1);
+      while (write (fd, one, n) < 0 && errno == EINTR)
+	;
+
+      MUTEX_LOCK (&_async.lock);
+    }
+
+  return THREAD_RET;
+}
+#endif
+
+
+/*
+ *  Returns MYSQL_WAIT_READ when a worker took the call, 0 when it ran here
+ */
+static int
+_async_start (TAsync *a)
+{
+#if HAVE_THREADS && defined (HAVE_PIPE)
+  TTHREAD thread;
+
+  if (a->fd != -1)
+    {
+      a->pNext = NULL;
+      MUTEX_LOCK (&_async.lock);
+      if (_async.nIdle <= _async.nQueued && _async.nThreads < ASYNC_THREADS
+	  && THREAD_CREATE (&thread, _async_worker, NULL) == 0)
+	{
+	  THREAD_DETACH (thread);
+	  _async.nThreads++;
+	}
+      if (_async.nThreads)
+	{
+	  a->bQueued = 1;
+	  if (_async.pTail)
+	    _async.pTail->pNext = a;
+	  else
+	    _async.pHead = a;
+	  _async.pTail = a;
+	  _async.nQueued++;
+	  COND_SIGNAL (&_async.work);
+	  MUTEX_UNLOCK (&_async.lock);
+	  return MYSQL_WAIT_READ;
+	}
+      MUTEX_UNLOCK (&_async.lock);
+    }
+#endif
+
+  _async_run (a);
+  a->lDone = 1;
+
+  return 0;
+}
+
+
+/*
+ *  The finished call of a handle. NULL with *pStatus set while it runs,
+ *  NULL with an error when there is no such call.
+ */
+static TAsync *
+_async_result (MYSQL *mysql, int op, int *pStatus)
+{
+  TAsync *a;
+
+  *pStatus = 0;
+  if (mysql == NULL)
+    return NULL;
+  if ((a = mysql->async_context) == NULL || a->op != op)
+    {
+      _set_error (mysql, CR_COMMANDS_OUT_OF_SYNC);
+      return NULL;
+    }
+  if (!a->lDone)
+    {
+      *pStatus = MYSQL_WAIT_READ;
+      return NULL;
+    }
+
+  _async_wait (a);
+  a->op = 0;
+
+  return a;
+}
+
+
+/*
+ *  Index of a handle whose call is complete, -1 after the timeout or when
+ *  none of them has a call in progress. The fds stay registered with an
+ *  epoll set of the calling thread, so waiting on the same handles again
+ *  costs one epoll_wait.
+ */
+static int
+_async_wait_any (MYSQL **mysql, unsigned int count, int timeout)
+{
+  TThreadPrivate *pThr;
+  TAsync *a;
+  unsigned long stamp;
+  unsigned int i, nPending;
+#ifdef HAVE_EPOLL_CREATE1
+  struct epoll_event aEv[64];
+  unsigned int iWait;
+  int j, n, bMine;
+#elif defined (HAVE_POLL)
+  struct pollfd *aPoll;
+#endif
+
+  if ((pThr = _thread_private ()) == NULL)
+    return -1;
+
+  for (;;)
+    {
+      /* Threads may wait on the same handle, the stamps of all of them
+       * come from one serial and the last wait owns the handle
+       */
+      nPending = 0;
+      MUTEX_LOCK (&_async.lock);
+      stamp = ++_async.waitSerial;
+      for (i = 0; i < count; i++)
+	{
+	  if (mysql[i] == NULL || (a = mysql[i]->async_context) == NULL
+	      || !a->op)
+	    continue;
+	  if (a->lDone)
+	    {
+	      MUTEX_UNLOCK (&_async.lock);
+	      return (int) i;
+	    }
+	  a->iWait = i;
+	  a->waitStamp = stamp;
+	  nPending++;
+	}
+      MUTEX_UNLOCK (&_async.lock);
+      if (nPending == 0)
+	return -1;
+
+#ifdef HAVE_EPOLL_CREATE1
+      if (pThr->epollId == 0)
+	{
+	  if ((pThr->epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1)
+	    return -1;
+	  MUTEX_LOCK (&_async.lock);
+	  pThr->epollId = ++_async.epollSerial;
+	  MUTEX_UNLOCK (&_async.lock);
+	}
+      for (i = 0; i < count; i++)
+	{
+	  if (mysql[i] == NULL || (a = mysql[i]->async_context) == NULL
+	      || a->waitStamp != stamp || a->epollId == pThr->epollId)
+	    continue;
+	  aEv[0].events = EPOLLIN;
+	  aEv[0].data.ptr = a;
+	  if (epoll_ctl (pThr->epfd, EPOLL_CTL_ADD, a->fd, &aEv[0]) == 0
+	      || errno == EEXIST)
+	    a->epollId = pThr->epollId;
+	}
+
+      n = epoll_wait (pThr->epfd, aEv, sizeof (aEv) / sizeof (aEv[0]),
+	  timeout);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return -1;
+      for (j = 0; j < n; j++)
+	{
+	  a = (TAsync *) aEv[j].data.ptr;
+	  MUTEX_LOCK (&_async.lock);
+	  bMine = (a->waitStamp == stamp);
+	  iWait = a->iWait;
+	  MUTEX_UNLOCK (&_async.lock);
+	  if (bMine && a->lDone)
+	    return (int) iWait;
+
+	  /* Done, but not asked for this time; it would keep waking us */
+	  if (!bMine)
+	    {
+	      epoll_ctl (pThr->epfd, EPOLL_CTL_DEL, a->fd, &aEv[j]);
+	      a->epollId = 0;
+	    }
+	}
+#elif defined (HAVE_POLL)
+      if ((aPoll = (struct pollfd *) calloc (nPending,
+	      sizeof (struct pollfd))) == NULL)
+	return -1;
+      for (nPending = 0, i = 0; i < count; i++)
+	{
+	  if (mysql[i] == NULL || (a = mysql[i]->async_context) == NULL
+	      || a->waitStamp != stamp)
+	    continue;
+	  aPoll[nPending].fd = a->fd;
+	  aPoll[nPending++].events = POLLIN;
+	}
+      i = poll (aPoll, nPending, timeout);
+      free (aPoll);
+      if ((int) i == 0)
+	return -1;
+#elif HAVE_THREADS && defined (HAVE_PIPE)
+      /* Nothing to wait on many fds with, take the first one */
+      for (i = 0; i < count; i++)
+	{
+	  if (mysql[i] && (a = mysql[i]->async_context) != NULL
+	      && a->waitStamp == stamp)
+	    {
+	      _async_wait (a);
+	      return (int) i;
+	    }
+	}
+#endif
+    }
+}
+
+
+/*
+ *  Options
+ *
+ *  mysql_options fills mysql->options before the connect. The bridge
+ *  settings are copied into the private connection state by
+ *  _apply_options, which also runs when they change on an open handle.
+ */
+#define OPT_STR		0
+#define OPT_UINT	1
+#define OPT_ULONG	2
+#define OPT_BOOL	3
+#define OPT_CONNECT	4	/* connect parameter, not a mysql_option */
+
+static const struct
+  {
+    const char *	name;
+    int			option;
+    int			type;
+  } _opt_names[] =
+  {
+    { "host",			0,				OPT_CONNECT },
+    { "user",			1,				OPT_CONNECT },
+    { "password",		2,				OPT_CONNECT },
+    { "database",		3,				OPT_CONNECT },
+    { "port",			4,				OPT_CONNECT },
+    { "socket",			5,				OPT_CONNECT },
+    { "connect-timeout",	MYSQL_OPT_CONNECT_TIMEOUT,	OPT_UINT },
+    { "compress",		MYSQL_OPT_COMPRESS,		OPT_BOOL },
+    { "init-command",		MYSQL_INIT_COMMAND,		OPT_STR },
+    { "character-sets-dir",	MYSQL_SET_CHARSET_DIR,		OPT_STR },
+    { "default-character-set",	MYSQL_SET_CHARSET_NAME,		OPT_STR },
+    { "local-infile",		MYSQL_OPT_LOCAL_INFILE,		OPT_UINT },
+    { "fetch-batch-size",	MYSQL_OPT_FETCH_BATCH_SIZE,	OPT_UINT },
+    { "max-column-buffer",	MYSQL_OPT_MAX_COLUMN_BUFFER,	OPT_ULONG },
+    { "max-result-buffer",	MYSQL_OPT_MAX_RESULT_BUFFER,	OPT_ULONG },
+    { "stmt-pool-size",		MYSQL_OPT_STMT_POOL_SIZE,	OPT_UINT },
+    { "ping-window",		MYSQL_OPT_PING_WINDOW,		OPT_UINT },
+    { "query-cache-size",	MYSQL_OPT_QUERY_CACHE_SIZE,	OPT_ULONG },
+    { "query-cache-ttl",	MYSQL_OPT_QUERY_CACHE_TTL,	OPT_UINT },
+    { "async",			MYSQL_OPT_ASYNC,		OPT_BOOL },
+    { "catalog-cache-ttl",	MYSQL_OPT_CATALOG_CACHE_TTL,	OPT_UINT },
+    { "odbc-character-set",	MYSQL_OPT_ODBC_CHARSET,		OPT_STR },
+    { "load-threads",		MYSQL_OPT_LOAD_THREADS,		OPT_UINT },
+    { "sql-dialect",		MYSQL_OPT_SQL_DIALECT,		OPT_STR },
+    { "dialect-cache-size",	MYSQL_OPT_DIALECT_CACHE_SIZE,	OPT_UINT },
+    { "slow-log",		MYSQL_OPT_SLOW_LOG,		OPT_STR },
+    { "long-query-time",	MYSQL_OPT_LONG_QUERY_TIME,	OPT_UINT },
+    { "columnar",		MYSQL_OPT_COLUMNAR,		OPT_BOOL },
+    { "shared-cache",		MYSQL_OPT_SHARED_CACHE,		OPT_STR },
+    { "shared-cache-size",	MYSQL_OPT_SHARED_CACHE_SIZE,	OPT_ULONG },
+    { "group-commit",		MYSQL_OPT_GROUP_COMMIT,		OPT_UINT },
+    { "read-replicas",		MYSQL_OPT_READ_REPLICAS,	OPT_STR },
+    { "hedged-reads",		MYSQL_OPT_HEDGED_READS,		OPT_UINT },
+    { "shard-map",		MYSQL_OPT_SHARD_MAP,		OPT_STR },
+    { "scroll-window",		MYSQL_OPT_SCROLL_WINDOW,	OPT_UINT },
+    { NULL }
+  };
+
+
+static int
+_opt_str (MYSQL *mysql, char **pp, const char *arg)
+{
+  char *copy = NULL;
+
+  if (arg && (copy = strdup (arg)) == NULL)
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return 1;
+    }
+  safe_free (*pp);
+  *pp = copy;
+
+  return 0;
+}
+
+
+static int
+_impl_options (MYSQL *mysql, enum mysql_option option, const char *arg)
+{
+  struct st_mysql_options *opt = &mysql->options;
+
+  switch (option)
+    {
+    case MYSQL_OPT_COMPRESS:
+      opt->compress = 1;
+      opt->client_flag |= CLIENT_COMPRESS;
+      return 0;
+
+    case MYSQL_OPT_NAMED_PIPE:
+      opt->named_pipe = 1;
+      return 0;
+
+    case MYSQL_INIT_COMMAND:
+      return _opt_str (mysql, &opt->init_command, arg);
+
+    case MYSQL_READ_DEFAULT_FILE:
+      return _opt_str (mysql, &opt->my_cnf_file, arg);
+
+    case MYSQL_READ_DEFAULT_GROUP:
+      return _opt_str (mysql, &opt->my_cnf_group, arg);
+
+    case MYSQL_SET_CHARSET_DIR:
+      return _opt_str (mysql, &opt->charset_dir, arg);
+
+    case MYSQL_SET_CHARSET_NAME:
+      return _opt_str (mysql, &opt->charset_name, arg);
+
+    case MYSQL_OPT_ODBC_CHARSET:
+      return _opt_str (mysql, &opt->odbc_charset, arg);
+
+    case MYSQL_OPT_SLOW_LOG:
+      return _opt_str (mysql, &opt->slow_log, arg);
+
+    case MYSQL_OPT_SHARED_CACHE:
+      return _opt_str (mysql, &opt->shared_cache, arg);
+
+    case MYSQL_OPT_READ_REPLICAS:
+      return _opt_str (mysql, &opt->read_replicas, arg);
+
+    case MYSQL_OPT_SHARD_MAP:
+      return _opt_str (mysql, &opt->shard_map, arg);
+
+    case MYSQL_OPT_SQL_DIALECT:
+      if (arg && *arg && _xl_find (arg) == NULL)
+	{
+	  _set_error (mysql, ER_WRONG_VALUE_FOR_VAR);
+	  return 1;
+	}
+      if (_opt_str (mysql, &opt->sql_dialect, arg))
+	return 1;
+      if (DBOF(mysql) && DBOF(mysql)->bConnected)
+	_xl_init (mysql);
+      return 0;
+
+    case MYSQL_OPT_LOCAL_INFILE:
+      if (arg == NULL || *(const unsigned int *) arg)
+	opt->client_flag |= CLIENT_LOCAL_FILES;
+      else
+	opt->client_flag &= ~CLIENT_LOCAL_FILES;
+      return 0;
+
+    case MYSQL_OPT_ASYNC:
+      opt->async = arg ? *(const my_bool *) arg : 1;
+      if (opt->async && _async_context (mysql) == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return 1;
+	}
+      return 0;
+
+    case MYSQL_OPT_COLUMNAR:
+      opt->columnar = arg ? *(const my_bool *) arg : 1;
+      return 0;
+
+    default:
+      break;
+    }
+
+  /* The rest take a number */
+  if (arg == NULL)
+    return 1;
+
+  switch (option)
+    {
+    case MYSQL_OPT_CONNECT_TIMEOUT:
+      opt->connect_timeout = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_FETCH_BATCH_SIZE:
+      opt->fetch_batch_size = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_MAX_COLUMN_BUFFER:
+      opt->max_column_buffer = *(const unsigned long *) arg;
+      break;
+
+    case MYSQL_OPT_MAX_RESULT_BUFFER:
+      opt->max_result_buffer = *(const unsigned long *) arg;
+      break;
+
+    case MYSQL_OPT_STMT_POOL_SIZE:
+      opt->stmt_pool_size = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_PING_WINDOW:
+      opt->ping_window = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_CATALOG_CACHE_TTL:
+      opt->catalog_cache_ttl = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_LOAD_THREADS:
+      opt->load_threads = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_DIALECT_CACHE_SIZE:
+      opt->dialect_cache_size = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_LONG_QUERY_TIME:
+      opt->long_query_time = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_SHARED_CACHE_SIZE:
+      opt->shared_cache_size = *(const unsigned long *) arg;
+      break;
+
+    case MYSQL_OPT_GROUP_COMMIT:
+      opt->group_commit = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_HEDGED_READS:
+      opt->hedged_reads = *(const unsigned int *) arg;
+      break;
+
+    case MYSQL_OPT_SCROLL_WINDOW:
+      opt->scroll_window = *(const unsigned int *) arg;
+      break;
+
+    /* The query cache is shared by the whole process, see _qc_init */
+    case MYSQL_OPT_QUERY_CACHE_SIZE:
+      opt->query_cache_size = *(const unsigned long *) arg;
+      break;
+
+    case MYSQL_OPT_QUERY_CACHE_TTL:
+      opt->query_cache_ttl = *(const unsigned int *) arg;
+      break;
+
+    default:
+      return 1;
+    }
+
+  if (DBOF(mysql))
+    _apply_options (mysql);
+
+  return 0;
+}
+
+
+static void
+_apply_options (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+
+  pDB->nPingWindow = mysql->options.ping_window;
+  pDB->nCatalogTtl = mysql->options.catalog_cache_ttl;
+  if (pDB->nCatalogTtl == 0)
+    _cat_flush (pDB);
+  pDB->nStmtPoolMax = mysql->options.stmt_pool_size;
+  if (pDB->nStmtPoolMax > STMT_POOL_MAX)
+    pDB->nStmtPoolMax = STMT_POOL_MAX;
+  while (pDB->nStmtPool > pDB->nStmtPoolMax)
+    SQLFreeStmt (pDB->aStmtPool[--pDB->nStmtPool], SQL_DROP);
+  pDB->nXlateMax = mysql->options.dialect_cache_size;
+  _xl_trim (pDB);
+  pDB->nGroupMs = mysql->options.group_commit;
+  pDB->nHedgePct = mysql->options.hedged_reads;
+  if (pDB->nHedgePct > 100)
+    pDB->nHedgePct = 100;
+  pDB->nScrollWindow = mysql->options.scroll_window;
+}
+
+
+static void
+_free_options (struct st_mysql_options *opt)
+{
+  char **strs[] =
+    {
+      &opt->host, &opt->init_command, &opt->user, &opt->password,
+      &opt->unix_socket, &opt->db, &opt->my_cnf_file, &opt->my_cnf_group,
+      &opt->charset_dir, &opt->charset_name, &opt->ssl_key, &opt->ssl_cert,
+      &opt->ssl_ca, &opt->ssl_capath, &opt->odbc_charset, &opt->sql_dialect,
+      &opt->slow_log, &opt->shared_cache, &opt->read_replicas,
+      &opt->shard_map
+    };
+  unsigned int i;
+
+  for (i = 0; i < sizeof (strs) / sizeof (strs[0]); i++)
+    {
+      safe_free (*strs[i]);
+      *strs[i] = NULL;
+    }
+}
+
+
+/*
+ *  my.cnf style option files
+ *
+ *  A name without a path separator is looked up as <name>.cnf in the
+ *  usual places, later files overriding earlier ones. Only the listed
+ *  [groups] are read; keys use dashes, underscores are accepted too.
+ */
+typedef int (*TCnfCallback) (void *ctx, const char *key, const char *value);
+
+static int
+_cnf_read_file (const char *path, const char **groups, TCnfCallback cb,
+    void *ctx)
+{
+  char line[1024];
+  char *cp, *key, *value, *ep;
+  int bInGroup = 0;
+  int i;
+  FILE *fd;
+
+  if ((fd = fopen (path, "r")) == NULL)
+    return 0;
+
+  while (fgets (line, sizeof (line), fd))
+    {
+      for (key = line; isspace ((unsigned char) *key); key++)
+	;
+      for (ep = key + strlen (key); ep > key && isspace ((unsigned char) ep[-1]); )
+	*--ep = 0;
+      if (*key == 0 || *key == '#' || *key == ';' || *key == '!')
+	continue;
+
+      if (*key == '[')
+	{
+	  if ((cp = strchr (key, ']')) != NULL)
+	    *cp = 0;
+	  bInGroup = 0;
+	  for (i = 0; groups[i]; i++)
+	    {
+	      if (!strcasecmp (key + 1, groups[i]))
+		bInGroup = 1;
+	    }
+	  continue;
+	}
+      if (!bInGroup)
+	continue;
+
+      value = NULL;
+      if ((cp = strchr (key, '=')) != NULL)
+	{
+	  *cp = 0;
+	  for (value = cp + 1; isspace ((unsigned char) *value); value++)
+	    ;
+	  for (ep = cp; ep > key && isspace ((unsigned char) ep[-1]); )
+	    *--ep = 0;
+
+	  /* Strip quotes */
+	  ep = value + strlen (value);
+	  if (ep - value >= 2 && (*value == '"' || *value == '\'')
+	      && ep[-1] == *value)
+	    {
+	      ep[-1] = 0;
+	      value++;
+	    }
+	}
+      for (cp = key; *cp; cp++)
+	{
+	  if (*cp == '_')
+	    *cp = '-';
+	}
+
+      if (cb (ctx, key, value))
+	{
+	  fclose (fd);
+	  return -1;
+	}
+    }
+
+  fclose (fd);
+
+  return 0;
+}
+
+
+static int
+_cnf_read (const char *name, const char **groups, TCnfCallback cb,
+    void *ctx)
+{
+  static const char *dirs[] = { "/etc/%s.cnf", "/etc/mysql/%s.cnf", NULL };
+  char path[1024];
+  const char *home;
+  int i;
+
+  if (name == NULL || *name == 0)
+    name = "my";
+
+  if (strchr (name, '/') || strchr (name, '\\'))
+    return _cnf_read_file (name, groups, cb, ctx);
+
+  for (i = 0; dirs[i]; i++)
+    {
+      snprintf (path, sizeof (path), dirs[i], name);
+      if (_cnf_read_file (path, groups, cb, ctx))
+	return -1;
+    }
+  if ((home = getenv ("HOME")) != NULL)
+    {
+      snprintf (path, sizeof (path), "%s/.%s.cnf", home, name);
+      if (_cnf_read_file (path, groups, cb, ctx))
+	return -1;
+    }
+
+  return 0;
+}
+
+
+static int
+_cnf_option (void *ctx, const char *key, const char *value)
+{
+  MYSQL *mysql = (MYSQL *) ctx;
+  struct st_mysql_options *opt = &mysql->options;
+  unsigned long ulValue;
+  unsigned int uValue;
+  my_bool bValue;
+  int i;
+
+  for (i = 0; _opt_names[i].name; i++)
+    {
+      if (!strcmp (_opt_names[i].name, key))
+	break;
+    }
+  if (_opt_names[i].name == NULL)
+    return 0;
+
+  ulValue = value ? strtoul (value, NULL, 10) : 1;
+  uValue = (unsigned int) ulValue;
+  bValue = (my_bool) (ulValue != 0);
+
+  switch (_opt_names[i].type)
+    {
+    case OPT_CONNECT:
+      switch (_opt_names[i].option)
+	{
+	case 0: return _opt_str (mysql, &opt->host, value);
+	case 1: return _opt_str (mysql, &opt->user, value);
+	case 2: return _opt_str (mysql, &opt->password, value);
+	case 3: return _opt_str (mysql, &opt->db, value);
+	case 4: opt->port = uValue; return 0;
+	case 5: return _opt_str (mysql, &opt->unix_socket, value);
+	}
+      return 0;
+
+    case OPT_STR:
+      if (value == NULL)
+	return 0;
+      return _impl_options (mysql, (enum mysql_option) _opt_names[i].option,
+	  value);
+
+    case OPT_ULONG:
+      _impl_options (mysql, (enum mysql_option) _opt_names[i].option,
+	  (const char *) &ulValue);
+      return 0;
+
+    case OPT_BOOL:
+      if (!bValue)
+	return 0;
+      _impl_options (mysql, (enum mysql_option) _opt_names[i].option,
+	  (const char *) &bValue);
+      return 0;
+
+    default:
+      _impl_options (mysql, (enum mysql_option) _opt_names[i].option,
+	  (const char *) &uValue);
+      return 0;
+    }
+}
+
+
+/*
+ *  MYSQL_READ_DEFAULT_FILE / MYSQL_READ_DEFAULT_GROUP, read at connect
+ *  time from the [client] group and the named one
+ */
+static int
+_read_options (MYSQL *mysql)
+{
+  const char *groups[3];
+
+  groups[0] = "client";
+  groups[1] = mysql->options.my_cnf_group;
+  groups[2] = NULL;
+
+  return _cnf_read (mysql->options.my_cnf_file, groups, _cnf_option, mysql);
+}
+
+
+/* load_defaults collects "--key=value" arguments in here */
+typedef struct
+  {
+    char **	argv;
+    int		argc;
+    int		max;
+  } TCnfArgs;
+
+static int
+_cnf_arg (void *ctx, const char *key, const char *value)
+{
+  TCnfArgs *args = (TCnfArgs *) ctx;
+  size_t len;
+  char **argv;
+  char *arg;
+
+  if (args->argc == args->max)
+    {
+      args->max = args->max ? 2 * args->max : 16;
+      argv = (char **) realloc (args->argv, args->max * sizeof (char *));
+      if (argv == NULL)
+	return -1;
+      args->argv = argv;
+    }
+
+  len = strlen (key) + (value ? strlen (value) + 1 : 0) + 3;
+  if ((arg = malloc (len)) == NULL)
+    return -1;
+  if (value)
+    snprintf (arg, len, "--%s=%s", key, value);
+  else
+    snprintf (arg, len, "--%s", key);
+  args->argv[args->argc++] = arg;
+
+  return 0;
+}
+
+
+static int
+_cnf_print (void *ctx, const char *key, const char *value)
+{
+  if (value)
+    printf ("--%s=%s ", key, value);
+  else
+    printf ("--%s ", key);
+
+  return 0;
+}
+
+
+/* What load_defaults handed out, released by free_defaults */
+typedef struct SCnfBlock
+  {
+    struct SCnfBlock *pNext;
+    TCnfArgs	args;
+    char **	argv;
+  } TCnfBlock;
+
+static void
+_cnf_free_block (TCnfBlock *pBlock)
+{
+  int i;
+
+  for (i = 0; i < pBlock->args.argc; i++)
+    free (pBlock->args.argv[i]);
+  safe_free (pBlock->args.argv);
+  safe_free (pBlock->argv);
+  free (pBlock);
+}
+
+
+/* Very, very dummy */
+unsigned long max_allowed_packet = 0;
+unsigned long net_buffer_length = 0;
+
+
+static MYSQL *
+_impl_init (MYSQL *mysql)
+{
+  RUN_ONCE (&_global_once, _global_init);
+
+  if (mysql == NULL)
+    {
+      if ((mysql = malloc (sizeof (MYSQL))) == NULL)
+	{
+	  _set_error (NULL, CR_OUT_OF_MEMORY);
+	  return NULL;
+	}
+      memset (mysql, 0, sizeof (MYSQL));
+      mysql->free_me = 1;
+    }
+  else
+    memset (mysql, 0, sizeof (MYSQL));
+
+  mysql->options.fetch_batch_size = FETCH_BATCH_SIZE;
+  mysql->options.stmt_pool_size = STMT_POOL_SIZE;
+  mysql->options.ping_window = PING_WINDOW_MS;
+  mysql->options.catalog_cache_ttl = CATALOG_CACHE_TTL;
+  mysql->options.dialect_cache_size = DIALECT_CACHE_SIZE;
+  mysql->options.long_query_time = LONG_QUERY_TIME;
+  mysql->options.shared_cache_size = SHC_SIZE;
+  mysql->net.fd = -1;			/* see _async_context */
+
+  return mysql;
+}
+
+
+static void 
+_impl_close (MYSQL *mysql)
+{
+  if (mysql)
+    {
+      _async_free (mysql);
+      safe_free (mysql->host);
+      safe_free (mysql->user);
+      safe_free (mysql->passwd);
+      safe_free (mysql->unix_socket);
+      safe_free (mysql->server_version);
+      safe_free (mysql->host_info);
+      safe_free (mysql->info);
+      safe_free (mysql->db);
+      _free_options (&mysql->options);
+      _free_db (mysql);
+      _free_fields (mysql);
+      if (mysql->free_me)
+	free (mysql);
+    }
+}
+
+
+static MYSQL *
+_impl_real_connect (
+    MYSQL *mysql,
+    const char *host,
+    const char *user,
+    const char *passwd,
+    const char *db,
+    unsigned int port,
+    const char *unix_socket,
+    unsigned int clientflag)
+{
+  struct st_mysql_options opt;
+  TAsync *async;
+  my_bool save_reconnect;
+  int save_free;
+  char dsn[512];
+  NET net;
+
+  if (mysql->options.my_cnf_file || mysql->options.my_cnf_group)
+    {
+      if (_read_options (mysql))
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return NULL;
+	}
+    }
+
+  /* Connect parameters not given come from the options */
+  if (host == NULL)
+    host = mysql->options.host;
+  if (user == NULL)
+    user = mysql->options.user;
+  if (passwd == NULL)
+    passwd = mysql->options.password;
+  if (db == NULL)
+    db = mysql->options.db;
+  if (port == 0)
+    port = mysql->options.port;
+  if (unix_socket == NULL)
+    unix_socket = mysql->options.unix_socket;
+  clientflag |= mysql->options.client_flag;
+
+  /* this is all to fool the client */
+  mysql->host = safe_dup (host);
+  mysql->user = safe_dup (user);
+  mysql->passwd = safe_dup (passwd);
+  mysql->db = safe_dup (db);
+  mysql->unix_socket = safe_dup (unix_socket);
+  mysql->port = port;
+  mysql->client_flag = clientflag;
+  mysql->server_version = strdup (MYSQL_SERVER_VERSION "-" MYSQL_SERVER_SUFFIX);
+  mysql->host_info = strdup ("localhost via TCP/IP");
+  mysql->protocol_version = PROTOCOL_VERSION;
+  mysql->thread_id = 100;
+  mysql->server_capabilities = 0;
+  mysql->affected_rows = (my_ulonglong) -1;
+  mysql->status = MYSQL_STATUS_READY;
+
+  snprintf (dsn, sizeof (dsn), "DSN=%s;UID=%s;PWD=%s",
+      db && db[0] ? db : "mysql",
+      user ? user : "",
+      passwd ? passwd : "");
+
+  if (_alloc_db (mysql))
+    goto failed;
+  _apply_options (mysql);
+  if (_route_init (mysql, user, passwd)
+      || _shard_init (mysql, user, passwd))
+    goto failed;
+
+  if (_connect_db (mysql, dsn))
+    goto failed;
+
+  return mysql;
+
+failed:
+  /* Back to the state of mysql_init, keeping the error and the options
+   * for another attempt on the same handle
+   */
+  opt = mysql->options;
+  memset (&mysql->options, 0, sizeof (opt));
+  save_free = mysql->free_me;
+  save_reconnect = mysql->reconnect;
+  async = mysql->async_context;		/* may be running this */
+  mysql->async_context = NULL;
+  mysql->free_me = 0;
+  _impl_close (mysql);
+  net = mysql->net;
+  memset (mysql, 0, sizeof (MYSQL));
+  mysql->net = net;
+  mysql->free_me = save_free;
+  mysql->reconnect = save_reconnect;
+  mysql->options = opt;
+  mysql->async_context = async;
+
+  return NULL;
+}
+
+
+static MYSQL *
+_impl_connect (
+    MYSQL *mysql,
+    const char *host,
+    const char *user,
+    const char *passwd)
+{
+  MYSQL *res;
+
+  mysql = _impl_init (mysql);
+  res = _impl_real_connect (mysql, host, user, passwd, NULL, 0, NULL, 0);
+  if (res == NULL)
+    _impl_close (mysql);
+
+  return res;
+}
+
+
+/*
+ *  Transactions and group commit
+ *
+ *  mysql_autocommit, mysql_commit and mysql_rollback map onto
+ *  SQL_ATTR_AUTOCOMMIT and SQLEndTran. BEGIN, COMMIT and SET AUTOCOMMIT
+ *  sent as SQL are followed too, for server_status and reconnects.
+ *
+ *  ODBC cannot merge the transactions of separate connections, so the
+ *  group-commit option works per connection: in autocommit mode a write
+ *  turns the driver's autocommit off and the writes that follow within
+ *  the bound share one commit. Anything but a single write commits the
+ *  group first, as do the transaction calls and mysql_close. A flusher
+ *  thread commits groups of idle connections once the bound has passed,
+ *  so a write is durable within the bound rather than when it returns.
+ *  Each grouped write is preceded by a savepoint, and a failing one is
+ *  rolled back to it; some data sources (PostgreSQL) would otherwise
+ *  abort the whole group. Where savepoints fail, writes are not grouped.
+ *  A group that is lost after all, with the connection or a commit, is
+ *  reported by the next call as ER_ERROR_DURING_COMMIT or the error of
+ *  the commit.
+ */
+
+/*
+ *  SET [SESSION] AUTOCOMMIT = v, also as @@autocommit or
+ *  @@session.autocommit. Returns the mode, -1 for anything else.
+ */
+static int
+_sql_autocommit (const char *query, size_t len)
+{
+  const char *cp = query;
+  const char *end = query + len;
+  TSQLToken tok;
+
+  cp = _sql_token (cp, end, &tok);
+  if (!_tok_is (&tok, "SET"))
+    return -1;
+
+  cp = _sql_token (cp, end, &tok);
+  while ((tok.type == TK_PUNCT && (*tok.start == '@' || *tok.start == '.'))
+      || _tok_is (&tok, "SESSION") || _tok_is (&tok, "LOCAL"))
+    cp = _sql_token (cp, end, &tok);
+  if (!_tok_is (&tok, "AUTOCOMMIT"))
+    return -1;
+
+  cp = _sql_token (cp, end, &tok);
+  if (tok.type == TK_PUNCT && *tok.start == ':')
+    cp = _sql_token (cp, end, &tok);
+  if (tok.type != TK_PUNCT || *tok.start != '=')
+    return -1;
+
+  _sql_token (cp, end, &tok);
+  if ((tok.type == TK_NUMBER && tok.len == 1 && *tok.start == '1')
+      || _tok_is (&tok, "ON") || _tok_is (&tok, "TRUE"))
+    return 1;
+  if ((tok.type == TK_NUMBER && tok.len == 1 && *tok.start == '0')
+      || _tok_is (&tok, "OFF") || _tok_is (&tok, "FALSE"))
+    return 0;
+
+  return -1;
+}
+
+
+/*
+ *  Statements that leave state in the session: SET other than
+ *  AUTOCOMMIT (SET NAMES, search_path, sql_mode, time_zone, user
+ *  variables), USE and CREATE TEMPORARY TABLE
+ */
+static int
+_sql_session (const char *query, size_t len)
+{
+  const char *end = query + len;
+  const char *cp;
+  TSQLToken tok;
+
+  cp = _sql_token (query, end, &tok);
+  if (_tok_is (&tok, "SET"))
+    return _sql_autocommit (query, len) < 0;
+  if (_tok_is (&tok, "USE"))
+    return 1;
+  if (_tok_is (&tok, "CREATE"))
+    {
+      _sql_token (cp, end, &tok);
+      return _tok_is (&tok, "TEMPORARY");
+    }
+
+  return 0;
+}
+
+
+static void
+_trans_status (TSQLPrivate *pDB)
+{
+  MYSQL *mysql = pDB->mysql;
+
+  mysql->server_status &= ~(SERVER_STATUS_IN_TRANS | SERVER_STATUS_AUTOCOMMIT);
+  if (pDB->bInTrans)
+    mysql->server_status |= SERVER_STATUS_IN_TRANS;
+  if (pDB->bAutocommit)
+    mysql->server_status |= SERVER_STATUS_AUTOCOMMIT;
+}
+
+
+/*
+ *  Keep up with a statement that is about to run
+ */
+static void
+_trans_note (TSQLPrivate *pDB, const TSQLInfo *info, const char *query,
+    size_t len)
+{
+  int mode;
+
+  switch (info->kind)
+    {
+    case SQL_KIND_BEGIN:
+      pDB->bInTrans = 1;
+      break;
+
+    case SQL_KIND_END:
+      pDB->bInTrans = 0;
+      break;
+
+    case SQL_KIND_OTHER:
+      if ((mode = _sql_autocommit (query, len)) >= 0)
+	{
+	  pDB->bAutocommit = mode;
+	  if (mode)
+	    pDB->bInTrans = 0;
+	}
+      break;
+
+    default:
+      /* Without autocommit the first statement opens a transaction */
+      if (!pDB->bAutocommit)
+	pDB->bInTrans = 1;
+      break;
+    }
+
+  /* Reads would find none of it on a replica, see _route_pick */
+  if ((info->kind == SQL_KIND_OTHER || info->kind == SQL_KIND_DDL)
+      && _sql_session (query, len))
+    pDB->bSession = 1;
+
+  _trans_status (pDB);
+}
+
+
+#if HAVE_THREADS && !defined (WIN32)
+/*
+ *  pthread_cond_timedwait wants a deadline on the realtime clock
+ */
+static void
+_cond_timedwait (TCOND *cond, TMUTEX *lock, unsigned long ms)
+{
+  struct timespec ts;
+
+#ifdef CLOCK_REALTIME
+  clock_gettime (CLOCK_REALTIME, &ts);
+#else
+  ts.tv_sec = time (NULL);
+  ts.tv_nsec = 0;
+#endif
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (long) (ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+  pthread_cond_timedwait (cond, lock, &ts);
+}
+#endif
+
+
+/*
+ *  Wait until the flusher gives the handle back
+ */
+static void
+_group_wait (TSQLPrivate *pDB)
+{
+  MUTEX_LOCK (&_group.lock);
+  while (pDB->lBusy == 2)
+    COND_WAIT (&_group.done, &_group.lock);
+  MUTEX_UNLOCK (&_group.lock);
+}
+
+
+/*
+ *  Take the connection off the flusher list. On return the flusher is
+ *  done with it and will not come back.
+ */
+static void
+_group_unlist (TSQLPrivate *pDB)
+{
+  TSQLPrivate **pp;
+
+  MUTEX_LOCK (&_group.lock);
+  if (pDB->bGroupListed)
+    {
+      for (pp = &_group.pHead; *pp != pDB; pp = &(*pp)->pGroupNext)
+	;
+      *pp = pDB->pGroupNext;
+      pDB->bGroupListed = 0;
+    }
+  while (pDB->lBusy == 2)
+    COND_WAIT (&_group.done, &_group.lock);
+  MUTEX_UNLOCK (&_group.lock);
+}
+
+
+/*
+ *  Errors of the group are kept for the next call of the owner, the
+ *  MYSQL handle is not touched: the flusher gets here while the owner
+ *  may read mysql_error or mysql_affected_rows without entering.
+ */
+static void
+_group_error (TSQLPrivate *pDB, unsigned int err, const char *msg)
+{
+  char state[6];
+
+  if (pDB->groupErrno)
+    return;
+
+  if (msg == NULL)
+    {
+      if (_diag_read (pDB, SQL_NULL_HSTMT, state, pDB->szGroupError))
+	strcpy (pDB->szGroupError, "Unknown MySQL error");
+      err = _state_errno (state);
+    }
+  else
+    strcpy (pDB->szGroupError, msg);
+  pDB->groupErrno = err;
+}
+
+
+/*
+ *  End the group with a commit or rollback and go back to autocommit
+ */
+static int
+_group_end (TSQLPrivate *pDB, SQLSMALLINT completion)
+{
+  SQLRETURN ret;
+  int rc = 0;
+
+  pDB->bGroup = 0;
+  pDB->nGroup = 0;
+  ret = SQLEndTran (SQL_HANDLE_DBC, pDB->hDbc, completion);
+  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+    {
+      _group_error (pDB, 0, NULL);
+      rc = -1;
+    }
+  ret = SQLSetConnectAttr (pDB->hDbc, SQL_ATTR_AUTOCOMMIT,
+      (SQLPOINTER) SQL_AUTOCOMMIT_ON, 0);
+  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+    {
+      _group_error (pDB, 0, NULL);
+      rc = -1;
+    }
+
+  return rc;
+}
+
+
+/*
+ *  The group is gone, with nDone writes that had returned
+ */
+static void
+_group_lost (TSQLPrivate *pDB, unsigned int nDone)
+{
+  if (nDone)
+    _group_error (pDB, ER_ERROR_DURING_COMMIT,
+	"Writes of the group commit were rolled back");
+  if (pDB->bConnected)
+    _group_end (pDB, SQL_ROLLBACK);
+  pDB->bGroup = 0;
+  pDB->nGroup = 0;
+}
+
+
+/*
+ *  SAVEPOINT and ROLLBACK TO SAVEPOINT for the group, leaving the error
+ *  of the handle alone
+ */
+static int
+_group_exec (MYSQL *mysql, const char *sql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLHSTMT hStmt;
+  SQLRETURN ret;
+
+  if (_make_room (mysql) || (hStmt = _stmt_acquire (mysql)) == SQL_NULL_HSTMT)
+    return -1;
+  ret = SQLExecDirect (hStmt, (SQLCHAR *) sql, SQL_NTS);
+  _stmt_release (pDB, hStmt);
+
+  return (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO) ? 0 : -1;
+}
+
+
+/*
+ *  A commit that failed after its writes had returned
+ */
+static int
+_group_report (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+
+  if (pDB->groupErrno == 0)
+    return 0;
+
+  mysql->net.last_errno = pDB->groupErrno;
+  memcpy (mysql->net.last_error, pDB->szGroupError,
+      sizeof (mysql->net.last_error));
+  pDB->groupErrno = 0;
+
+  return -1;
+}
+
+
+/*
+ *  Commit the group of the calling owner, if there is one
+ */
+static int
+_group_flush (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+
+  if (_group_report (mysql))
+    return -1;
+  if (!pDB->bGroup)
+    return 0;
+
+  _group_unlist (pDB);
+  if (_group_end (pDB, SQL_COMMIT))
+    return _group_report (mysql);
+
+  return 0;
+}
+
+
+/*
+ *  For mysql_affected_rows, which finds it in _impl_affected_rows
+ */
+static void
+_group_rows (TSQLPrivate *pDB)
+{
+  SQLLEN numRows;
+  SQLRETURN ret;
+
+  if (!pDB->bPrepared || pDB->hStmt == SQL_NULL_HSTMT)
+    return;
+
+  ret = SQLRowCount (pDB->hStmt, &numRows);
+  if (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO)
+    {
+      pDB->groupRows = (my_ulonglong) numRows;
+      pDB->bGroupRows = 1;
+    }
+}
+
+
+static THREAD_FN
+_group_worker (void *arg)
+{
+  TSQLPrivate **pp, *pDB;
+  unsigned long now, age, left, wait;
+
+  MUTEX_LOCK (&_group.lock);
+  for (;;)
+    {
+      /* The first one due that is not in a call, or how long to sleep */
+      now = _now_ms ();
+      wait = 0;
+      for (pp = &_group.pHead; (pDB = *pp) != NULL; pp = &pDB->pGroupNext)
+	{
+	  age = now - pDB->ulGroupStart;
+	  if (age < pDB->nGroupMs)
+	    left = pDB->nGroupMs - age;
+	  else if (ATOMIC_CAS (&pDB->lBusy, 0, 2))
+	    break;
+	  else
+	    left = pDB->nGroupMs ? pDB->nGroupMs : 1;
+	  if (wait == 0 || left < wait)
+	    wait = left;
+	}
+
+      if (pDB)
+	{
+	  /* Ours until lBusy is 0 again, see _enter */
+	  *pp = pDB->pGroupNext;
+	  pDB->bGroupListed = 0;
+	  MUTEX_UNLOCK (&_group.lock);
+
+	  if (pDB->bGroup && pDB->bConnected)
+	    {
+	      /* The row count may not outlive the commit */
+	      if (pDB->bRowCountPending && !pDB->bGroupRows)
+		_group_rows (pDB);
+	      _group_end (pDB, SQL_COMMIT);
+	    }
+	  ATOMIC_SET (&pDB->lBusy, 0);
+
+	  MUTEX_LOCK (&_group.lock);
+	  COND_BROADCAST (&_group.done);
+	}
+      else if (_group.pHead)
+	COND_TIMEDWAIT (&_group.work, &_group.lock, wait);
+      else
+	COND_WAIT (&_group.work, &_group.lock);
+    }
+
+  return THREAD_RET;
+}
+
+
+/*
+ *  Hand a new group to the flusher. Without threads the next call or
+ *  mysql_close commits it.
+ */
+static void
+_group_list (TSQLPrivate *pDB)
+{
+  TTHREAD thread;
+
+  MUTEX_LOCK (&_group.lock);
+  pDB->pGroupNext = _group.pHead;
+  _group.pHead = pDB;
+  pDB->bGroupListed = 1;
+
+  if (!_group.bRunning && THREAD_CREATE (&thread, _group_worker, NULL) == 0)
+    {
+      THREAD_DETACH (thread);
+      _group.bRunning = 1;
+    }
+  if (_group.bRunning)
+    COND_SIGNAL (&_group.work);
+  MUTEX_UNLOCK (&_group.lock);
+}
+
+
+/*
+ *  Before a statement runs: commit the group unless the statement may
+ *  join it, or open one for a write
+ */
+static int
+_group_begin (MYSQL *mysql, int bBatch)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  int bWrite = !bBatch && pDB->qcInfo.kind == SQL_KIND_WRITE;
+  SQLRETURN ret;
+
+  if (_group_report (mysql))
+    return -1;
+
+  if (pDB->bGroup && (!bWrite || pDB->nGroup >= GROUP_COMMIT_MAX
+	  || _now_ms () - pDB->ulGroupStart >= pDB->nGroupMs)
+      && _group_flush (mysql))
+    return -1;
+
+  /* Open cursors could be closed by the commit */
+  if (!pDB->bGroup && bWrite && pDB->nGroupMs && !pDB->bGroupRefused
+      && pDB->bAutocommit && !pDB->bInTrans && pDB->pStreaming == NULL)
+    {
+      ret = SQLSetConnectAttr (pDB->hDbc, SQL_ATTR_AUTOCOMMIT,
+	  (SQLPOINTER) SQL_AUTOCOMMIT_OFF, 0);
+      if (_trap_sqlerror (mysql, ret, "SQLSetConnectAttr"))
+	return -1;
+      pDB->bGroup = 1;
+      pDB->nGroup = 0;
+      pDB->ulGroupStart = _now_ms ();
+      _group_list (pDB);
+    }
+
+  /* The point a failing write goes back to. Without savepoints the
+   * first write goes on alone and the connection stops grouping; a
+   * group that was under way cannot be trusted any more.
+   */
+  if (pDB->bGroup && _group_exec (mysql, "SAVEPOINT " GROUP_SAVEPOINT))
+    {
+      _group_unlist (pDB);
+      if (pDB->nGroup == 0)
+	{
+	  pDB->bGroupRefused = 1;
+	  _group_end (pDB, SQL_ROLLBACK);
+	}
+      else
+	_group_lost (pDB, pDB->nGroup);
+      if (_group_report (mysql))
+	return -1;
+    }
+
+  if (pDB->bGroup)
+    pDB->nGroup++;
+
+  return 0;
+}
+
+
+/*
+ *  A write of the group failed. It is rolled back to its savepoint and
+ *  the others are committed now, so the next statement starts clean.
+ *  When that is not possible they are lost, the next call says so.
+ */
+static void
+_group_fail (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+
+  if (!pDB->bGroup)
+    return;
+
+  _group_unlist (pDB);
+  if (pDB->bConnected
+      && _group_exec (mysql, "ROLLBACK TO SAVEPOINT " GROUP_SAVEPOINT) == 0)
+    _group_end (pDB, SQL_COMMIT);
+  else
+    _group_lost (pDB, pDB->nGroup - 1);
+}
+
+
+static my_bool
+_impl_autocommit (MYSQL *mysql, my_bool mode)
+{
+  TSQLPrivate *pDB;
+  SQLRETURN ret;
+
+  if ((pDB = _db (mysql)) == NULL || _group_flush (mysql))
+    return 1;
+
+  ret = SQLSetConnectAttr (pDB->hDbc, SQL_ATTR_AUTOCOMMIT,
+      (SQLPOINTER) (SQLULEN) (mode ? SQL_AUTOCOMMIT_ON : SQL_AUTOCOMMIT_OFF),
+      0);
+  if (_trap_sqlerror (mysql, ret, "SQLSetConnectAttr"))
+    return 1;
+
+  /* Turning it on commits what is open */
+  pDB->bAutocommit = (mode != 0);
+  if (mode)
+    pDB->bInTrans = 0;
+  _trans_status (pDB);
+
+  return 0;
+}
+
+
+static my_bool
+_impl_end_tran (MYSQL *mysql, SQLSMALLINT completion)
+{
+  TSQLPrivate *pDB;
+  SQLRETURN ret;
+
+  /* Writes of a group were reported done, a rollback keeps them */
+  if ((pDB = _db (mysql)) == NULL || _group_flush (mysql))
+    return 1;
+
+  ret = SQLEndTran (SQL_HANDLE_DBC, pDB->hDbc, completion);
+  if (_trap_sqlerror (mysql, ret, "SQLEndTran"))
+    return 1;
+
+  pDB->bInTrans = 0;
+  _trans_status (pDB);
+
+  return 0;
+}
+
+
+/*
+ *  Read/write splitting
+ *
+ *  With read-replicas the database named at connect stays the primary
+ *  and the listed DSNs take the reads: single SELECTs that the query
+ *  cache would also call repeatable (see _sql_volatile), outside of
+ *  transactions and commit groups. Other statements and every other
+ *  call go to the primary. Replica sessions only run init_command, so
+ *  once the client has set up its session with SET, USE or temporary
+ *  tables, its reads stay on the primary until it reconnects. Replicas
+ *  are taken to be the same kind of data source as the primary; they
+ *  are connected on first use.
+ *
+ *  Reads are spread over the replicas by weight, the inverse of the
+ *  executes in flight times a moving average of the execute latency.
+ *  Both are kept per DSN for the whole process, so all handles steer
+ *  around a replica that is busy or slow. The latency of a replica that
+ *  gets few reads fades, so it is measured again before long. A read
+ *  that fails on a replica runs again on the primary, and a lost replica
+ *  is left alone for ROUTE_RETRY_MS.
+ */
+
+static TRouteTarget *
+_route_target (const char *dsn)
+{
+  TRouteTarget *t;
+
+  MUTEX_LOCK (&_route.lock);
+  for (t = _route.pHead; t; t = t->pNext)
+    {
+      if (!strcmp (t->pDsn, dsn))
+	break;
+    }
+  if (t == NULL && (t = (TRouteTarget *) calloc (1, sizeof (TRouteTarget))))
+    {
+      if ((t->pDsn = strdup (dsn)) == NULL)
+	{
+	  free (t);
+	  t = NULL;
+	}
+      else
+	{
+	  t->pNext = _route.pHead;
+	  _route.pHead = t;
+	}
+    }
+  MUTEX_UNLOCK (&_route.lock);
+
+  return t;
+}
+
+
+/*
+ *  One link per DSN of the read-replicas option
+ */
+static int
+_route_init (MYSQL *mysql, const char *user, const char *passwd)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  const char *cp = mysql->options.read_replicas;
+  TRouteLink *link;
+  char connStr[512];
+  char dsn[128];
+  unsigned int nMax;
+  size_t n;
+
+  if (cp == NULL)
+    return 0;
+
+  pDB->ulRoute = ((unsigned long) _now_us () ^ (unsigned long) (size_t) pDB)
+      & 0xFFFFFFFFUL;
+  if (pDB->ulRoute == 0)
+    pDB->ulRoute = 1;
+  for (nMax = 1, n = 0; cp[n]; n++)
+    {
+      if (cp[n] == ',')
+	nMax++;
+    }
+  if ((pDB->aLinks = (TRouteLink *) calloc (nMax, sizeof (TRouteLink))) == NULL)
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return -1;
+    }
+
+  for (;;)
+    {
+      cp += strspn (cp, ", \t");
+      if ((n = strcspn (cp, ", \t")) == 0)
+	break;
+      snprintf (dsn, sizeof (dsn), "%.*s", (int) n, cp);
+      cp += n;
+
+      snprintf (connStr, sizeof (connStr), "DSN=%s;UID=%s;PWD=%s", dsn,
+	  user ? user : "", passwd ? passwd : "");
+      link = &pDB->aLinks[pDB->nLinks];
+      link->hDbc = SQL_NULL_HDBC;
+      link->hStmt = SQL_NULL_HSTMT;
+      if ((link->pConnStr = strdup (connStr)) == NULL
+	  || (link->pTarget = _route_target (dsn)) == NULL)
+	{
+	  safe_free (link->pConnStr);
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return -1;
+	}
+      pDB->nLinks++;
+    }
+
+  return 0;
+}
+
+
+static void
+_route_close (TRouteLink *link)
+{
+  if (link->hStmt != SQL_NULL_HSTMT)
+    SQLFreeStmt (link->hStmt, SQL_DROP);
+  if (link->bConnected)
+    SQLDisconnect (link->hDbc);
+  if (link->hDbc != SQL_NULL_HDBC)
+    SQLFreeConnect (link->hDbc);
+  link->hStmt = SQL_NULL_HSTMT;
+  link->hDbc = SQL_NULL_HDBC;
+  link->bConnected = 0;
+}
+
+
+/*
+ *  The replica is lost. Statements the primary side still holds keep
+ *  the connection until they come back.
+ */
+static void
+_route_down (TRouteLink *link)
+{
+  link->bDown = 1;
+  link->ulDown = _now_ms ();
+  if (link->nLent == 0)
+    _route_close (link);
+}
+
+
+static void
+_route_free (TSQLPrivate *pDB)
+{
+  unsigned int i;
+
+  _hedge_collect (pDB, 1);
+  safe_free (pDB->hedge.pText);
+  pDB->hedge.nTextMax = 0;
+  for (i = 0; i < pDB->nLinks; i++)
+    {
+      _route_close (&pDB->aLinks[i]);
+      safe_free (pDB->aLinks[i].pConnStr);
+    }
+  safe_free (pDB->aLinks);
+  pDB->aLinks = NULL;
+  pDB->nLinks = 0;
+}
+
+
+static int
+_route_connect (MYSQL *mysql, TRouteLink *link)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLSMALLINT buflen;
+  SQLCHAR buf[257];
+  SQLRETURN ret;
+
+  ret = SQLAllocConnect (pDB->hEnv, &link->hDbc);
+  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+    {
+      link->hDbc = SQL_NULL_HDBC;
+      goto failed;
+    }
+
+  if (mysql->options.connect_timeout)
+    SQLSetConnectAttr (link->hDbc, SQL_ATTR_LOGIN_TIMEOUT,
+	(SQLPOINTER) (SQLULEN) mysql->options.connect_timeout, 0);
+  ret = SQLDriverConnect (link->hDbc, 0, (SQLCHAR *) link->pConnStr, SQL_NTS,
+      buf, sizeof (buf), &buflen, SQL_DRIVER_NOPROMPT);
+  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+    goto failed;
+  link->bConnected = 1;
+
+  ret = SQLAllocStmt (link->hDbc, &link->hStmt);
+  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+    {
+      link->hStmt = SQL_NULL_HSTMT;
+      goto failed;
+    }
+
+  /* The session is set up as on the primary */
+  if (mysql->options.init_command)
+    {
+      ret = SQLExecDirect (link->hStmt,
+	  (SQLCHAR *) mysql->options.init_command, SQL_NTS);
+      if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+	goto failed;
+      SQLFreeStmt (link->hStmt, SQL_CLOSE);
+    }
+
+  link->bDown = 0;
+  return 0;
+
+failed:
+  _route_down (link);
+  return -1;
+}
+
+
+/*
+ *  What a read on the replica is expected to cost, 0 if it cannot take
+ *  one. _route.lock held.
+ */
+static double
+_route_cost (TRouteLink *link, unsigned long now)
+{
+  unsigned long age, latency;
+
+  if (link->bDown
+      && (link->bConnected || now - link->ulDown < ROUTE_RETRY_MS))
+    return 0;
+
+  latency = link->pTarget->ulLatency;
+  age = (now - link->pTarget->ulSampled) / ROUTE_DECAY_MS;
+  if (age)
+    latency = (age < 32) ? latency >> age : 0;
+
+  return (double) (link->pTarget->nOutstanding + 1) * (double) (latency + 1);
+}
+
+
+/*
+ *  The replica for a read, NULL if the primary has to run it
+ */
+static TRouteLink *
+_route_pick (MYSQL *mysql, int bBatch)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TRouteLink *link, *pick = NULL;
+  unsigned long now;
+  unsigned int i;
+  double total = 0, cost, x;
+
+  if (pDB->nLinks == 0 || bBatch || pDB->qcInfo.kind != SQL_KIND_READ
+      || !pDB->qcInfo.bCacheable || !pDB->bAutocommit || pDB->bInTrans
+      || pDB->bGroup || pDB->bSession)
+    return NULL;
+
+  /* xorshift, good enough to spread the load */
+  pDB->ulRoute ^= pDB->ulRoute << 13;
+  pDB->ulRoute ^= (pDB->ulRoute & 0xFFFFFFFFUL) >> 17;
+  pDB->ulRoute ^= pDB->ulRoute << 5;
+  pDB->ulRoute &= 0xFFFFFFFFUL;
+
+  now = _now_ms ();
+  MUTEX_LOCK (&_route.lock);
+  for (i = 0; i < pDB->nLinks; i++)
+    {
+      link = &pDB->aLinks[i];
+      link->dWeight = 0;
+      /* A hedge that lost may still run there */
+      if (pDB->hedge.state != HEDGE_IDLE && pDB->hedge.pLink == link)
+	continue;
+      if ((cost = _route_cost (link, now)) > 0)
+	link->dWeight = 1.0 / cost;
+      total += link->dWeight;
+    }
+
+  /* Each replica gets its share of the reads, by weight */
+  x = total * (double) pDB->ulRoute / 4294967296.0;
+  for (i = 0; i < pDB->nLinks; i++)
+    {
+      link = &pDB->aLinks[i];
+      if (link->dWeight > 0)
+	{
+	  pick = link;
+	  if ((x -= link->dWeight) < 0)
+	    break;
+	}
+    }
+  if (pick)
+    pick->pTarget->nOutstanding++;
+  MUTEX_UNLOCK (&_route.lock);
+
+  return pick;
+}
+
+
+/*
+ *  Run a read on a replica. Returns SQL_ERROR if the primary has to run
+ *  it, otherwise hStmt is now the statement of the replica.
+ */
+static SQLRETURN
+_route_read (MYSQL *mysql, int bBatch, const char *exec, long execLen)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TRouteTarget *t;
+  TRouteLink *link, *sent;
+  SQLHSTMT hStmt = SQL_NULL_HSTMT;
+  SQLRETURN ret = SQL_ERROR, first;
+  SQLCHAR state[15];
+  SQLCHAR msg[256];
+  my_ulonglong us = 0;
+  int hedge = 0;
+
+  _hedge_collect (pDB, 0);
+  if ((link = _route_pick (mysql, bBatch)) == NULL)
+    return SQL_ERROR;
+  sent = link;
+  t = link->pTarget;
+
+  if (link->bConnected || _route_connect (mysql, link) == 0)
+    {
+      hStmt = link->hStmt;
+      link->hStmt = SQL_NULL_HSTMT;
+      if (hStmt == SQL_NULL_HSTMT)
+	{
+	  ret = SQLAllocStmt (link->hDbc, &hStmt);
+	  if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+	    hStmt = SQL_NULL_HSTMT;
+	}
+      if (hStmt != SQL_NULL_HSTMT)
+	{
+	  hedge = _hedge_arm (mysql, link, hStmt, exec, execLen);
+	  us = _now_us ();
+	  ret = SQLExecDirect (hStmt, (SQLCHAR *) exec, (SQLINTEGER) execLen);
+	  us = _now_us () - us;
+	}
+    }
+  if (ret == SQL_INVALID_HANDLE)
+    ret = SQL_ERROR;
+
+  /* If the hedge won, go on with its replica and statement */
+  first = ret;
+  if (hedge)
+    ret = _hedge_settle (pDB, hedge, ret, us, &link, &hStmt);
+
+  /* A first send that lost was at least this slow */
+  MUTEX_LOCK (&_route.lock);
+  t->nOutstanding--;
+  if (first != SQL_ERROR || link != sent)
+    {
+      t->ulLatency = t->ulLatency
+	  ? (unsigned long) ((7 * (my_ulonglong) t->ulLatency + us) / 8)
+	  : (unsigned long) us + 1;
+      t->ulSampled = _now_ms ();
+    }
+  MUTEX_UNLOCK (&_route.lock);
+
+  if (ret == SQL_ERROR)
+    {
+      if (hStmt != SQL_NULL_HSTMT)
+	{
+	  state[0] = 0;
+	  SQLGetDiagRec (SQL_HANDLE_STMT, hStmt, 1, state, NULL, msg,
+	      sizeof (msg), NULL);
+	  SQLFreeStmt (hStmt, SQL_DROP);
+	  if (!strncmp ((char *) state, "08", 2))
+	    _route_down (link);
+	}
+      return SQL_ERROR;
+    }
+
+  /* The statement of the primary waits in its free list */
+  if (pDB->hStmt != SQL_NULL_HSTMT)
+    _stmt_release (pDB, pDB->hStmt);
+  pDB->hStmt = hStmt;
+  pDB->pRouted = link;
+  link->nLent++;
+
+  return ret;
+}
+
+
+/*
+ *  A statement of the replica comes back from the primary side
+ */
+static void
+_route_give (TRouteLink *link, SQLHSTMT hStmt)
+{
+  link->nLent--;
+  if (link->hStmt == SQL_NULL_HSTMT && !link->bDown)
+    {
+      SQLFreeStmt (hStmt, SQL_CLOSE);
+      SQLFreeStmt (hStmt, SQL_UNBIND);
+      link->hStmt = hStmt;
+    }
+  else
+    SQLFreeStmt (hStmt, SQL_DROP);
+
+  if (link->bDown && link->nLent == 0)
+    _route_close (link);
+}
+
+
+/*
+ *  Before the next statement, hStmt goes back to the replica that ran
+ *  the last one
+ */
+static void
+_route_return (TSQLPrivate *pDB)
+{
+  if (pDB->pRouted == NULL)
+    return;
+
+  if (pDB->hStmt != SQL_NULL_HSTMT)
+    _route_give (pDB->pRouted, pDB->hStmt);
+  else
+    pDB->pRouted->nLent--;
+  pDB->hStmt = SQL_NULL_HSTMT;
+  pDB->pRouted = NULL;
+}
+
+
+/*
+ *  Hedged reads
+ *
+ *  With hedged-reads a read that takes longer on its replica than 95 in
+ *  100 earlier executes of its class is sent to a second replica as
+ *  well. The first to finish is taken and the other one is stopped with
+ *  SQLCancel. Statements that differ in literals only are one class; the
+ *  latency of each class is kept in a histogram for the whole process.
+ *  Only what _route_pick sends to a replica is hedged, so nothing but
+ *  repeatable SELECTs outside of transactions ever runs twice. The
+ *  option is the share of those reads, in percent, that may be sent
+ *  again; the rest waits for the first send as before.
+ *
+ *  The first send runs on the calling thread. A worker sends the hedge
+ *  when the deadline passes. A hedge that loses finishes in the
+ *  background, and its replica is not used by the handle until then.
+ */
+
+/*
+ *  Statements that differ in literals only are of one class
+ */
+static unsigned int
+_hedge_class (const char *exec, long execLen)
+{
+  const char *cp = exec;
+  const char *end = exec + execLen;
+  unsigned long h = 2166136261UL;
+  TSQLToken tok;
+  size_t i;
+
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END)
+	break;
+      if (tok.type == TK_STRING || tok.type == TK_NUMBER)
+	h = (h ^ '?') * 16777619UL;
+      else
+	{
+	  for (i = 0; i < tok.len; i++)
+	    h = (h ^ (unsigned char) toupper ((unsigned char) tok.start[i]))
+		* 16777619UL;
+	}
+      h = (h ^ ' ') * 16777619UL;
+    }
+
+  return (unsigned int) (h % HEDGE_CLASSES);
+}
+
+
+/*
+ *  Histogram buckets, four to each power of two of the microseconds
+ */
+static unsigned int
+_hedge_bucket (my_ulonglong us)
+{
+  unsigned int b = 0;
+
+  if (us < 4)
+    return (unsigned int) us;
+  while ((us >> b) >= 8)
+    b++;
+  b = 4 * b + (unsigned int) (us >> b);
+
+  return (b < HEDGE_BUCKETS) ? b : HEDGE_BUCKETS - 1;
+}
+
+
+/*
+ *  Record an execute of the class, _hedge.lock held
+ */
+static void
+_hedge_sample (unsigned int iClass, my_ulonglong us)
+{
+  unsigned int *hist = _hedge.aHist[iClass];
+  unsigned int i, n;
+
+  hist[_hedge_bucket (us)]++;
+  if (++_hedge.aSamples[iClass] < HEDGE_WINDOW)
+    return;
+
+  /* Older executes count half */
+  for (n = 0, i = 0; i < HEDGE_BUCKETS; i++)
+    n += (hist[i] /= 2);
+  _hedge.aSamples[iClass] = n;
+}
+
+
+/*
+ *  The p95 latency of the class in us, 0 if too few executes were
+ *  timed. _hedge.lock held.
+ */
+static my_ulonglong
+_hedge_p95 (unsigned int iClass)
+{
+  unsigned int *hist = _hedge.aHist[iClass];
+  unsigned int i, n, left;
+
+  if ((n = _hedge.aSamples[iClass]) < HEDGE_SAMPLES)
+    return 0;
+
+  /* Upper edge of the bucket that holds the 95th percentile */
+  left = n - (n * 95 + 99) / 100;
+  for (i = HEDGE_BUCKETS - 1; i > 0 && hist[i] <= left; i--)
+    left -= hist[i];
+  if (i < 4)
+    return i + 1;
+
+  return (my_ulonglong) ((i - 4) % 4 + 5) << ((i - 4) / 4);
+}
+
+
+static void
+_hedge_spawn (void)
+{
+  TTHREAD thread;
+
+  if (_hedge.nThreads < HEDGE_THREADS
+      && THREAD_CREATE (&thread, _hedge_worker, NULL) == 0)
+    {
+      THREAD_DETACH (thread);
+      _hedge.nThreads++;
+    }
+}
+
+
+/*
+ *  The replica for the hedge: the cheapest one but the first.
+ *  _hedge.lock held, the owner of the handle is in the first send.
+ */
+static TRouteLink *
+_hedge_link (THedge *h)
+{
+  TSQLPrivate *pDB = h->pDB;
+  TRouteLink *link, *pick = NULL;
+  unsigned long now;
+  unsigned int i;
+  double cost, best = 0;
+
+  now = _now_ms ();
+  MUTEX_LOCK (&_route.lock);
+  for (i = 0; i < pDB->nLinks; i++)
+    {
+      link = &pDB->aLinks[i];
+      if (link == h->pFirst || (cost = _route_cost (link, now)) == 0)
+	continue;
+      if (pick == NULL || cost < best)
+	{
+	  pick = link;
+	  best = cost;
+	}
+    }
+  if (pick)
+    pick->pTarget->nOutstanding++;
+  MUTEX_UNLOCK (&_route.lock);
+
+  return pick;
+}
+
+
+/*
+ *  Run the hedge, on a worker. Whichever send finishes first stops the
+ *  other one.
+ */
+static void
+_hedge_send (THedge *h)
+{
+  TRouteLink *link = h->pLink;
+  TRouteTarget *t = link->pTarget;
+  SQLHSTMT hStmt = h->hStmt;
+  SQLRETURN ret = SQL_ERROR;
+  SQLCHAR state[15];
+  SQLCHAR msg[256];
+  my_ulonglong us = 0;
+  int bCancel = 0;
+  int bRun;
+
+  if (!link->bConnected && _route_connect (h->pDB->mysql, link) == 0)
+    {
+      hStmt = link->hStmt;
+      link->hStmt = SQL_NULL_HSTMT;
+    }
+  if (link->bConnected && hStmt == SQL_NULL_HSTMT)
+    {
+      ret = SQLAllocStmt (link->hDbc, &hStmt);
+      if (ret != SQL_SUCCESS && ret != SQL_SUCCESS_WITH_INFO)
+	hStmt = SQL_NULL_HSTMT;
+      ret = SQL_ERROR;
+    }
+
+  /* From here on the owner can cancel it; a first send that is back
+   * already needs no hedge
+   */
+  MUTEX_LOCK (&_hedge.lock);
+  h->hStmt = hStmt;
+  bRun = (h->winner == 0);
+  MUTEX_UNLOCK (&_hedge.lock);
+
+  if (hStmt != SQL_NULL_HSTMT && bRun)
+    {
+      us = _now_us ();
+      ret = SQLExecDirect (hStmt, (SQLCHAR *) h->pText,
+	  (SQLINTEGER) h->execLen);
+      us = _now_us () - us;
+      if (ret == SQL_INVALID_HANDLE)
+	ret = SQL_ERROR;
+      if (ret == SQL_ERROR)
+	{
+	  state[0] = 0;
+	  SQLGetDiagRec (SQL_HANDLE_STMT, hStmt, 1, state, NULL, msg,
+	      sizeof (msg), NULL);
+	  h->bLost = !strncmp ((char *) state, "08", 2);
+	}
+    }
+
+  MUTEX_LOCK (&_route.lock);
+  t->nOutstanding--;
+  if (ret != SQL_ERROR)
+    {
+      t->ulLatency = t->ulLatency
+	  ? (unsigned long) ((7 * (my_ulonglong) t->ulLatency + us) / 8)
+	  : (unsigned long) us + 1;
+      t->ulSampled = _now_ms ();
+    }
+  MUTEX_UNLOCK (&_route.lock);
+
+  MUTEX_LOCK (&_hedge.lock);
+  h->ret = ret;
+  if (ret != SQL_ERROR)
+    {
+      _hedge_sample (h->iClass, us);
+      if (h->winner == 0)
+	{
+	  h->winner = 2;
+	  bCancel = 1;
+	}
+    }
+  MUTEX_UNLOCK (&_hedge.lock);
+
+  /* The owner waits for HEDGE_DONE before it touches hFirst again */
+  if (bCancel)
+    SQLCancel (h->hFirst);
+
+  MUTEX_LOCK (&_hedge.lock);
+  h->state = HEDGE_DONE;
+  COND_BROADCAST (&_hedge.done);
+  MUTEX_UNLOCK (&_hedge.lock);
+}
+
+
+/*
+ *  Claim a hedge that is due. Returns 0 if it is not sent after all.
+ *  _hedge.lock held.
+ */
+static int
+_hedge_claim (THedge *h)
+{
+  char *text;
+
+  _hedge.pHead = h->pNext;
+  h->state = HEDGE_IDLE;
+
+  /* The cap is checked again, many may fall due at once */
+  if (_hedge.nSent * 100 >= _hedge.nReads * h->pDB->nHedgePct)
+    return 0;
+  if (h->nTextMax <= (size_t) h->execLen)
+    {
+      if ((text = (char *) realloc (h->pText, h->execLen + 1)) == NULL)
+	return 0;
+      h->pText = text;
+      h->nTextMax = (size_t) h->execLen + 1;
+    }
+  if ((h->pLink = _hedge_link (h)) == NULL)
+    return 0;
+
+  /* The text of the first send goes away when its call returns */
+  memcpy (h->pText, h->pExec, (size_t) h->execLen);
+  h->pText[h->execLen] = 0;
+  h->pExec = NULL;
+
+  /* The replica is ours until _hedge_collect */
+  h->hStmt = h->pLink->hStmt;
+  h->pLink->hStmt = SQL_NULL_HSTMT;
+  h->pLink->nLent++;
+  h->state = HEDGE_SENT;
+  _hedge.nSent++;
+
+  return 1;
+}
+
+
+static THREAD_FN
+_hedge_worker (void *arg)
+{
+  THedge *h;
+  my_ulonglong now;
+
+  MUTEX_LOCK (&_hedge.lock);
+  for (;;)
+    {
+      if ((h = _hedge.pHead) == NULL)
+	{
+	  _hedge.nIdle++;
+	  COND_WAIT (&_hedge.work, &_hedge.lock);
+	  _hedge.nIdle--;
+	  continue;
+	}
+
+      now = _now_us ();
+      if (now < h->ullDue)
+	{
+	  _hedge.nIdle++;
+	  COND_TIMEDWAIT (&_hedge.work, &_hedge.lock,
+	      (unsigned long) ((h->ullDue - now + 999) / 1000));
+	  _hedge.nIdle--;
+	  continue;
+	}
+
+      if (!_hedge_claim (h))
+	continue;
+
+      /* Someone has to watch the deadlines that are left */
+      if (_hedge.pHead && _hedge.nIdle == 0)
+	_hedge_spawn ();
+      MUTEX_UNLOCK (&_hedge.lock);
+
+      _hedge_send (h);
+
+      MUTEX_LOCK (&_hedge.lock);
+    }
+
+  return THREAD_RET;
+}
+
+
+/*
+ *  Before a replica runs a read: list it to be sent again once it takes
+ *  longer than the p95 of its class. Returns 0 without hedging, 1 if
+ *  the read is only timed and 2 if it is listed.
+ */
+static int
+_hedge_arm (MYSQL *mysql, TRouteLink *link, SQLHSTMT hStmt,
+    const char *exec, long execLen)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  THedge *h = &pDB->hedge, **pp;
+  my_ulonglong due;
+  int rc = 1;
+
+  if (pDB->nHedgePct == 0 || pDB->nLinks < 2)
+    return 0;
+
+  /* A hedge that lost may still be running under iClass */
+  h->iRead = _hedge_class (exec, execLen);
+  if (h->state != HEDGE_IDLE)
+    return 1;
+
+  MUTEX_LOCK (&_hedge.lock);
+  if (++_hedge.nReads >= HEDGE_SPAN)
+    {
+      _hedge.nReads /= 2;
+      _hedge.nSent /= 2;
+    }
+
+  if ((due = _hedge_p95 (h->iRead)) != 0
+      && _hedge.nSent * 100 < _hedge.nReads * pDB->nHedgePct)
+    {
+      if (_hedge.nIdle == 0)
+	_hedge_spawn ();
+      if (_hedge.nThreads)
+	{
+	  h->pDB = pDB;
+	  h->iClass = h->iRead;
+	  h->ullDue = _now_us () + (due > HEDGE_MIN_US ? due : HEDGE_MIN_US);
+	  h->pFirst = link;
+	  h->hFirst = hStmt;
+	  h->pExec = exec;
+	  h->execLen = execLen;
+	  h->pLink = NULL;
+	  h->hStmt = SQL_NULL_HSTMT;
+	  h->winner = 0;
+	  h->bLost = 0;
+	  h->state = HEDGE_ARMED;
+
+	  for (pp = &_hedge.pHead; *pp && (*pp)->ullDue <= h->ullDue;
+	      pp = &(*pp)->pNext)
+	    ;
+	  h->pNext = *pp;
+	  *pp = h;
+	  if (_hedge.pHead == h)
+	    COND_SIGNAL (&_hedge.work);
+	  rc = 2;
+	}
+    }
+  MUTEX_UNLOCK (&_hedge.lock);
+
+  return rc;
+}
+
+
+/*
+ *  The first send is back with ret. Returns what to go on with: that,
+ *  or the result of the hedge if it won, in which case *pLink and
+ *  *phStmt are now those of the hedge.
+ */
+static SQLRETURN
+_hedge_settle (TSQLPrivate *pDB, int hedge, SQLRETURN ret, my_ulonglong us,
+    TRouteLink **pLink, SQLHSTMT *phStmt)
+{
+  THedge *h = &pDB->hedge, **pp;
+  TRouteLink *link;
+  SQLHSTMT hCancel = SQL_NULL_HSTMT;
+
+  MUTEX_LOCK (&_hedge.lock);
+  if (hedge == 2 && h->state == HEDGE_ARMED)
+    {
+      for (pp = &_hedge.pHead; *pp != h; pp = &(*pp)->pNext)
+	;
+      *pp = h->pNext;
+      h->state = HEDGE_IDLE;
+    }
+  else if (hedge == 2 && h->state != HEDGE_IDLE)
+    {
+      if (ret != SQL_ERROR && h->winner == 0)
+	h->winner = 1;
+      if (h->winner == 1)
+	{
+	  /* Without a statement yet the worker sees the winner first */
+	  if (h->state == HEDGE_SENT)
+	    hCancel = h->hStmt;
+	}
+      else
+	{
+	  while (h->state != HEDGE_DONE)
+	    COND_WAIT (&_hedge.done, &_hedge.lock);
+	}
+    }
+  else
+    hedge = 1;
+
+  /* A first send that lost was at least this slow */
+  if (ret != SQL_ERROR || (hedge == 2 && h->winner == 2))
+    _hedge_sample (h->iRead, us);
+  MUTEX_UNLOCK (&_hedge.lock);
+
+  if (hedge == 1)
+    return ret;
+  if (hCancel != SQL_NULL_HSTMT)
+    SQLCancel (hCancel);
+
+  if (h->winner == 2)
+    {
+      /* The statement of the first send was never lent */
+      link = *pLink;
+      SQLFreeStmt (*phStmt, SQL_CLOSE);
+      if (link->hStmt == SQL_NULL_HSTMT)
+	link->hStmt = *phStmt;
+      else
+	SQLFreeStmt (*phStmt, SQL_DROP);
+
+      *pLink = h->pLink;
+      *phStmt = h->hStmt;
+      h->pLink->nLent--;
+      h->hStmt = SQL_NULL_HSTMT;
+      h->state = HEDGE_IDLE;
+      return h->ret;
+    }
+
+  _hedge_collect (pDB, 0);
+
+  return ret;
+}
+
+
+/*
+ *  A hedge that lost gives its replica back once it is done. With bWait
+ *  this waits for it.
+ */
+static void
+_hedge_collect (TSQLPrivate *pDB, int bWait)
+{
+  THedge *h = &pDB->hedge;
+
+  if (h->state == HEDGE_IDLE)
+    return;
+
+  MUTEX_LOCK (&_hedge.lock);
+  while (bWait && h->state == HEDGE_SENT)
+    COND_WAIT (&_hedge.done, &_hedge.lock);
+  bWait = (h->state == HEDGE_DONE);
+  MUTEX_UNLOCK (&_hedge.lock);
+  if (!bWait)
+    return;
+
+  if (h->bLost)
+    _route_down (h->pLink);
+  if (h->hStmt != SQL_NULL_HSTMT)
+    _route_give (h->pLink, h->hStmt);
+  else if (--h->pLink->nLent == 0 && h->pLink->bDown)
+    _route_close (h->pLink);
+  h->hStmt = SQL_NULL_HSTMT;
+  h->state = HEDGE_IDLE;
+}
+
+
+/*
+ *  Sharding
+ *
+ *  With shard-map one table is spread over several data sources by the
+ *  value of a numeric key column:
+ *
+ *	orders.id:s1=..999,s2=1000..1999,s3=2000..
+ *
+ *  Statements that name the table go to the shards, everything else to
+ *  the database named at connect. Other tables such a statement reads
+ *  must exist on the shards too. When the WHERE clause pins the key
+ *  with = or IN, ANDed at the top level, only the shards of those keys
+ *  run the statement; otherwise all of them do, each over a connection
+ *  of its own and at the same time. The rows of an INSERT go to the
+ *  shards of their keys.
+ *
+ *  A SELECT comes back as one stored result. The rows of the shards
+ *  are concatenated, or merged by ORDER BY, which each shard has already
+ *  sorted by. COUNT and SUM are added up and MIN and MAX compared, and
+ *  with GROUP BY or DISTINCT the rows of a group are folded into one.
+ *  LIMIT applies to the merged rows. What cannot be merged this way is
+ *  refused rather than answered wrong: AVG, HAVING, COUNT(DISTINCT),
+ *  ORDER BY an expression, INSERT ... SELECT.
+ *
+ *  There is no distributed transaction, each shard commits on its own.
+ *  A rollback of the client could not undo the writes on the shards, so
+ *  these are refused inside a transaction and without autocommit.
+ */
+
+static const char * const _shard_aggs[] =
+  {
+    "COUNT", "SUM", "MIN", "MAX", "AVG", "GROUP_CONCAT", "STD", "STDDEV",
+    "STDDEV_POP", "STDDEV_SAMP", "VARIANCE", "VAR_POP", "VAR_SAMP",
+    "BIT_AND", "BIT_OR", "BIT_XOR", "JSON_ARRAYAGG", "JSON_OBJECTAGG", NULL
+  };
+
+static const char * const _shard_modifiers[] =
+  {
+    "ALL", "HIGH_PRIORITY", "STRAIGHT_JOIN", "SQL_SMALL_RESULT",
+    "SQL_BIG_RESULT", "SQL_BUFFER_RESULT", "SQL_CACHE", "SQL_NO_CACHE",
+    NULL
+  };
+
+/* Clauses after WHERE */
+static const char * const _shard_ends[] =
+  {
+    "GROUP", "HAVING", "ORDER", "LIMIT", "FOR", "LOCK", "UNION", "INTO",
+    "PROCEDURE", "WINDOW", NULL
+  };
+
+
+static int
+_shard_is (TSQLToken *tok, int c)
+{
+  return tok->type == TK_PUNCT && *tok->start == c;
+}
+
+
+/*
+ *  Parses table.key:DSN=lo..hi,DSN=lo..hi,... A DSN may have several
+ *  ranges; either end of a range may be left open.
+ */
+static int
+_shard_init (MYSQL *mysql, const char *user, const char *passwd)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  const char *cp = mysql->options.shard_map;
+  const char *dot, *colon;
+  TShardRange *range;
+  TShard *shard;
+  char connStr[512];
+  char entry[256];
+  char dsn[128];
+  char *eq, *sep, *ep;
+  unsigned int nMax, i;
+  size_t n;
+
+  if (cp == NULL)
+    return 0;
+
+  cp += strspn (cp, " \t");
+  if ((colon = strchr (cp, ':')) == NULL
+      || (dot = (const char *) memchr (cp, '.', colon - cp)) == NULL
+      || dot == cp || dot + 1 == colon)
+    goto invalid;
+  pDB->pShardTable = (char *) calloc (dot - cp + 1, 1);
+  pDB->pShardKey = (char *) calloc (colon - dot, 1);
+  for (nMax = 1, n = 0; cp[n]; n++)
+    {
+      if (cp[n] == ',')
+	nMax++;
+    }
+  pDB->aShards = (TShard *) calloc (nMax, sizeof (TShard));
+  pDB->aRanges = (TShardRange *) calloc (nMax, sizeof (TShardRange));
+  if (!pDB->pShardTable || !pDB->pShardKey || !pDB->aShards
+      || !pDB->aRanges)
+    goto nomem;
+  for (n = 0; cp + n < dot; n++)
+    pDB->pShardTable[n] = tolower ((unsigned char) cp[n]);
+  memcpy (pDB->pShardKey, dot + 1, colon - dot - 1);
+
+  for (cp = colon + 1;;)
+    {
+      cp += strspn (cp, ", \t");
+      if ((n = strcspn (cp, ",")) == 0)
+	break;
+      if (n >= sizeof (entry))
+	goto invalid;
+      memcpy (entry, cp, n);
+      entry[n] = 0;
+      cp += n;
+
+      /* DSN=lo..hi */
+      if ((eq = strchr (entry, '=')) == NULL
+	  || (sep = strstr (eq + 1, "..")) == NULL)
+	goto invalid;
+      *eq = *sep = 0;
+      n = strcspn (entry, " \t");
+      if (n == 0 || n >= sizeof (dsn) || entry[n + strspn (entry + n, " \t")])
+	goto invalid;
+      memcpy (dsn, entry, n);
+      dsn[n] = 0;
+
+      range = &pDB->aRanges[pDB->nRanges];
+      range->lo = strtod (eq + 1, &ep);
+      range->bLo = (ep != eq + 1);
+      if (ep[strspn (ep, " \t")])
+	goto invalid;
+      range->hi = strtod (sep + 2, &ep);
+      range->bHi = (ep != sep + 2);
+      if (ep[strspn (ep, " \t")])
+	goto invalid;
+
+      for (i = 0; i < pDB->nShards; i++)
+	{
+	  if (!strcmp (pDB->aShards[i].pDsn, dsn))
+	    break;
+	}
+      if (i == pDB->nShards)
+	{
+	  snprintf (connStr, sizeof (connStr), "DSN=%s;UID=%s;PWD=%s", dsn,
+	      user ? user : "", passwd ? passwd : "");
+	  shard = &pDB->aShards[pDB->nShards++];
+	  if ((shard->pDsn = strdup (dsn)) == NULL
+	      || (shard->pConnStr = strdup (connStr)) == NULL)
+	    goto nomem;
+	}
+      range->iShard = i;
+      pDB->nRanges++;
+    }
+  if (pDB->nShards == 0)
+    goto invalid;
+
+  return 0;
+
+invalid:
+  _set_error (mysql, CR_UNKNOWN_ERROR);
+  return -1;
+
+nomem:
+  _set_error (mysql, CR_OUT_OF_MEMORY);
+  return -1;
+}
+
+
+static void
+_shard_free (TSQLPrivate *pDB)
+{
+  unsigned int i;
+
+  for (i = 0; i < pDB->nShards; i++)
+    {
+      if (pDB->aShards[i].mysql)
+	_impl_close (pDB->aShards[i].mysql);
+      safe_free (pDB->aShards[i].pDsn);
+      safe_free (pDB->aShards[i].pConnStr);
+      safe_free (pDB->aShards[i].pOwnText);
+    }
+  safe_free (pDB->aShards);
+  safe_free (pDB->aRanges);
+  safe_free (pDB->pShardTable);
+  safe_free (pDB->pShardKey);
+  pDB->aShards = NULL;
+  pDB->aRanges = NULL;
+  pDB->pShardTable = NULL;
+  pDB->pShardKey = NULL;
+  pDB->nShards = 0;
+  pDB->nRanges = 0;
+}
+
+
+/*
+ *  The shard of a key, -1 if no range has it
+ */
+static int
+_shard_of (TSQLPrivate *pDB, double key)
+{
+  TShardRange *range;
+  unsigned int i;
+
+  for (i = 0, range = pDB->aRanges; i < pDB->nRanges; i++, range++)
+    {
+      if ((!range->bLo || key >= range->lo)
+	  && (!range->bHi || key <= range->hi))
+	return (int) range->iShard;
+    }
+
+  return -1;
+}
+
+
+static int
+_shard_tok_eq (TSQLToken *tok, const char *name)
+{
+  const char *cp = tok->start;
+  size_t len = tok->len;
+
+  if (tok->type == TK_QUOTED && len >= 2)
+    {
+      cp++;
+      len -= 2;
+    }
+  else if (tok->type != TK_WORD)
+    return 0;
+
+  return strlen (name) == len && !strncasecmp (cp, name, len);
+}
+
+
+static int
+_shard_is_key (TSQLPrivate *pDB, TSQLToken *tok)
+{
+  return _shard_tok_eq (tok, pDB->pShardKey);
+}
+
+
+/* Words after a table name that are not its alias */
+static const char * const _shard_joins[] =
+  {
+    "JOIN", "INNER", "LEFT", "RIGHT", "CROSS", "NATURAL", "STRAIGHT_JOIN",
+    "FULL", "OUTER", NULL
+  };
+
+/*
+ *  Whether a [qual.]key in the statement at query is a column of the
+ *  sharded table: qual is the table or its alias, or without qual the
+ *  statement names no other table. A table joined with itself does not
+ *  qualify, its other rows may be anywhere.
+ */
+static int
+_shard_qualifies (TSQLPrivate *pDB, const char *query, const char *end,
+    TSQLToken *qual)
+{
+  const char *cp = query;
+  const char *after;
+  TSQLToken tok, alias;
+  int bMatch = 0;
+  int nSeen = 0;
+
+  if (qual == NULL)
+    return pDB->qcInfo.nTables == 1 && !pDB->qcInfo.bAllTables;
+
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END)
+	break;
+      if (!_shard_tok_eq (&tok, pDB->pShardTable))
+	continue;
+
+      /* table [AS] alias, not table.column */
+      after = _sql_token (cp, end, &alias);
+      if (_shard_is (&alias, '.'))
+	continue;
+      cp = after;
+      nSeen++;
+      if (_shard_tok_eq (qual, pDB->pShardTable))
+	bMatch = 1;
+      if (_tok_is (&alias, "AS"))
+	cp = _sql_token (cp, end, &alias);
+      if ((alias.type == TK_WORD || alias.type == TK_QUOTED)
+	  && !_tok_in (&alias, _sql_clause_end)
+	  && !_tok_in (&alias, _shard_joins)
+	  && alias.len == qual->len
+	  && !strncasecmp (alias.start, qual->start, qual->len))
+	bMatch = 1;
+    }
+
+  return bMatch && nSeen == 1;
+}
+
+
+/*
+ *  A literal key at cp, a number or a quoted number. Returns the
+ *  position after it, NULL if there is something else.
+ */
+static const char *
+_shard_value (const char *cp, const char *end, double *pValue)
+{
+  TSQLToken tok;
+  char buf[64];
+  char *ep;
+  size_t off = 0;
+  int bNeg = 0;
+
+  cp = _sql_token (cp, end, &tok);
+  if (_shard_is (&tok, '-') || _shard_is (&tok, '+'))
+    {
+      bNeg = _shard_is (&tok, '-');
+      cp = _sql_token (cp, end, &tok);
+    }
+  if (tok.type == TK_STRING && tok.len >= 2)
+    off = 1;
+  else if (tok.type != TK_NUMBER)
+    return NULL;
+  if (tok.len - 2 * off >= sizeof (buf))
+    return NULL;
+  memcpy (buf, tok.start + off, tok.len - 2 * off);
+  buf[tok.len - 2 * off] = 0;
+
+  *pValue = strtod (buf, &ep);
+  if (ep == buf || *ep)
+    return NULL;
+  if (bNeg)
+    *pValue = -*pValue;
+
+  return cp;
+}
+
+
+static void
+_shard_unmark (TSQLPrivate *pDB)
+{
+  unsigned int i;
+
+  for (i = 0; i < pDB->nShards; i++)
+    pDB->aShards[i].bUsed = 0;
+}
+
+
+/*
+ *  Marks the shard of a key, returns 1 if it was not marked before
+ */
+static int
+_shard_mark (TSQLPrivate *pDB, double key)
+{
+  int i;
+
+  if ((i = _shard_of (pDB, key)) < 0 || pDB->aShards[i].bUsed)
+    return 0;
+  pDB->aShards[i].bUsed = 1;
+
+  return 1;
+}
+
+
+/*
+ *  Where the WHERE clause of a statement begins, NULL if there is none
+ */
+static const char *
+_shard_find_where (const char *cp, const char *end)
+{
+  TSQLToken tok;
+  int depth = 0;
+
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END)
+	return NULL;
+      if (_shard_is (&tok, '('))
+	depth++;
+      else if (_shard_is (&tok, ')'))
+	depth--;
+      else if (depth == 0 && _tok_is (&tok, "WHERE"))
+	return cp;
+    }
+}
+
+
+/*
+ *  Marks the shards a WHERE clause at cp keeps to: key = literal or key
+ *  IN (literals), ANDed at the top level, where key is a column of the
+ *  sharded table. Returns how many, 0 if any shard may have rows.
+ */
+static unsigned int
+_shard_where (TSQLPrivate *pDB, const char *query, const char *cp,
+    const char *end)
+{
+  TSQLToken tok, next, qual;
+  const char *after, *vp;
+  unsigned int n = 0;
+  int depth = 0;
+  int bStart = 1;
+  int bFound = 0;
+  int bQual;
+  double key;
+
+  _shard_unmark (pDB);
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END || _shard_is (&tok, ';'))
+	break;
+      if (_shard_is (&tok, '('))
+	depth++;
+      else if (_shard_is (&tok, ')'))
+	depth--;
+      if (depth > 0 || _shard_is (&tok, ')'))
+	{
+	  bStart = 0;
+	  continue;
+	}
+      if (_tok_in (&tok, _shard_ends))
+	break;
+
+      /* Any OR at the top level and every shard may have rows */
+      if (_tok_is (&tok, "OR") || _tok_is (&tok, "XOR")
+	  || _shard_is (&tok, '|'))
+	{
+	  n = 0;
+	  break;
+	}
+      if (_tok_is (&tok, "AND") || _shard_is (&tok, '&'))
+	{
+	  bStart = 1;
+	  continue;
+	}
+      if (!bStart || bFound)
+	continue;
+      bStart = 0;
+
+      /* [table.]key */
+      after = _sql_token (cp, end, &next);
+      bQual = _shard_is (&next, '.');
+      if (bQual)
+	{
+	  qual = tok;
+	  cp = _sql_token (after, end, &tok);
+	  after = _sql_token (cp, end, &next);
+	}
+      if (!_shard_is_key (pDB, &tok)
+	  || !_shard_qualifies (pDB, query, end, bQual ? &qual : NULL))
+	continue;
+
+      if (_shard_is (&next, '='))
+	{
+	  if ((vp = _shard_value (after, end, &key)) == NULL)
+	    continue;
+	  _sql_token (vp, end, &next);
+	  if (next.type != TK_END && !_shard_is (&next, ';')
+	      && !_tok_is (&next, "AND") && !_shard_is (&next, '&')
+	      && !_tok_in (&next, _shard_ends))
+	    continue;
+	  n += _shard_mark (pDB, key);
+	  bFound = 1;
+	  cp = vp;
+	}
+      else if (_tok_is (&next, "IN"))
+	{
+	  vp = _sql_token (after, end, &next);
+	  if (!_shard_is (&next, '('))
+	    continue;
+	  do
+	    {
+	      if ((vp = _shard_value (vp, end, &key)) == NULL)
+		break;
+	      n += _shard_mark (pDB, key);
+	      vp = _sql_token (vp, end, &next);
+	    }
+	  while (_shard_is (&next, ','));
+	  if (vp == NULL || !_shard_is (&next, ')'))
+	    {
+	      /* Not a plain list after all */
+	      n = 0;
+	      _shard_unmark (pDB);
+	      continue;
+	    }
+	  bFound = 1;
+	  cp = vp;
+	}
+    }
+
+  if (n == 0)
+    _shard_unmark (pDB);
+
+  return n;
+}
+
+
+/*
+ *  One item of the select list, up to the token that ends it. Its kind
+ *  goes to *pKind, -1 when shard results of it cannot be merged.
+ */
+static const char *
+_shard_item (const char *cp, const char *end, TSQLToken *term, int *pKind,
+    int *pbStar)
+{
+  TSQLToken tok, next;
+  int nTok, depth = 0;
+  int nAfter = -1;		/* tokens after an aggregate call */
+  int bDot = 0;
+
+  *pKind = SHARD_PLAIN;
+  for (nTok = 0;; nTok++)
+    {
+      cp = _sql_token (cp, end, term);
+      tok = *term;
+      if (tok.type == TK_END || (depth == 0 && (_shard_is (&tok, ',')
+	  || _shard_is (&tok, ';') || _tok_is (&tok, "FROM"))))
+	break;
+      if (nAfter >= 0)
+	{
+	  /* Only an alias may follow */
+	  if (nAfter == 0 && _tok_is (&tok, "AS"))
+	    continue;
+	  if (nAfter++ || (tok.type != TK_WORD && tok.type != TK_QUOTED
+	      && tok.type != TK_STRING))
+	    *pKind = -1;
+	  continue;
+	}
+      if (_shard_is (&tok, '('))
+	depth++;
+      else if (_shard_is (&tok, ')'))
+	depth--;
+      else if (_shard_is (&tok, '*') && (nTok == 0 || bDot))
+	*pbStar = 1;
+      else if (_tok_in (&tok, _shard_aggs))
+	{
+	  _sql_token (cp, end, &next);
+	  if (!_shard_is (&next, '('))
+	    ;
+	  else if (nTok || depth)
+	    *pKind = -1;	/* inside an expression */
+	  else
+	    {
+	      if (_tok_is (&tok, "COUNT") || _tok_is (&tok, "SUM"))
+		*pKind = SHARD_SUM;
+	      else if (_tok_is (&tok, "MIN"))
+		*pKind = SHARD_MIN;
+	      else if (_tok_is (&tok, "MAX"))
+		*pKind = SHARD_MAX;
+	      else
+		*pKind = -1;
+
+	      cp = _sql_token (cp, end, &next);
+	      _sql_token (cp, end, &next);
+	      if (_tok_is (&next, "DISTINCT") && *pKind == SHARD_SUM)
+		*pKind = -1;
+	      for (depth = 1; depth > 0; )
+		{
+		  cp = _sql_token (cp, end, &next);
+		  if (next.type == TK_END)
+		    {
+		      *pKind = -1;
+		      break;
+		    }
+		  if (_shard_is (&next, '('))
+		    depth++;
+		  else if (_shard_is (&next, ')'))
+		    depth--;
+		}
+	      depth = 0;
+	      nAfter = 0;
+	    }
+	}
+      bDot = _shard_is (&tok, '.');
+    }
+
+  return cp;
+}
+
+
+/*
+ *  Two names the same, quoted or not
+ */
+static int
+_shard_tok_same (TSQLToken *a, TSQLToken *b)
+{
+  const char *ap = a->start, *bp = b->start;
+  size_t an = a->len, bn = b->len;
+
+  if (a->type == TK_QUOTED && an >= 2)
+    {
+      ap++;
+      an -= 2;
+    }
+  if (b->type == TK_QUOTED && bn >= 2)
+    {
+      bp++;
+      bn -= 2;
+    }
+
+  return an == bn && !strncasecmp (ap, bp, an);
+}
+
+
+/*
+ *  The column and the alias of a select item that is a plain column,
+ *  [table.]column [[AS] alias]. For any other item name gets TK_END.
+ */
+static void
+_shard_item_name (const char *cp, const char *end, TSQLToken *name,
+    TSQLToken *alias)
+{
+  TSQLToken tok;
+
+  alias->type = TK_END;
+  cp = _sql_token (cp, end, name);
+  for (;;)
+    {
+      if (name->type != TK_WORD && name->type != TK_QUOTED)
+	{
+	  name->type = TK_END;
+	  return;
+	}
+      cp = _sql_token (cp, end, &tok);
+      if (!_shard_is (&tok, '.'))
+	break;
+      cp = _sql_token (cp, end, name);
+    }
+  if (_tok_is (&tok, "AS"))
+    cp = _sql_token (cp, end, &tok);
+  if (tok.type == TK_WORD || tok.type == TK_QUOTED)
+    {
+      *alias = tok;
+      cp = _sql_token (cp, end, &tok);
+    }
+  if (tok.type != TK_END)
+    name->type = TK_END;
+}
+
+
+/*
+ *  Reads what the merge of a scattered SELECT needs from the statement.
+ *  Returns -1 with the error set if it cannot be merged.
+ */
+static int
+_shard_select (MYSQL *mysql, TShardPlan *plan, const char *q, size_t len)
+{
+  const char *end = q + len;
+  const char *cp, *np, *ip;
+  TSQLToken aName[SHARD_ITEMS], aAlias[SHARD_ITEMS];
+  TSQLToken tok, next;
+  char *ep;
+  unsigned long value;
+  unsigned int j;
+  int kind, depth = 0;
+  size_t n;
+
+  memset (plan, 0, sizeof (TShardPlan));
+  cp = _sql_token (q, end, &tok);		/* SELECT */
+  for (;;)
+    {
+      np = _sql_token (cp, end, &tok);
+      if (_tok_is (&tok, "DISTINCT") || _tok_is (&tok, "DISTINCTROW"))
+	plan->bGroup = 1;
+      else if (!_tok_in (&tok, _shard_modifiers))
+	break;
+      cp = np;
+    }
+
+  /* The select list */
+  do
+    {
+      ip = cp;
+      cp = _shard_item (cp, end, &tok, &kind, &plan->bStar);
+      if (kind < 0)
+	goto unsupported;
+      if (kind != SHARD_PLAIN)
+	plan->bAgg = 1;
+      if (plan->nItems < SHARD_ITEMS)
+	{
+	  plan->aItem[plan->nItems] = (unsigned char) kind;
+	  _shard_item_name (ip, tok.start, &aName[plan->nItems],
+	      &aAlias[plan->nItems]);
+	}
+      else if (plan->bAgg)
+	goto unsupported;
+      plan->nItems++;
+    }
+  while (_shard_is (&tok, ','));
+  if (!_tok_is (&tok, "FROM") || (plan->bStar && plan->bAgg))
+    goto unsupported;
+
+  /* Clauses after FROM */
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END || _shard_is (&tok, ';'))
+	break;
+      if (_shard_is (&tok, '('))
+	depth++;
+      else if (_shard_is (&tok, ')'))
+	depth--;
+      if (depth > 0)
+	continue;
+
+      if (_tok_is (&tok, "GROUP"))
+	{
+	  /* Each term one of the plain columns the rows fold on */
+	  plan->bGroup = plan->bGroupBy = 1;
+	  cp = _sql_token (cp, end, &tok);	/* BY */
+	  do
+	    {
+	      cp = _sql_token (cp, end, &tok);
+	      if (tok.type == TK_NUMBER)
+		{
+		  value = strtoul (tok.start, &ep, 10);
+		  if (ep != tok.start + tok.len || value == 0
+		      || value > plan->nItems || value > SHARD_ITEMS)
+		    goto unsupported;
+		  j = (unsigned int) value - 1;
+		}
+	      else
+		{
+		  for (;;)
+		    {
+		      if (tok.type != TK_WORD && tok.type != TK_QUOTED)
+			goto unsupported;
+		      np = _sql_token (cp, end, &next);
+		      if (!_shard_is (&next, '.'))
+			break;
+		      cp = _sql_token (np, end, &tok);
+		    }
+		  for (j = 0; j < plan->nItems && j < SHARD_ITEMS; j++)
+		    {
+		      if (aName[j].type != TK_END
+			  && (_shard_tok_same (&aName[j], &tok)
+			  || (aAlias[j].type != TK_END
+			  && _shard_tok_same (&aAlias[j], &tok))))
+			break;
+		    }
+		  if (j == plan->nItems || j == SHARD_ITEMS)
+		    goto unsupported;
+		}
+	      if (plan->aItem[j] != SHARD_PLAIN || aName[j].type == TK_END)
+		goto unsupported;
+	      plan->aKey[j] = 1;
+
+	      np = _sql_token (cp, end, &tok);
+	      if (_tok_is (&tok, "ASC") || _tok_is (&tok, "DESC"))
+		{
+		  cp = np;
+		  np = _sql_token (cp, end, &tok);
+		}
+	      if (_shard_is (&tok, ','))
+		cp = np;
+	      else if (tok.type != TK_END && !_shard_is (&tok, ';')
+		  && !_tok_in (&tok, _shard_ends))
+		goto unsupported;	/* an expression, WITH ROLLUP */
+	    }
+	  while (_shard_is (&tok, ','));
+	}
+      else if (_tok_is (&tok, "HAVING") || _tok_is (&tok, "UNION")
+	  || _tok_is (&tok, "INTERSECT") || _tok_is (&tok, "EXCEPT")
+	  || _tok_is (&tok, "ROLLUP"))
+	goto unsupported;
+      else if (_tok_is (&tok, "ORDER"))
+	{
+	  cp = _sql_token (cp, end, &tok);	/* BY */
+	  do
+	    {
+	      if (plan->nOrder == SHARD_ORDER)
+		goto unsupported;
+	      cp = _sql_token (cp, end, &tok);
+	      if (tok.type == TK_NUMBER)
+		{
+		  value = strtoul (tok.start, &ep, 10);
+		  if (ep != tok.start + tok.len || value == 0)
+		    goto unsupported;
+		  plan->aOrderCol[plan->nOrder] = (int) value - 1;
+		}
+	      else
+		{
+		  /* The column part of a qualified name */
+		  for (;;)
+		    {
+		      if (tok.type != TK_WORD && tok.type != TK_QUOTED)
+			goto unsupported;
+		      np = _sql_token (cp, end, &next);
+		      if (!_shard_is (&next, '.'))
+			break;
+		      cp = _sql_token (np, end, &tok);
+		    }
+		  n = tok.len;
+		  np = tok.start;
+		  if (tok.type == TK_QUOTED && n >= 2)
+		    {
+		      np++;
+		      n -= 2;
+		    }
+		  if (n > NAME_LEN)
+		    goto unsupported;
+		  memcpy (plan->aOrderName[plan->nOrder], np, n);
+		  plan->aOrderName[plan->nOrder][n] = 0;
+		  plan->aOrderCol[plan->nOrder] = -1;
+		}
+	      np = _sql_token (cp, end, &tok);
+	      if (_tok_is (&tok, "ASC") || _tok_is (&tok, "DESC"))
+		{
+		  plan->aOrderDesc[plan->nOrder] = _tok_is (&tok, "DESC");
+		  cp = np;
+		  np = _sql_token (cp, end, &tok);
+		}
+	      plan->nOrder++;
+	      if (_shard_is (&tok, ','))
+		cp = np;
+	      else if (tok.type != TK_END && !_shard_is (&tok, ';')
+		  && !_tok_in (&tok, _shard_ends))
+		goto unsupported;	/* an expression */
+	    }
+	  while (_shard_is (&tok, ','));
+	}
+      else if (_tok_is (&tok, "LIMIT"))
+	{
+	  plan->bLimit = 1;
+	  plan->limStart = tok.start - q;
+	  cp = _sql_token (cp, end, &tok);
+	  if (tok.type != TK_NUMBER)
+	    goto unsupported;
+	  plan->nLimit = strtoul (tok.start, NULL, 10);
+	  np = _sql_token (cp, end, &next);
+	  if (_shard_is (&next, ',') || _tok_is (&next, "OFFSET"))
+	    {
+	      cp = _sql_token (np, end, &tok);
+	      if (tok.type != TK_NUMBER)
+		goto unsupported;
+	      value = strtoul (tok.start, NULL, 10);
+	      if (_shard_is (&next, ','))
+		{
+		  plan->nOffset = plan->nLimit;
+		  plan->nLimit = value;
+		}
+	      else
+		plan->nOffset = value;
+	    }
+	  plan->limEnd = cp - q;
+	}
+    }
+
+  return 0;
+
+unsupported:
+  _set_error (mysql, ER_NOT_SUPPORTED_YET);
+  return -1;
+}
+
+
+/*
+ *  Returns 1 if the statement has a LIMIT of its own, not one of a
+ *  subquery
+ */
+static int
+_shard_limited (const char *cp, const char *end)
+{
+  TSQLToken tok;
+  int depth = 0;
+
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END || _shard_is (&tok, ';'))
+	return 0;
+      if (_shard_is (&tok, '('))
+	depth++;
+      else if (_shard_is (&tok, ')'))
+	depth--;
+      else if (depth == 0 && _tok_is (&tok, "LIMIT"))
+	return 1;
+    }
+}
+
+
+/*
+ *  Returns 1 if an UPDATE assigns to the key, which could move rows to
+ *  another shard
+ */
+static int
+_shard_sets_key (TSQLPrivate *pDB, const char *cp, const char *end)
+{
+  TSQLToken tok, next;
+  const char *np;
+  int depth = 0;
+  int bStart = 0;
+
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END || _shard_is (&tok, ';'))
+	return 0;
+      if (_shard_is (&tok, '('))
+	depth++;
+      else if (_shard_is (&tok, ')'))
+	depth--;
+      if (depth > 0)
+	continue;
+      if (_tok_is (&tok, "SET") || _shard_is (&tok, ','))
+	{
+	  bStart = 1;
+	  continue;
+	}
+      if (_tok_is (&tok, "WHERE") || _tok_in (&tok, _shard_ends))
+	return 0;
+      if (!bStart)
+	continue;
+      bStart = 0;
+
+      np = _sql_token (cp, end, &next);
+      while (_shard_is (&next, '.'))
+	{
+	  cp = _sql_token (np, end, &tok);
+	  np = _sql_token (cp, end, &next);
+	}
+      if (_shard_is_key (pDB, &tok) && _shard_is (&next, '='))
+	return 1;
+    }
+}
+
+
+/*
+ *  Copies the error of a shard connection to the client handle
+ */
+static void
+_shard_error (MYSQL *mysql, MYSQL *w)
+{
+  mysql->net.last_errno = w->net.last_errno;
+  strcpy (mysql->net.last_error, w->net.last_error);
+  strcpy (DBOF(mysql)->szSqlState, DBOF(w)->szSqlState);
+}
+
+
+/*
+ *  The connection to a shard takes the settings of the client handle.
+ *  It is opened by the first statement, see _shard_worker.
+ */
+static MYSQL *
+_shard_handle (MYSQL *mysql, TShard *shard)
+{
+  MYSQL *w;
+
+  if (shard->mysql)
+    return shard->mysql;
+
+  if ((w = _impl_init (NULL)) == NULL || _alloc_db (w))
+    {
+      if (w)
+	_impl_close (w);
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return NULL;
+    }
+  w->client_flag = mysql->client_flag & ~CLIENT_MULTI_STATEMENTS;
+  w->reconnect = mysql->reconnect;
+  w->options.connect_timeout = mysql->options.connect_timeout;
+  w->options.fetch_batch_size = mysql->options.fetch_batch_size;
+  w->options.max_column_buffer = mysql->options.max_column_buffer;
+  w->options.max_result_buffer = mysql->options.max_result_buffer;
+  w->options.init_command = safe_dup (mysql->options.init_command);
+  w->options.odbc_charset = safe_dup (mysql->options.odbc_charset);
+  w->options.charset_name = safe_dup (mysql->options.charset_name);
+  w->options.sql_dialect = safe_dup (mysql->options.sql_dialect);
+
+  /* The query cache tells the shards apart by database */
+  w->db = safe_dup (shard->pDsn);
+  w->user = safe_dup (mysql->user);
+  _apply_options (w);
+  shard->mysql = w;
+
+  return w;
+}
+
+
+static THREAD_FN
+_shard_worker (void *arg)
+{
+  TShard *shard = (TShard *) arg;
+  MYSQL *w = shard->mysql;
+  TSQLPrivate *pDB = DBOF(w);
+
+  shard->rc = -1;
+  if (pDB->pConnStr == NULL && _connect_db (w, shard->pConnStr))
+    return THREAD_RET;
+  if (_query_run (w, shard->pText, (long) shard->nText, 0))
+    return THREAD_RET;
+
+  if (w->field_count)
+    {
+      if ((shard->pRes = _impl_store_result (w)) == NULL)
+	return THREAD_RET;
+      _meta_resolve (shard->pRes);
+    }
+  else
+    {
+      if (pDB->bRowCountPending)
+	_impl_affected_rows (w);
+      if (pDB->bIdentityPending)
+	_impl_insert_id (w);
+      shard->affected = w->affected_rows;
+      shard->insertId = w->insert_id;
+    }
+  shard->rc = 0;
+
+  return THREAD_RET;
+}
+
+
+/*
+ *  Runs the statement on the marked shards, all but the first in
+ *  threads of their own. The first error goes to the client handle.
+ */
+static int
+_shard_exec (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TShard *shard, *first = NULL;
+  unsigned int i;
+  int rc = 0;
+
+  for (i = 0, shard = pDB->aShards; i < pDB->nShards; i++, shard++)
+    {
+      shard->pRes = NULL;
+      shard->bThread = 0;
+      if (!shard->bUsed)
+	continue;
+      if (_shard_handle (mysql, shard) == NULL)
+	return -1;
+      if (first == NULL)
+	first = shard;
+    }
+  if (first == NULL)
+    return 0;
+
+  for (shard = first + 1; shard < pDB->aShards + pDB->nShards; shard++)
+    {
+      if (shard->bUsed)
+	shard->bThread = !THREAD_CREATE (&shard->thread, _shard_worker, shard);
+    }
+
+  _shard_worker (first);
+
+  for (i = 0, shard = pDB->aShards; i < pDB->nShards; i++, shard++)
+    {
+      if (!shard->bUsed)
+	continue;
+      if (shard->bThread)
+	THREAD_JOIN (shard->thread);
+      else if (shard != first)
+	_shard_worker (shard);
+      if (shard->rc == 0)
+	continue;
+      if (rc == 0)
+	{
+	  _shard_error (mysql, shard->mysql);
+	  rc = -1;
+	}
+
+      /* Connected again for the next statement */
+      if (!DBOF(shard->mysql)->bConnected)
+	{
+	  _impl_close (shard->mysql);
+	  shard->mysql = NULL;
+	}
+    }
+
+  if (rc)
+    {
+      for (i = 0, shard = pDB->aShards; i < pDB->nShards; i++, shard++)
+	{
+	  if (shard->pRes)
+	    _free_res (shard->pRes);
+	  shard->pRes = NULL;
+	}
+    }
+
+  return rc;
+}
+
+
+static void
+_shard_row_free (MYSQL_ROWS *row, unsigned int nFields)
+{
+  unsigned int j;
+
+  for (j = 0; j < nFields; j++)
+    safe_free (row->data[j]);
+  free (row);
+}
+
+
+/*
+ *  Moves the rows of a shard result to aRows. Rows shared with the query
+ *  cache are copied.
+ */
+static int
+_shard_take (MYSQL_RES *res, MYSQL_ROWS **aRows, size_t *pnRows)
+{
+  MYSQL_ROWS *r, *copy;
+  unsigned int j;
+
+  for (r = res->data->data; r; r = r->next)
+    {
+      if (RESOF(res)->pCached == NULL)
+	{
+	  aRows[(*pnRows)++] = r;
+	  continue;
+	}
+      copy = (MYSQL_ROWS *) calloc (1,
+	  sizeof (MYSQL_ROWS) + res->field_count * sizeof (char *));
+      if (copy == NULL)
+	return -1;
+      copy->data = (char **) (copy + 1);
+      aRows[(*pnRows)++] = copy;
+      for (j = 0; j < res->field_count; j++)
+	{
+	  if (r->data[j] && (copy->data[j] = strdup (r->data[j])) == NULL)
+	    return -1;
+	}
+    }
+
+  if (RESOF(res)->pCached == NULL)
+    {
+      res->data->data = NULL;
+      res->data->rows = 0;
+      res->data_cursor = NULL;
+    }
+
+  return 0;
+}
+
+
+/*
+ *  Order of two values of a column. NULL sorts first; the rest compares
+ *  by number or by bytes.
+ */
+static int
+_shard_compare (MYSQL_FIELD *f, const char *a, const char *b)
+{
+  double x, y;
+
+  if (a == NULL || b == NULL)
+    return (a != NULL) - (b != NULL);
+  if (IS_NUM_FIELD (f) && f->type != FIELD_TYPE_TIMESTAMP)
+    {
+      x = strtod (a, NULL);
+      y = strtod (b, NULL);
+      return (x > y) - (x < y);
+    }
+
+  return strcmp (a, b);
+}
+
+
+static int
+_shard_cmp (TShardPlan *plan, MYSQL_FIELD *fields, MYSQL_ROWS *a,
+    MYSQL_ROWS *b)
+{
+  unsigned int k;
+  int col, c;
+
+  for (k = 0; k < plan->nOrder; k++)
+    {
+      col = plan->aOrderCol[k];
+      c = _shard_compare (&fields[col], a->data[col], b->data[col]);
+      if (c)
+	return plan->aOrderDesc[k] ? -c : c;
+    }
+
+  return 0;
+}
+
+
+/*
+ *  Stable natural merge sort. Each shard sent its rows sorted, so the
+ *  first pass finds one run per shard and log2(shards) passes merge them.
+ */
+static int
+_shard_sort (TShardPlan *plan, MYSQL_FIELD *fields, MYSQL_ROWS **aRows,
+    size_t nRows)
+{
+  MYSQL_ROWS **src = aRows, **dst, **buf, **swap;
+  size_t lo, mid, hi, i, j, k;
+  unsigned int nRuns;
+
+  if (nRows < 2)
+    return 0;
+  buf = (MYSQL_ROWS **) malloc (nRows * sizeof (MYSQL_ROWS *));
+  if ((dst = buf) == NULL)
+    return -1;
+
+  do
+    {
+      /* Merge each pair of runs */
+      for (nRuns = 0, lo = 0; lo < nRows; lo = hi, nRuns++)
+	{
+	  for (mid = lo + 1; mid < nRows
+	      && _shard_cmp (plan, fields, src[mid - 1], src[mid]) <= 0; mid++)
+	    ;
+	  for (hi = mid + 1; hi < nRows
+	      && _shard_cmp (plan, fields, src[hi - 1], src[hi]) <= 0; hi++)
+	    ;
+	  if (hi > nRows)
+	    hi = nRows;
+	  for (i = lo, j = mid, k = lo; k < hi; k++)
+	    {
+	      if (j == hi || (i < mid
+		  && _shard_cmp (plan, fields, src[i], src[j]) <= 0))
+		dst[k] = src[i++];
+	      else
+		dst[k] = src[j++];
+	    }
+	}
+      swap = src;
+      src = dst;
+      dst = swap;
+    }
+  while (nRuns > 1);
+
+  if (src != aRows)
+    memcpy (aRows, src, nRows * sizeof (MYSQL_ROWS *));
+  free (buf);
+
+  return 0;
+}
+
+
+static int
+_shard_kind (TShardPlan *plan, unsigned int j)
+{
+  return (plan->bAgg && j < plan->nItems) ? plan->aItem[j] : SHARD_PLAIN;
+}
+
+
+/* An exact number as the server prints it, [-]digits[.digits] */
+typedef struct
+  {
+    int bNeg;
+    const char *pInt;
+    size_t nInt;
+    const char *pDec;
+    size_t nDec;
+  }
+TShardNum;
+
+
+static void
+_shard_num (const char *cp, TShardNum *num)
+{
+  while (isspace ((unsigned char) *cp))
+    cp++;
+  num->bNeg = *cp == '-';
+  if (*cp == '-' || *cp == '+')
+    cp++;
+  num->pInt = cp;
+  num->nInt = strspn (cp, "0123456789");
+  cp += num->nInt;
+  num->pDec = *cp == '.' ? cp + 1 : cp;
+  num->nDec = strspn (num->pDec, "0123456789");
+}
+
+
+/* Digit k of num written with nInt integer digits */
+static int
+_shard_digit (TShardNum *num, size_t nInt, size_t k)
+{
+  if (k >= nInt)
+    return k - nInt < num->nDec ? num->pDec[k - nInt] - '0' : 0;
+  if (k < nInt - num->nInt)
+    return 0;
+  return num->pInt[k - (nInt - num->nInt)] - '0';
+}
+
+
+/*
+ *  Sums two exact numbers digit by digit, so a DECIMAL or BIGINT total
+ *  keeps every digit the shards returned. Returns a malloc'd string.
+ */
+static char *
+_shard_sum (const char *a, const char *b)
+{
+  TShardNum x, y, *big, *small;
+  size_t nInt, nDec, n, k;
+  int bNeg, bSub, c, d;
+  char *digits, *res, *cp;
+
+  _shard_num (a, &x);
+  _shard_num (b, &y);
+  nInt = (x.nInt > y.nInt ? x.nInt : y.nInt) + 1;
+  nDec = x.nDec > y.nDec ? x.nDec : y.nDec;
+  n = nInt + nDec;
+
+  /* Subtract the smaller magnitude from the larger one */
+  big = &x;
+  small = &y;
+  bSub = x.bNeg != y.bNeg;
+  if (bSub)
+    {
+      for (k = 0; k < n; k++)
+	if ((c = _shard_digit (&x, nInt, k) - _shard_digit (&y, nInt, k)))
+	  break;
+      if (k < n && c < 0)
+	{
+	  big = &y;
+	  small = &x;
+	}
+    }
+  bNeg = big->bNeg;
+
+  if ((digits = (char *) malloc (n)) == NULL)
+    return NULL;
+  for (c = 0, k = n; k-- > 0;)
+    {
+      d = _shard_digit (small, nInt, k);
+      d = _shard_digit (big, nInt, k) + (bSub ? -d : d) + c;
+      c = d < 0 ? -1 : d / 10;
+      digits[k] = (char) ('0' + (d + 10) % 10);
+    }
+
+  for (k = 0; k < n && digits[k] == '0'; k++)
+    ;
+  if (k == n)
+    bNeg = 0;
+
+  if ((res = (char *) malloc (n + 3)) == NULL)
+    {
+      free (digits);
+      return NULL;
+    }
+  cp = res;
+  if (bNeg)
+    *cp++ = '-';
+  for (k = 0; k < nInt - 1 && digits[k] == '0'; k++)
+    ;
+  memcpy (cp, digits + k, nInt - k);
+  cp += nInt - k;
+  if (nDec)
+    {
+      *cp++ = '.';
+      memcpy (cp, digits + nInt, nDec);
+      cp += nDec;
+    }
+  *cp = 0;
+  free (digits);
+
+  return res;
+}
+
+
+/*
+ *  Adds two values of a COUNT or SUM column. Exact ones keep every
+ *  digit and the larger number of decimals, approximate ones are added
+ *  as doubles as the server does.
+ */
+static int
+_shard_add (char **pDst, const char *src)
+{
+  char buf[64];
+  char *cp;
+
+  if (strpbrk (*pDst, "eE") || strpbrk (src, "eE"))
+    {
+      snprintf (buf, sizeof (buf), "%.17g", strtod (*pDst, NULL)
+	  + strtod (src, NULL));
+      cp = strdup (buf);
+    }
+  else
+    cp = _shard_sum (*pDst, src);
+  if (cp == NULL)
+    return -1;
+
+  if (strlen (cp) <= strlen (*pDst))
+    {
+      strcpy (*pDst, cp);
+      free (cp);
+    }
+  else
+    {
+      free (*pDst);
+      *pDst = cp;
+    }
+
+  return 0;
+}
+
+
+/*
+ *  Whether rows that differ in column j stay apart: the GROUP BY
+ *  columns, without one the plain columns
+ */
+static int
+_shard_apart (TShardPlan *plan, unsigned int j)
+{
+  if (plan->bGroupBy)
+    return j < SHARD_ITEMS && plan->aKey[j];
+  return _shard_kind (plan, j) == SHARD_PLAIN;
+}
+
+
+static unsigned long
+_shard_hash (TShardPlan *plan, unsigned int nFields, MYSQL_ROWS *row)
+{
+  unsigned long hash = 2166136261UL;
+  const unsigned char *cp;
+  unsigned int j;
+
+  for (j = 0; j < nFields; j++)
+    {
+      if (!_shard_apart (plan, j))
+	continue;
+      if ((cp = (const unsigned char *) row->data[j]) == NULL)
+	hash = (hash ^ 0xff) * 16777619UL;
+      else
+	{
+	  for (; *cp; cp++)
+	    hash = (hash ^ *cp) * 16777619UL;
+	  hash = (hash ^ 0) * 16777619UL;
+	}
+    }
+
+  return hash;
+}
+
+
+static int
+_shard_same (TShardPlan *plan, unsigned int nFields, MYSQL_ROWS *a,
+    MYSQL_ROWS *b)
+{
+  unsigned int j;
+
+  for (j = 0; j < nFields; j++)
+    {
+      if (!_shard_apart (plan, j))
+	continue;
+      if (a->data[j] == NULL || b->data[j] == NULL)
+	{
+	  if (a->data[j] != b->data[j])
+	    return 0;
+	}
+      else if (strcmp (a->data[j], b->data[j]))
+	return 0;
+    }
+
+  return 1;
+}
+
+
+/*
+ *  Rows with the same GROUP BY columns, or without one the same plain
+ *  columns, become one, their aggregates combined. On error *pnRows still counts the rows left in aRows.
+ */
+static int
+_shard_fold (TShardPlan *plan, MYSQL_FIELD *fields, unsigned int nFields,
+    MYSQL_ROWS **aRows, size_t *pnRows)
+{
+  MYSQL_ROWS **aSlots;
+  MYSQL_ROWS *row, *dst;
+  size_t nSlots, nOut, i, h;
+  unsigned int j;
+  char *swap;
+  int kind, c;
+
+  for (nSlots = 16; nSlots < 2 * *pnRows; nSlots <<= 1)
+    ;
+  if ((aSlots = (MYSQL_ROWS **) calloc (nSlots, sizeof (MYSQL_ROWS *)))
+      == NULL)
+    return -1;
+
+  for (nOut = i = 0; i < *pnRows; i++)
+    {
+      row = aRows[i];
+      h = _shard_hash (plan, nFields, row) & (nSlots - 1);
+      for (; (dst = aSlots[h]) != NULL; h = (h + 1) & (nSlots - 1))
+	{
+	  if (_shard_same (plan, nFields, dst, row))
+	    break;
+	}
+      if (dst == NULL)
+	{
+	  aSlots[h] = aRows[nOut++] = row;
+	  continue;
+	}
+
+      for (j = 0; j < nFields; j++)
+	{
+	  if ((kind = _shard_kind (plan, j)) == SHARD_PLAIN
+	      || row->data[j] == NULL)
+	    continue;
+	  if (dst->data[j] != NULL)
+	    {
+	      if (kind == SHARD_SUM)
+		{
+		  if (_shard_add (&dst->data[j], row->data[j]))
+		    goto nomem;
+		  continue;
+		}
+	      c = _shard_compare (&fields[j], row->data[j], dst->data[j]);
+	      if (kind == SHARD_MIN ? c >= 0 : c <= 0)
+		continue;
+	    }
+	  swap = dst->data[j];
+	  dst->data[j] = row->data[j];
+	  row->data[j] = swap;
+	}
+      _shard_row_free (row, nFields);
+    }
+  *pnRows = nOut;
+  free (aSlots);
+
+  return 0;
+
+nomem:
+  /* Row i was not folded in, it stays with the rest */
+  for (; i < *pnRows; i++)
+    aRows[nOut++] = aRows[i];
+  *pnRows = nOut;
+  free (aSlots);
+
+  return -1;
+}
+
+
+/*
+ *  One stored result from the results of the shards
+ */
+static MYSQL_RES *
+_shard_gather (MYSQL *mysql, TShardPlan *plan)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  MYSQL_RES *res = NULL;
+  MYSQL_RES *src = NULL;
+  MYSQL_ROWS **aRows = NULL;
+  MYSQL_ROWS *rp = NULL;
+  MYSQL_FIELD *f;
+  size_t nRows = 0;
+  size_t nMax = 0;
+  size_t i, nFirst, nStop;
+  unsigned int nFields, j, k;
+  int err = CR_OUT_OF_MEMORY;
+
+  for (k = 0; k < pDB->nShards; k++)
+    {
+      if (pDB->aShards[k].pRes == NULL)
+	continue;
+      if (src == NULL)
+	src = pDB->aShards[k].pRes;
+      else if (pDB->aShards[k].pRes->field_count != src->field_count)
+	{
+	  err = CR_UNKNOWN_ERROR;
+	  goto failed;
+	}
+      nMax += pDB->aShards[k].pRes->data->rows;
+    }
+  if (src == NULL)
+    {
+      err = CR_UNKNOWN_ERROR;
+      goto failed;
+    }
+  nFields = src->field_count;
+
+  /* ORDER BY names a column of the result */
+  for (k = 0; k < plan->nOrder; k++)
+    {
+      if (plan->aOrderCol[k] < 0)
+	{
+	  for (j = 0; j < nFields; j++)
+	    {
+	      if (src->fields[j].name
+		  && !strcasecmp (src->fields[j].name, plan->aOrderName[k]))
+		break;
+	    }
+	  plan->aOrderCol[k] = (int) j;
+	}
+      if (plan->aOrderCol[k] >= (int) nFields)
+	{
+	  err = ER_NOT_SUPPORTED_YET;
+	  goto failed;
+	}
+    }
+
+  if ((f = _alloc_fields (mysql, nFields)) == NULL)
+    return NULL;
+  for (j = 0; j < nFields; j++)
+    {
+      f[j] = src->fields[j];
+      f[j].name = safe_dup (src->fields[j].name);
+      f[j].table = safe_dup (src->fields[j].table);
+      f[j].def = safe_dup (src->fields[j].def);
+      if ((src->fields[j].name && f[j].name == NULL)
+	  || (src->fields[j].table && f[j].table == NULL)
+	  || (src->fields[j].def && f[j].def == NULL))
+	goto failed;
+    }
+  if ((res = _alloc_res (mysql, 0)) == NULL
+      || (res->data = (MYSQL_DATA *) calloc (1, sizeof (MYSQL_DATA))) == NULL)
+    goto failed;
+  res->data->fields = nFields;
+
+  aRows = (MYSQL_ROWS **) malloc ((nMax + 1) * sizeof (MYSQL_ROWS *));
+  if (aRows == NULL)
+    goto failed;
+  for (k = 0; k < pDB->nShards; k++)
+    {
+      if (pDB->aShards[k].pRes
+	  && _shard_take (pDB->aShards[k].pRes, aRows, &nRows))
+	goto failed;
+    }
+
+  if ((plan->bAgg || plan->bGroup)
+      && _shard_fold (plan, res->fields, nFields, aRows, &nRows))
+    goto failed;
+  if (_shard_sort (plan, res->fields, aRows, nRows))
+    goto failed;
+
+  /* LIMIT counts the merged rows */
+  nFirst = 0;
+  nStop = nRows;
+  if (plan->bLimit)
+    {
+      nFirst = plan->nOffset < nRows ? plan->nOffset : nRows;
+      if (plan->nLimit < nRows - nFirst)
+	nStop = nFirst + plan->nLimit;
+    }
+  for (i = 0; i < nRows; i++)
+    {
+      if (i < nFirst || i >= nStop)
+	{
+	  _shard_row_free (aRows[i], nFields);
+	  continue;
+	}
+      aRows[i]->next = NULL;
+      if (rp)
+	rp->next = aRows[i];
+      else
+	res->data->data = aRows[i];
+      rp = aRows[i];
+      res->data->rows++;
+    }
+  res->data_cursor = res->data->data;
+  free (aRows);
+
+  return res;
+
+failed:
+  _set_error (mysql, err);
+  if (aRows)
+    {
+      for (i = 0; i < nRows; i++)
+	_shard_row_free (aRows[i], nFields);
+      free (aRows);
+    }
+  if (res)
+    _free_res (res);
+  _free_fields (mysql);
 
   return NULL;
 }
 
 
-static MYSQL *
-_impl_connect (
-    MYSQL *mysql,
-    const char *host,
-    const char *user,
-    const char *passwd)
+/*
+ *  Appends to the text a shard runs
+ */
+static int
+_shard_append (TShard *shard, const char *text, size_t n)
+{
+  size_t nMax;
+  char *cp;
+
+  if (shard->nText + n + 1 > shard->nOwnMax)
+    {
+      for (nMax = shard->nOwnMax ? shard->nOwnMax : 256;
+	  nMax < shard->nText + n + 1; nMax *= 2)
+	;
+      if ((cp = (char *) realloc (shard->pOwnText, nMax)) == NULL)
+	return -1;
+      shard->pOwnText = cp;
+      shard->nOwnMax = nMax;
+    }
+  memcpy (shard->pOwnText + shard->nText, text, n);
+  shard->nText += n;
+  shard->pOwnText[shard->nText] = 0;
+
+  return 0;
+}
+
+
+/*
+ *  Position of the key among the columns of the table, for an INSERT
+ *  without a column list
+ */
+static int
+_shard_key_column (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TShard *shard = &pDB->aShards[0];
+  TCatEntry *entry;
+  unsigned int j;
+  int bOwned;
+  int iKey = -1;
+  MYSQL *w;
+
+  if ((w = _shard_handle (mysql, shard)) == NULL)
+    return -1;
+  if (DBOF(w)->pConnStr == NULL && _connect_db (w, shard->pConnStr))
+    {
+      _shard_error (mysql, w);
+      _impl_close (w);
+      shard->mysql = NULL;
+      return -1;
+    }
+  if ((entry = _cat_get (w, CAT_FIELDS, pDB->pShardTable, &bOwned)) == NULL)
+    {
+      _shard_error (mysql, w);
+      return -1;
+    }
+  for (j = 0; j < entry->nItems; j++)
+    {
+      if (entry->fields[j].name
+	  && !strcasecmp (entry->fields[j].name, pDB->pShardKey))
+	{
+	  iKey = (int) j;
+	  break;
+	}
+    }
+  if (bOwned)
+    _cat_free_entry (entry);
+  if (iKey < 0)
+    _set_error (mysql, ER_NOT_SUPPORTED_YET);
+
+  return iKey;
+}
+
+
+/*
+ *  Splits the rows of an INSERT or REPLACE by key. Each shard gets the
+ *  statement with its own rows; if all go to one, the text is unchanged.
+ */
+static int
+_shard_insert (MYSQL *mysql, const char *q, size_t len)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  const char *end = q + len;
+  const char *cp, *np, *vp, *rows, *rowStart;
+  TSQLToken tok, next;
+  TShard *shard;
+  unsigned int i, nUsed;
+  int iKey = -1;
+  int iCol, iShard, depth;
+  double key;
+  size_t n;
+
+  cp = _sql_token (q, end, &tok);		/* INSERT or REPLACE */
+  do
+    cp = _sql_token (cp, end, &tok);
+  while (_tok_is (&tok, "LOW_PRIORITY") || _tok_is (&tok, "DELAYED")
+      || _tok_is (&tok, "HIGH_PRIORITY") || _tok_is (&tok, "IGNORE")
+      || _tok_is (&tok, "INTO"));
+
+  /* Rows read from another table are not split */
+  np = _sql_token (cp, end, &next);
+  if (_shard_is (&next, '.'))
+    {
+      cp = _sql_token (np, end, &tok);
+      np = _sql_token (cp, end, &next);
+    }
+  n = tok.len;
+  vp = tok.start;
+  if (tok.type == TK_QUOTED && n >= 2)
+    {
+      vp++;
+      n -= 2;
+    }
+  if ((tok.type != TK_WORD && tok.type != TK_QUOTED)
+      || strlen (pDB->pShardTable) != n
+      || strncasecmp (vp, pDB->pShardTable, n))
+    goto unsupported;
+  cp = np;
+
+  /* The column list */
+  if (_shard_is (&next, '('))
+    {
+      for (iCol = 0;; )
+	{
+	  cp = _sql_token (cp, end, &tok);
+	  if (_shard_is (&tok, ')'))
+	    break;
+	  if (_shard_is (&tok, ','))
+	    iCol++;
+	  else if (_shard_is_key (pDB, &tok))
+	    iKey = iCol;
+	  else if (tok.type != TK_WORD && tok.type != TK_QUOTED)
+	    goto unsupported;
+	}
+      if (iKey < 0)
+	goto unsupported;
+      cp = _sql_token (cp, end, &next);
+    }
+  else
+    cp = np;
+
+  _shard_unmark (pDB);
+  if (_tok_is (&next, "SET"))
+    {
+      /* One row: SET a = 1, key = 2 */
+      for (depth = 0, iShard = -2;; )
+	{
+	  cp = _sql_token (cp, end, &tok);
+	  if (tok.type == TK_END || (depth == 0 && (_shard_is (&tok, ';')
+	      || _tok_is (&tok, "ON"))))
+	    break;
+	  if (_shard_is (&tok, '('))
+	    depth++;
+	  else if (_shard_is (&tok, ')'))
+	    depth--;
+	  else if (depth == 0 && _shard_is_key (pDB, &tok))
+	    {
+	      np = _sql_token (cp, end, &next);
+	      if (!_shard_is (&next, '='))
+		continue;
+	      if ((vp = _shard_value (np, end, &key)) == NULL)
+		goto unsupported;
+	      _sql_token (vp, end, &next);
+	      if (next.type != TK_END && !_shard_is (&next, ',')
+		  && !_shard_is (&next, ';') && !_tok_is (&next, "ON"))
+		goto unsupported;
+	      if ((iShard = _shard_of (pDB, key)) < 0)
+		goto nopart;
+	      cp = vp;
+	    }
+	}
+      if (iShard < 0)
+	goto unsupported;
+      shard = &pDB->aShards[iShard];
+      shard->bUsed = 1;
+      shard->pText = q;
+      shard->nText = len;
+
+      return 0;
+    }
+  if (!_tok_is (&next, "VALUES") && !_tok_is (&next, "VALUE"))
+    goto unsupported;
+  if (iKey < 0 && (iKey = _shard_key_column (mysql)) < 0)
+    return -1;
+
+  /* VALUES (...), (...) */
+  rows = cp;
+  nUsed = 0;
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (!_shard_is (&tok, '('))
+	goto unsupported;
+      rowStart = tok.start;
+      for (iCol = 0, iShard = -2, depth = 1; depth > 0; )
+	{
+	  if (iCol == iKey && iShard == -2)
+	    {
+	      if ((vp = _shard_value (cp, end, &key)) == NULL)
+		goto unsupported;
+	      _sql_token (vp, end, &next);
+	      if (!_shard_is (&next, ',') && !_shard_is (&next, ')'))
+		goto unsupported;
+	      if ((iShard = _shard_of (pDB, key)) < 0)
+		goto nopart;
+	      cp = vp;
+	    }
+	  cp = _sql_token (cp, end, &tok);
+	  if (tok.type == TK_END)
+	    goto unsupported;
+	  if (_shard_is (&tok, '('))
+	    depth++;
+	  else if (_shard_is (&tok, ')'))
+	    depth--;
+	  else if (depth == 1 && _shard_is (&tok, ','))
+	    iCol++;
+	}
+      if (iShard < 0)
+	goto unsupported;
+
+      shard = &pDB->aShards[iShard];
+      if (!shard->bUsed)
+	{
+	  shard->bUsed = 1;
+	  shard->nText = 0;
+	  nUsed++;
+	  if (_shard_append (shard, q, rows - q))
+	    goto nomem;
+	}
+      else if (_shard_append (shard, ",", 1))
+	goto nomem;
+      if (_shard_append (shard, rowStart, cp - rowStart))
+	goto nomem;
+
+      np = _sql_token (cp, end, &next);
+      if (!_shard_is (&next, ','))
+	break;
+      cp = np;
+    }
+
+  /* ON DUPLICATE KEY UPDATE and the like */
+  for (i = 0, shard = pDB->aShards; i < pDB->nShards; i++, shard++)
+    {
+      if (!shard->bUsed)
+	continue;
+      if (nUsed == 1)
+	{
+	  shard->pText = q;
+	  shard->nText = len;
+	}
+      else if (_shard_append (shard, cp, end - cp))
+	goto nomem;
+      else
+	shard->pText = shard->pOwnText;
+    }
+
+  return 0;
+
+nopart:
+  _set_error (mysql, ER_NO_PARTITION_FOR_GIVEN_VALUE);
+  return -1;
+
+unsupported:
+  _set_error (mysql, ER_NOT_SUPPORTED_YET);
+  return -1;
+
+nomem:
+  _set_error (mysql, CR_OUT_OF_MEMORY);
+  return -1;
+}
+
+
+/*
+ *  Runs a statement on the shards when it names the sharded table.
+ *  Returns 1 if it is not for them.
+ */
+static int
+_shard_query (MYSQL *mysql, const char *query, size_t len)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  TSQLInfo *info = &pDB->qcInfo;
+  const char *end = query + len;
+  const char *cp;
+  TShardPlan plan;
+  MYSQL_RES *res;
+  TShard *shard;
+  TSQLToken tok;
+  char *text = NULL;
+  unsigned long nLimit;
+  unsigned int i, nUsed;
+  size_t n;
+  int rc = -1;
+
+  for (i = 0; i < info->nTables; i++)
+    {
+      if (!strcmp (info->tables[i], pDB->pShardTable))
+	break;
+    }
+  if (i == info->nTables)
+    return 1;
+
+  if (info->kind == SQL_KIND_WRITE && (pDB->bInTrans || !pDB->bAutocommit))
+    {
+      _set_error (mysql, ER_NOT_SUPPORTED_YET);
+      return -1;
+    }
+
+  memset (&plan, 0, sizeof (plan));
+  _shard_unmark (pDB);
+  cp = _sql_token (query, end, &tok);
+  for (i = 0; i < pDB->nShards; i++)
+    {
+      pDB->aShards[i].pText = query;
+      pDB->aShards[i].nText = len;
+    }
+
+  if (info->kind == SQL_KIND_READ && !_tok_is (&tok, "SELECT"))
+    {
+      /* EXPLAIN and the like, any shard can answer */
+      if (!_tok_in (&tok, _sql_reads))
+	{
+	  _set_error (mysql, ER_NOT_SUPPORTED_YET);
+	  goto done;
+	}
+      pDB->aShards[0].bUsed = 1;
+    }
+  else if (info->kind == SQL_KIND_READ)
+    {
+      cp = _shard_find_where (cp, end);
+      nUsed = cp ? _shard_where (pDB, query, cp, end) : 0;
+
+      /* One shard returns the answer as it is */
+      if (nUsed != 1 && _shard_select (mysql, &plan, query, len))
+	goto done;
+
+      /* Each shard returns enough rows for the merged LIMIT */
+      if (plan.bLimit && (plan.bAgg || plan.bGroup || plan.nOffset))
+	{
+	  if ((text = (char *) malloc (len + 32)) == NULL)
+	    {
+	      _set_error (mysql, CR_OUT_OF_MEMORY);
+	      goto done;
+	    }
+	  memcpy (text, query, plan.limStart);
+	  n = plan.limStart;
+	  if (!plan.bAgg && !plan.bGroup)
+	    {
+	      nLimit = plan.nOffset + plan.nLimit;
+	      if (nLimit < plan.nLimit)
+		nLimit = (unsigned long) -1;
+	      n += sprintf (text + n, "LIMIT %lu", nLimit);
+	    }
+	  memcpy (text + n, query + plan.limEnd, len - plan.limEnd);
+	  n += len - plan.limEnd;
+	  for (i = 0; i < pDB->nShards; i++)
+	    {
+	      pDB->aShards[i].pText = text;
+	      pDB->aShards[i].nText = n;
+	    }
+	}
+    }
+  else if (info->kind == SQL_KIND_WRITE && info->bInsert)
+    {
+      if (_shard_insert (mysql, query, len))
+	goto done;
+    }
+  else if (info->kind == SQL_KIND_WRITE
+      && (_tok_is (&tok, "UPDATE") || _tok_is (&tok, "DELETE")))
+    {
+      if (_tok_is (&tok, "UPDATE") && _shard_sets_key (pDB, cp, end))
+	{
+	  _set_error (mysql, ER_NOT_SUPPORTED_YET);
+	  goto done;
+	}
+      cp = _shard_find_where (cp, end);
+      nUsed = cp ? _shard_where (pDB, query, cp, end) : 0;
+
+      /* Every shard would change up to LIMIT rows of its own */
+      if (nUsed != 1 && _shard_limited (query, end))
+	{
+	  _set_error (mysql, ER_NOT_SUPPORTED_YET);
+	  goto done;
+	}
+    }
+  else if (info->kind != SQL_KIND_DDL)
+    return 1;
+
+  /* Without a key in the statement, every shard has a part */
+  for (nUsed = 0, i = 0; i < pDB->nShards; i++)
+    nUsed += pDB->aShards[i].bUsed;
+  if (nUsed == 0)
+    {
+      for (i = 0; i < pDB->nShards; i++)
+	pDB->aShards[i].bUsed = 1;
+    }
+
+  if (_shard_exec (mysql))
+    goto done;
+
+  _alloc_fields (mysql, 0);
+  mysql->affected_rows = 0;
+  if (info->kind == SQL_KIND_READ)
+    {
+      if ((res = _shard_gather (mysql, &plan)) == NULL)
+	goto done;
+      pDB->pLocalRes = res;
+      mysql->field_count = res->field_count;
+      mysql->affected_rows = res->data->rows;
+    }
+  else
+    {
+      /* insert_id is the one of the last shard that made one */
+      for (i = 0, shard = pDB->aShards; i < pDB->nShards; i++, shard++)
+	{
+	  if (!shard->bUsed)
+	    continue;
+	  mysql->affected_rows += shard->affected;
+	  if (shard->insertId)
+	    mysql->insert_id = shard->insertId;
+	}
+      if (info->kind == SQL_KIND_DDL)
+	_cat_flush (pDB);
+    }
+  rc = 0;
+
+done:
+  for (i = 0, shard = pDB->aShards; i < pDB->nShards; i++, shard++)
+    {
+      if (shard->pRes)
+	_free_res (shard->pRes);
+      shard->pRes = NULL;
+      shard->pText = NULL;
+      shard->nText = 0;
+    }
+  safe_free (text);
+
+  return rc;
+}
+
+
+/*
+ *  Multiple statements
+ *
+ *  With CLIENT_MULTI_STATEMENTS a query may hold several statements. A
+ *  driver that takes batches gets the whole text in one round trip and
+ *  mysql_next_result walks its results with SQLMoreResults. Otherwise
+ *  the text is split here and every statement runs when mysql_next_result
+ *  gets to it.
+ */
+
+/* END of these does not close a BEGIN or CASE */
+static const char * const _multi_end_of[] =
+  {
+    "IF", "LOOP", "WHILE", "REPEAT", NULL
+  };
+
+/*
+ *  The statement from *pPos on, up to a ';' outside of compound
+ *  statements: the BEGIN ... END body of a routine or trigger holds
+ *  statements of its own. Returns 0 at the end of the text, an empty
+ *  statement before a ';' comes with *pLen 0.
+ */
+static int
+_multi_scan (const char *text, size_t len, size_t *pPos, size_t *pStart,
+    size_t *pLen)
+{
+  const char *end = text + len;
+  const char *cp = text + *pPos;
+  const char *start = NULL, *last = NULL;
+  TSQLToken tok, next;
+  int bRoutine = 0;
+  int depth = 0;
+
+  for (;;)
+    {
+      cp = _sql_token (cp, end, &tok);
+      if (tok.type == TK_END)
+	break;
+      if (start == NULL)
+	bRoutine = _tok_is (&tok, "CREATE") || _tok_is (&tok, "ALTER");
+      if (depth == 0 && tok.type == TK_PUNCT && *tok.start == ';')
+	{
+	  *pPos = (size_t) (cp - text);
+	  *pStart = (size_t) ((start ? start : tok.start) - text);
+	  *pLen = start ? (size_t) (last - start) : 0;
+	  return 1;
+	}
+
+      /* Blocks are the bodies of routines, triggers and events, or
+       * BEGIN NOT ATOMIC; BEGIN [WORK] on its own starts a transaction.
+       * CASE ... END may be an expression in a block.
+       */
+      _sql_token (cp, end, &next);
+      if ((_tok_is (&tok, "BEGIN") && (depth > 0 || bRoutine
+		  || (start == NULL && _tok_is (&next, "NOT"))))
+	  || _tok_is (&tok, "CASE"))
+	depth++;
+      else if (depth > 0 && _tok_is (&tok, "END")
+	  && !_tok_in (&next, _multi_end_of))
+	depth--;
+
+      if (start == NULL)
+	start = tok.start;
+      last = tok.start + tok.len;
+    }
+
+  *pPos = len;
+  if (start == NULL)
+    return 0;
+  *pStart = (size_t) (start - text);
+  *pLen = (size_t) (last - start);
+  return 1;
+}
+
+
+/*
+ *  Finds the next statement that is not empty from *pPos on
+ */
+static int
+_multi_next (const char *text, size_t len, size_t *pPos, size_t *pStart,
+    size_t *pLen)
+{
+  while (_multi_scan (text, len, pPos, pStart, pLen))
+    {
+      if (*pLen)
+	return 1;
+    }
+
+  return 0;
+}
+
+
+/*
+ *  Forget the statements of the last query. A batch with results left is
+ *  closed, the next statement would fail on its open cursor.
+ */
+static void
+_multi_reset (TSQLPrivate *pDB)
+{
+  if (pDB->hMulti != SQL_NULL_HSTMT && pDB->hMulti == pDB->hStmt)
+    {
+      SQLFreeStmt (pDB->hStmt, SQL_CLOSE);
+      pDB->bPrepared = 0;
+    }
+  safe_free (pDB->pMulti);
+  pDB->pMulti = NULL;
+  pDB->nMulti = pDB->iMulti = 0;
+  pDB->bMultiBatch = 0;
+  pDB->hMulti = SQL_NULL_HSTMT;
+}
+
+
+/*
+ *  SERVER_MORE_RESULTS_EXISTS for mysql_more_results. After the last
+ *  result the text is dropped, the cursor stays with that result.
+ */
+static void
+_multi_status (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  size_t pos, start, n;
+
+  pos = pDB->iMulti;
+  if (pDB->pMulti
+      && _multi_next (pDB->pMulti, pDB->nMulti, &pos, &start, &n))
+    {
+      mysql->server_status |= SERVER_MORE_RESULTS_EXISTS;
+      return;
+    }
+
+  mysql->server_status &= ~SERVER_MORE_RESULTS_EXISTS;
+  pDB->hMulti = SQL_NULL_HSTMT;
+  _multi_reset (pDB);
+}
+
+
+/*
+ *  One batch, unless a statement has to be handled on this side. With
+ *  a shard map each statement goes through _shard_query. The statements
+ *  are the ones _multi_next finds, so mysql_next_result expects as many
+ *  results as the batch has.
+ */
+static int
+_multi_batch (TSQLPrivate *pDB, const char *text, size_t len)
 {
-  MYSQL *res;
+  size_t pos = 0, start, n;
+  TSQLToken tok;
 
-  mysql = _impl_init (mysql);
-  res = _impl_real_connect (mysql, host, user, passwd, NULL, 0, NULL, 0);
-  if (res == NULL)
-    _impl_close (mysql);
+  if (!(pDB->ulBatch & SQL_BS_SELECT_EXPLICIT)
+      || !(pDB->ulBatch & SQL_BS_ROW_COUNT_EXPLICIT) || pDB->pDialect
+      || pDB->nShards)
+    return 0;
 
-  return res;
+  while (_multi_scan (text, len, &pos, &start, &n))
+    {
+      /* An empty statement would be a result of its own over there */
+      if (n == 0)
+	return 0;
+
+      /* LOAD DATA LOCAL INFILE is done on this side */
+      _sql_token (text + start, text + start + n, &tok);
+      if (_tok_is (&tok, "LOAD"))
+	return 0;
+    }
+
+  return 1;
+}
+
+
+/*
+ *  The server ran all statements of a batch, keep up with what they did
+ */
+static void
+_multi_analyze (TSQLPrivate *pDB, const char *text, size_t len)
+{
+  size_t pos = 0, start, n;
+  TSQLInfo info;
+
+  while (_multi_next (text, len, &pos, &start, &n))
+    {
+      _sql_analyze (text + start, n, &info);
+      _trans_note (pDB, &info, text + start, n);
+      if (info.kind == SQL_KIND_WRITE || info.kind == SQL_KIND_DDL)
+	_qc_invalidate (&info);
+      if (info.kind == SQL_KIND_DDL)
+	_cat_flush (pDB);
+    }
+
+  /* The first result is described next */
+  pos = 0;
+  if (_multi_next (text, len, &pos, &start, &n))
+    _sql_analyze (text + start, n, &pDB->qcInfo);
 }
 
 
+/*
+ *  Describes the result the statement just produced
+ */
 static int
-_impl_query (
+_query_describe (MYSQL *mysql, SQLRETURN ret)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLSMALLINT col, numCols;
+  MYSQL_FIELD *f;
+  my_ulonglong t0;
+
+  pDB->bPrepared = 1;
+  pDB->bHaveData = (ret != SQL_NO_DATA);
+
+  /* Allocate column descriptors */
+  t0 = _slow_now (pDB->pSlow);
+  numCols = 0;
+  if (pDB->bHaveData)
+    {
+      ret = SQLNumResultCols (pDB->hStmt, &numCols);
+      if (_trap_sqlerror (mysql, ret, "SQLNumResultCols"))
+	return -1;
+    }
+
+  f = _alloc_fields (mysql, (unsigned int) numCols);
+  if (f == NULL && numCols)
+    return -1;
+
+  /* What binding needs, names and tables are read when asked for */
+  for (col = 1; col <= numCols; col++, f++)
+    {
+      SQLSMALLINT sqlType, decimals, nullable;
+      SQLULEN colSize;
+      SQLLEN lValue;
+
+      ret = SQLDescribeCol (pDB->hStmt, col, NULL, 0, NULL, &sqlType,
+	  &colSize, &decimals, &nullable);
+      if (_trap_sqlerror (mysql, ret, "SQLDescribeCol"))
+	return -1;
+
+      f->type = _field_type (sqlType);
+      f->decimals = (unsigned int) (decimals > 0 ? decimals : 0);
+      if (nullable == SQL_NO_NULLS)
+	f->flags |= NOT_NULL_FLAG;
+      if (IS_NUM (f->type))
+	f->flags |= NUM_FLAG;
+      if (f->type == FIELD_TYPE_BLOB)
+	f->flags |= BLOB_FLAG;
+
+      /* field.length */
+      lValue = _display_size (sqlType, colSize);
+      if (lValue <= 0) /* blobs and unknown sizes */
+	lValue = 65500;
+      if (mysql->options.max_column_buffer
+	  && (unsigned long) lValue > mysql->options.max_column_buffer)
+	lValue = (SQLLEN) mysql->options.max_column_buffer;
+      f->length = (unsigned int) lValue;
+
+      /* TODO set field.db in MySQL4 emulation mode */
+    }
+
+  /* Asked for by mysql_affected_rows, or the result's row count */
+  mysql->affected_rows = (my_ulonglong) -1;
+  pDB->bRowCountPending = (numCols == 0);
+  pDB->bGroupRows = 0;
+
+  _slow_add (pDB->pSlow, SLOW_DESCRIBE, t0);
+
+  if (numCols == 0)
+    {
+      mysql->insert_id = 0;
+      pDB->bIdentityPending = pDB->bIdentityWanted;
+      _slow_finish (pDB);
+    }
+
+  return 0;
+}
+
+
+/*
+ *  Runs one statement, or with bBatch all of a multi-statement text
+ */
+static int
+_query_run (
     MYSQL *mysql,
     const char *query,
-    long len)
+    long len,
+    int bBatch)
 {
   TSQLPrivate *pDB;
-  SQLSMALLINT col, numCols;
   SQLLEN numRows;
   SQLRETURN ret;
-  MYSQL_FIELD *f;
+  char *batch = NULL;
+  char *conv = NULL;
+  const char *exec;
+  long execLen;
+  my_ulonglong t0;
+  size_t n;
+  int rc;
+
+  /* A connection lost earlier comes back with the next query */
+  if (mysql && mysql->reconnect && (pDB = DBOF(mysql)) != NULL
+      && !pDB->bConnected && pDB->pConnStr && _reconnect (mysql))
+    return -1;
 
   if ((pDB = _db (mysql)) == NULL)
     return -1;
 
-  /* Close previous stmt */
-  if (pDB->bPrepared)
+  /* Warnings are of the last statement, see mysql_warning_count */
+  _diag_forget (pDB, SQL_NULL_HSTMT);
+  pDB->nWarnings = 0;
+
+  /* Close previous stmt, unless a streaming result took it */
+  pDB->bRowCountPending = 0;
+  if (pDB->pLazyRes)
+    _meta_resolve (&pDB->pLazyRes->res);
+  if (pDB->bPrepared && pDB->hStmt != SQL_NULL_HSTMT)
     {
       SQLFreeStmt (pDB->hStmt, SQL_CLOSE);
       pDB->bPrepared = 0;
     }
+  _route_return (pDB);
 
   pDB->bHaveData = FALSE;
+  if (pDB->pLocalRes)
+    {
+      _free_res (pDB->pLocalRes);
+      pDB->pLocalRes = NULL;
+    }
+
+  if (len == SQL_NTS)
+    len = (long) strlen (query);
+
+  safe_free (mysql->info);
+  mysql->info = NULL;
+  _slow_begin (mysql, query, (size_t) len);
+
+  _sql_analyze (query, (size_t) len, &pDB->qcInfo);
+  _trans_note (pDB, &pDB->qcInfo, query, (size_t) len);
+
+  /* The key of an earlier INSERT is not this one's, also when this one
+   * fails or is done on this side
+   */
+  if (pDB->qcInfo.bInsert)
+    {
+      mysql->insert_id = 0;
+      pDB->bIdentityPending = 0;
+    }
+  if (_group_begin (mysql, bBatch))
+    return -1;
+
+  /* LOAD DATA LOCAL INFILE is done on this side */
+  t0 = _slow_now (pDB->pSlow);
+  if (!bBatch && pDB->qcInfo.kind == SQL_KIND_WRITE
+      && (rc = _ld_query (mysql, query, (size_t) len)) != 1)
+    {
+      _slow_add (pDB->pSlow, SLOW_EXECUTE, t0);
+      _slow_finish (pDB);
+      _qc_reset (pDB);
+      if (rc == 0)
+	_qc_invalidate (&pDB->qcInfo);
+      else
+	_group_fail (mysql);
+      return rc;
+    }
+
+  /* SHOW and DESCRIBE have no portable SQL, the catalog answers them */
+  if (pDB->pDialect && pDB->qcInfo.kind == SQL_KIND_READ
+      && (rc = _xl_show (mysql, query, (size_t) len)) != 1)
+    {
+      _slow_add (pDB->pSlow, SLOW_EXECUTE, t0);
+      _slow_finish (pDB);
+      _qc_reset (pDB);
+      return rc;
+    }
+
+  /* The sharded table is spread over the shards, the rest stays here */
+  if (!bBatch && pDB->nShards
+      && (rc = _shard_query (mysql, query, (size_t) len)) != 1)
+    {
+      _slow_add (pDB->pSlow, SLOW_EXECUTE, t0);
+      _slow_finish (pDB);
+      _qc_reset (pDB);
+      return rc;
+    }
+
+  /* Answer deterministic reads from the query cache */
+  _qc_reset (pDB);
+  if (!bBatch && _qc.maxBytes && _qc_lookup (mysql, query, (size_t) len))
+    {
+      _alloc_fields (mysql, 0);
+      mysql->field_count = pDB->pQcHit->field_count;
+      mysql->affected_rows = pDB->pQcHit->affected_rows;
+      return 0;
+    }
+  if (!bBatch && pDB->bShared && _shc_lookup (mysql, query, (size_t) len))
+    {
+      _alloc_fields (mysql, 0);
+      mysql->field_count = pDB->pLocalRes->field_count;
+      mysql->affected_rows = pDB->pLocalRes->data->rows;
+      return 0;
+    }
+
+  if (_make_room (mysql))
+    return -1;
+  if (pDB->hStmt == SQL_NULL_HSTMT
+      && (pDB->hStmt = _stmt_acquire (mysql)) == SQL_NULL_HSTMT)
+    return -1;
+
+  /* In the dialect of the data source, text owned by the dialect cache */
+  exec = query;
+  execLen = len;
+  if (pDB->pDialect)
+    {
+      if ((exec = _xl_translate (pDB, query, (size_t) len, &n)) == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return -1;
+	}
+      execLen = (long) n;
+    }
+
+  /* The statement goes out in the encoding of the data source */
+  if (CS_CONVERT (pDB))
+    {
+      conv = (char *) malloc (pDB->csClient == CS_LATIN1
+	  ? 2 * execLen + 1 : execLen + 1);
+      if (conv == NULL)
+	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
+	  return -1;
+	}
+      execLen = (long) _cs_convert (pDB->csClient, exec, (size_t) execLen,
+	  conv);
+      exec = conv;
+    }
+
+  /* An INSERT brings its generated key back in the same round trip */
+  pDB->bIdentityWanted = _identity_wanted (mysql);
+  if (!bBatch && pDB->bIdentityWanted && pDB->bIdentityBatch
+      && (batch = _identity_batch (pDB, exec, &execLen)) != NULL)
+    {
+      safe_free (conv);
+      conv = NULL;
+      exec = batch;
+    }
+
+  /* A seek on the streaming result runs the read again, see _scroll_open */
+  safe_free (pDB->pScrollSql);
+  pDB->pScrollSql = NULL;
+  if (!bBatch && pDB->nScrollWindow && pDB->qcInfo.kind == SQL_KIND_READ
+      && (pDB->pScrollSql = (char *) malloc (execLen + 1)) != NULL)
+    {
+      memcpy (pDB->pScrollSql, exec, execLen);
+      pDB->pScrollSql[execLen] = 0;
+    }
 
-  /* Prepare & execute new one */
-  ret = SQLExecDirect (pDB->hStmt, (SQLCHAR *) query, (SQLINTEGER) len);
+  /* Prepare & execute new one, reads maybe on a replica */
+  t0 = _slow_now (pDB->pSlow);
+  if ((ret = _route_read (mysql, bBatch, exec, execLen)) == SQL_ERROR)
+    ret = SQLExecDirect (pDB->hStmt, (SQLCHAR *) exec, (SQLINTEGER) execLen);
+  _slow_add (pDB->pSlow, SLOW_EXECUTE, t0);
   if (_trap_sqlerror (mysql, ret, "SQLExecDirect"))
+    {
+      /* Like the MySQL client, resend once on a fresh connection. Inside
+       * a transaction the earlier statements are gone, so report it.
+       */
+      if (mysql->net.last_errno != CR_SERVER_LOST || !mysql->reconnect
+	  || pDB->bInTrans || pDB->bGroup || _reconnect (mysql))
+	{
+	  /* The data source may have run statements of the batch before
+	   * and after the failing one, their writes still count
+	   */
+	  if (bBatch)
+	    _multi_analyze (pDB, query, (size_t) len);
+	  _group_fail (mysql);
+	  safe_free (batch);
+	  safe_free (conv);
+	  return -1;
+	}
+
+      t0 = _slow_now (pDB->pSlow);
+      ret = SQLExecDirect (pDB->hStmt, (SQLCHAR *) exec, (SQLINTEGER) execLen);
+      _slow_add (pDB->pSlow, SLOW_EXECUTE, t0);
+      if (_trap_sqlerror (mysql, ret, "SQLExecDirect"))
+	{
+	  if (bBatch)
+	    _multi_analyze (pDB, query, (size_t) len);
+	  safe_free (batch);
+	  safe_free (conv);
+	  return -1;
+	}
+    }
+  pDB->ulAlive = _now_ms ();
+  safe_free (conv);
+
+  if (bBatch)
+    _multi_analyze (pDB, query, (size_t) len);
+  else
+    {
+      if (pDB->qcInfo.kind == SQL_KIND_WRITE
+	  || pDB->qcInfo.kind == SQL_KIND_DDL)
+	_qc_invalidate (&pDB->qcInfo);
+      if (pDB->qcInfo.kind == SQL_KIND_DDL)
+	_cat_flush (pDB);
+    }
+
+  /* mysql_insert_id follows the last statement without a result set */
+  if (batch)
+    {
+      free (batch);
+      ret = SQLRowCount (pDB->hStmt, &numRows);
+      mysql->affected_rows = (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO)
+	  ? (my_ulonglong) numRows : (my_ulonglong) -1;
+
+      ret = SQLMoreResults (pDB->hStmt);
+      if (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO)
+	pDB->bIdentityPending = (_identity_fetch (mysql, pDB->hStmt) != 0);
+      else
+	{
+	  /* The driver did not run it after all, do not try again */
+	  pDB->bIdentityBatch = 0;
+	  pDB->bIdentityPending = 1;
+	}
+      _set_error (mysql, 0);
+      SQLFreeStmt (pDB->hStmt, SQL_CLOSE);
+      pDB->bHaveData = FALSE;
+      _alloc_fields (mysql, 0);
+      _slow_finish (pDB);
+
+      return 0;
+    }
+
+  return _query_describe (mysql, ret);
+}
+
+
+static int
+_impl_query (
+    MYSQL *mysql,
+    const char *query,
+    long len)
+{
+  TSQLPrivate *pDB;
+  size_t pos = 0, start, n;
+  int bBatch;
+  int rc;
+
+  if (mysql == NULL || (pDB = DBOF(mysql)) == NULL)
+    return _query_run (mysql, query, len, 0);
+
+  _multi_reset (pDB);
+  mysql->server_status &= ~SERVER_MORE_RESULTS_EXISTS;
+  if (len == SQL_NTS)
+    len = (long) strlen (query);
+
+  /* One statement, maybe followed by a ';' */
+  if (!(mysql->client_flag & CLIENT_MULTI_STATEMENTS)
+      || !_multi_next (query, (size_t) len, &pos, &start, &n))
+    return _query_run (mysql, query, len, 0);
+  pDB->iMulti = pos;
+  if (!_multi_next (query, (size_t) len, &pos, &start, &n))
+    return _query_run (mysql, query, len, 0);
+
+  if ((pDB->pMulti = (char *) malloc ((size_t) len + 1)) == NULL)
+    {
+      _set_error (mysql, CR_OUT_OF_MEMORY);
+      return -1;
+    }
+  memcpy (pDB->pMulti, query, (size_t) len);
+  pDB->pMulti[len] = 0;
+  pDB->nMulti = (size_t) len;
+
+  bBatch = _multi_batch (pDB, pDB->pMulti, pDB->nMulti);
+  if (bBatch)
+    rc = _query_run (mysql, pDB->pMulti, len, 1);
+  else
+    {
+      pos = 0;
+      _multi_next (pDB->pMulti, pDB->nMulti, &pos, &start, &n);
+      rc = _query_run (mysql, pDB->pMulti + start, (long) n, 0);
+    }
+
+  /* Statements after a failing one are not sent. A batch went out as
+   * one piece, whatever of it the data source ran was accounted for.
+   */
+  if (rc)
+    {
+      _multi_reset (pDB);
+      return rc;
+    }
+  if (bBatch)
+    {
+      pDB->bMultiBatch = 1;
+      pDB->hMulti = pDB->hStmt;
+    }
+  _multi_status (mysql);
+
+  return 0;
+}
+
+
+/*
+ *  The next result of a batch: 0 with one, 1 when the data source had
+ *  no more, -1 on error
+ */
+static int
+_multi_more (MYSQL *mysql, const char *query, size_t len)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLRETURN ret;
+
+  /* A use_result result still reads the previous one */
+  if (pDB->hMulti == SQL_NULL_HSTMT || pDB->hStmt != pDB->hMulti)
+    {
+      _set_error (mysql, pDB->hMulti == SQL_NULL_HSTMT
+	  ? CR_SERVER_LOST : CR_COMMANDS_OUT_OF_SYNC);
+      return -1;
+    }
+
+  pDB->bRowCountPending = 0;
+  if (pDB->pLazyRes)
+    _meta_resolve (&pDB->pLazyRes->res);
+  pDB->bHaveData = FALSE;
+  safe_free (mysql->info);
+  mysql->info = NULL;
+  _qc_reset (pDB);
+  _sql_analyze (query, len, &pDB->qcInfo);
+
+  SQLFreeStmt (pDB->hStmt, SQL_UNBIND);
+  ret = SQLMoreResults (pDB->hStmt);
+  if (ret == SQL_NO_DATA)
+    {
+      /* Fewer results than statements, there is no empty one to show */
+      _alloc_fields (mysql, 0);
+      pDB->bPrepared = 0;
+      return 1;
+    }
+  if (_trap_sqlerror (mysql, ret, "SQLMoreResults"))
     return -1;
+  pDB->ulAlive = _now_ms ();
 
-  pDB->bPrepared = 1;
-  pDB->bHaveData = (ret != SQL_NO_DATA);
+  return _query_describe (mysql, ret);
+}
 
-  /* Allocate column descriptors */
-  numCols = 0;
-  if (pDB->bHaveData)
+
+/*
+ *  As mysql_next_result: 0 with the next result, -1 when there are no
+ *  more, > 0 on error
+ */
+static int
+_impl_next_result (MYSQL *mysql)
+{
+  TSQLPrivate *pDB;
+  size_t start, n;
+  int rc;
+
+  if ((pDB = _db (mysql)) == NULL)
+    return 1;
+
+  mysql->server_status &= ~SERVER_MORE_RESULTS_EXISTS;
+  if (pDB->pMulti == NULL
+      || !_multi_next (pDB->pMulti, pDB->nMulti, &pDB->iMulti, &start, &n))
     {
-      ret = SQLNumResultCols (pDB->hStmt, &numCols);
-      if (_trap_sqlerror (mysql, ret, "SQLNumResultCols"))
-	return -1;
+      _multi_reset (pDB);
+      return -1;
     }
 
-  f = _alloc_fields (mysql, (unsigned int) numCols);
+  if (pDB->bMultiBatch)
+    rc = _multi_more (mysql, pDB->pMulti + start, n);
+  else
+    rc = _query_run (mysql, pDB->pMulti + start, (long) n, 0);
+  if (rc)
+    {
+      _multi_reset (pDB);
+      return rc > 0 ? -1 : 1;
+    }
+  _multi_status (mysql);
+
+  return 0;
+}
+
+
+/*
+ *  SQLRowCount of a statement without result set, asked for only when
+ *  mysql_affected_rows wants it
+ */
+static void
+_impl_affected_rows (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLLEN numRows;
+  SQLRETURN ret;
+
+  pDB->bRowCountPending = 0;
+  if (pDB->bGroupRows)
+    {
+      /* The flusher took it before its commit */
+      pDB->bGroupRows = 0;
+      mysql->affected_rows = pDB->groupRows;
+      return;
+    }
+  if (!pDB->bConnected || !pDB->bPrepared || pDB->hStmt == SQL_NULL_HSTMT)
+    return;
+
+  ret = SQLRowCount (pDB->hStmt, &numRows);
+  if (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO)
+    mysql->affected_rows = (my_ulonglong) numRows;
+}
+
+
+/*
+ *  Cheap round trip for drivers without SQL_ATTR_CONNECTION_DEAD
+ */
+static int
+_ping_roundtrip (MYSQL *mysql)
+{
+  TSQLPrivate *pDB = DBOF(mysql);
+  SQLHSTMT hStmt;
+  SQLRETURN ret;
+  int rc;
+
+  if (_make_room (mysql) || (hStmt = _stmt_acquire (mysql)) == SQL_NULL_HSTMT)
+    return -1;
+
+  pDB->hDiagStmt = hStmt;
+  ret = SQLExecDirect (hStmt, (SQLCHAR *) "SELECT 1", SQL_NTS);
+  rc = _trap_sqlerror (mysql, ret, "SQLExecDirect");
+  pDB->hDiagStmt = SQL_NULL_HSTMT;
+  _stmt_release (pDB, hStmt);
 
-  /* Query field properties */
-  for (col = 1; col <= numCols; col++, f++)
-    {
-      SQLLEN lValue;
-      SQLSMALLINT retLen;
-      SQLCHAR value[128];
+  /* Any answer will do, even an error from a picky server */
+  return (rc && !pDB->bConnected) ? -1 : 0;
+}
 
-      /* TODO */
-      f->type = FIELD_TYPE_STRING;
 
-      /* field.table */
-      value[0] = 0;
-      ret = SQLColAttribute (pDB->hStmt, col, SQL_DESC_TABLE_NAME,
-	  value, (SQLSMALLINT) sizeof (value), &retLen, &lValue);
-      if (_trap_sqlerror (mysql, ret, "SQLColAttribute"))
-	return -1;
-      f->table = strdup ((const char *)value);
+/*
+ *  Connection pools ping before every checkout, so a round trip within
+ *  the last nPingWindow ms is taken as proof of life. Otherwise ask the
+ *  driver manager, which usually knows without going to the server.
+ */
+static int
+_impl_ping (MYSQL *mysql)
+{
+  TSQLPrivate *pDB;
+  unsigned long now;
+  int rc = -1;
+#ifdef SQL_ATTR_CONNECTION_DEAD
+  SQLUINTEGER dead;
+  SQLRETURN ret;
+#endif
 
-      /* field.name */
-      value[0] = 0;
-      ret = SQLColAttribute (pDB->hStmt, col, SQL_DESC_LABEL,
-	  value, (SQLSMALLINT) sizeof (value), &retLen, &lValue);
-      if (_trap_sqlerror (mysql, ret, "SQLColAttribute"))
-	return -1;
-      f->name = strdup ((const char *)value);
+  if (mysql == NULL || (pDB = DBOF(mysql)) == NULL)
+    {
+      _set_error (mysql, CR_SERVER_LOST);
+      return -1;
+    }
 
-      /* field.length */
-      lValue = 0;
-      ret = SQLColAttribute (pDB->hStmt, col, SQL_DESC_DISPLAY_SIZE,
-	  value, (SQLSMALLINT) sizeof (value), &retLen, &lValue);
-      if (_trap_sqlerror (mysql, ret, "SQLColAttribute"))
-	return -1;
-      if (lValue < 0) /* blobs give -1(?) */
-	lValue = 65500;
-      f->length = (unsigned int) lValue;
+  now = _now_ms ();
+  if (pDB->bConnected)
+    {
+      if (now - pDB->ulAlive < pDB->nPingWindow)
+	rc = 0;
+      else
+	{
+#ifdef SQL_ATTR_CONNECTION_DEAD
+	  ret = SQLGetConnectAttr (pDB->hDbc, SQL_ATTR_CONNECTION_DEAD,
+	      &dead, 0, NULL);
+	  if (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO)
+	    {
+	      if (dead == SQL_CD_FALSE)
+		rc = 0;
+	      else
+		pDB->bConnected = 0;
+	    }
+	  else
+#endif
+	    rc = _ping_roundtrip (mysql);
+	}
+    }
 
-      /* TODO set field.db in MySQL4 emulation mode */
+  if (rc == 0)
+    {
+      pDB->ulAlive = now;
+      _set_error (mysql, 0);
+      return 0;
     }
 
-  /* Retrieve affected_rows */
-  ret = SQLRowCount (pDB->hStmt, &numRows);
-  if (_trap_sqlerror (mysql, ret, "SQLRowCount"))
-    mysql->affected_rows = (my_ulonglong) -1;
-  else
-    mysql->affected_rows = (my_ulonglong) numRows;
+  if (!pDB->bConnected && mysql->reconnect && pDB->pConnStr)
+    return _reconnect (mysql);
 
-  return 0;
+  _set_error (mysql, CR_SERVER_LOST);
+  return -1;
 }
 
 
@@ -795,14 +14129,21 @@ _impl_use_result (MYSQL *mysql)
 {
   TSQLPrivate *pDB;
   MYSQL_RES *res;
-  unsigned int j;
-  SQLRETURN ret;
+  my_ulonglong t0;
 
   if ((pDB = _db (mysql)) == NULL)
     return NULL;
 
+  if (pDB->pQcHit)
+    return _qc_result (mysql);
+  if ((res = pDB->pLocalRes) != NULL)
+    {
+      pDB->pLocalRes = NULL;
+      return res;
+    }
+
   /* note: this could also fail if there are no fields (eg. after INSERT) */
-  if ((res = _alloc_res (mysql)) == NULL)
+  if ((res = _alloc_res (mysql, 1)) == NULL)
     return NULL;
 
   /* This array of fields is returned to the caller -
@@ -811,25 +14152,29 @@ _impl_use_result (MYSQL *mysql)
   res->current_row = (MYSQL_ROW) calloc (res->field_count, sizeof (char *));
   if (res->current_row == NULL)
     goto failed;
+  RESOF(res)->pUseRow = res->current_row;
 
   /* Bind the result set */
-  SQLFreeStmt (pDB->hStmt, SQL_UNBIND);
-  for (j = 0; j < res->field_count; j++)
+  t0 = _slow_now (pDB->pSlow);
+  if (_bind_res (mysql, res, pDB->hStmt))
     {
-      ret = SQLBindCol (
-	  pDB->hStmt,
-	  (SQLUSMALLINT) (j + 1),
-	  SQL_C_CHAR,
-	  res->row[j],
-	  (SQLINTEGER) res->fields[j].max_length,
-	  (SQLLEN *) &res->lengths[j]);
-
-      if (_trap_sqlerror (mysql, ret, "SQLBindCol"))
-	{
-	  _free_res (res);
-	  return NULL;
-	}
+      _free_res (res);
+      return NULL;
     }
+  _slow_add (pDB->pSlow, SLOW_BIND, t0);
+  _slow_attach (pDB, res);
+
+  /* The open cursor moves to the result, later queries use another handle */
+  RESOF(res)->hStmt = pDB->hStmt;
+  RESOF(res)->hMeta = pDB->hStmt;
+  RESOF(res)->pLink = pDB->pRouted;
+  pDB->pRouted = NULL;
+  RESOF(res)->pScrollSql = pDB->pScrollSql;
+  pDB->pScrollSql = NULL;
+  RESOF(res)->pNext = pDB->pStreaming;
+  pDB->pStreaming = RESOF(res);
+  pDB->hStmt = SQL_NULL_HSTMT;
+  pDB->bPrepared = 0;
 
   return res;
 
@@ -845,82 +14190,81 @@ _impl_store_result (MYSQL *mysql)
 {
   TSQLPrivate *pDB;
   MYSQL_RES *res;
-  unsigned int j;
-  SQLRETURN ret;
-  SQLLEN *ind;
-  MYSQL_ROWS *rp = NULL;
+  my_ulonglong t0;
 
   if ((pDB = _db (mysql)) == NULL)
     return NULL;
 
+  if (pDB->pQcHit)
+    return _qc_result (mysql);
+  if ((res = pDB->pLocalRes) != NULL)
+    {
+      pDB->pLocalRes = NULL;
+      return res;
+    }
+
+  if (pDB->hStmt == SQL_NULL_HSTMT)
+    return NULL;
+
   /* note: this could also fail if there are no fields (eg. after INSERT) */
-  if ((res = _alloc_res (mysql)) == NULL)
+  if ((res = _alloc_res (mysql, 1)) == NULL)
     return NULL;
 
   /* Bind the result set */
-  SQLFreeStmt (pDB->hStmt, SQL_UNBIND);
-  for (j = 0; j < res->field_count; j++)
+  t0 = _slow_now (pDB->pSlow);
+  if (_bind_res (mysql, res, pDB->hStmt))
     {
-      ret = SQLBindCol (
-	  pDB->hStmt,
-	  (SQLUSMALLINT) (j + 1),
-	  SQL_C_CHAR,
-	  res->row[j],
-	  res->fields[j].max_length,
-	  (SQLLEN *) &res->lengths[j]);
+      _free_res (res);
+      return NULL;
+    }
+  _slow_add (pDB->pSlow, SLOW_BIND, t0);
 
-      if (_trap_sqlerror (mysql, ret, "SQLBindCol"))
+  /* The columnar option keeps the values by column, see _col_alloc */
+  if (mysql->options.columnar)
+    {
+      RESOF(res)->pCols = _col_alloc (res->field_count, COL_ROWS);
+      if (RESOF(res)->pCols == NULL)
 	{
+	  _set_error (mysql, CR_OUT_OF_MEMORY);
 	  _free_res (res);
 	  return NULL;
 	}
+      RESOF(res)->pCols->bView = 1;
     }
 
-  res->data = (MYSQL_DATA *) calloc (1, sizeof (MYSQL_DATA));
-  if (res->data == NULL)
-    goto failed;
-  res->data->fields = mysql->field_count;
-
   /* Now fetch all the records */
-  ind = (SQLLEN *) res->lengths;
-  for (;;)
+  t0 = _slow_now (pDB->pSlow);
+  if (_fetch_all (mysql, res, pDB->hStmt) < 0)
     {
-      ret = SQLFetch (pDB->hStmt);
-      if (_trap_sqlerror (res->handle, ret, "SQLFetch"))
-	return NULL;
-      if (ret == SQL_NO_DATA_FOUND)
-	break;
+      _qc_reset (pDB);
+      _free_res (res);
+      return NULL;
+    }
+  _slow_add (pDB->pSlow, SLOW_FETCH, t0);
 
-      if (_append_row (res->data, &rp) == -1)
-	{
-	  /* I don't 'goto failed' here, because maybe we've already
-	   * collected a lot of info...
-	   */
-	  _set_error (mysql, CR_OUT_OF_MEMORY);
-	  break;
-	}
+  /* Names come from hStmt until the next query closes it */
+  RESOF(res)->hMeta = pDB->hStmt;
+  pDB->pLazyRes = RESOF(res);
+  mysql->affected_rows = res->data->rows;
 
-      for (j = 0; j < res->field_count; j++)
+  /* Only a slow statement needs the hold time and the byte count */
+  if (pDB->pSlow && pDB->pSlow->bActive)
+    {
+      if (_slow_over (pDB->pSlow))
 	{
-	  if (ind[j] != SQL_NULL_DATA)
-	    rp->data[j] = strdup (res->row[j]);
+	  pDB->pSlow->bytes = _slow_bytes (res);
+	  _slow_attach (pDB, res);
 	}
-
-#if 0
-      /* TODO should we limit the max # of rows somehow? */
-      if (res->data->rows > 1000)
-	break;
-#endif
+      else
+	_slow_finish (pDB);
     }
 
-  res->data_cursor = res->data->data;
+  if (pDB->pShcKey)
+    _shc_insert (mysql, res);
+  if (pDB->pQcKey)
+    _qc_insert (mysql, res);
 
   return res;
-
-failed:
-  _set_error (mysql, CR_OUT_OF_MEMORY);
-  _free_res (res);
-  return NULL;
 }
 
 
@@ -928,10 +14272,16 @@ static MYSQL_ROW
 _impl_fetch_row (MYSQL_RES *res)
 {
   TSQLPrivate *pDB;
+  my_ulonglong t0;
   unsigned int j;
   SQLRETURN ret;
   SQLLEN *ind;
+  char *conv;
+  size_t n;
+  int rc;
 
+  if (COLUMNAR (res))
+    return _col_fetch_row (res);
   if (res->data)
     {
       /* if we're here, the result set is from store_result */
@@ -946,30 +14296,102 @@ _impl_fetch_row (MYSQL_RES *res)
       return res->current_row;
     }
 
-  pDB = _db (res->handle);
-  if (res->eof || pDB == NULL)
+  if (res->eof || RESOF(res)->hStmt == SQL_NULL_HSTMT)
     return NULL;
-
-  ret = SQLFetch (pDB->hStmt);
-  if (_trap_sqlerror (res->handle, ret, "SQLFetch"))
+  if ((pDB = _db (res->handle)) == NULL)
     return NULL;
 
+  if (RESOF(res)->pScroll)
+    {
+      /* The cursor stays open for mysql_data_seek */
+      t0 = _slow_now (RESOF(res)->pSlow);
+      rc = _scroll_row (res);
+      _slow_add (RESOF(res)->pSlow, SLOW_FETCH, t0);
+      if (rc <= 0)
+	{
+	  res->eof = rc == 0;
+	  return NULL;
+	}
+      ret = SQL_SUCCESS;
+    }
+  else
+    {
+      pDB->hDiagStmt = RESOF(res)->hStmt;
+      t0 = _slow_now (RESOF(res)->pSlow);
+      ret = SQLFetch (RESOF(res)->hStmt);
+      _slow_add (RESOF(res)->pSlow, SLOW_FETCH, t0);
+      rc = _trap_sqlerror (res->handle, ret, "SQLFetch");
+      pDB->hDiagStmt = SQL_NULL_HSTMT;
+      if (rc)
+	return NULL;
+    }
+
   if (ret == SQL_NO_DATA_FOUND)
     {
+      /* Cursor exhausted, the statement can serve other queries unless
+       * a seek may still run the read again on it
+       */
       res->eof = 1;
+      if (RESOF(res)->pScrollSql == NULL)
+	_detach_res (res);
       return NULL;
     }
 
   ind = (SQLLEN *) res->lengths;
-  for (j = 0; j < res->field_count; j++)
+  if (!CS_CONVERT (pDB))
     {
-      if (ind[j] == SQL_NULL_DATA)
-	res->current_row[j] = NULL;
-      else
-	res->current_row[j] = res->row[j];
+      for (j = 0; j < res->field_count; j++)
+	{
+	  if (ind[j] == SQL_NULL_DATA)
+	    {
+	      res->current_row[j] = NULL;
+	      continue;
+	    }
+	  /* SQL_NO_TOTAL or truncated, the buffer has what there is */
+	  if (ind[j] < 0 || ind[j] >= (SQLLEN) res->fields[j].max_length)
+	    ind[j] = (SQLLEN) strlen (res->row[j]);
+	  res->current_row[j] = res->row[j];
+	}
+    }
+  else
+    {
+      /* Transcode into a second buffer, the bound one is the driver's */
+      if ((conv = RESOF(res)->pConv) == NULL)
+	{
+	  for (n = 0, j = 0; j < res->field_count; j++)
+	    n += 2 * res->fields[j].max_length + 1;
+	  if ((conv = RESOF(res)->pConv = (char *) malloc (n)) == NULL)
+	    {
+	      _set_error (res->handle, CR_OUT_OF_MEMORY);
+	      return NULL;
+	    }
+	}
+      for (j = 0; j < res->field_count; j++)
+	{
+	  if (ind[j] == SQL_NULL_DATA)
+	    {
+	      res->current_row[j] = NULL;
+	      continue;
+	    }
+	  res->current_row[j] = conv;
+	  ind[j] = (SQLLEN) _cs_convert (pDB->csOdbc, res->row[j],
+	      strlen (res->row[j]), conv);
+	  conv += 2 * res->fields[j].max_length + 1;
+	}
     }
 
-  res->row_count++;
+  if (RESOF(res)->pSlow)
+    {
+      for (j = 0; j < res->field_count; j++)
+	{
+	  if (ind[j] != SQL_NULL_DATA)
+	    RESOF(res)->pSlow->bytes += (my_ulonglong) ind[j];
+	}
+    }
+  if (RESOF(res)->pScroll == NULL)
+    res->row_count++;
+  else if (res->row_count < RESOF(res)->pScroll->pos)
+    res->row_count = RESOF(res)->pScroll->pos;	/* rows seen, once each */
 
   return res->current_row;
 }
@@ -1030,15 +14452,233 @@ mysql_real_connect (
 void STDCALL 
 mysql_close (MYSQL *mysql)
 {
-  TRACE ("mysql_close");
-  _impl_close (mysql);
+  TRACE ("mysql_close");
+  _impl_close (mysql);
+}
+
+
+int STDCALL
+mysql_get_socket (const MYSQL *mysql)
+{
+  TRACE ("mysql_get_socket");
+  if (mysql == NULL || mysql->async_context == NULL)
+    return -1;
+  return mysql->net.fd;
+}
+
+
+int STDCALL
+mysql_real_connect_start (
+    MYSQL **ret,
+    MYSQL *mysql,
+    const char *host,
+    const char *user,
+    const char *passwd,
+    const char *db,
+    unsigned int port,
+    const char *unix_socket,
+    unsigned long clientflag)
+{
+  TAsync *a;
+
+  TRACE ("mysql_real_connect_start");
+  if (mysql == NULL || (a = _async_prepare (mysql, ASYNC_CONNECT)) == NULL)
+    {
+      *ret = NULL;
+      return 0;
+    }
+  a->pHost = host;
+  a->pUser = user;
+  a->pPasswd = passwd;
+  a->pDb = db;
+  a->port = port;
+  a->pSocket = unix_socket;
+  a->clientFlag = clientflag;
+  if (_async_start (a))
+    return MYSQL_WAIT_READ;
+  return mysql_real_connect_cont (ret, mysql, 0);
+}
+
+
+int STDCALL
+mysql_real_connect_cont (MYSQL **ret, MYSQL *mysql, int status)
+{
+  TAsync *a;
+
+  TRACE ("mysql_real_connect_cont");
+  if ((a = _async_result (mysql, ASYNC_CONNECT, &status)) == NULL)
+    {
+      if (status == 0)
+	*ret = NULL;
+      return status;
+    }
+  *ret = a->pConn;
+  return 0;
+}
+
+
+int STDCALL
+mysql_real_query_start (int *ret, MYSQL *mysql, const char *q,
+    unsigned long length)
+{
+  TAsync *a;
+
+  TRACE ("mysql_real_query_start");
+  if (mysql == NULL || (a = _async_prepare (mysql, ASYNC_QUERY)) == NULL)
+    {
+      *ret = -1;
+      return 0;
+    }
+  a->pQuery = q;
+  a->nQuery = length;
+  if (_async_start (a))
+    return MYSQL_WAIT_READ;
+  return mysql_real_query_cont (ret, mysql, 0);
+}
+
+
+int STDCALL
+mysql_real_query_cont (int *ret, MYSQL *mysql, int status)
+{
+  TAsync *a;
+
+  TRACE ("mysql_real_query_cont");
+  if ((a = _async_result (mysql, ASYNC_QUERY, &status)) == NULL)
+    {
+      if (status == 0)
+	*ret = -1;
+      return status;
+    }
+  *ret = a->rc;
+  return 0;
+}
+
+
+int STDCALL
+mysql_store_result_start (MYSQL_RES **ret, MYSQL *mysql)
+{
+  TAsync *a;
+
+  TRACE ("mysql_store_result_start");
+  if (mysql == NULL || (a = _async_prepare (mysql, ASYNC_STORE)) == NULL)
+    {
+      *ret = NULL;
+      return 0;
+    }
+  if (_async_start (a))
+    return MYSQL_WAIT_READ;
+  return mysql_store_result_cont (ret, mysql, 0);
+}
+
+
+int STDCALL
+mysql_store_result_cont (MYSQL_RES **ret, MYSQL *mysql, int status)
+{
+  TAsync *a;
+
+  TRACE ("mysql_store_result_cont");
+  if ((a = _async_result (mysql, ASYNC_STORE, &status)) == NULL)
+    {
+      if (status == 0)
+	*ret = NULL;
+      return status;
+    }
+  *ret = a->pResult;
+  a->pResult = NULL;
+  return 0;
+}
+
+
+int STDCALL
+mysql_fetch_row_start (MYSQL_ROW *ret, MYSQL_RES *res)
+{
+  TAsync *a;
+
+  TRACE ("mysql_fetch_row_start");
+
+  /* Only a streaming result waits for the connection */
+  if (res->data || res->eof || RESOF(res)->hStmt == SQL_NULL_HSTMT
+      || res->handle == NULL)
+    {
+      *ret = mysql_fetch_row (res);
+      return 0;
+    }
+  if ((a = _async_prepare (res->handle, ASYNC_FETCH)) == NULL)
+    {
+      *ret = NULL;
+      return 0;
+    }
+  a->pRes = res;
+  if (_async_start (a))
+    return MYSQL_WAIT_READ;
+  return mysql_fetch_row_cont (ret, res, 0);
+}
+
+
+int STDCALL
+mysql_fetch_row_cont (MYSQL_ROW *ret, MYSQL_RES *res, int status)
+{
+  TAsync *a;
+
+  TRACE ("mysql_fetch_row_cont");
+  if ((a = _async_result (res->handle, ASYNC_FETCH, &status)) == NULL)
+    {
+      if (status == 0)
+	*ret = NULL;
+      return status;
+    }
+  *ret = a->row;
+  return 0;
+}
+
+
+int STDCALL
+mysql_close_start (MYSQL *mysql)
+{
+  TAsync *a;
+
+  TRACE ("mysql_close_start");
+  if (mysql == NULL)
+    return 0;
+  if (DBOF(mysql) == NULL
+      || (a = _async_prepare (mysql, ASYNC_CLOSE)) == NULL)
+    {
+      _impl_close (mysql);
+      return 0;
+    }
+  if (_async_start (a))
+    return MYSQL_WAIT_READ;
+  return mysql_close_cont (mysql, 0);
+}
+
+
+int STDCALL
+mysql_close_cont (MYSQL *mysql, int status)
+{
+  TRACE ("mysql_close_cont");
+  if (_async_result (mysql, ASYNC_CLOSE, &status) == NULL && status)
+    return status;
+  _impl_close (mysql);
+  return 0;
+}
+
+
+int STDCALL
+mysql_wait_any (MYSQL **mysql, unsigned int count, int timeout)
+{
+  TRACE ("mysql_wait_any");
+  return _async_wait_any (mysql, count, timeout);
 }
 
 
 unsigned int STDCALL
 mysql_errno (MYSQL *mysql)
 {
+  TThreadPrivate *pThr;
+
   TRACE ("mysql_errno");
+  if (mysql == NULL)
+    return (pThr = _thread_private ()) ? pThr->last_errno : CR_OUT_OF_MEMORY;
   return mysql->net.last_errno;
 }
 
@@ -1046,11 +14686,29 @@ mysql_errno (MYSQL *mysql)
 char * STDCALL
 mysql_error (MYSQL *mysql)
 {
+  TThreadPrivate *pThr;
+
   TRACE ("mysql_error");
+  if (mysql == NULL)
+    return (pThr = _thread_private ()) ? pThr->last_error : "";
   return mysql->net.last_error;
 }
 
 
+/*
+ *  Warnings of the last statement, its fetches included
+ */
+unsigned int STDCALL
+mysql_warning_count (MYSQL *mysql)
+{
+  TRACE ("mysql_warning_count");
+  if (mysql == NULL || DBOF(mysql) == NULL)
+    return 0;
+  _diag_drain (mysql);
+  return DBOF(mysql)->nWarnings;
+}
+
+
 char * STDCALL
 mysql_info (MYSQL *mysql)
 {
@@ -1065,7 +14723,10 @@ mysql_query (MYSQL *mysql, const char *q)
   int rc;
 
   TRACE ("mysql_query");
+  if (_enter (mysql))
+    return -1;
   rc = _impl_query (mysql, q, SQL_NTS);
+  _leave (mysql);
   return rc;
 }
 
@@ -1092,7 +14753,92 @@ mysql_real_query (MYSQL *mysql, const char *q, unsigned int length)
   int rc;
 
   TRACE ("mysql_real_query");
+  if (_enter (mysql))
+    return -1;
   rc = _impl_query (mysql, q, (long) length);
+  _leave (mysql);
+  return rc;
+}
+
+
+my_bool STDCALL
+mysql_more_results (MYSQL *mysql)
+{
+  TRACE ("mysql_more_results");
+  return (mysql->server_status & SERVER_MORE_RESULTS_EXISTS) != 0;
+}
+
+
+int STDCALL
+mysql_next_result (MYSQL *mysql)
+{
+  int rc;
+
+  TRACE ("mysql_next_result");
+  if (_enter (mysql))
+    return 1;
+  rc = _impl_next_result (mysql);
+  _leave (mysql);
+  return rc;
+}
+
+
+int STDCALL
+mysql_set_server_option (MYSQL *mysql, enum enum_mysql_set_option option)
+{
+  TRACE ("mysql_set_server_option");
+  switch (option)
+    {
+    case MYSQL_OPTION_MULTI_STATEMENTS_ON:
+      mysql->client_flag |= CLIENT_MULTI_STATEMENTS;
+      return 0;
+    case MYSQL_OPTION_MULTI_STATEMENTS_OFF:
+      mysql->client_flag &= ~CLIENT_MULTI_STATEMENTS;
+      return 0;
+    }
+  _set_error (mysql, CR_UNKNOWN_ERROR);
+  return 1;
+}
+
+
+my_bool STDCALL
+mysql_autocommit (MYSQL *mysql, my_bool auto_mode)
+{
+  my_bool rc;
+
+  TRACE ("mysql_autocommit");
+  if (_enter (mysql))
+    return 1;
+  rc = _impl_autocommit (mysql, auto_mode);
+  _leave (mysql);
+  return rc;
+}
+
+
+my_bool STDCALL
+mysql_commit (MYSQL *mysql)
+{
+  my_bool rc;
+
+  TRACE ("mysql_commit");
+  if (_enter (mysql))
+    return 1;
+  rc = _impl_end_tran (mysql, SQL_COMMIT);
+  _leave (mysql);
+  return rc;
+}
+
+
+my_bool STDCALL
+mysql_rollback (MYSQL *mysql)
+{
+  my_bool rc;
+
+  TRACE ("mysql_rollback");
+  if (_enter (mysql))
+    return 1;
+  rc = _impl_end_tran (mysql, SQL_ROLLBACK);
+  _leave (mysql);
   return rc;
 }
 
@@ -1103,7 +14849,10 @@ mysql_use_result (MYSQL *mysql)
   MYSQL_RES *res;
 
   TRACE ("mysql_use_result");
+  if (_enter (mysql))
+    return NULL;
   res = _impl_use_result (mysql);
+  _leave (mysql);
   return res;
 }
 
@@ -1114,32 +14863,109 @@ mysql_store_result (MYSQL *mysql)
   MYSQL_RES *res;
 
   TRACE ("mysql_store_result");
+  if (_enter (mysql))
+    return NULL;
   res = _impl_store_result (mysql);
+  _leave (mysql);
   return res;
 }
 
 
+void STDCALL
+mysql_query_cache_configure (unsigned long max_bytes, unsigned int ttl)
+{
+  TRACE ("mysql_query_cache_configure");
+  RUN_ONCE (&_global_once, _global_init);
+
+  MUTEX_LOCK (&_qc.lock);
+  _qc.maxBytes = max_bytes;
+  _qc.ttl = ttl;
+  _qc.bConfigured = 1;
+  MUTEX_UNLOCK (&_qc.lock);
+
+  /* Shrinking or disabling drops what no longer fits */
+  if (max_bytes == 0)
+    mysql_query_cache_flush ();
+  else
+    {
+      MUTEX_LOCK (&_qc.lock);
+      while (_qc.bytes > _qc.maxBytes && _qc.pLruTail)
+	{
+	  _qc.stats.evictions++;
+	  _qc_unlink (_qc.pLruTail);
+	}
+      _qc.stats.bytes = _qc.bytes;
+      MUTEX_UNLOCK (&_qc.lock);
+    }
+}
+
+
+void STDCALL
+mysql_query_cache_flush (void)
+{
+  TRACE ("mysql_query_cache_flush");
+  RUN_ONCE (&_global_once, _global_init);
+
+  MUTEX_LOCK (&_qc.lock);
+  _qc.generation++;
+  while (_qc.pLruTail)
+    _qc_unlink (_qc.pLruTail);
+  _qc.stats.bytes = _qc.bytes;
+  MUTEX_UNLOCK (&_qc.lock);
+}
+
+
+void STDCALL
+mysql_query_cache_stats (MYSQL_QUERY_CACHE_STATS *stats)
+{
+  TRACE ("mysql_query_cache_stats");
+  RUN_ONCE (&_global_once, _global_init);
+
+  MUTEX_LOCK (&_qc.lock);
+  *stats = _qc.stats;
+  MUTEX_UNLOCK (&_qc.lock);
+}
+
+
 MYSQL_RES * STDCALL
 mysql_list_dbs (MYSQL *mysql, const char *wild)
 {
-  TRACE ("mysql_list_dbs UNIMPLEMENTED");
-  UNIMPLEMENTED (MYSQL_RES *);
+  MYSQL_RES *res;
+
+  TRACE ("mysql_list_dbs");
+  if (_enter (mysql))
+    return NULL;
+  res = _impl_list (mysql, CAT_DBS, NULL, wild);
+  _leave (mysql);
+  return res;
 }
 
 
 MYSQL_RES * STDCALL
 mysql_list_tables (MYSQL *mysql, const char *wild)
 {
-  TRACE ("mysql_list_tables UNIMPLEMENTED");
-  UNIMPLEMENTED (MYSQL_RES *);
+  MYSQL_RES *res;
+
+  TRACE ("mysql_list_tables");
+  if (_enter (mysql))
+    return NULL;
+  res = _impl_list (mysql, CAT_TABLES, NULL, wild);
+  _leave (mysql);
+  return res;
 }
 
 
 MYSQL_RES * STDCALL
 mysql_list_fields (MYSQL *mysql, const char *table, const char *wild)
 {
-  TRACE ("mysql_list_fields UNIMPLEMENTED");
-  UNIMPLEMENTED (MYSQL_RES *);
+  MYSQL_RES *res;
+
+  TRACE ("mysql_list_fields");
+  if (_enter (mysql))
+    return NULL;
+  res = _impl_list (mysql, CAT_FIELDS, table, wild);
+  _leave (mysql);
+  return res;
 }
 
 
@@ -1187,6 +15013,7 @@ MYSQL_FIELD * STDCALL
 mysql_fetch_field_direct (MYSQL_RES *res, unsigned int fieldnr)
 {
   TRACE ("mysql_fetch_field_direct");
+  _meta_resolve (res);
   return &res->fields[fieldnr];
 }
 
@@ -1195,14 +15022,42 @@ MYSQL_FIELD * STDCALL
 mysql_fetch_fields (MYSQL_RES *res)
 {
   TRACE ("mysql_fetch_fields");
+  _meta_resolve (res);
   return res->fields;
 }
 
 
+/*
+ *  Before a seek, a streaming read goes on a scrollable cursor
+ */
+static void
+_scroll_seek (MYSQL_RES *res)
+{
+  if (RESOF(res)->pScrollSql && RESOF(res)->hStmt
+      && _enter (res->handle) == 0)
+    {
+      _scroll_open (res);
+      _leave (res->handle);
+    }
+}
+
+
 MYSQL_ROWS * STDCALL
 mysql_row_tell (MYSQL_RES *res)
 {
   TRACE ("mysql_row_tell");
+
+  /* Of a scrollable result the position, for mysql_row_seek only. A
+   * streaming read goes on a scrollable cursor now, positions are not
+   * handed out for a cursor that may never open.
+   */
+  _scroll_seek (res);
+  if (RESOF(res)->pScroll)
+    return (MYSQL_ROWS *) (size_t) (RESOF(res)->pScroll->pos + 1);
+
+  /* Columnar rows have no MYSQL_ROWS, the row number stands in */
+  if (COLUMNAR (res))
+    return (MYSQL_ROWS *) (size_t) (RESOF(res)->pCols->nCursor + 1);
   return res->data_cursor;
 }
 
@@ -1227,6 +15082,14 @@ my_ulonglong STDCALL
 mysql_affected_rows (MYSQL *mysql)
 {
   TRACE ("mysql_affected_rows");
+
+  /* Asked for only now, see _impl_query */
+  if (DBOF(mysql) && DBOF(mysql)->bRowCountPending && _enter (mysql) == 0)
+    {
+      _impl_affected_rows (mysql);
+      _leave (mysql);
+    }
+
   return mysql->affected_rows;
 }
 
@@ -1235,6 +15098,15 @@ my_ulonglong STDCALL
 mysql_insert_id (MYSQL *mysql)
 {
   TRACE ("mysql_insert_id");
+
+  /* Asked for only now, see _identity_init */
+  if (DBOF(mysql) && DBOF(mysql)->bIdentityPending && _enter (mysql) == 0)
+    {
+      if (DBOF(mysql)->bConnected)
+	_impl_insert_id (mysql);
+      _leave (mysql);
+    }
+
   return mysql->insert_id;
 }
 
@@ -1242,8 +15114,32 @@ mysql_insert_id (MYSQL *mysql)
 void STDCALL
 mysql_data_seek (MYSQL_RES *res, my_ulonglong offset)
 {
-  TRACE ("mysql_data_seek UNIMPLEMENTED");
-  UNIMPLEMENTED_VOID;
+  MYSQL_ROWS *rp;
+
+  TRACE ("mysql_data_seek");
+
+  /* A scrollable cursor goes there with the next mysql_fetch_row */
+  _scroll_seek (res);
+  if (RESOF(res)->pScroll)
+    {
+      RESOF(res)->pScroll->pos = offset;
+      res->eof = 0;
+      return;
+    }
+
+  /* Only a stored result has the rows to go to */
+  if (res->data == NULL)
+    return;
+
+  if (COLUMNAR (res))
+    RESOF(res)->pCols->nCursor = offset;
+  else
+    {
+      for (rp = res->data->data; rp && offset; offset--)
+	rp = rp->next;
+      res->data_cursor = rp;
+    }
+  res->current_row = NULL;
 }
 
 
@@ -1253,8 +15149,24 @@ mysql_row_seek (MYSQL_RES *res, MYSQL_ROW_OFFSET offset)
   MYSQL_ROW_OFFSET old;
 
   TRACE ("mysql_row_seek");
-  old = res->data_cursor;
-  res->data_cursor = offset;
+  old = mysql_row_tell (res);
+  _scroll_seek (res);
+  if (RESOF(res)->pScroll)
+    {
+      RESOF(res)->pScroll->pos = (my_ulonglong) (size_t) offset - 1;
+      res->eof = 0;
+      return old;
+    }
+
+  /* Only a stored result has the rows to go to. Positions come from a
+   * scrollable cursor only, which a result keeps once it has one.
+   */
+  if (res->data == NULL)
+    return old;
+  if (COLUMNAR (res))
+    RESOF(res)->pCols->nCursor = (my_ulonglong) (size_t) offset - 1;
+  else
+    res->data_cursor = offset;
   res->current_row = NULL;
 
   return old;
@@ -1277,8 +15189,41 @@ mysql_field_seek (MYSQL_RES *res, MYSQL_FIELD_OFFSET offset)
 MYSQL_ROW STDCALL
 mysql_fetch_row (MYSQL_RES *res)
 {
+  MYSQL_ROW row;
+
   TRACE ("mysql_fetch_row");
-  return _impl_fetch_row (res);
+
+  /* Buffered rows never touch the connection */
+  if (res->data)
+    return _impl_fetch_row (res);
+  if (res->eof || RESOF(res)->hStmt == SQL_NULL_HSTMT)
+    return NULL;
+
+  if (_enter (res->handle))
+    return NULL;
+  row = _impl_fetch_row (res);
+  _leave (res->handle);
+  return row;
+}
+
+
+my_ulonglong STDCALL
+mysql_export_result (MYSQL_RES *res, int fd, enum mysql_export_format format,
+    unsigned int flags)
+{
+  my_ulonglong rc;
+
+  TRACE ("mysql_export_result");
+
+  /* Buffered rows never touch the connection */
+  if (res->data)
+    return _impl_export (res, fd, format, flags);
+
+  if (_enter (res->handle))
+    return (my_ulonglong) -1;
+  rc = _impl_export (res, fd, format, flags);
+  _leave (res->handle);
+  return rc;
 }
 
 
@@ -1294,7 +15239,8 @@ mysql_fetch_lengths (MYSQL_RES *res)
   if (!(column=res->current_row))               
     return 0;                                   /* Something is wrong */
 
-  if (res->data)
+  /* A columnar row has them already, see _col_fetch_row */
+  if (res->data && !COLUMNAR (res))
     {   
       lengths=res->lengths;
       for (i = 0 ; i < res->field_count ; column++,i ++)
@@ -1312,6 +15258,84 @@ mysql_fetch_lengths (MYSQL_RES *res)
 }
 
 
+/*
+ *  Values of one column of a stored result, see MYSQL_COLUMN
+ */
+int STDCALL
+mysql_fetch_column (MYSQL_RES *res, unsigned int column, MYSQL_COLUMN *col)
+{
+  TColumns *pCols;
+  TColumn *c;
+
+  TRACE ("mysql_fetch_column");
+
+  /* Only a stored result has all its rows */
+  if (res == NULL || res->data == NULL || column >= res->field_count)
+    return -1;
+  if (RESOF(res)->pCols == NULL && _col_from_rows (res))
+    return -1;
+
+  pCols = RESOF(res)->pCols;
+  c = &pCols->aCol[column];
+  col->rows = pCols->nRows;
+  col->data = c->data;
+  col->offsets = c->offsets;
+  col->nulls = c->nulls;
+
+  return 0;
+}
+
+
+/*
+ *  Write a stored result to a file for mysql_load_result
+ */
+int STDCALL
+mysql_save_result (MYSQL_RES *res, const char *file)
+{
+  TResField *aField;
+  TResHead head;
+  FILE *fd;
+  int rc;
+
+  TRACE ("mysql_save_result");
+
+  if (res == NULL || res->data == NULL)
+    return -1;
+  _meta_resolve (res);
+  if (RESOF(res)->pCols == NULL && _col_from_rows (res))
+    return -1;
+
+  if ((aField = _rf_layout (res, &head)) == NULL)
+    return -1;
+  if ((fd = fopen (file, "wb")) == NULL)
+    {
+      free (aField);
+      return -1;
+    }
+  rc = _rf_write (res, &head, aField, fd, NULL);
+  if (fclose (fd) != 0)
+    rc = -1;
+  if (rc)
+    remove (file);
+  free (aField);
+
+  return rc;
+}
+
+
+/*
+ *  Read-only result mapped from a file of mysql_save_result. It does not
+ *  belong to a connection.
+ */
+MYSQL_RES * STDCALL
+mysql_load_result (const char *file)
+{
+  TRACE ("mysql_load_result");
+
+  return _rf_load (file);
+}
+
+
 MYSQL_FIELD * STDCALL
 mysql_fetch_field (MYSQL_RES *res)
 {
@@ -1323,6 +15347,7 @@ mysql_fetch_field (MYSQL_RES *res)
 
   if (res->current_field >= res->field_count)
     return NULL;
+  _meta_resolve (res);
   
   return &res->fields[res->current_field++];
 }
@@ -1417,15 +15442,84 @@ unsigned int STDCALL
 mysql_thread_safe (void)
 {
   TRACE ("mysql_thread_safe");
-  return 1;
+  return HAVE_THREADS;
+}
+
+
+my_bool
+my_thread_init (void)
+{
+  TRACE ("my_thread_init");
+  return _thread_private () == NULL;
+}
+
+
+void
+my_thread_end (void)
+{
+#if HAVE_THREADS
+  TThreadPrivate *pThr;
+
+  TRACE ("my_thread_end");
+  if (_thread_key_ok
+      && (pThr = (TThreadPrivate *) KEY_GET (_thread_key)) != NULL)
+    {
+      KEY_SET (_thread_key, NULL);
+      _thread_destroy (pThr);
+    }
+#endif
+}
+
+
+my_bool STDCALL
+mysql_thread_init (void)
+{
+  TRACE ("mysql_thread_init");
+  return my_thread_init ();
+}
+
+
+void STDCALL
+mysql_thread_end (void)
+{
+  TRACE ("mysql_thread_end");
+  my_thread_end ();
 }
 
 
 const char *
 mysql_character_set_name (MYSQL *mysql)
 {
+  TSQLPrivate *pDB;
+
   TRACE ("mysql_character_set_name");
-  return "latin1";
+
+  if (mysql == NULL || (pDB = DBOF(mysql)) == NULL || !pDB->pszCharset)
+    return MYSQL_CHARSET;
+
+  return pDB->pszCharset;
+}
+
+
+int STDCALL
+mysql_set_character_set (MYSQL *mysql, const char *csname)
+{
+  int rc = 1;
+
+  TRACE ("mysql_set_character_set");
+
+  if (csname == NULL || _enter (mysql))
+    return 1;
+
+  /* Takes effect right away, and again after a reconnect */
+  if (_cs_lookup (csname) < 0)
+    _set_error (mysql, CR_CANT_READ_CHARSET);
+  else if (_opt_str (mysql, &mysql->options.charset_name, csname) == 0)
+    rc = DBOF(mysql) ? _cs_init (mysql) : 0;
+
+  _leave (mysql);
+
+  return rc;
 }
 
 
@@ -1456,8 +15550,14 @@ mysql_kill (MYSQL *mysql, unsigned long pid)
 int STDCALL
 mysql_ping (MYSQL *mysql)
 {
-  TRACE ("mysql_ping UNIMPLEMENTED");
-  UNIMPLEMENTED (int);
+  int rc;
+
+  TRACE ("mysql_ping");
+  if (_enter (mysql))
+    return -1;
+  rc = _impl_ping (mysql);
+  _leave (mysql);
+  return rc;
 }
 
 
@@ -1472,8 +15572,14 @@ mysql_stat (MYSQL *mysql)
 int STDCALL
 mysql_options (MYSQL *mysql, enum mysql_option option, const char *arg)
 {
-  TRACE ("mysql_options UNIMPLEMENTED");
-  UNIMPLEMENTED (int);
+  int rc;
+
+  TRACE ("mysql_options");
+  if (_enter (mysql))
+    return 1;
+  rc = _impl_options (mysql, option, arg);
+  _leave (mysql);
+  return rc;
 }
 
 
@@ -1527,8 +15633,8 @@ myodbc_remove_escape (MYSQL *mysql, char *name)
 void
 my_init (void)
 {
-  TRACE ("my_init UNIMPLEMENTED");
-  UNIMPLEMENTED_VOID;
+  TRACE ("my_init");
+  RUN_ONCE (&_global_once, _global_init);
 }
 
 
@@ -1539,22 +15645,66 @@ load_defaults (
     int *argc,
     char ***argv)
 {
-  TRACE ("load_defaults UNIMPLEMENTED");
-  UNIMPLEMENTED_VOID;
+  TCnfBlock *pBlock;
+  int i, n;
+
+  TRACE ("load_defaults");
+  RUN_ONCE (&_global_once, _global_init);
+
+  if ((pBlock = (TCnfBlock *) calloc (1, sizeof (TCnfBlock))) == NULL)
+    return;
+
+  /* Options from the files go between argv[0] and the real arguments */
+  if (_cnf_read (conf_file, groups, _cnf_arg, &pBlock->args)
+      || (pBlock->argv = (char **) calloc (*argc + pBlock->args.argc + 1,
+	  sizeof (char *))) == NULL)
+    {
+      _cnf_free_block (pBlock);
+      return;
+    }
+
+  n = 0;
+  if (*argc > 0)
+    pBlock->argv[n++] = (*argv)[0];
+  for (i = 0; i < pBlock->args.argc; i++)
+    pBlock->argv[n++] = pBlock->args.argv[i];
+  for (i = 1; i < *argc; i++)
+    pBlock->argv[n++] = (*argv)[i];
+  pBlock->argv[n] = NULL;
+
+  *argc = n;
+  *argv = pBlock->argv;
+
+  MUTEX_LOCK (&_defaults_lock);
+  pBlock->pNext = _defaults_mem;
+  _defaults_mem = pBlock;
+  MUTEX_UNLOCK (&_defaults_lock);
 }
 
 
 void
 print_defaults (const char *conf_file, const char **groups)
 {
-  TRACE ("print_defaults UNIMPLEMENTED");
-  UNIMPLEMENTED_VOID;
+  TRACE ("print_defaults");
+
+  _cnf_read (conf_file, groups, _cnf_print, NULL);
+  printf ("\n");
 }
 
 
 void
 free_defaults (void)
 {
-  TRACE ("free_defaults UNIMPLEMENTED");
-  UNIMPLEMENTED_VOID;
+  TCnfBlock *pBlock;
+
+  TRACE ("free_defaults");
+  RUN_ONCE (&_global_once, _global_init);
+
+  MUTEX_LOCK (&_defaults_lock);
+  while ((pBlock = _defaults_mem) != NULL)
+    {
+      _defaults_mem = pBlock->pNext;
+      _cnf_free_block (pBlock);
+    }
+  MUTEX_UNLOCK (&_defaults_lock);
 }
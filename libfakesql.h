@@ -98,6 +98,12 @@
 #define CLIENT_SSL		2048	/* Switch to SSL after handshake */
 #define CLIENT_IGNORE_SIGPIPE	4096	/* IGNORE sigpipes */
 #define CLIENT_TRANSACTIONS	8192	/* Client knows about transactions */
+#define CLIENT_MULTI_STATEMENTS	(1UL << 16) /* Enable multi-stmt support */
+#define CLIENT_MULTI_RESULTS	(1UL << 17) /* Enable multi-results */
+
+#define SERVER_STATUS_IN_TRANS	1	/* Transaction has started */
+#define SERVER_STATUS_AUTOCOMMIT 2	/* Server in auto_commit mode */
+#define SERVER_MORE_RESULTS_EXISTS 8	/* Multi query - next query exists */
 
 #define MYSQL_ERRMSG_SIZE	200
 
@@ -213,6 +219,31 @@ struct st_mysql_options
     char *			ssl_cert;
     char *			ssl_ca;
     char *			ssl_capath;
+
+    /* mysql2odbc bridge settings */
+    unsigned int		fetch_batch_size;  /* rows per SQLFetch */
+    unsigned long		max_column_buffer; /* 0 = display size */
+    unsigned long		max_result_buffer; /* store_result limit */
+    unsigned int		stmt_pool_size;	   /* idle statements kept */
+    unsigned int		ping_window;	   /* ms, see mysql_ping */
+    unsigned long		query_cache_size;  /* process wide, once */
+    unsigned int		query_cache_ttl;
+    my_bool			async;
+    unsigned int		catalog_cache_ttl; /* mysql_list_* cache */
+    char *			odbc_charset;	   /* of the data source */
+    unsigned int		load_threads;	   /* LOAD DATA LOCAL */
+    char *			sql_dialect;	   /* of the data source */
+    unsigned int		dialect_cache_size; /* statements kept */
+    char *			slow_log;	   /* file, NULL = off */
+    unsigned int		long_query_time;   /* ms, slow log threshold */
+    my_bool			columnar;	   /* store_result by column */
+    char *			shared_cache;	   /* segment file, NULL = off */
+    unsigned long		shared_cache_size;
+    unsigned int		group_commit;	   /* ms, 0 = commit each write */
+    char *			read_replicas;	   /* DSNs, separated by commas */
+    unsigned int		hedged_reads;	   /* % extra executes, 0 = off */
+    char *			shard_map;	   /* table.key:DSN=lo..hi,... */
+    unsigned int		scroll_window;	   /* rows per block, 0 = forward only */
   };
 
 enum mysql_option
@@ -225,7 +256,38 @@ enum mysql_option
     MYSQL_READ_DEFAULT_GROUP,
     MYSQL_SET_CHARSET_DIR,
     MYSQL_SET_CHARSET_NAME,
-    MYSQL_OPT_LOCAL_INFILE
+    MYSQL_OPT_LOCAL_INFILE,
+
+    /* mysql2odbc extensions */
+    MYSQL_OPT_FETCH_BATCH_SIZE = 1000,	/* unsigned int */
+    MYSQL_OPT_MAX_COLUMN_BUFFER,	/* unsigned long */
+    MYSQL_OPT_MAX_RESULT_BUFFER,	/* unsigned long */
+    MYSQL_OPT_STMT_POOL_SIZE,		/* unsigned int */
+    MYSQL_OPT_PING_WINDOW,		/* unsigned int, ms */
+    MYSQL_OPT_QUERY_CACHE_SIZE,		/* unsigned long, once per process */
+    MYSQL_OPT_QUERY_CACHE_TTL,		/* unsigned int, seconds */
+    MYSQL_OPT_ASYNC,			/* my_bool */
+    MYSQL_OPT_CATALOG_CACHE_TTL,	/* unsigned int, seconds */
+    MYSQL_OPT_ODBC_CHARSET,		/* char *, latin1 or utf8 */
+    MYSQL_OPT_LOAD_THREADS,		/* unsigned int */
+    MYSQL_OPT_SQL_DIALECT,		/* char *, mssql, postgresql, ... */
+    MYSQL_OPT_DIALECT_CACHE_SIZE,	/* unsigned int, statements */
+    MYSQL_OPT_SLOW_LOG,			/* char *, file name */
+    MYSQL_OPT_LONG_QUERY_TIME,		/* unsigned int, ms */
+    MYSQL_OPT_COLUMNAR,			/* my_bool */
+    MYSQL_OPT_SHARED_CACHE,		/* char *, segment file */
+    MYSQL_OPT_SHARED_CACHE_SIZE,	/* unsigned long */
+    MYSQL_OPT_GROUP_COMMIT,		/* unsigned int, ms */
+    MYSQL_OPT_READ_REPLICAS,		/* char *, DSN,DSN,... */
+    MYSQL_OPT_HEDGED_READS,		/* unsigned int, percent */
+    MYSQL_OPT_SHARD_MAP,		/* char *, table.key:DSN=lo..hi,... */
+    MYSQL_OPT_SCROLL_WINDOW		/* unsigned int, rows */
+  };
+
+enum enum_mysql_set_option
+  {
+    MYSQL_OPTION_MULTI_STATEMENTS_ON,
+    MYSQL_OPTION_MULTI_STATEMENTS_OFF
   };
 
 enum mysql_status
@@ -263,10 +325,11 @@ typedef struct st_mysql
 //  MEM_ROOT			field_alloc;
     my_bool			free_me;
     my_bool			reconnect; /* set to 1 if automatic reconnect */
-//  struct st_mysql_options	options;
+    struct st_mysql_options	options;
 //  char			scramble_buff[9];
 //  struct charset_info_st *	charset;
     unsigned int		server_language;
+    struct SAsync *		async_context;	/* mysql_*_start */
   } MYSQL;
 
 typedef struct st_mysql_res
@@ -285,6 +348,55 @@ typedef struct st_mysql_res
     my_bool			eof;		/* Used my mysql_fetch_row */
   } MYSQL_RES;
 
+typedef struct st_mysql_query_cache_stats
+  {
+    unsigned long		hits;
+    unsigned long		misses;
+    unsigned long		evictions;	/* LRU and TTL */
+    unsigned long		invalidations;	/* dropped after a write */
+    unsigned long		entries;
+    unsigned long		bytes;
+  } MYSQL_QUERY_CACHE_STATS;
+
+
+/* mysql_export_result */
+enum mysql_export_format
+  {
+    MYSQL_EXPORT_CSV,		/* RFC 4180, NULL is an empty field */
+    MYSQL_EXPORT_TSV,		/* as mysql --batch, NULL is \N */
+    MYSQL_EXPORT_JSONL		/* one object per row */
+  };
+
+#define MYSQL_EXPORT_HEADER	1	/* column names first, CSV and TSV */
+
+
+/*
+ *  mysql_fetch_column. Value i starts at data + offsets[i] and is 0
+ *  terminated, its length is offsets[i + 1] - offsets[i] - 1. A NULL is
+ *  an empty value with bit (i & 7) of nulls[i >> 3] set. The buffers
+ *  belong to the result.
+ */
+typedef struct st_mysql_column
+  {
+    my_ulonglong		rows;
+    const char *		data;
+    const unsigned long *	offsets;	/* rows + 1 */
+    const unsigned char *	nulls;		/* bitmap */
+  } MYSQL_COLUMN;
+
+
+/*
+ *  Non-blocking API. A _start call returns 0 when the call is complete,
+ *  else the events to wait for on mysql_get_socket; then call the _cont
+ *  function until it returns 0. The arguments must stay valid until then.
+ *  mysql_wait_any returns the index of a handle whose call is complete,
+ *  or -1 after timeout ms (-1 waits forever) or when none has a call.
+ */
+#define MYSQL_WAIT_READ		1
+#define MYSQL_WAIT_WRITE	2
+#define MYSQL_WAIT_EXCEPT	4
+#define MYSQL_WAIT_TIMEOUT	8
+
 
 /* Functions to get information from the MYSQL and MYSQL_RES structures */
 /* Should definitely be used if one uses shared libraries */
@@ -301,7 +413,10 @@ extern "C" {
 #define mysql_affected_rows _fake_mysql_affected_rows
 #define mysql_change_user _fake_mysql_change_user
 #define mysql_character_set_name _fake_mysql_character_set_name
+#define mysql_set_character_set _fake_mysql_set_character_set
 #define mysql_close _fake_mysql_close
+#define mysql_close_start _fake_mysql_close_start
+#define mysql_close_cont _fake_mysql_close_cont
 #define mysql_connect _fake_mysql_connect
 #define mysql_create_db _fake_mysql_create_db
 #define mysql_data_seek _fake_mysql_data_seek
@@ -316,7 +431,13 @@ extern "C" {
 #define mysql_fetch_field_direct _fake_mysql_fetch_field_direct
 #define mysql_fetch_fields _fake_mysql_fetch_fields
 #define mysql_fetch_lengths _fake_mysql_fetch_lengths
+#define mysql_export_result _fake_mysql_export_result
+#define mysql_fetch_column _fake_mysql_fetch_column
+#define mysql_save_result _fake_mysql_save_result
+#define mysql_load_result _fake_mysql_load_result
 #define mysql_fetch_row _fake_mysql_fetch_row
+#define mysql_fetch_row_start _fake_mysql_fetch_row_start
+#define mysql_fetch_row_cont _fake_mysql_fetch_row_cont
 #define mysql_field_count _fake_mysql_field_count
 #define mysql_field_seek _fake_mysql_field_seek
 #define mysql_field_tell _fake_mysql_field_tell
@@ -324,6 +445,8 @@ extern "C" {
 #define mysql_get_client_info _fake_mysql_get_client_info
 #define mysql_get_host_info _fake_mysql_get_host_info
 #define mysql_get_proto_info _fake_mysql_get_proto_info
+#define mysql_get_socket _fake_mysql_get_socket
+#define mysql_wait_any _fake_mysql_wait_any
 #define mysql_get_server_info _fake_mysql_get_server_info
 #define mysql_info _fake_mysql_info
 #define mysql_init _fake_mysql_init
@@ -338,10 +461,23 @@ extern "C" {
 #define mysql_odbc_escape_string _fake_mysql_odbc_escape_string
 #define mysql_ping _fake_mysql_ping
 #define mysql_query _fake_mysql_query
+#define mysql_query_cache_configure _fake_mysql_query_cache_configure
+#define mysql_query_cache_flush _fake_mysql_query_cache_flush
+#define mysql_query_cache_stats _fake_mysql_query_cache_stats
 #define mysql_read_query_result _fake_mysql_read_query_result
 #define mysql_real_connect _fake_mysql_real_connect
+#define mysql_real_connect_start _fake_mysql_real_connect_start
+#define mysql_real_connect_cont _fake_mysql_real_connect_cont
 #define mysql_real_escape_string _fake_mysql_real_escape_string
 #define mysql_real_query _fake_mysql_real_query
+#define mysql_more_results _fake_mysql_more_results
+#define mysql_next_result _fake_mysql_next_result
+#define mysql_set_server_option _fake_mysql_set_server_option
+#define mysql_autocommit _fake_mysql_autocommit
+#define mysql_commit _fake_mysql_commit
+#define mysql_rollback _fake_mysql_rollback
+#define mysql_real_query_start _fake_mysql_real_query_start
+#define mysql_real_query_cont _fake_mysql_real_query_cont
 #define mysql_refresh _fake_mysql_refresh
 #define mysql_row_seek _fake_mysql_row_seek
 #define mysql_row_tell _fake_mysql_row_tell
@@ -350,7 +486,10 @@ extern "C" {
 #define mysql_shutdown _fake_mysql_shutdown
 #define mysql_stat _fake_mysql_stat
 #define mysql_store_result _fake_mysql_store_result
+#define mysql_store_result_start _fake_mysql_store_result_start
+#define mysql_store_result_cont _fake_mysql_store_result_cont
 #define mysql_thread_id _fake_mysql_thread_id
+#define mysql_warning_count _fake_mysql_warning_count
 #define mysql_thread_safe _fake_mysql_thread_safe
 #define mysql_use_result _fake_mysql_use_result
 #endif
@@ -385,10 +524,14 @@ char *mysql_error (MYSQL * mysql);
 
 char *mysql_info (MYSQL * mysql);
 
+unsigned int mysql_warning_count (MYSQL * mysql);
+
 unsigned long mysql_thread_id (MYSQL * mysql);
 
 const char *mysql_character_set_name (MYSQL * mysql);
 
+int mysql_set_character_set (MYSQL * mysql, const char *csname);
+
 MYSQL *mysql_init (MYSQL * mysql);
 
 MYSQL *mysql_connect (MYSQL * mysql, const char *host,
@@ -415,6 +558,19 @@ int mysql_read_query_result (MYSQL * mysql);
 int mysql_real_query (MYSQL * mysql, const char *q,
     unsigned int length);
 
+my_bool mysql_more_results (MYSQL * mysql);
+
+int mysql_next_result (MYSQL * mysql);
+
+int mysql_set_server_option (MYSQL * mysql,
+    enum enum_mysql_set_option option);
+
+my_bool mysql_autocommit (MYSQL * mysql, my_bool auto_mode);
+
+my_bool mysql_commit (MYSQL * mysql);
+
+my_bool mysql_rollback (MYSQL * mysql);
+
 int mysql_create_db (MYSQL * mysql, const char *DB);
 
 int mysql_drop_db (MYSQL * mysql, const char *DB);
@@ -457,6 +613,19 @@ int mysql_options (MYSQL * mysql, enum mysql_option option,
 
 void mysql_free_result (MYSQL_RES * result);
 
+/*
+ *  The query cache is one for the whole process. The query-cache-size
+ *  and query-cache-ttl options of the first connection to set them size
+ *  it when that connection connects, later connections do not change
+ *  it. This call always does.
+ */
+void mysql_query_cache_configure (unsigned long max_bytes,
+    unsigned int ttl);
+
+void mysql_query_cache_flush (void);
+
+void mysql_query_cache_stats (MYSQL_QUERY_CACHE_STATS * stats);
+
 void mysql_data_seek (MYSQL_RES * result, my_ulonglong offset);
 
 MYSQL_ROW_OFFSET mysql_row_seek (MYSQL_RES * result,
@@ -469,8 +638,46 @@ MYSQL_ROW mysql_fetch_row (MYSQL_RES * result);
 
 unsigned long *mysql_fetch_lengths (MYSQL_RES * result);
 
+my_ulonglong mysql_export_result (MYSQL_RES * result, int fd,
+    enum mysql_export_format format, unsigned int flags);
+
+int mysql_fetch_column (MYSQL_RES * result, unsigned int column,
+    MYSQL_COLUMN * col);
+
+int mysql_save_result (MYSQL_RES * result, const char *file);
+
+MYSQL_RES *mysql_load_result (const char *file);
+
 MYSQL_FIELD *mysql_fetch_field (MYSQL_RES * result);
 
+int mysql_get_socket (const MYSQL * mysql);
+
+int mysql_real_connect_start (MYSQL ** ret, MYSQL * mysql,
+    const char *host, const char *user, const char *passwd,
+    const char *db, unsigned int port, const char *unix_socket,
+    unsigned long clientflag);
+
+int mysql_real_connect_cont (MYSQL ** ret, MYSQL * mysql, int status);
+
+int mysql_real_query_start (int *ret, MYSQL * mysql, const char *q,
+    unsigned long length);
+
+int mysql_real_query_cont (int *ret, MYSQL * mysql, int status);
+
+int mysql_store_result_start (MYSQL_RES ** ret, MYSQL * mysql);
+
+int mysql_store_result_cont (MYSQL_RES ** ret, MYSQL * mysql, int status);
+
+int mysql_fetch_row_start (MYSQL_ROW * ret, MYSQL_RES * result);
+
+int mysql_fetch_row_cont (MYSQL_ROW * ret, MYSQL_RES * result, int status);
+
+int mysql_close_start (MYSQL * sock);
+
+int mysql_close_cont (MYSQL * sock, int status);
+
+int mysql_wait_any (MYSQL ** mysql, unsigned int count, int timeout);
+
 unsigned long mysql_escape_string (char *to, const char *from,
     unsigned long from_length);
 
@@ -493,10 +700,18 @@ void my_init (void);
 void load_defaults (const char *conf_file, const char **groups, int *argc,
     char ***argv);
 
+void print_defaults (const char *conf_file, const char **groups);
+
+void free_defaults (void);
+
 my_bool my_thread_init (void);
 
 void my_thread_end (void);
 
+my_bool mysql_thread_init (void);
+
+void mysql_thread_end (void);
+
 //@
 char *get_tty_password (char *opt_message);
 #ifdef __cplusplus
@@ -99,6 +99,143 @@ query (MYSQL *mh, const char *q)
 }
 
 
+/*
+ *  Run q, which returns one value, and compare it with want
+ */
+int
+expect (MYSQL *mh, const char *q, const char *want)
+{
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  const char *got = "(no row)";
+  int rc;
+
+  if (mysql_query (mh, q) || (res = mysql_store_result (mh)) == NULL)
+    {
+      fprintf (stderr, "** %s: %s.\n", q, mysql_error (mh));
+      return -1;
+    }
+  if ((row = mysql_fetch_row (res)) != NULL)
+    got = row[0] ? row[0] : "NULL";
+  rc = strcmp (got, want) ? -1 : 0;
+  printf ("%s %s: %s\n", rc ? "FAILED" : "ok", q, got);
+  mysql_free_result (res);
+
+  return rc;
+}
+
+
+/*
+ *  Run q, which a sharded table cannot answer
+ */
+int
+refused (MYSQL *mh, const char *q)
+{
+  int rc = 0;
+
+  if (mysql_query (mh, q) == 0)
+    {
+      mysql_free_result (mysql_store_result (mh));
+      rc = -1;
+    }
+  else if (mysql_errno (mh) != 1235)	/* ER_NOT_SUPPORTED_YET */
+    rc = -1;
+  printf ("%s %s: %s\n", rc ? "FAILED" : "ok", q,
+      rc ? mysql_error (mh) : "refused");
+
+  return rc;
+}
+
+
+/*
+ *  Replicas and shards against local stand-in DSNs, e.g.
+ *
+ *	mtest -d primary -r replica1,replica2 \
+ *	    -s mtest_s.id:shard1=..99,shard2=100.. -x
+ *
+ *  The replicas need not replicate anything: each gets a row of its
+ *  own in mtest_r, so a read shows whether it ran on a replica or on
+ *  the primary. The shards get mtest_s from the scenario.
+ */
+int
+scenario (MYSQL *mh, const char *host, const char *user, const char *pass,
+    const char *replicas, const char *shards)
+{
+  MYSQL *rh;
+  char *list, *dsn;
+  int rc = 0;
+
+  query (mh, "DROP TABLE mtest_r");
+  query (mh, "DROP TABLE mtest_s");
+
+  /* Reads go to a replica, until the session has state of its own */
+  if (replicas)
+    {
+      list = strdup (replicas);
+      for (dsn = strtok (list, ","); dsn; dsn = strtok (NULL, ","))
+	{
+	  rh = mysql_init (NULL);
+	  if (mysql_real_connect (rh, host, user, pass, dsn, 0, NULL, 0)
+	      == NULL)
+	    {
+	      fprintf (stderr, "** %s: %s.\n", dsn, mysql_error (rh));
+	      rc = -1;
+	    }
+	  else
+	    {
+	      query (rh, "DROP TABLE mtest_r");
+	      if (query (rh, "CREATE TABLE mtest_r (id INTEGER, v VARCHAR(20))")
+		  || query (rh, "INSERT INTO mtest_r VALUES (1, 'replica')"))
+		rc = -1;
+	    }
+	  mysql_close (rh);
+	}
+      free (list);
+    }
+  if (query (mh, "CREATE TABLE mtest_r (id INTEGER, v VARCHAR(20))")
+      || query (mh, "INSERT INTO mtest_r VALUES (1, 'one')"))
+    rc = -1;
+  if (replicas)
+    rc |= expect (mh, "SELECT v FROM mtest_r WHERE id = 1", "replica");
+  if (query (mh, "SET @mtest = 1"))
+    rc = -1;
+  rc |= expect (mh, "SELECT v FROM mtest_r WHERE id = 1", "one");
+
+  /* The sharded table: rows by key, merged aggregates and groups */
+  if (query (mh, "CREATE TABLE mtest_s "
+	  "(id INTEGER, amount INTEGER, tag VARCHAR(10))")
+      || query (mh, "INSERT INTO mtest_s VALUES "
+	  "(1, 10, 'a'), (150, 20, 'a'), (160, 5, 'b')"))
+    rc = -1;
+  rc |= expect (mh, "SELECT COUNT(*) FROM mtest_s", "3");
+  rc |= expect (mh, "SELECT SUM(amount) FROM mtest_s", "35");
+  rc |= expect (mh, "SELECT amount FROM mtest_s WHERE id = 150", "20");
+  rc |= expect (mh, "SELECT SUM(amount), tag FROM mtest_s "
+      "GROUP BY tag ORDER BY tag", "30");
+  rc |= expect (mh, "SELECT tag AS t, COUNT(*) FROM mtest_s "
+      "GROUP BY t ORDER BY t DESC", "b");
+  if (shards)
+    {
+      /* Groups fold on selected columns only */
+      rc |= refused (mh, "SELECT COUNT(*) FROM mtest_s GROUP BY tag");
+      rc |= refused (mh, "SELECT tag, COUNT(*) FROM mtest_s "
+	  "GROUP BY tag, amount");
+    }
+  if (query (mh, "UPDATE mtest_s SET amount = 11 WHERE id = 1"))
+    rc = -1;
+  rc |= expect (mh, "SELECT SUM(amount) FROM mtest_s", "36");
+  if (query (mh, "DELETE FROM mtest_s WHERE id = 150"))
+    rc = -1;
+  rc |= expect (mh, "SELECT COUNT(*) FROM mtest_s", "2");
+
+  query (mh, "DROP TABLE mtest_r");
+  query (mh, "DROP TABLE mtest_s");
+  puts (rc ? "scenario FAILED" : "scenario ok");
+
+  return rc;
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -106,12 +243,16 @@ main (int argc, char **argv)
   char *db = "mysql";
   char *user = "root";
   char *pass = "";
+  char *replicas = NULL;
+  char *shards = NULL;
+  int bScenario = 0;
   char line[2048];
   MYSQL *mh;
+  int rc = 0;
 
 #ifndef WIN32
   int key;
-  while ((key = getopt (argc, argv, "h:u:p:d:")) != EOF)
+  while ((key = getopt (argc, argv, "h:u:p:d:r:s:x")) != EOF)
     {
       switch (key)
 	{
@@ -127,9 +268,19 @@ main (int argc, char **argv)
 	case 'p':
 	  pass = optarg;
 	  break;
+	case 'r':
+	  replicas = optarg;
+	  break;
+	case 's':
+	  shards = optarg;
+	  break;
+	case 'x':
+	  bScenario = 1;
+	  break;
 	default:
 	  fprintf (stderr,
-	      "usage: %s [-u user] [-p pass] [-h host] [-d db]\n", argv[0]);
+	      "usage: %s [-u user] [-p pass] [-h host] [-d db] "
+	      "[-r dsn,...] [-s table.key:dsn=lo..hi,...] [-x]\n", argv[0]);
 	  return 1;
 	}
     }
@@ -137,6 +288,10 @@ main (int argc, char **argv)
 
   mh = (MYSQL *) calloc (1, sizeof (MYSQL));
   mysql_init (mh);
+  if (replicas)
+    mysql_options (mh, MYSQL_OPT_READ_REPLICAS, replicas);
+  if (shards)
+    mysql_options (mh, MYSQL_OPT_SHARD_MAP, shards);
 
   if (mysql_real_connect (mh, host, user, pass, db, 0, NULL, 0) == NULL)
     {
@@ -149,7 +304,10 @@ main (int argc, char **argv)
       mysql_get_server_info (mh),
       mysql_get_host_info (mh));
 
-  for (;;)
+  if (bScenario)
+    rc = scenario (mh, host, user, pass, replicas, shards);
+
+  while (!bScenario)
     {
       fputs (">>", stdout);
       if (fgets (line, sizeof (line), stdin) == NULL)
@@ -170,5 +328,5 @@ main (int argc, char **argv)
   mysql_close (mh);
   free (mh);
 
-  return 0;
+  return rc ? 1 : 0;
 }